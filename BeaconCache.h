@@ -0,0 +1,140 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef BEACONCACHE_H
+#define BEACONCACHE_H
+/*
+  BeaconCache - suppress repeated Beacons and Probe Responses
+
+  Each AP sends a Beacon every 102.4 ms. Nearly all of them are identical to the
+  last. The cache holds a digest of the last forwarded frame body for each
+  BSSID, one entry for Beacons and one for Probe Responses. A frame is
+  forwarded when it is new, its content changed, or the refresh interval
+  expired. Otherwise it is dropped.
+
+  The digest skips the parts that change on every frame, the timestamp and the
+  TIM element (DTIM count and traffic bitmap).
+
+  Only the prescreen filters touch the table, they run in serial_pcap_cb() or
+  filter_task, never both at once. Other tasks ask for a flush by bumping
+  flush_req; the table is cleared on the next check.
+*/
+#include "KConfig.h"
+#ifndef HOST_SHIM_H
+#include <esp_rom_crc.h>
+#endif
+#include "WiFiPcap.h"
+
+constexpr size_t k_beacon_cache_probe = 4;  // Slots searched before evicting
+static_assert(0 == (CONFIG_WIFIPCAP_BEACON_CACHE_SIZE & (CONFIG_WIFIPCAP_BEACON_CACHE_SIZE - 1)),
+    "CONFIG_WIFIPCAP_BEACON_CACHE_SIZE must be a power of 2");
+
+struct BeaconCacheEntry {
+    MacAddr bssid;
+    uint8_t subtype;
+    uint8_t used;
+    uint32_t digest;
+    uint32_t last_ms;         // millis() when last forwarded
+};
+
+struct BeaconCache {
+    BeaconCacheEntry entry[CONFIG_WIFIPCAP_BEACON_CACHE_SIZE];
+    volatile uint32_t flush_req;
+    uint32_t flush_ack;
+
+    // Statistics
+    uint32_t hits;            // Frames dropped as duplicates
+    uint32_t misses;          // Frames forwarded, new or changed
+    uint32_t refreshes;       // Frames forwarded, unchanged but refresh expired
+    uint32_t evicts;          // Entries replaced by a different BSSID
+};
+
+static inline void beacon_cache_clear(BeaconCache *bc) {
+    memset(bc->entry, 0, sizeof(bc->entry));
+    bc->flush_ack = bc->flush_req;
+}
+
+// Any task - Forget all BSSIDs, the next frame from each one is forwarded.
+static inline void beacon_cache_flush(BeaconCache *bc) {
+    bc->flush_req = bc->flush_req + 1;
+}
+
+static inline uint32_t beacon_digest(const WiFiPktHdr* const pkt, size_t len) {
+    const uint8_t *p = (const uint8_t *)pkt + wifi_header_length(pkt) + sizeof(TimeStamp);
+    const uint8_t * const end = (const uint8_t *)pkt + len;
+    if (p + offsetof(MgmtBeacon, variable) - sizeof(TimeStamp) > end) return 0;
+
+    // beacon_int and capab_info
+    uint32_t crc = esp_rom_crc32_le(0, p, offsetof(MgmtBeacon, variable) - sizeof(TimeStamp));
+    p += offsetof(MgmtBeacon, variable) - sizeof(TimeStamp);
+    // Elements, id, length, value
+    while (p < end) {
+        size_t ie_len = (p + 1 < end) ? 2u + p[1] : 1u;
+        if (p + ie_len > end) ie_len = end - p;
+        if (WLAN_EID_TIM != p[0]) crc = esp_rom_crc32_le(crc, p, ie_len);
+        p += ie_len;
+    }
+    return crc;
+}
+
+/*
+  Returns true when the Beacon or Probe Response is a duplicate and should be
+  dropped. "len" is the frame length without FCS.
+*/
+static inline bool beacon_cache_check(BeaconCache *bc, const WiFiPktHdr* const pkt, size_t len, uint32_t refresh_ms) {
+    if (bc->flush_req != bc->flush_ack) beacon_cache_clear(bc);
+
+    const uint8_t *bssid = pkt->addr3.mac;
+    const uint32_t now = millis();
+    const uint32_t digest = beacon_digest(pkt, len);
+    const uint32_t key = ((uint32_t)bssid[3] << 16 | (uint32_t)bssid[4] << 8 | bssid[5]) ^ pkt->fctl.subtype;
+    const uint32_t mask = CONFIG_WIFIPCAP_BEACON_CACHE_SIZE - 1;
+    const uint32_t idx = key * 2654435761u;  // Knuth multiplicative hash
+
+    BeaconCacheEntry *victim = NULL;
+    for (size_t n = 0; n < k_beacon_cache_probe; n++) {
+        BeaconCacheEntry *e = &bc->entry[((idx >> 16) + n) & mask];
+        if (!e->used) {
+            victim = e;
+            break;
+        }
+        if (e->subtype == pkt->fctl.subtype && 0 == memcmp(e->bssid.mac, bssid, sizeof(MacAddr))) {
+            if (e->digest == digest) {
+                if (0 == refresh_ms || now - e->last_ms < refresh_ms) {
+                    bc->hits++;
+                    return true;
+                }
+                bc->refreshes++;
+            } else {
+                bc->misses++;
+                e->digest = digest;
+            }
+            e->last_ms = now;
+            return false;
+        }
+        if (NULL == victim || (int32_t)(e->last_ms - victim->last_ms) < 0) victim = e;
+    }
+
+    if (victim->used) bc->evicts++;
+    bc->misses++;
+    memcpy(victim->bssid.mac, bssid, sizeof(MacAddr));
+    victim->subtype = pkt->fctl.subtype;
+    victim->used = 1;
+    victim->digest = digest;
+    victim->last_ms = now;
+    return false;
+}
+
+#endif // BEACONCACHE_H
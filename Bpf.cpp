@@ -0,0 +1,334 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Classic BPF interpreter, see Bpf.h
+
+  Opcode values are from libpcap's pcap/bpf.h. Loads from the packet are in
+  network byte order. A load outside the packet rejects it, the same as
+  libpcap.
+*/
+#include "WiFiPcap.ino.globals.h"
+
+#include "Bpf.h"
+
+// Instruction classes
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD          0x00
+#define BPF_LDX         0x01
+#define BPF_ST          0x02
+#define BPF_STX         0x03
+#define BPF_ALU         0x04
+#define BPF_JMP         0x05
+#define BPF_RET         0x06
+#define BPF_MISC        0x07
+
+// ld/ldx fields
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define BPF_W           0x00
+#define BPF_H           0x08
+#define BPF_B           0x10
+#define BPF_MODE(code)  ((code) & 0xe0)
+#define BPF_IMM         0x00
+#define BPF_ABS         0x20
+#define BPF_IND         0x40
+#define BPF_MEM         0x60
+#define BPF_LEN         0x80
+#define BPF_MSH         0xa0
+
+// alu/jmp fields
+#define BPF_OP(code)    ((code) & 0xf0)
+#define BPF_ADD         0x00
+#define BPF_SUB         0x10
+#define BPF_MUL         0x20
+#define BPF_DIV         0x30
+#define BPF_OR          0x40
+#define BPF_AND         0x50
+#define BPF_LSH         0x60
+#define BPF_RSH         0x70
+#define BPF_NEG         0x80
+#define BPF_MOD         0x90
+#define BPF_XOR         0xa0
+
+#define BPF_JA          0x00
+#define BPF_JEQ         0x10
+#define BPF_JGT         0x20
+#define BPF_JGE         0x30
+#define BPF_JSET        0x40
+#define BPF_SRC(code)   ((code) & 0x08)
+#define BPF_K           0x00
+#define BPF_X           0x08
+
+// ret - BPF_K and BPF_X also apply
+#define BPF_RVAL(code)  ((code) & 0x18)
+#define BPF_A           0x10
+
+// misc
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX         0x00
+#define BPF_TXA         0x80
+
+#define BPF_MEMWORDS    16
+
+/*
+  Whole opcodes are matched, as libpcap does, not the class, size and mode
+  fields one at a time. Those pass combinations bpf_filter() has no case
+  for, eg. "ret x", 0x0e, or a store with mode bits, 0x62.
+*/
+esp_err_t bpf_validate(const BpfInsn *insn, size_t len) {
+    if (0 == len || CONFIG_WIFIPCAP_BPF_MAX_INSNS < len) return ESP_ERR_INVALID_SIZE;
+
+    for (size_t i = 0; i < len; i++) {
+        const BpfInsn *p = &insn[i];
+        const size_t from = i + 1;
+        switch (p->code) {
+            case BPF_RET | BPF_K:
+            case BPF_RET | BPF_A:
+            // The packet length is checked at run time
+            case BPF_LD | BPF_W | BPF_ABS:
+            case BPF_LD | BPF_H | BPF_ABS:
+            case BPF_LD | BPF_B | BPF_ABS:
+            case BPF_LD | BPF_W | BPF_IND:
+            case BPF_LD | BPF_H | BPF_IND:
+            case BPF_LD | BPF_B | BPF_IND:
+            case BPF_LDX | BPF_B | BPF_MSH:
+            case BPF_LD | BPF_W | BPF_LEN:
+            case BPF_LDX | BPF_W | BPF_LEN:
+            case BPF_LD | BPF_IMM:
+            case BPF_LDX | BPF_IMM:
+            case BPF_MISC | BPF_TAX:
+            case BPF_MISC | BPF_TXA:
+            case BPF_ALU | BPF_ADD | BPF_K: case BPF_ALU | BPF_ADD | BPF_X:
+            case BPF_ALU | BPF_SUB | BPF_K: case BPF_ALU | BPF_SUB | BPF_X:
+            case BPF_ALU | BPF_MUL | BPF_K: case BPF_ALU | BPF_MUL | BPF_X:
+            case BPF_ALU | BPF_AND | BPF_K: case BPF_ALU | BPF_AND | BPF_X:
+            case BPF_ALU | BPF_OR  | BPF_K: case BPF_ALU | BPF_OR  | BPF_X:
+            case BPF_ALU | BPF_XOR | BPF_K: case BPF_ALU | BPF_XOR | BPF_X:
+            // A shift of 32 or more gives 0
+            case BPF_ALU | BPF_LSH | BPF_K: case BPF_ALU | BPF_LSH | BPF_X:
+            case BPF_ALU | BPF_RSH | BPF_K: case BPF_ALU | BPF_RSH | BPF_X:
+            case BPF_ALU | BPF_DIV | BPF_X:
+            case BPF_ALU | BPF_MOD | BPF_X:
+            case BPF_ALU | BPF_NEG:
+                break;
+
+            case BPF_LD | BPF_MEM:
+            case BPF_LDX | BPF_MEM:
+            case BPF_ST:
+            case BPF_STX:
+                if (BPF_MEMWORDS <= p->k) return ESP_ERR_INVALID_ARG;
+                break;
+
+            case BPF_ALU | BPF_DIV | BPF_K:
+            case BPF_ALU | BPF_MOD | BPF_K:
+                if (0 == p->k) return ESP_ERR_INVALID_ARG;
+                break;
+
+            case BPF_JMP | BPF_JA:
+                if (p->k >= len - from) return ESP_ERR_INVALID_ARG;
+                break;
+            case BPF_JMP | BPF_JEQ | BPF_K: case BPF_JMP | BPF_JEQ | BPF_X:
+            case BPF_JMP | BPF_JGT | BPF_K: case BPF_JMP | BPF_JGT | BPF_X:
+            case BPF_JMP | BPF_JGE | BPF_K: case BPF_JMP | BPF_JGE | BPF_X:
+            case BPF_JMP | BPF_JSET | BPF_K: case BPF_JMP | BPF_JSET | BPF_X:
+                if (from + p->jt >= len || from + p->jf >= len) return ESP_ERR_INVALID_ARG;
+                break;
+
+            default:
+                return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return (BPF_RET == BPF_CLASS(insn[len - 1].code)) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t bpf_publish(BpfProgram *prog, size_t len) {
+    if (0 == len) {
+        bpf_remove(prog);
+        return ESP_OK;
+    }
+    esp_err_t err = bpf_validate(bpf_scratch(prog), len);
+    if (ESP_OK != err) return err;
+    prog->last ^= 1u;
+    prog->active = len | ((prog->last) ? k_bpf_active_copy : 0);
+    return ESP_OK;
+}
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint32_t load_be16(const uint8_t *p) {
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+uint32_t bpf_filter(const BpfInsn *insn, size_t len, const uint8_t *pkt, uint32_t wirelen, uint32_t buflen, uint64_t *executed) {
+    uint32_t A = 0;
+    uint32_t X = 0;
+    uint32_t mem[BPF_MEMWORDS] = { 0 };
+    const BpfInsn *pc = insn;
+    const BpfInsn * const end = &insn[len];
+    uint32_t count = 0;
+    uint32_t result = 0;
+
+    for (;; pc++) {
+        // Validated programs never leave, this is for one that was not
+        if (pc >= end) goto done;
+        count++;
+        const uint32_t k = pc->k;
+        uint32_t at;
+        switch (pc->code) {
+            case BPF_RET | BPF_K:
+                result = k;
+                goto done;
+            case BPF_RET | BPF_A:
+                result = A;
+                goto done;
+
+            case BPF_LD | BPF_W | BPF_ABS:
+                at = k;
+            load_w:
+                if (at > buflen || 4 > buflen - at) goto done;
+                A = load_be32(&pkt[at]);
+                break;
+            case BPF_LD | BPF_H | BPF_ABS:
+                at = k;
+            load_h:
+                if (at > buflen || 2 > buflen - at) goto done;
+                A = load_be16(&pkt[at]);
+                break;
+            case BPF_LD | BPF_B | BPF_ABS:
+                at = k;
+            load_b:
+                if (at >= buflen) goto done;
+                A = pkt[at];
+                break;
+            case BPF_LD | BPF_W | BPF_IND:
+                at = X + k;
+                if (at < X) goto done;
+                goto load_w;
+            case BPF_LD | BPF_H | BPF_IND:
+                at = X + k;
+                if (at < X) goto done;
+                goto load_h;
+            case BPF_LD | BPF_B | BPF_IND:
+                at = X + k;
+                if (at < X) goto done;
+                goto load_b;
+            case BPF_LD | BPF_W | BPF_LEN:
+                A = wirelen;
+                break;
+            case BPF_LDX | BPF_W | BPF_LEN:
+                X = wirelen;
+                break;
+            case BPF_LD | BPF_IMM:
+                A = k;
+                break;
+            case BPF_LDX | BPF_IMM:
+                X = k;
+                break;
+            case BPF_LD | BPF_MEM:
+                A = mem[k];
+                break;
+            case BPF_LDX | BPF_MEM:
+                X = mem[k];
+                break;
+            case BPF_LDX | BPF_B | BPF_MSH:
+                if (k >= buflen) goto done;
+                X = (pkt[k] & 0x0fu) << 2;
+                break;
+            case BPF_ST:
+                mem[k] = A;
+                break;
+            case BPF_STX:
+                mem[k] = X;
+                break;
+
+            case BPF_JMP | BPF_JA:
+                if (k >= (uint32_t)(end - pc)) goto done;
+                pc += k;
+                break;
+            case BPF_JMP | BPF_JGT | BPF_K:
+                pc += (A > k) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JGE | BPF_K:
+                pc += (A >= k) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JEQ | BPF_K:
+                pc += (A == k) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JSET | BPF_K:
+                pc += (A & k) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JGT | BPF_X:
+                pc += (A > X) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JGE | BPF_X:
+                pc += (A >= X) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JEQ | BPF_X:
+                pc += (A == X) ? pc->jt : pc->jf;
+                break;
+            case BPF_JMP | BPF_JSET | BPF_X:
+                pc += (A & X) ? pc->jt : pc->jf;
+                break;
+
+            case BPF_ALU | BPF_ADD | BPF_X: A += X; break;
+            case BPF_ALU | BPF_SUB | BPF_X: A -= X; break;
+            case BPF_ALU | BPF_MUL | BPF_X: A *= X; break;
+            case BPF_ALU | BPF_DIV | BPF_X:
+                if (0 == X) goto done;
+                A /= X;
+                break;
+            case BPF_ALU | BPF_MOD | BPF_X:
+                if (0 == X) goto done;
+                A %= X;
+                break;
+            case BPF_ALU | BPF_AND | BPF_X: A &= X; break;
+            case BPF_ALU | BPF_OR  | BPF_X: A |= X; break;
+            case BPF_ALU | BPF_XOR | BPF_X: A ^= X; break;
+            case BPF_ALU | BPF_LSH | BPF_X: A = (X < 32) ? A << X : 0; break;
+            case BPF_ALU | BPF_RSH | BPF_X: A = (X < 32) ? A >> X : 0; break;
+            case BPF_ALU | BPF_ADD | BPF_K: A += k; break;
+            case BPF_ALU | BPF_SUB | BPF_K: A -= k; break;
+            case BPF_ALU | BPF_MUL | BPF_K: A *= k; break;
+            case BPF_ALU | BPF_DIV | BPF_K: A /= k; break;
+            case BPF_ALU | BPF_MOD | BPF_K: A %= k; break;
+            case BPF_ALU | BPF_AND | BPF_K: A &= k; break;
+            case BPF_ALU | BPF_OR  | BPF_K: A |= k; break;
+            case BPF_ALU | BPF_XOR | BPF_K: A ^= k; break;
+            case BPF_ALU | BPF_LSH | BPF_K: A = (k < 32) ? A << k : 0; break;
+            case BPF_ALU | BPF_RSH | BPF_K: A = (k < 32) ? A >> k : 0; break;
+            case BPF_ALU | BPF_NEG:         A = -A; break;
+
+            case BPF_MISC | BPF_TAX:
+                X = A;
+                break;
+            case BPF_MISC | BPF_TXA:
+                A = X;
+                break;
+
+            default:
+                // Not reachable with a validated program
+                goto done;
+        }
+    }
+done:
+    *executed += count;
+    return result;
+}
+#pragma GCC pop_options
@@ -0,0 +1,101 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef WIFIPCAP_BPF_H
+#define WIFIPCAP_BPF_H
+/*
+  Bpf - classic BPF filter programs, as compiled by libpcap's pcap_compile()
+
+  esp32shark.py compiles a Wireshark capture filter for linktype 105
+  (PCAP_LINK_TYPE_802_11) and uploads the instructions. The packet the program
+  sees is the 802.11 frame from the SDK, the same bytes that go to Wireshark.
+
+  bpf_validate() checks a program the way libpcap's bpf_validate() does: the
+  exact opcodes bpf_filter() runs, scratch memory in range, no constant
+  divide by zero, jumps only forward and inside the program, ending with a
+  return. Since no jump goes backward, the instructions executed per packet
+  are bounded by the program length, which is limited to
+  CONFIG_WIFIPCAP_BPF_MAX_INSNS.
+
+  A new program is loaded and validated in the copy of BpfProgram.insn[] not
+  published last, then published with one store to "active". A packet
+  filter still running the old program never sees a half written one.
+
+  extras/bpf_conformance.cpp compares both with libpcap on a PC.
+*/
+#include "KConfig.h"
+#include <stdint.h>
+#include <stddef.h>
+#ifndef HOST_SHIM_H
+#include <esp_err.h>
+#endif
+
+struct BpfInsn {
+    uint16_t code;
+    uint8_t  jt;
+    uint8_t  jf;
+    uint32_t k;
+};
+
+constexpr uint32_t k_bpf_active_copy = (1u << 31);
+
+struct BpfProgram {
+    BpfInsn insn[2][CONFIG_WIFIPCAP_BPF_MAX_INSNS];
+    volatile uint32_t active; // Length of the program running, k_bpf_active_copy
+                              // set when it is insn[1]. 0, no program
+    uint32_t last;            // insn[] published last, the next loads the other
+    uint32_t loading;         // instruction count expected by the upload
+
+    // Statistics
+    uint32_t pass;
+    uint32_t reject;
+    uint64_t executed;        // instructions executed
+};
+
+/*
+  Returns ESP_OK when the program is safe to run.
+*/
+esp_err_t bpf_validate(const BpfInsn *insn, size_t len);
+
+/*
+  Run a validated program of "len" instructions. Returns the snap length from
+  the program, 0 to reject the packet or when it leaves the program.
+  "wirelen" is the original length and "buflen" the bytes available at
+  "pkt". Adds the instructions executed to "*executed".
+*/
+uint32_t bpf_filter(const BpfInsn *insn, size_t len, const uint8_t *pkt, uint32_t wirelen, uint32_t buflen, uint64_t *executed);
+
+/*
+  Validate the "len" instructions loaded at bpf_scratch() and make them the
+  program running. On an error the program running is unchanged.
+*/
+esp_err_t bpf_publish(BpfProgram *prog, size_t len);
+
+// Remove the program, no packet is filtered after this
+static inline void bpf_remove(BpfProgram *prog) {
+    prog->active = 0;
+}
+
+// Where the next program is loaded, not the one a packet filter may be running
+static inline BpfInsn *bpf_scratch(BpfProgram *prog) {
+    return prog->insn[prog->last ^ 1u];
+}
+
+// Instructions in the program running, 0 none
+static inline uint32_t bpf_length(const BpfProgram *prog) {
+    return prog->active & ~k_bpf_active_copy;
+}
+
+#endif // WIFIPCAP_BPF_H
@@ -0,0 +1,107 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef CHANSTATS_H
+#define CHANSTATS_H
+/*
+  ChanStats - per channel packet counters, written on one core and read on the
+  other without tearing.
+
+  The counters are split into one shard per core. A shard is only written from
+  its own core, by a single task, so the writer never contends with another
+  writer. Today that is wifi_promis_cb() on the SDK core.
+
+  Each channel of a shard carries a sequence count, a seqlock. The writer makes
+  it odd before touching the counters and even again after. A reader copies the
+  counters and retries when the count was odd or moved while it copied. Readers
+  sum the shards into a ChannelStats. Nothing is ever reset; a reader that
+  wants a rate or a count since some event keeps its own earlier snapshot and
+  takes the difference.
+*/
+#include <freertos/FreeRTOS.h>
+#include "WiFiPcap.h"
+
+struct ChannelStats {
+    uint64_t mgmt;
+    uint64_t ctrl;
+    uint64_t data;
+    uint64_t error;
+    uint64_t total;
+    uint64_t totalBytes;
+    uint64_t dropped;
+    uint64_t full;                    // queue full
+    uint64_t mgmtSubtype[16];
+    uint64_t dataSubtype[16];
+};
+
+struct ChanStatsCell {
+    volatile uint32_t seq;            // odd while the writer is updating
+    ChannelStats stats;
+};
+
+struct ChanStatsShard {
+    ChanStatsCell ch[maxChannel];
+};
+
+struct ChanStats {
+    ChanStatsShard shard[portNUM_PROCESSORS];
+};
+
+static inline void chan_stats_fence() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);  // memw
+}
+
+// Writer - Open the cell of "channel_index" on this core for update
+static inline ChannelStats *chan_stats_begin(ChanStats *cs, size_t channel_index) {
+    ChanStatsCell *cell = &cs->shard[xPortGetCoreID()].ch[channel_index];
+    cell->seq = cell->seq + 1;
+    chan_stats_fence();
+    return &cell->stats;
+}
+
+// Writer - Close the cell opened by chan_stats_begin()
+static inline void chan_stats_end(ChanStats *cs, size_t channel_index) {
+    ChanStatsCell *cell = &cs->shard[xPortGetCoreID()].ch[channel_index];
+    chan_stats_fence();
+    cell->seq = cell->seq + 1;
+}
+
+/*
+  Reader - Any task. Sum of all shards for "channel_index" at one point in
+  time, per shard. Counters keep running; nothing is reset.
+*/
+static inline void chan_stats_snapshot(const ChanStats *cs, size_t channel_index, ChannelStats *out) {
+    memset(out, 0, sizeof(ChannelStats));
+    for (size_t core = 0; core < portNUM_PROCESSORS; core++) {
+        const ChanStatsCell *cell = &cs->shard[core].ch[channel_index];
+        ChannelStats copy;
+        uint32_t seq;
+        do {
+            seq = cell->seq;
+            chan_stats_fence();
+            memcpy(&copy, (const void *)&cell->stats, sizeof(ChannelStats));
+            chan_stats_fence();
+        } while ((seq & 1u) || seq != cell->seq);
+
+        const uint64_t *from = (const uint64_t *)&copy;
+        uint64_t *to = (uint64_t *)out;
+        for (size_t n = 0; n < sizeof(ChannelStats) / sizeof(uint64_t); n++) to[n] += from[n];
+    }
+}
+
+// WiFiPcap.ino - chan_stats_snapshot() of the capture counters for "channel"
+void get_channel_stats(size_t channel, ChannelStats *out);
+
+#endif // CHANSTATS_H
@@ -0,0 +1,64 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+/*
+  Histogram - log2 bucketed latency in microseconds, fixed size
+
+  Bucket 0 counts 0 us, bucket n counts 2^(n-1) to 2^n - 1 us. The last
+  bucket also takes everything longer, about 4.2 seconds and up.
+
+  The layout is also the wire format of the latency report, see
+  LatencyReport in SerialPcap.h. Only serial_task adds to and reads the
+  histograms, reads reset them.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#ifndef STRUCT_PACKED
+#define STRUCT_PACKED __attribute__((packed))
+#endif
+
+constexpr size_t k_histogram_buckets = 24;
+
+struct Histogram {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t bucket[k_histogram_buckets];
+} STRUCT_PACKED;
+
+static inline void histogram_add(Histogram *h, uint32_t us) {
+    size_t n = (us) ? 32u - __builtin_clz(us) : 0;
+    if (k_histogram_buckets <= n) n = k_histogram_buckets - 1;
+    h->bucket[n]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) h->max_us = us;
+}
+
+// Copy out and start over
+static inline void histogram_take(Histogram *h, Histogram *out) {
+    memcpy(out, h, sizeof(Histogram));
+    memset(h, 0, sizeof(Histogram));
+}
+
+// Upper bound of bucket "n" in microseconds
+static inline uint32_t histogram_bucket_us(size_t n) {
+    return (n) ? (1u << n) - 1u : 0;
+}
+
+#endif // HISTOGRAM_H
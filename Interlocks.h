@@ -117,6 +117,29 @@ static inline uint32_t interlocked_read(volatile uint32_t *addr) {
 //         : "memory");
 //         return val;
 // }
+
+#elif !defined(__XTENSA__)
+////////////////////////////////////////////////////////////////////////////////
+// Host builds, eg. extras/sd_bench.cpp, with the GCC atomic builtins
+#include <stdint.h>
+
+static inline bool interlocked_compare_exchange(volatile void* *addr, void* const testval, void* const setval) {
+    void* expected = testval;
+    return __atomic_compare_exchange_n((void**)addr, &expected, setval, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline bool interlocked_compare_exchange(volatile uint32_t *addr, uint32_t const testval, uint32_t const setval) {
+    uint32_t expected = testval;
+    return __atomic_compare_exchange_n(addr, &expected, setval, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline void* interlocked_read(volatile void* *addr) {
+    return __atomic_load_n((void**)addr, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t interlocked_read(volatile uint32_t *addr) {
+    return __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+}
 #endif
 
 
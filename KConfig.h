@@ -7,19 +7,24 @@
 #define KCONFIG_H
 
 /*
-    CONFIG_WIFIPCAP_WORK_QUEUE_LEN
+    CONFIG_WIFIPCAP_RING_SIZE_PSRAM
+    CONFIG_WIFIPCAP_RING_SIZE_DRAM
 
-    int "Number of packet entries in the work queue"
-    default 128
+    int "Size in bytes of the captured packet ring"
+    default 256*1024 for PSRAM, 64*1024 for DRAM
     help
         The filter callback function should not do a lot of work, the time
         consuming IO operations are defered to the SerialPcap task on a
         different CPU if possible.
 
-        The SerialPcap task gets pointers to captured packets from the queue and
-        passes them on to the host. Here you specify the length of that queue.
+        The callback copies each captured packet, PCAP header and payload, in
+        place into a ring buffer. The SerialPcap task passes them on to the host
+        from there. PSRAM is used when available otherwise DRAM. Here you
+        specify the size of that ring for each. A full size packet is about
+        2.3K.
 */
-#define CONFIG_WIFIPCAP_WORK_QUEUE_LEN 128u
+#define CONFIG_WIFIPCAP_RING_SIZE_PSRAM (256u*1024u)
+#define CONFIG_WIFIPCAP_RING_SIZE_DRAM  (64u*1024u)
 
 
 /*
@@ -97,6 +102,341 @@
 */
 #define CONFIG_WIFIPCAP_SERIAL_TX_BUFFER_SIZE (2*1024)
 
+
+/*
+    CONFIG_WIFIPCAP_RAW_RING_SIZE
+
+    int "Size of the unfiltered packet ring for the filter stage"
+    default 32*1024
+    help
+        With the deferred filter stage, serial_pcap_cb() only copies packets
+        into this DRAM ring. The filter task applies the custom filters and
+        moves the packets it keeps into the packet ring.
+*/
+#define CONFIG_WIFIPCAP_RAW_RING_SIZE (32u*1024u)
+
+
+/*
+    CONFIG_WIFIPCAP_FILTER_TASK_PRIORITY
+
+    int "Filter stage task priority"
+    default 3
+    help
+        Runs on the same core as SerialTask. A little higher so the raw ring
+        drains while SerialTask waits on USB.
+*/
+#define CONFIG_WIFIPCAP_FILTER_TASK_PRIORITY 3u
+
+
+/*
+    CONFIG_WIFIPCAP_PRIO_RING_SIZE
+
+    int "Size of the high priority packet ring"
+    default 16*1024
+    help
+        Capacity reserved for EAPOL, Authentication, Association and
+        Deauthentication frames. When it is full they also use the packet
+        ring. Data and Control frames only use the packet ring. DRAM.
+*/
+#define CONFIG_WIFIPCAP_PRIO_RING_SIZE (16u*1024u)
+
+
+/*
+    CONFIG_WIFIPCAP_PRIO_WEIGHT
+
+    int "High priority records written before a best effort one"
+    default 0
+    help
+        0 for strict priority, SerialTask always empties the high priority
+        ring first. Otherwise, after this many high priority records in a row,
+        one waiting best effort record goes next.
+*/
+#define CONFIG_WIFIPCAP_PRIO_WEIGHT 0u
+
+
+/*
+    CONFIG_WIFIPCAP_OVERLOAD_START
+
+    int "Packet ring pressure, percent, where the overload ladder starts"
+    default 50
+    help
+        Pressure is the larger of the packet ring fill and the time to drain
+        it at the measured USB rate, as a percent of
+        CONFIG_WIFIPCAP_OVERLOAD_DRAIN_MS. From this level on, best effort
+        Data frames are cut to the 802.11 header. Each further
+        CONFIG_WIFIPCAP_OVERLOAD_STEP samples Data frames, 1 in 2 then 1 in
+        8 by TA/RA, then drops Control frames. 0 turns the ladder off. The
+        host can change it with 'O'.
+*/
+#define CONFIG_WIFIPCAP_OVERLOAD_START 50u
+
+
+/*
+    CONFIG_WIFIPCAP_OVERLOAD_STEP
+
+    int "Pressure, percent, between overload levels"
+    default 12
+*/
+#define CONFIG_WIFIPCAP_OVERLOAD_STEP 12u
+
+
+/*
+    CONFIG_WIFIPCAP_OVERLOAD_HYSTERESIS
+
+    int "Pressure, percent, below a level before stepping down"
+    default 8
+*/
+#define CONFIG_WIFIPCAP_OVERLOAD_HYSTERESIS 8u
+
+
+/*
+    CONFIG_WIFIPCAP_OVERLOAD_DRAIN_MS
+
+    int "Packet ring drain time, ms, counted as 100% pressure"
+    default 250
+*/
+#define CONFIG_WIFIPCAP_OVERLOAD_DRAIN_MS 250u
+
+
+/*
+    CONFIG_WIFIPCAP_BATCH_SIZE
+
+    int "Size of the SerialPcap write batch buffer"
+    default 4*1024
+    help
+        SerialPcap copies queued packets into this buffer and passes them to
+        the USB CDC driver in one write. Should hold at least one full size
+        packet. The byte budget actually used, defaults to
+        CONFIG_WIFIPCAP_SERIAL_TX_BUFFER_SIZE, can be lowered by the host.
+*/
+#define CONFIG_WIFIPCAP_BATCH_SIZE (4*1024)
+
+
+/*
+    CONFIG_WIFIPCAP_LZ_WINDOW
+
+    int "Bytes of history the block compressor can refer back to"
+    default 4*1024
+    help
+        With block compression, host 'z', each write is packed against the
+        last CONFIG_WIFIPCAP_LZ_WINDOW bytes sent, so a repeated Beacon can
+        point at the copy in an earlier write. Takes this plus
+        CONFIG_WIFIPCAP_BATCH_SIZE, twice, of DRAM once the host asks for
+        it. At most 65535 - CONFIG_WIFIPCAP_BATCH_SIZE.
+*/
+#define CONFIG_WIFIPCAP_LZ_WINDOW (4*1024)
+
+
+/*
+    CONFIG_WIFIPCAP_LZ_HASH_BITS
+
+    int "log2 of the block compressor match table entries"
+    default 11
+    help
+        4 bytes of DRAM per entry.
+*/
+#define CONFIG_WIFIPCAP_LZ_HASH_BITS 11u
+
+
+/*
+    CONFIG_WIFIPCAP_LZ_MIN_SAVE_PCT
+
+    int "Least saving, percent, for a block to be sent packed"
+    default 10
+    help
+        A block that does not pack this well is sent as is. After several
+        in a row the compressor rests for a while and sends blocks as is
+        without trying.
+*/
+#define CONFIG_WIFIPCAP_LZ_MIN_SAVE_PCT 10u
+
+
+/*
+    CONFIG_WIFIPCAP_FRAME_LOG_SIZE
+
+    int "Bytes of log lines held for the framed transport"
+    default 2*1024
+    help
+        With the framed transport, host 'R', ESP_LOG output of every task
+        waits here for serial_task and goes out on the log channel instead of
+        the console. Lines that find no room are counted and lost. Allocated
+        the first time the host asks for frames.
+*/
+#define CONFIG_WIFIPCAP_FRAME_LOG_SIZE (2*1024)
+
+
+/*
+    CONFIG_WIFIPCAP_BATCH_LATENCY_MS
+
+    int "Longest time a packet may wait in the write batch"
+    default 20
+    help
+        When no more packets are queued, a partly filled batch is held this
+        long waiting for more before it is written. 0 writes as soon as the
+        queue is empty. Can be changed by the host.
+*/
+#define CONFIG_WIFIPCAP_BATCH_LATENCY_MS 20u
+
+/*
+    CONFIG_WIFIPCAP_BEACON_CACHE_SIZE
+
+    int "Number of BSSIDs tracked for Beacon/Probe Response deduplication"
+    default 64
+    help
+        Must be a power of 2. Each Beacon and Probe Response source uses one
+        entry. When full, the least recently forwarded entry is replaced.
+*/
+#define CONFIG_WIFIPCAP_BEACON_CACHE_SIZE 64u
+
+
+/*
+    CONFIG_WIFIPCAP_BEACON_REFRESH_MS
+
+    int "Forward an unchanged Beacon/Probe Response after this many ms"
+    default 10000
+    help
+        With deduplication on, an unchanged Beacon or Probe Response is still
+        forwarded once per interval. 0 forwards only on change. Can be changed
+        by the host.
+*/
+#define CONFIG_WIFIPCAP_BEACON_REFRESH_MS 10000u
+
+/*
+    CONFIG_WIFIPCAP_RETRY_CACHE_SIZE
+
+    int "Number of transmitters tracked for retransmit suppression"
+    default 128
+    help
+        Must be a power of 2. QoS Data uses one entry per transmitter and TID,
+        other Data and Management frames one entry per transmitter each. When
+        full, the least recently seen entry is replaced.
+*/
+#define CONFIG_WIFIPCAP_RETRY_CACHE_SIZE 128u
+
+/*
+    CONFIG_WIFIPCAP_WATCH_MAC_SIZE
+
+    int "Slots in the unicast/MAC address watch list"
+    default 512
+    help
+        Must be a power of 2. Up to 3/4 of the slots can be loaded by the host.
+        8 bytes each.
+*/
+#define CONFIG_WIFIPCAP_WATCH_MAC_SIZE 512u
+
+
+/*
+    CONFIG_WIFIPCAP_WATCH_OUI_SIZE
+
+    int "Slots in the OUI watch list"
+    default 64
+    help
+        Must be a power of 2. Up to 3/4 of the slots can be loaded by the host.
+        4 bytes each.
+*/
+#define CONFIG_WIFIPCAP_WATCH_OUI_SIZE 64u
+
+/*
+    CONFIG_WIFIPCAP_BPF_MAX_INSNS
+
+    int "Longest BPF filter program accepted from the host"
+    default 256
+    help
+        Also the most instructions a program can execute per packet, jumps
+        only go forward. 8 bytes each.
+*/
+#define CONFIG_WIFIPCAP_BPF_MAX_INSNS 256u
+
+/*
+    CONFIG_WIFIPCAP_HISTORY_SIZE
+
+    int "Bytes of PSRAM for the capture history"
+    default 4*1024*1024
+    help
+        While no host is connected, the frames captured go into a ring in
+        PSRAM instead of being thrown away, the oldest overwritten first. A
+        host that asks, 'J' and 'j', gets the last seconds of it ahead of live
+        traffic. Allocated after the Cache AUTH and the packet ring, only when
+        the largest free PSRAM block holds this size and
+        CONFIG_WIFIPCAP_HISTORY_HEADROOM more. 0 or no PSRAM for none.
+*/
+#define CONFIG_WIFIPCAP_HISTORY_SIZE (4u*1024u*1024u)
+
+/*
+    CONFIG_WIFIPCAP_HISTORY_HEADROOM
+
+    int "Bytes of PSRAM the capture history leaves free"
+    default 256*1024
+    help
+        With CONFIG_SPIRAM_USE_MALLOC, large malloc() calls made later, the
+        config buffers and the SD card, may come from PSRAM. Without this much
+        left over, capture runs without a history.
+*/
+#define CONFIG_WIFIPCAP_HISTORY_HEADROOM (256u*1024u)
+
+/*
+    CONFIG_WIFIPCAP_SD_CHUNK_SIZE
+
+    int "Bytes in each TF card write, USE_SD_CAPTURE"
+    default 16*1024
+    help
+        Two buffers of this size, DMA capable DRAM. Every write but the
+        last of a file is a whole chunk at a chunk aligned offset. Larger
+        chunks spend less of the card's time per byte, see
+        extras/sd_bench.cpp. A multiple of 512.
+*/
+#define CONFIG_WIFIPCAP_SD_CHUNK_SIZE (16u*1024u)
+
+/*
+    CONFIG_WIFIPCAP_SD_FILE_SIZE
+
+    int "Start a new capture file on the TF card at this size"
+    default 64*1024*1024
+    help
+        Files are made this size when opened, so FAT allocates no clusters
+        while streaming, and cut to the length written when closed.
+*/
+#define CONFIG_WIFIPCAP_SD_FILE_SIZE (64u*1024u*1024u)
+
+/*
+    CONFIG_WIFIPCAP_SD_FILE_MS
+
+    int "And when the capture file is this old, 0 for no limit"
+    default 10*60*1000
+*/
+#define CONFIG_WIFIPCAP_SD_FILE_MS (10u*60u*1000u)
+
+/*
+    CONFIG_WIFIPCAP_SD_SYNC_MS
+
+    int "Flush the capture file's FAT entry at this interval, 0 on close only"
+    default 5000
+    help
+        Bounds what is lost when the power goes. Each sync is a small write
+        to the FAT and the directory, away from the data.
+*/
+#define CONFIG_WIFIPCAP_SD_SYNC_MS 5000u
+
+/*
+    CONFIG_WIFIPCAP_SD_STALL_US
+
+    int "Count TF card writes longer than this as stalls"
+    default 100000
+*/
+#define CONFIG_WIFIPCAP_SD_STALL_US 100000u
+
+/*
+    CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH
+
+    int "Largest binary configuration message from the host"
+    default 8*1024
+    help
+        The binary configuration dialog takes all settings in one message,
+        watch lists and BPF program included. Allocated for the dialog only.
+        At most 65535.
+*/
+#define CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH (8*1024)
+
 /* Document
   !) Not useful, ESP32 does not appear to give us the FCS. It just includes the
   size of FCS in the packet length :(
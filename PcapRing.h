@@ -0,0 +1,160 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef PCAPRING_H
+#define PCAPRING_H
+/*
+  PcapRing - a single-producer/single-consumer ring of variable length records
+  held in place in one contiguous arena.
+
+  The producer is the WiFi RX callback, serial_pcap_cb(), on the SDK core. The
+  consumer is serial_task on the other core. Each side owns one offset, head for
+  the producer and tail for the consumer, and only reads the other's. No heap
+  calls, no locks.
+
+  Records are 4-byte aligned and never split across the end of the arena. When
+  a record does not fit in the space left at the end, the producer leaves a
+  wrap marker (a record length of 0) and continues at the start of the arena.
+  The arena is empty when head == tail; the producer never lets head catch up
+  to tail.
+
+  Offsets are published with interlocked_compare_exchange(). Besides being
+  atomic, S32C1I orders the store with the load that follows. That closes the
+  window where the producer could decide the consumer is busy while the
+  consumer decides the ring is empty and goes to sleep. See ring_commit() and
+  ring_release().
+*/
+#include "Interlocks.h"
+
+#ifndef STRUCT_PACKED
+#define STRUCT_PACKED __attribute__((packed))
+#endif
+
+struct RingRecord {
+    uint32_t length;          // Arena bytes used by this record, 0 marks a wrap
+    uint8_t  data[];
+} STRUCT_PACKED;
+
+struct PcapRing {
+    uint8_t *arena;
+    uint32_t size;            // multiple of 4
+    volatile uint32_t head;   // next write offset, producer owned
+    volatile uint32_t tail;   // next read offset, consumer owned
+    uint32_t reserve_at;      // producer, offset of reservation in progress
+    uint32_t reserve_len;
+
+    // Statistics, producer updated
+    uint32_t high_water;      // Most arena bytes in use at one time
+    uint32_t wraps;           // Times the producer wrapped to the start
+    uint32_t full;            // Records refused for lack of space
+};
+
+static inline uint32_t ring_record_size(size_t len) {
+    return (sizeof(RingRecord) + len + 3u) & ~3u;
+}
+
+static inline void ring_init(PcapRing *ring, void *arena, size_t size) {
+    ring->arena = (uint8_t *)arena;
+    ring->size = (arena) ? (size & ~3u) : 0;
+    ring->head = ring->tail = 0;
+    ring->reserve_at = ring->reserve_len = 0;
+    ring->high_water = ring->wraps = ring->full = 0;
+}
+
+static inline uint32_t ring_used(PcapRing *ring, uint32_t head, uint32_t tail) {
+    return (head >= tail) ? head - tail : ring->size - tail + head;
+}
+
+static inline uint32_t ring_used(PcapRing *ring) {
+    return ring_used(ring, interlocked_read(&ring->head), interlocked_read(&ring->tail));
+}
+
+/*
+  Producer - Reserve space for a record of "len" bytes. Returns a pointer to
+  the record data or NULL when full. Nothing is visible to the consumer until
+  ring_commit().
+*/
+static inline void *ring_reserve(PcapRing *ring, size_t len) {
+    const uint32_t need = ring_record_size(len);
+    const uint32_t head = ring->head;
+    const uint32_t tail = interlocked_read(&ring->tail);
+    uint32_t at = head;
+    if (head >= tail) {
+        // Free: [head, size) and [0, tail)
+        uint32_t room = ring->size - head;
+        if (0 == tail) room -= 1;   // Wrapping head to 0 would look empty
+        if (room < need) {
+            if (tail <= need) return NULL;
+            at = 0;
+        }
+    } else {
+        // Free: [head, tail)
+        if (tail - head <= need) return NULL;
+    }
+    ring->reserve_at = at;
+    ring->reserve_len = need;
+    RingRecord *rec = (RingRecord *)&ring->arena[at];
+    rec->length = need;
+    return rec->data;
+}
+
+/*
+  Producer - Publish the reserved record. Returns true when the consumer may
+  have seen an empty ring and needs a wake up.
+*/
+static inline bool ring_commit(PcapRing *ring) {
+    const uint32_t old_head = ring->head;
+    uint32_t head = ring->reserve_at + ring->reserve_len;
+    if (head >= ring->size) head = 0;
+    if (ring->reserve_at != old_head) {
+        ((RingRecord *)&ring->arena[old_head])->length = 0;  // wrap marker
+        ring->wraps++;
+    }
+    interlocked_compare_exchange(&ring->head, old_head, head);
+    const uint32_t tail = interlocked_read(&ring->tail);
+    const uint32_t used = ring_used(ring, head, tail);
+    if (used > ring->high_water) ring->high_water = used;
+    return tail == old_head;
+}
+
+/*
+  Consumer - Returns the oldest record or NULL when empty. The record stays
+  valid and writable until ring_release().
+*/
+static inline RingRecord *ring_peek(PcapRing *ring) {
+    uint32_t tail = ring->tail;
+    const uint32_t head = interlocked_read(&ring->head);
+    if (tail == head) return NULL;
+    RingRecord *rec = (RingRecord *)&ring->arena[tail];
+    if (0 == rec->length) {
+        // The producer wrapped to the start, a record is always there.
+        rec = (RingRecord *)&ring->arena[0];
+    }
+    return rec;
+}
+
+/*
+  Consumer - Return the record from ring_peek() to the producer. Returns true
+  when more records are waiting.
+*/
+static inline bool ring_release(PcapRing *ring, RingRecord *rec) {
+    const uint32_t old_tail = ring->tail;
+    uint32_t tail = (uint32_t)((uint8_t *)rec - ring->arena) + rec->length;
+    if (tail >= ring->size) tail = 0;
+    interlocked_compare_exchange(&ring->tail, old_tail, tail);
+    return tail != interlocked_read(&ring->head);
+}
+
+#endif // PCAPRING_H
@@ -0,0 +1,230 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef PRESCREEN_H
+#define PRESCREEN_H
+/*
+  Prescreen - the filters run on each packet in serial_pcap_cb() or
+  filter_task, before it goes in the packet rings.
+
+  prescreen<kPolicy>() is specialized at compile time for each combination
+  of the policy bits. prescreen_select() in SerialPcap.cpp picks the one
+  matching cust_fltr, prescreen_policy(), when the host dialog finishes. The
+  callback then runs a function without tests for filters that are off.
+
+  k_policy_generic builds the one function that tests every filter at run
+  time instead. It is not in prescreen_table, extras/prescreen_bench.cpp
+  times it against the specialized ones.
+
+  PC builds include host_shim.h first and define
+  PCAP_MAX_CAPTURE_PACKET_SIZE, SerialPcap.h does on the device.
+*/
+#include "KConfig.h"
+#ifndef HOST_SHIM_H
+#include <esp_wifi.h>
+#endif
+#include "WiFiPcap.h"
+#include "WatchList.h"
+#include "Bpf.h"
+#include "BeaconCache.h"
+#include "RetryCache.h"
+
+#ifndef PCAP_MAX_CAPTURE_PACKET_SIZE
+#error "Include SerialPcap.h before Prescreen.h"
+#endif
+
+#define WIFIPCAP_PAYLOAD_FCS_LEN               (4)
+
+/*
+  Snap lengths, by frame type and subtype. 0 keeps the whole packet,
+  k_snaplen_header keeps only the 802.11 header, see wifi_header_length().
+  EAPOL frames are always kept whole. Cleared when each host session starts.
+*/
+constexpr uint16_t k_snaplen_header = 1u;
+
+struct CustomFilters {
+    bool badpkt;
+    bool fcslen;
+    bool dedup;
+    bool noretry;
+    bool deferred;   // Filter in filter_task, not serial_pcap_cb()
+    uint32_t beacon_refresh_ms;
+    bool session;
+    size_t mcastlen; // 0, 1, 3, or 6
+    MacAddr mcast;   // Multicast Address
+    WatchList watch; // MAC Addresses and OUIs Of Interest
+    BpfProgram bpf;  // Capture filter from the host
+    uint16_t snaplen[4][16];
+    uint32_t cache_auth_count;
+    uintptr_t cache_auth;
+    uintptr_t cache_next;
+    uintptr_t cache_end;
+    uintptr_t cache_read_next;
+};
+
+// What the prescreen filters read and update
+struct PrescreenCtx {
+    CustomFilters *fltr;
+    RetryCache *retry;
+    BeaconCache *beacon;
+};
+
+/*
+  Prescreen policy bits, one specialized prescreen<>() for each combination.
+  k_policy_extra covers the filters used less often, BPF, retry suppression,
+  beacon dedup and snap lengths. Those are still tested at run time.
+*/
+constexpr uint32_t k_policy_badpkt  = (1u << 0);
+constexpr uint32_t k_policy_fcslen  = (1u << 1);
+constexpr uint32_t k_policy_session = (1u << 2);
+constexpr uint32_t k_policy_watch   = (1u << 3);
+constexpr uint32_t k_policy_extra   = (1u << 4);
+constexpr uint32_t k_policy_count   = (1u << 5);
+constexpr uint32_t k_policy_generic = k_policy_count;
+
+typedef ssize_t (*prescreen_fn)(const PrescreenCtx *ctx, const wifi_promiscuous_pkt_t *snoop, wifi_promiscuous_pkt_type_t type, ssize_t *length);
+
+// The policy bits for the filters tested before the length
+static inline uint32_t prescreen_flags(const CustomFilters *fltr) {
+    uint32_t policy = 0;
+    if (fltr->badpkt) policy |= k_policy_badpkt;
+    if (fltr->fcslen) policy |= k_policy_fcslen;
+    if (fltr->session) policy |= k_policy_session;
+    if (!watch_list_empty(&fltr->watch)) policy |= k_policy_watch;
+    return policy;
+}
+
+// The policy for the current settings, an index into prescreen_table
+static inline uint32_t prescreen_policy(const CustomFilters *fltr) {
+    uint32_t policy = prescreen_flags(fltr);
+    bool extra = fltr->bpf.active || fltr->noretry || fltr->dedup;
+    for (size_t i = 0; !extra && i < sizeof(fltr->snaplen) / sizeof(fltr->snaplen[0][0]); i++) {
+        extra = (0 != (&fltr->snaplen[0][0])[i]);
+    }
+    if (extra) policy |= k_policy_extra;
+    return policy;
+}
+
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+/*
+  Returns the number of bytes to keep, 0 drops the packet. "*length" gets the
+  packet length for the pcap header.
+*/
+template <uint32_t kPolicy>
+static ssize_t prescreen(const PrescreenCtx *ctx, const wifi_promiscuous_pkt_t *snoop, wifi_promiscuous_pkt_type_t type, ssize_t *length) {
+    CustomFilters * const fltr = ctx->fltr;
+    const uint32_t policy = (kPolicy & k_policy_generic) ? prescreen_flags(fltr) | k_policy_extra : kPolicy;
+
+    // Skip error state packets - does this include with FCS Errors ??
+    // rx_ctrl.rx_state is underdocumented. I assume it would be set for errors
+    // other than fcsfail. Like runt packets, jumbo packets, DMA error, etc.
+    if (!(policy & k_policy_badpkt) && 0 != snoop->rx_ctrl.rx_state) return 0;
+
+    const WiFiPktHdr* const pkt = (WiFiPktHdr*)snoop->payload;
+    // Apply prescreen filters
+    if (policy & k_policy_session) {
+        // These seem to work for limiting excess captured packets when
+        // focusing on IP/TCP data. While Wireshark is logging, each side
+        // needs to authenticate with the AP for decryption to work.
+        //?? Do I need any WIFI_PKT_MGMT packets ??
+        if (WIFI_PKT_MGMT == type) {
+            if (WLAN_FC_STYPE_BEACON     == pkt->fctl.subtype) return 0;
+            if (WLAN_FC_STYPE_PROBE_REQ  == pkt->fctl.subtype) return 0;
+            if (WLAN_FC_STYPE_PROBE_RESP == pkt->fctl.subtype) return 0;
+        }
+        // Disregard (no data) subtypes.
+        if (WIFI_PKT_DATA == type && (0x04u & pkt->fctl.subtype)) return 0;
+    }
+    // Match Source or Destination Address to an OUI (or unicast address)
+    if (policy & k_policy_watch) {
+        do {
+            if (fltr->mcastlen) {
+                if (1 == fltr->mcastlen) {
+                    // Keep any broadcast response
+                    if ((!pkt->fctl.toDS && (1u & pkt->ra.mac[0])) ||
+                        ( pkt->fctl.toDS && (1u & pkt->addr3.mac[0])) ) {
+                        continue;
+                    }
+                } else {
+                  // Keep selective broadcast
+                  size_t len = fltr->mcastlen;
+                  uint8_t *moi = fltr->mcast.mac;
+                  if ((!pkt->fctl.toDS && 0 == memcmp(pkt->ra.mac,    moi, len)) ||
+                      ( pkt->fctl.toDS && 0 == memcmp(pkt->addr3.mac, moi, len))) {
+                      continue;
+                  }
+                }
+            }
+            // Log packet on interesting Source Address or Destination Address
+            if (watch_list_match_frame(&fltr->watch, pkt)) continue;
+            return 0;
+        } while (false);
+    }
+    *length = snoop->rx_ctrl.sig_len;
+    if (!(policy & k_policy_fcslen)) {
+        *length -= WIFIPCAP_PAYLOAD_FCS_LEN;
+    }
+    ssize_t keepLength = *length;
+    if (keepLength > PCAP_MAX_CAPTURE_PACKET_SIZE) keepLength = PCAP_MAX_CAPTURE_PACKET_SIZE;
+    if (!(policy & k_policy_extra) || 0 >= keepLength) return keepLength;
+
+    // Host capture filter, its return value is a snap length
+    const uint32_t bpf_active = fltr->bpf.active;
+    if (bpf_active) {
+        const BpfInsn *insn = fltr->bpf.insn[(bpf_active & k_bpf_active_copy) ? 1 : 0];
+        uint32_t snap = bpf_filter(insn, bpf_active & ~k_bpf_active_copy, snoop->payload, *length, keepLength, &fltr->bpf.executed);
+        if (0 == snap) {
+            fltr->bpf.reject++;
+            return 0;
+        }
+        fltr->bpf.pass++;
+        if (snap < (uint32_t)keepLength) keepLength = snap;
+    }
+    if (fltr->noretry && 0 == snoop->rx_ctrl.rx_state &&
+        (WIFI_PKT_MGMT == type || WIFI_PKT_DATA == type)) {
+        ssize_t len = snoop->rx_ctrl.sig_len - WIFIPCAP_PAYLOAD_FCS_LEN;
+        if (0 < len && retry_cache_check(ctx->retry, pkt, len)) return 0;
+    }
+    if (fltr->dedup && WIFI_PKT_MGMT == type && 0 == snoop->rx_ctrl.rx_state &&
+        (WLAN_FC_STYPE_BEACON == pkt->fctl.subtype || WLAN_FC_STYPE_PROBE_RESP == pkt->fctl.subtype)) {
+        ssize_t len = snoop->rx_ctrl.sig_len - WIFIPCAP_PAYLOAD_FCS_LEN;
+        if (len > PCAP_MAX_CAPTURE_PACKET_SIZE) len = PCAP_MAX_CAPTURE_PACKET_SIZE;
+        if (0 < len && beacon_cache_check(ctx->beacon, pkt, len, fltr->beacon_refresh_ms)) return 0;
+    }
+    // Per frame type snap length, capture_length is reduced and
+    // packet_length keeps the original length.
+    ssize_t snaplen = fltr->snaplen[pkt->fctl.type][pkt->fctl.subtype];
+    if (snaplen && snaplen < keepLength) {
+        if (WLAN_FC_TYPE_DATA == pkt->fctl.type && wifi_eapol(pkt, keepLength)) {
+            // Keep EAPOL whole
+        } else {
+            if (k_snaplen_header == snaplen) snaplen = wifi_header_length(pkt);
+            if (snaplen < keepLength) keepLength = snaplen;
+        }
+    }
+    return keepLength;
+}
+#pragma GCC pop_options
+
+#define PRESCREEN_4(n) prescreen<(n)>, prescreen<(n) + 1>, prescreen<(n) + 2>, prescreen<(n) + 3>
+static const prescreen_fn prescreen_table[k_policy_count] = {
+    PRESCREEN_4(0),  PRESCREEN_4(4),  PRESCREEN_4(8),  PRESCREEN_4(12),
+    PRESCREEN_4(16), PRESCREEN_4(20), PRESCREEN_4(24), PRESCREEN_4(28)
+};
+#undef PRESCREEN_4
+static_assert(32 == k_policy_count, "Update prescreen_table");
+
+#endif // PRESCREEN_H
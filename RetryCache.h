@@ -0,0 +1,123 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef RETRYCACHE_H
+#define RETRYCACHE_H
+/*
+  RetryCache - suppress retransmitted frames
+
+  Like the receive cache of an 802.11 station, remember the last Sequence
+  Control value seen from each transmitter. QoS Data keeps one per TID, other
+  Data and Management frames one each. A frame with the retry bit set and the
+  same sequence and fragment number as the last one is an exact retransmit and
+  is dropped. The first copy is the one forwarded.
+
+  Only the prescreen filters touch the table, they run in serial_pcap_cb() or
+  filter_task, never both at once. Other tasks ask for a flush by bumping
+  flush_req.
+*/
+#include "KConfig.h"
+#include "WiFiPcap.h"
+
+constexpr size_t k_retry_cache_probe = 4;   // Slots searched before evicting
+static_assert(0 == (CONFIG_WIFIPCAP_RETRY_CACHE_SIZE & (CONFIG_WIFIPCAP_RETRY_CACHE_SIZE - 1)),
+    "CONFIG_WIFIPCAP_RETRY_CACHE_SIZE must be a power of 2");
+
+struct RetryCacheEntry {
+    MacAddr ta;
+    uint8_t tid;              // QoS TID, 0x10 non-QoS Data, 0x20 Management
+    uint8_t used;
+    uint16_t seqctl;
+    uint16_t age;             // RetryCache::clock when last updated
+};
+
+struct RetryCache {
+    RetryCacheEntry entry[CONFIG_WIFIPCAP_RETRY_CACHE_SIZE];
+    uint16_t clock;
+    volatile uint32_t flush_req;
+    uint32_t flush_ack;
+
+    // Statistics
+    uint32_t suppressed;      // Retransmits dropped
+    uint64_t suppressed_bytes;
+    uint32_t evicts;          // Entries replaced by a different transmitter
+};
+
+static inline void retry_cache_clear(RetryCache *rc) {
+    memset(rc->entry, 0, sizeof(rc->entry));
+    rc->flush_ack = rc->flush_req;
+}
+
+// Any task - Forget all transmitters
+static inline void retry_cache_flush(RetryCache *rc) {
+    rc->flush_req = rc->flush_req + 1;
+}
+
+/*
+  Records the Sequence Control of a Management or Data frame and returns true
+  when the frame is a retransmit of the last one from the same transmitter.
+  "len" is the frame length without FCS, counted when suppressed.
+*/
+static inline bool retry_cache_check(RetryCache *rc, const WiFiPktHdr* const pkt, size_t len) {
+    if (rc->flush_req != rc->flush_ack) retry_cache_clear(rc);
+    if (len < offsetof(struct WiFiPktHdr, addr4)) return false;
+
+    uint8_t tid = 0x20u;
+    if (WLAN_FC_TYPE_DATA == pkt->fctl.type) {
+        tid = 0x10u;
+        if (0x08u & pkt->fctl.subtype) {
+            size_t at = offsetof(struct WiFiPktHdr, addr4);
+            if (pkt->fctl.toDS && pkt->fctl.fromDS) at += sizeof(MacAddr);
+            if (len >= at + sizeof(QOS_CNTRL)) tid = ((const uint8_t *)pkt)[at] & 0x0Fu;
+        }
+    }
+    const uint8_t *ta = pkt->ta.mac;
+    uint16_t seqctl;
+    memcpy(&seqctl, &pkt->seqctl, sizeof(seqctl));
+    const uint32_t key = ((uint32_t)ta[3] << 16 | (uint32_t)ta[4] << 8 | ta[5]) ^ ((uint32_t)tid << 8);
+    const uint32_t mask = CONFIG_WIFIPCAP_RETRY_CACHE_SIZE - 1;
+    const uint32_t idx = key * 2654435761u;  // Knuth multiplicative hash
+    const uint16_t now = ++rc->clock;
+
+    RetryCacheEntry *victim = NULL;
+    for (size_t n = 0; n < k_retry_cache_probe; n++) {
+        RetryCacheEntry *e = &rc->entry[((idx >> 16) + n) & mask];
+        if (!e->used) {
+            victim = e;
+            break;
+        }
+        if (e->tid == tid && 0 == memcmp(e->ta.mac, ta, sizeof(MacAddr))) {
+            e->age = now;
+            if (pkt->fctl.retry && e->seqctl == seqctl) {
+                rc->suppressed++;
+                rc->suppressed_bytes += len;
+                return true;
+            }
+            e->seqctl = seqctl;
+            return false;
+        }
+        if (NULL == victim || (uint16_t)(now - e->age) > (uint16_t)(now - victim->age)) victim = e;
+    }
+
+    if (victim->used) rc->evicts++;
+    memcpy(victim->ta.mac, ta, sizeof(MacAddr));
+    victim->tid = tid;
+    victim->used = 1;
+    victim->seqctl = seqctl;
+    victim->age = now;
+    return false;
+}
+
+#endif // RETRYCACHE_H
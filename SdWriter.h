@@ -0,0 +1,312 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef SDWRITER_H
+#define SDWRITER_H
+/*
+  SdWriter - capture files on the TF card, written in large aligned chunks
+  from double buffers.
+
+  The producer, serial_task, copies records into one of two chunk buffers.
+  Records are split across the buffers. Every write to a file but its last
+  is then a whole chunk at a chunk aligned offset, the best case for FAT on
+  an SD card. The producer hands a full buffer to the writer task and fills
+  the other one while the writer calls sd_writer_service(). When neither
+  buffer is free, the producer holds the record where it is, see
+  sd_writer_ready(), or it is dropped and counted as an overrun. The
+  producer never waits on the card.
+
+  Files are made at their full size when opened, so no clusters are
+  allocated while streaming. On close they are cut to the length written. A
+  file ends when the next record would take it past "max_bytes", when it is
+  "max_ms" old, or on sd_writer_finish(). Each file starts with the file
+  header given to sd_writer_init().
+
+  Ownership of a buffer passes with its "len", published with
+  interlocked_compare_exchange() as in PcapRing.h. Buffers go to the writer
+  in order and come back in order.
+
+  File calls go through SdWriterIo. On the device they use VFS/FATFS. For
+  extras/sd_bench.cpp they use plain files.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Interlocks.h"
+#include "Histogram.h"
+
+constexpr size_t k_sd_buffers = 2;
+constexpr uint32_t k_sd_last = 0x80000000u;    // in SdChunk len, close the file after
+constexpr size_t k_sd_header_max = 32;
+constexpr size_t k_sd_path_max = 64;
+
+struct SdWriterIo {
+    void *ctx;
+    int (*open)(void *ctx, const char *path, uint32_t prealloc);  // fd, < 0 failed
+    int (*write)(void *ctx, int fd, const void *buf, size_t len); // bytes written
+    int (*sync)(void *ctx, int fd);
+    int (*close)(void *ctx, int fd, uint32_t length);             // cut to "length"
+    uint64_t (*now_us)(void);
+};
+
+struct SdChunk {
+    uint8_t *buf;
+    volatile uint32_t len;    // bytes to write | k_sd_last, 0 free
+    uint32_t file;            // number of the file it belongs to
+};
+
+struct SdWriterStats {
+    // Producer
+    uint32_t files;           // started
+    uint32_t records;
+    uint32_t overruns;        // records dropped, no free buffer
+    uint64_t dropped_bytes;
+
+    // Writer
+    uint32_t writes;
+    uint64_t bytes;
+    uint64_t write_us;        // time in write()
+    uint32_t stalls;          // writes longer than "stall_us"
+    uint32_t errors;          // open or write failed, the rest of the file is lost
+    uint32_t open_max_us;     // open and preallocate
+    uint32_t close_max_us;    // cut and close
+    Histogram latency;        // each write
+};
+
+struct SdWriter {
+    SdWriterIo io;
+    char dir[k_sd_path_max];
+    SdChunk chunk[k_sd_buffers];
+    uint32_t chunk_size;      // a multiple of 512
+    uint32_t max_bytes;       // a multiple of chunk_size
+    uint32_t max_ms;          // 0, no time limit
+    uint32_t sync_ms;         // 0, sync on close only
+    uint32_t stall_us;
+    uint8_t header[k_sd_header_max];
+    uint32_t header_len;
+
+    // Producer
+    uint32_t fill;            // chunk being filled
+    uint32_t fill_len;
+    uint32_t next_file;
+    uint32_t file;            // 0, none open
+    uint32_t file_bytes;
+    uint64_t file_start_us;
+    uint32_t handoffs;        // buffers given to the writer
+
+    // Writer
+    uint32_t drain;           // next chunk to write
+    int fd;
+    uint32_t fd_file;         // open, or failed and skipped
+    uint32_t fd_bytes;
+    uint64_t sync_us;
+
+    SdWriterStats stats;
+};
+
+/*
+  "bufs" are k_sd_buffers buffers of "chunk_size" bytes, DMA capable on the
+  device. Files are named "dir"/capNNNNN.pcap, from "first_file" on.
+*/
+static inline void sd_writer_init(SdWriter *w, const SdWriterIo *io, const char *dir, uint8_t * const *bufs,
+    uint32_t chunk_size, uint32_t max_bytes, uint32_t max_ms, const void *header, size_t header_len, uint32_t first_file) {
+    memset(w, 0, sizeof(SdWriter));
+    w->io = *io;
+    snprintf(w->dir, sizeof(w->dir), "%s", dir);
+    for (size_t i = 0; i < k_sd_buffers; i++) w->chunk[i].buf = bufs[i];
+    w->chunk_size = chunk_size & ~511u;
+    w->max_bytes = ((max_bytes + w->chunk_size - 1) / w->chunk_size) * w->chunk_size;
+    w->max_ms = max_ms;
+    w->stall_us = 100000u;
+    w->header_len = (k_sd_header_max < header_len) ? k_sd_header_max : header_len;
+    memcpy(w->header, header, w->header_len);
+    w->next_file = (first_file) ? first_file : 1;
+    w->fd = -1;
+}
+
+static inline void sd_writer_path(const SdWriter *w, uint32_t file, char *path, size_t size) {
+    snprintf(path, size, "%s/cap%05u.pcap", w->dir, (unsigned)file);
+}
+
+/*
+  Producer - Bytes that may be copied now. Only free buffers count, the one
+  being filled first.
+*/
+static inline uint32_t sd_writer_room(SdWriter *w) {
+    uint32_t room = 0;
+    for (size_t i = 0; i < k_sd_buffers; i++) {
+        const SdChunk *c = &w->chunk[(w->fill + i) % k_sd_buffers];
+        if (interlocked_read((volatile uint32_t *)&c->len)) break;
+        room += (0 == i) ? w->chunk_size - w->fill_len : w->chunk_size;
+    }
+    return room;
+}
+
+// Producer - Hand the buffer being filled to the writer
+static inline void sd_writer_handoff(SdWriter *w, uint32_t flags) {
+    SdChunk *c = &w->chunk[w->fill];
+    c->file = w->file;
+    interlocked_compare_exchange(&c->len, 0, w->fill_len | flags);
+    w->fill = (w->fill + 1) % k_sd_buffers;
+    w->fill_len = 0;
+    w->handoffs++;
+}
+
+// Producer - Copy, handing over each buffer as it fills. sd_writer_room() said it fits.
+static inline void sd_writer_put(SdWriter *w, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len) {
+        SdChunk *c = &w->chunk[w->fill];
+        size_t take = w->chunk_size - w->fill_len;
+        if (take > len) take = len;
+        memcpy(&c->buf[w->fill_len], p, take);
+        w->fill_len += take;
+        p += take;
+        len -= take;
+        if (w->chunk_size == w->fill_len) sd_writer_handoff(w, 0);
+    }
+}
+
+/*
+  Producer - End the file, what is left of it goes to the writer. Returns
+  false when that must wait for a free buffer, try again.
+*/
+static inline bool sd_writer_finish(SdWriter *w) {
+    if (0 == w->file) return true;
+    if (interlocked_read(&w->chunk[w->fill].len)) return false;
+    sd_writer_handoff(w, k_sd_last);
+    w->file = 0;
+    return true;
+}
+
+// Producer - The file must end before a record of "len" bytes
+static inline bool sd_writer_due(SdWriter *w, size_t len) {
+    if (0 == w->file) return false;
+    if (w->file_bytes + len > w->max_bytes) return true;
+    return w->max_ms && w->io.now_us() - w->file_start_us >= (uint64_t)w->max_ms * 1000u;
+}
+
+// Producer - End a file that has grown too old, for when no records come
+static inline bool sd_writer_poll(SdWriter *w) {
+    return sd_writer_due(w, 0) && sd_writer_finish(w);
+}
+
+/*
+  Producer - Can a record of "len" bytes be appended now. Ends the file
+  first when it is due. A caller that can hold the record, eg. in its ring,
+  waits for true rather than have sd_writer_append() drop it. Records too
+  big to ever fit are left to sd_writer_append() to drop.
+*/
+static inline bool sd_writer_ready(SdWriter *w, size_t len) {
+    const uint32_t need = w->header_len + len;
+    if (need > w->max_bytes || need > k_sd_buffers * w->chunk_size) return true;
+    if (sd_writer_due(w, len) && !sd_writer_finish(w)) return false;
+    return ((w->file) ? len : need) <= sd_writer_room(w);
+}
+
+/*
+  Producer - Append one record, given in two parts, eg. the headers made
+  here and the frame. Returns false when it was dropped. The writer has work
+  when "handoffs" changed.
+*/
+static inline bool sd_writer_append(SdWriter *w, const void *head, size_t head_len, const void *body, size_t body_len) {
+    const uint32_t len = head_len + body_len;
+    const uint32_t need = w->header_len + len;
+    if (need > w->max_bytes || need > k_sd_buffers * w->chunk_size || !sd_writer_ready(w, len)) {
+        w->stats.overruns++;
+        w->stats.dropped_bytes += len;
+        return false;
+    }
+    // A new file starts in a new buffer, at offset 0, sd_writer_finish() saw to that
+    if (0 == w->file) {
+        w->file = w->next_file++;
+        w->file_bytes = 0;
+        w->file_start_us = w->io.now_us();
+        w->stats.files++;
+        sd_writer_put(w, w->header, w->header_len);
+        w->file_bytes += w->header_len;
+    }
+    sd_writer_put(w, head, head_len);
+    sd_writer_put(w, body, body_len);
+    w->file_bytes += len;
+    w->stats.records++;
+    return true;
+}
+
+// Writer - Close the open file, cut to what was written
+static inline void sd_writer_close(SdWriter *w) {
+    if (0 > w->fd) return;
+    const uint64_t t0 = w->io.now_us();
+    w->io.close(w->io.ctx, w->fd, w->fd_bytes);
+    const uint32_t us = w->io.now_us() - t0;
+    if (us > w->stats.close_max_us) w->stats.close_max_us = us;
+    w->fd = -1;
+}
+
+/*
+  Writer - Write the buffers handed over, in order. Returns true when there
+  was any.
+*/
+static inline bool sd_writer_service(SdWriter *w) {
+    bool worked = false;
+    for (;;) {
+        SdChunk *c = &w->chunk[w->drain];
+        const uint32_t v = interlocked_read(&c->len);
+        if (0 == v) break;
+        const uint32_t len = v & ~k_sd_last;
+        if (c->file != w->fd_file) {
+            // A file not closed, its last buffer was never sent
+            sd_writer_close(w);
+            w->fd_file = c->file;
+            w->fd_bytes = 0;
+            char path[k_sd_path_max + 24];
+            sd_writer_path(w, c->file, path, sizeof(path));
+            const uint64_t t0 = w->io.now_us();
+            w->fd = w->io.open(w->io.ctx, path, w->max_bytes);
+            const uint32_t us = w->io.now_us() - t0;
+            if (us > w->stats.open_max_us) w->stats.open_max_us = us;
+            if (0 > w->fd) w->stats.errors++;
+            w->sync_us = t0;
+        }
+        if (len && 0 <= w->fd) {
+            const uint64_t t0 = w->io.now_us();
+            const int wrote = w->io.write(w->io.ctx, w->fd, c->buf, len);
+            const uint64_t t1 = w->io.now_us();
+            const uint32_t us = t1 - t0;
+            histogram_add(&w->stats.latency, us);
+            w->stats.writes++;
+            w->stats.write_us += us;
+            if (us > w->stall_us) w->stats.stalls++;
+            if (wrote == (int)len) {
+                w->stats.bytes += len;
+                w->fd_bytes += len;
+                if (w->sync_ms && t1 - w->sync_us >= (uint64_t)w->sync_ms * 1000u) {
+                    w->io.sync(w->io.ctx, w->fd);
+                    w->sync_us = t1;
+                }
+            } else {
+                w->stats.errors++;
+                sd_writer_close(w);
+            }
+        }
+        if (v & k_sd_last) sd_writer_close(w);
+        interlocked_compare_exchange(&c->len, v, 0);
+        w->drain = (w->drain + 1) % k_sd_buffers;
+        worked = true;
+    }
+    return worked;
+}
+
+#endif // SDWRITER_H
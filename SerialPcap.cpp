@@ -28,10 +28,28 @@
 #include <Arduino.h>
 #include <esp_system.h>
 #include <esp_wifi.h>
+#include <esp_cpu.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <freertos/ringbuf.h>
 // #include <hal/usb_serial_jtag_ll.h>
 #include "SerialPcap.h"
 #include "WiFiPcap.h"
 #include "Interlocks.h"
+#include "PcapRing.h"
+#include "BeaconCache.h"
+#include "RetryCache.h"
+#include "ChanStats.h"
+#include "WatchList.h"
+#include "Bpf.h"
+#include "TxBatch.h"
+#include "Prescreen.h"
+#if USE_SD_CAPTURE
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SdWriter.h"
+#endif
 
 #ifndef USE_WIFIPCAP_FILTER_AP_SESSION
 #define USE_WIFIPCAP_FILTER_AP_SESSION 0
@@ -49,7 +67,6 @@ static const char *TAG = "SerialPcap";
 
 extern "C" {
 
-#define WIFIPCAP_PAYLOAD_FCS_LEN               (4)
 #define WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS     (100)
 #define WIFIPCAP_HP_PROCESS_PACKET_TIMEOUT_MS  (10)      // High Priority Task
 
@@ -70,29 +87,307 @@ union UTaskState {
   TaskState b;
 };
 
-struct CustomFilters {
-    bool badpkt;
-    bool fcslen;
-    bool session;
-    size_t mcastlen; // 0, 1, 3, or 6
-    MacAddr mcast;   // Multicast Address
-    size_t moilen;   // 0 == None, 3 == OUI, 6 == MAC
-    MacAddr moi;     // MAC Address Of Interest
-    uint32_t cache_auth_count;
-    uintptr_t cache_auth;
-    uintptr_t cache_next;
-    uintptr_t cache_end;
-    uintptr_t cache_read_next;
+CustomFilters __NOINIT_ATTR cust_fltr;
+
+/*
+  Compact format encoder, serial_task owned. See PCAP_COMPACT_MAGIC.
+*/
+struct CompactState {
+    bool enabled;            // this session, host 'Z'
+    uint64_t last_us;        // time of the previous record
+    MacAddr mac[k_compact_mac_slots];
+
+    // Statistics
+    uint32_t records;
+    uint64_t pcap_bytes;     // as PCAP 2.4
+    uint64_t bytes;          // as sent
 };
+static_assert(CONFIG_WIFIPCAP_BATCH_SIZE >= PCAP_MAX_CAPTURE_PACKET_SIZE + sizeof(RadiotapHeader) + sizeof(PcapPacketHeader) + k_compact_overhead,
+    "CONFIG_WIFIPCAP_BATCH_SIZE must hold the largest compact record");
 
-CustomFilters __NOINIT_ATTR cust_fltr;
+// New stream, no earlier record to refer back to
+static inline void compact_reset(CompactState *cz) {
+    cz->last_us = 0;
+    memset(cz->mac, 0, sizeof(cz->mac));
+}
+
+/*
+  pcapng, host 'N'. An interface is made for a channel when it first shows
+  up, with the counts at that time as the base of its statistics.
+*/
+constexpr uint8_t k_pcapng_no_if = 0xFFu;
+
+struct PcapngState {
+    uint32_t isb_ms;                      // 0, PCAP 2.4. Otherwise pcapng and the ISB interval
+    uint32_t last_ms;
+    uint32_t if_count;
+    uint8_t if_id[maxChannel];            // k_pcapng_no_if until its IDB is out
+    uint8_t if_channel[maxChannel];
+    uint64_t base_recv[maxChannel];
+    uint64_t base_drop[maxChannel];
+    uint32_t base_shed[maxChannel];
+};
+static_assert(CONFIG_WIFIPCAP_BATCH_SIZE >= PCAP_MAX_CAPTURE_PACKET_SIZE + sizeof(RadiotapHeader) + k_pcapng_epb_overhead,
+    "CONFIG_WIFIPCAP_BATCH_SIZE must hold the largest Enhanced Packet Block");
+
+/*
+  Block compression, serial_task owned. See LzBlockHeader.
+
+  LZ4's block format, greedy with a single entry hash table, as in LZ4's fast
+  mode. The last CONFIG_WIFIPCAP_LZ_WINDOW bytes stay in "buf" ahead of the
+  block being packed and serve as its dictionary.
+*/
+constexpr size_t k_lz_min_match = 4;
+constexpr size_t k_lz_last_literals = 5;  // LZ4, no match reaches into these
+constexpr size_t k_lz_match_limit = 12;   // LZ4, no match starts this close to the end
+constexpr uint32_t k_lz_poor_limit = 8;   // blocks in a row that did not pack, then
+constexpr uint32_t k_lz_rest = 32;        //   blocks sent as is without trying
+static_assert(CONFIG_WIFIPCAP_LZ_WINDOW + CONFIG_WIFIPCAP_BATCH_SIZE <= 0xFFFFu,
+    "LZ4 offsets are 16 bits");
+
+struct LzState {
+    bool enabled;            // this session, host 'z'
+    uint8_t *buf;            // history, then the block being packed
+    uint32_t *table;         // stream offset + 1 by hash of 4 bytes, 0 empty
+    uint8_t *out;            // LzBlockHeader, then the block
+    uint32_t hist;           // history bytes at the start of "buf"
+    uint32_t base;           // stream offset of buf[0]
+    uint32_t poor;           // blocks in a row that did not pack
+    uint32_t rest;           // blocks left to send as is
+    uint64_t start_us;       // session start
+
+    // Statistics
+    uint32_t blocks;
+    uint32_t stored;         // sent as is
+    uint64_t in;
+    uint64_t bytes;          // sent, block headers included
+    uint64_t cycles;
+};
+
+/*
+  Framed transport, host 'R'. Frames are built in place, each buffer written
+  from has room for a FrameHeader before it and the CRC after. Log lines
+  from any task wait in "log" for serial_task.
+*/
+constexpr size_t k_frame_log_line = 120;  // longer lines are cut
+static_assert(sizeof(LzBlockHeader) + CONFIG_WIFIPCAP_BATCH_SIZE <= 0xFFFFu,
+    "FrameHeader length is 16 bits");
+
+struct FrameState {
+    uint32_t sync_ms;        // 0, not framed. Otherwise the FrameSync interval
+    uint32_t last_ms;
+    uint32_t seq;
+    RingbufHandle_t log;     // CONFIG_WIFIPCAP_FRAME_LOG_SIZE, made on first use
+    vprintf_like_t console;  // log output before this session, NULL when not ours
+    volatile uint32_t log_lost;
+
+    // Statistics
+    uint32_t frames;
+    uint32_t log_lines;
+};
+
+/*
+  Capture history, serial_task owned. Frames lane_drain() would throw away
+  while no host is connected are kept here, see history_save(). Records are
+  a WiFiPcap with a RadiotapHeader, time stamped with the device uptime.
+*/
+struct HistoryState {
+    PcapRing ring;           // CONFIG_WIFIPCAP_HISTORY_SIZE of PSRAM
+    uint32_t seconds;        // 'J', replay this far back, 0 none. This session
+    uint32_t kbytes;         // 'j', and no more than this, 0 no limit
+
+    // Statistics
+    uint32_t saved;
+    uint32_t overwritten;
+    uint32_t replayed;
+};
+
+/*
+  Trigger capture, host 'E', 'K' and 'k', serial_task owned. While quiet,
+  frames are held in the history ring, see trigger_hold().
+*/
+struct TriggerState {
+    TriggerDef list[k_trigger_max];
+    size_t len;              // 0, off. This session
+    uint32_t pre_ms;
+    uint32_t post_ms;
+    uint64_t until_us;       // esp_timer_get_time() the post window ends, 0 quiet
+    uint64_t start_us;       // esp_timer_get_time() this session began
+    int pending;             // TriggerDef matched by the frame in hand, -1 none
+
+    // Statistics
+    uint32_t fired;
+    uint32_t held;
+    uint64_t held_bytes;
+    uint64_t sent_bytes;     // of those, in a pre-trigger window
+};
+
+/*
+  A CONFIG_MSG_SET from the host while streaming, serial_task owned. It waits
+  in "buf" with capture stopped till the rings are empty.
+*/
+struct LiveConfig {
+    uint8_t *buf;            // NULL, none waiting
+    size_t len;
+    uint32_t seq;            // SETs this session
+    uint32_t stop_us;        // esp_timer_get_time() when capture stopped
+};
+
+/*
+  Periodic Telemetry records, serial_task owned
+*/
+struct TelemetryState {
+    uint32_t interval_ms;    // 0, off
+    bool due;                // send one now, the overload level changed. Only when on
+    uint32_t last_ms;
+    uint32_t seq;
+    uint32_t channel;        // channel of "stats"
+    ChannelStats stats;      // at the previous record
+    uint32_t writes;
+    uint64_t bytes;
+    uint64_t stall_us;
+    uint64_t lz_in;
+    uint64_t lz_bytes;
+    uint64_t lz_cycles;
+};
+
+/*
+  Statistics only operation, host 'V'. The counts of each channel at the
+  previous SurveyReport.
+*/
+struct SurveyBase {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t mgmt;
+    uint64_t ctrl;
+    uint64_t data;
+    uint64_t error;
+    uint64_t listen_us;
+};
+
+struct SurveyState {
+    volatile uint32_t interval_ms;  // 0, off. Otherwise no frames are forwarded
+    uint32_t last_ms;               // 0, the next poll takes the baseline
+    uint32_t seq;
+    SurveyBase base[maxChannel];
+};
+
+/*
+  Time spent waiting at a stage boundary, from enqueue to dequeue.
+*/
+struct StageStats {
+    uint32_t count;
+    uint32_t latency_max_us;
+    uint64_t latency_sum_us;
+};
+
+static inline void stage_stats_add(StageStats *stats, uint32_t enqueued_us) {
+    const uint32_t us = (uint32_t)esp_timer_get_time() - enqueued_us;
+    stats->count++;
+    stats->latency_sum_us += us;
+    if (us > stats->latency_max_us) stats->latency_max_us = us;
+}
+
+/*
+  Unfiltered packet as copied by serial_pcap_cb() for the filter stage.
+*/
+struct RawPacket {
+    uint32_t type;               // wifi_promiscuous_pkt_type_t
+    uint32_t enqueued_us;        // esp_timer_get_time()
+    wifi_promiscuous_pkt_t pkt;  // rx_ctrl followed by the payload
+};
+
+/*
+  Admission lanes into serial_task. EAPOL and the management frames that set
+  up or tear down a connection go in the high priority lane, the rest is best
+  effort. See pcap_priority().
+*/
+constexpr size_t k_lane_high  = 0;
+constexpr size_t k_lane_best  = 1;
+constexpr size_t k_lane_count = 2;
+
+struct LaneStats {           // pcap_enqueue() updated
+    uint32_t queued;
+    uint32_t dropped;
+};
+
+/*
+  Overload ladder - shed best effort load in steps before the packet ring
+  fills. serial_task sets the level from the ring pressure, pcap_enqueue()
+  applies it.
+*/
+constexpr uint32_t k_overload_truncate  = 1;  // Data frames, header only
+constexpr uint32_t k_overload_sample    = 2;  // and sample Data by TA/RA
+constexpr uint32_t k_overload_drop_ctrl = 4;  // and drop Control frames
+constexpr uint32_t k_overload_max       = 4;
+constexpr uint8_t k_overload_sample_shift[k_overload_max + 1] = { 0, 0, 1, 3, 3 };
+
+struct OverloadLadder {
+    uint32_t start_pct;          // 0, off
+    volatile uint32_t level;
+    uint32_t pressure;           // percent
+    uint32_t drain_Bps;          // USB, smoothed, over busy intervals only
+    bool drain_measured;         // drain_Bps is from a busy interval
+    uint32_t last_ms;
+    uint64_t last_bytes;
+    uint64_t last_stall_us;
+    uint32_t last_used;
+
+    // Statistics
+    uint32_t max_level;
+    uint32_t changes;
+    uint32_t truncated;          // pcap_enqueue() updated
+    uint64_t truncated_bytes;
+    uint32_t sampled_out;
+    uint32_t ctrl_dropped;
+    uint32_t shed[maxChannel];   // sampled out and dropped, by channel
+};
 
 struct SerialTask {
     TaskState volatile state;
     uint32_t channel = 0;
     SERIAL_INF* volatile pcapSerial = NULL;
     TaskHandle_t volatile task = NULL;
-    QueueHandle_t volatile work_queue = NULL;
+    PcapRing ring;               // best effort, and high priority overflow
+    PcapRing prio;               // high priority, CONFIG_WIFIPCAP_PRIO_RING_SIZE
+    LaneStats lane[k_lane_count];
+    uint32_t prio_spilled = 0;   // high priority records put in "ring"
+    uint32_t prio_run = 0;       // serial_task, high priority records in a row
+    OverloadLadder overload;
+    TxBatch batch;
+    CompactState compact;
+    LzState lz;
+    PcapngState pcapng;
+    FrameState frame;
+    HopEntry hop_list[k_hop_max];  // from the host dialog, this session
+    size_t hop_len = 0;
+    uint32_t hop_floor_ms = 0;     // adaptive dwell, 0 for off
+    volatile bool radiotap = false;  // records start with a RadiotapHeader
+    SurveyState survey;
+
+    // Filter stage, between serial_pcap_cb() and serial_task
+    TaskHandle_t volatile filter_task = NULL;
+    PcapRing raw;
+    volatile uint32_t deferred = false;
+    TelemetryState telemetry;
+    uint32_t host_poll_ms = 0;
+    LiveConfig live;
+    HistoryState history;
+    TriggerState trigger;
+#if USE_SD_CAPTURE
+    SdWriter sd;                 // TF card, while no host is connected
+    TaskHandle_t volatile sd_task = NULL;
+#endif
+
+    // Latency histograms, serial_task owned
+    Histogram residency;         // capture to ring_peek()
+    Histogram write;             // writeWait()
+    Histogram end_to_end;        // capture to USB write
+    uint32_t latency_seq = 0;
+    StageStats filter_stage;     // raw ring, callback to filter_task
+    StageStats writer_stage;     // packet ring, to serial_task
+    uint32_t cb_calls = 0;       // serial_pcap_cb(), SDK WiFi task time
+    uint64_t cb_cycles = 0;
 
     // Track time rollover, takes ~1.193046 hours
     // Also holds host GMT time of day used in the PCAP Packet Headers
@@ -104,6 +399,14 @@ struct SerialTask {
 };
 
 static SerialTask st;
+static BeaconCache beacon_cache;
+static RetryCache retry_cache;
+
+static const PrescreenCtx prescreen_ctx = { &cust_fltr, &retry_cache, &beacon_cache };
+static volatile prescreen_fn active_prescreen;
+static void prescreen_select(void);
+static bool lz_alloc(LzState *lz);
+static void live_cancel(LiveConfig *live);
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -142,6 +445,20 @@ void reinit_serial(SerialTask *session) {
 // in caps and minor in lower. Configuration is finished with a 'X' for execute.
 //
 
+// Print and start over
+static void printHistogram(SerialTask *session, const char *name, Histogram *hist) {
+    Histogram h;
+    histogram_take(hist, &h);
+    if (0 == h.count) return;
+    session->pcapSerial->printf("  %s %u, avg %u us, max %u us\n", name,
+        h.count, (uint32_t)(h.sum_us / h.count), h.max_us);
+    session->pcapSerial->printf("   ");
+    for (size_t n = 0; n < k_histogram_buckets; n++) {
+        if (h.bucket[n]) session->pcapSerial->printf(" <=%u:%u", histogram_bucket_us(n), h.bucket[n]);
+    }
+    session->pcapSerial->printf("\n");
+}
+
 void printSettings(SerialTask *session, int channel, uint32_t filter, const char *title) {
     session->pcapSerial->printf("%s\n", title);
     session->pcapSerial->printf("  %s %u\n", "Channel:", channel);
@@ -150,6 +467,16 @@ void printSettings(SerialTask *session, int channel, uint32_t filter, const char
     if (cust_fltr.badpkt) session->pcapSerial->printf("  %s\n", "Keep WIFI_PROMIS_FILTER_MASK_FCSFAIL");
     if (cust_fltr.fcslen) session->pcapSerial->printf("  %s\n", "k_filter_custom_fcslen");
     if (cust_fltr.session) session->pcapSerial->printf("  %s\n", "k_filter_custom_session");
+    if (cust_fltr.dedup) {
+        session->pcapSerial->printf("  %s %u ms\n", "k_filter_custom_dedup, refresh:", cust_fltr.beacon_refresh_ms);
+        session->pcapSerial->printf("  %s %u/%u/%u/%u\n", "beacon cache hits/misses/refreshes/evicts:",
+            beacon_cache.hits, beacon_cache.misses, beacon_cache.refreshes, beacon_cache.evicts);
+    }
+    if (cust_fltr.noretry) {
+        session->pcapSerial->printf("  %s\n", "k_filter_custom_noretry");
+        session->pcapSerial->printf("  %s %u/%llu/%u\n", "retry cache suppressed/bytes/evicts:",
+            retry_cache.suppressed, retry_cache.suppressed_bytes, retry_cache.evicts);
+    }
     if (cust_fltr.mcastlen) {
         session->pcapSerial->printf("  %s: '", "multicast");
         session->pcapSerial->printf("%02X", cust_fltr.mcast.mac[0]);
@@ -157,17 +484,186 @@ void printSettings(SerialTask *session, int channel, uint32_t filter, const char
             session->pcapSerial->printf(":%02X", cust_fltr.mcast.mac[i]);
         session->pcapSerial->printf("'\n");
     }
-    if (cust_fltr.moilen) {
-        const char *ouimac = (3 == cust_fltr.moilen) ? "oui" : "unicast";
-        session->pcapSerial->printf("  %s: '", ouimac);
-        session->pcapSerial->printf("%02X", cust_fltr.moi.mac[0]);
-        for (size_t i = 1; i < cust_fltr.moilen; i++)
-            session->pcapSerial->printf(":%02X", cust_fltr.moi.mac[i]);
-        session->pcapSerial->printf("'\n");
+    for (size_t i = 0; i < CONFIG_WIFIPCAP_WATCH_OUI_SIZE; i++) {
+        const uint32_t key = cust_fltr.watch.oui[i];
+        if (0 == key) continue;
+        session->pcapSerial->printf("  %s: '%02X:%02X:%02X'\n", "oui",
+            (uint8_t)key, (uint8_t)(key >> 8), (uint8_t)(key >> 16));
+    }
+    for (size_t i = 0; i < CONFIG_WIFIPCAP_WATCH_MAC_SIZE; i++) {
+        const uint64_t key = cust_fltr.watch.mac[i];
+        if (0 == key) continue;
+        session->pcapSerial->printf("  %s: '%02X:%02X:%02X:%02X:%02X:%02X'\n", "unicast",
+            (uint8_t)key, (uint8_t)(key >> 8), (uint8_t)(key >> 16),
+            (uint8_t)(key >> 24), (uint8_t)(key >> 32), (uint8_t)(key >> 40));
+    }
+    if (cust_fltr.bpf.active) {
+        session->pcapSerial->printf("  %s %u insns\n", "bpf:", bpf_length(&cust_fltr.bpf));
+        session->pcapSerial->printf("  %s %u/%u/%llu\n", "bpf pass/reject/executed:",
+            cust_fltr.bpf.pass, cust_fltr.bpf.reject, cust_fltr.bpf.executed);
+    }
+    for (size_t type = 0; type < 4; type++) {
+        for (size_t subtype = 0; subtype < 16; subtype++) {
+            uint32_t snaplen = cust_fltr.snaplen[type][subtype];
+            if (k_snaplen_header == snaplen) {
+                session->pcapSerial->printf("  %s %u.%u header\n", "snaplen:", type, subtype);
+            } else
+            if (snaplen) {
+                session->pcapSerial->printf("  %s %u.%u %u\n", "snaplen:", type, subtype, snaplen);
+            }
+        }
+    }
+    if (session->history.ring.size) {
+        const HistoryState *hs = &session->history;
+        session->pcapSerial->printf("  %s %u/%u\n", "history used/size:", ring_used(&session->history.ring), hs->ring.size);
+        session->pcapSerial->printf("  %s %u/%u/%u\n", "history saved/overwritten/replayed:",
+            hs->saved, hs->overwritten, hs->replayed);
+        if (hs->seconds) session->pcapSerial->printf("  %s %u s, %u KB\n", "history replay:", hs->seconds, hs->kbytes);
+    }
+    if (session->trigger.len) {
+        const TriggerState *ts = &session->trigger;
+        session->pcapSerial->printf("  %s", "triggers:");
+        for (size_t i = 0; i < ts->len; i++) {
+            session->pcapSerial->printf(" %u:%u%s", ts->list[i].kind, ts->list[i].value,
+                (ts->list[i].flags & TRIGGER_F_WATCHED) ? "w" : "");
+        }
+        session->pcapSerial->printf(", pre %u ms, post %u ms\n", ts->pre_ms, ts->post_ms);
+    }
+    if (session->trigger.fired || session->trigger.held) {
+        const TriggerState *ts = &session->trigger;
+        session->pcapSerial->printf("  %s %u/%u/%llu\n", "trigger fired/held/bytes saved:",
+            ts->fired, ts->held, ts->held_bytes - ts->sent_bytes);
+    }
+#if USE_SD_CAPTURE
+    if (session->sd_task) {
+        const SdWriter *w = &session->sd;
+        const SdWriterStats *s = &w->stats;
+        session->pcapSerial->printf("  %s %s, next %u\n", "sd dir:", w->dir, w->next_file);
+        session->pcapSerial->printf("  %s %u/%u/%u/%llu\n", "sd files/records/dropped/bytes:",
+            s->files, s->records, s->overruns, s->bytes);
+        session->pcapSerial->printf("  %s %u/%u/%u/%u us\n", "sd write avg/max/open max/close max:",
+            (s->writes) ? (uint32_t)(s->write_us / s->writes) : 0, s->latency.max_us, s->open_max_us, s->close_max_us);
+        session->pcapSerial->printf("  %s %u/%u/%u\n", "sd writes/stalls/errors:", s->writes, s->stalls, s->errors);
     }
+#endif
     if (cust_fltr.cache_auth_count) {
         session->pcapSerial->printf("  %s %u\n", "cache_auth_count:", cust_fltr.cache_auth_count);
     }
+    if (session->hop_len) {
+        session->pcapSerial->printf("  %s", "hop list:");
+        for (size_t i = 0; i < session->hop_len; i++) {
+            session->pcapSerial->printf(" %u:%u", session->hop_list[i].channel, session->hop_list[i].dwell_ms);
+        }
+        session->pcapSerial->printf("%s\n", (2 > session->hop_len) ? ", needs 2 or more" : "");
+        if (session->hop_floor_ms) {
+            session->pcapSerial->printf("  %s %u ms\n", "adaptive dwell, floor:", session->hop_floor_ms);
+        }
+    }
+    {
+        HopEntry list[k_hop_max];
+        const size_t len = get_hop_list(list, k_hop_max);
+        if (len) {
+            session->pcapSerial->printf("  %s", "hopping now:");
+            for (size_t i = 0; i < len; i++) session->pcapSerial->printf(" %u:%u", list[i].channel, list[i].dwell_ms);
+            session->pcapSerial->printf("\n");
+        }
+        HopStats hs;
+        get_hop_stats(&hs);
+        if (hs.hops) {
+            session->pcapSerial->printf("  %s %u/%u/%u, avg %u us, max %u us\n", "hops/failed/rounds:",
+                hs.hops, hs.fail, hs.rounds, hs.retune_us / hs.hops, hs.retune_max_us);
+            session->pcapSerial->printf("  %s %u/%u\n", "hop lost (est)/stale:", hs.lost, hs.stale);
+        }
+    }
+    if (session->survey.interval_ms) {
+        session->pcapSerial->printf("  %s %u ms, statistics only\n", "survey:", session->survey.interval_ms);
+    }
+    if (session->pcapng.isb_ms) {
+        session->pcapSerial->printf("  %s %u ms\n", "pcapng, statistics blocks:", session->pcapng.isb_ms);
+    }
+    if (session->frame.sync_ms) {
+        session->pcapSerial->printf("  %s %u ms\n", "framed, sync:", session->frame.sync_ms);
+    }
+    if (session->frame.frames) {
+        session->pcapSerial->printf("  %s %u/%u/%u\n", "frames/log lines/log lost:",
+            session->frame.frames, session->frame.log_lines, session->frame.log_lost);
+    }
+    {
+        ChannelStats stats;
+        get_channel_stats(channel, &stats);
+        session->pcapSerial->printf("  %s %llu/%llu/%llu/%llu/%llu\n", "channel mgmt/ctrl/data/error/total:",
+            stats.mgmt, stats.ctrl, stats.data, stats.error, stats.total);
+        session->pcapSerial->printf("  %s %llu/%llu/%llu\n", "channel bytes/dropped/full:",
+            stats.totalBytes, stats.dropped, stats.full);
+    }
+    session->pcapSerial->printf("  %s %u of %u, wraps %u, full %u\n", "ring high-water:",
+        session->ring.high_water, session->ring.size, session->ring.wraps, session->ring.full);
+    if (session->writer_stage.count) {
+        session->pcapSerial->printf("  %s avg %u us, max %u us\n", "ring latency:",
+            (uint32_t)(session->writer_stage.latency_sum_us / session->writer_stage.count),
+            session->writer_stage.latency_max_us);
+    }
+    if (session->prio.size) {
+        session->pcapSerial->printf("  %s %u of %u, wraps %u, full %u\n", "prio ring high-water:",
+            session->prio.high_water, session->prio.size, session->prio.wraps, session->prio.full);
+    }
+    session->pcapSerial->printf("  %s %u/%u, spilled %u\n", "high priority queued/dropped:",
+        session->lane[k_lane_high].queued, session->lane[k_lane_high].dropped, session->prio_spilled);
+    session->pcapSerial->printf("  %s %u/%u\n", "best effort queued/dropped:",
+        session->lane[k_lane_best].queued, session->lane[k_lane_best].dropped);
+    if (session->overload.start_pct) {
+        const OverloadLadder *ol = &session->overload;
+        session->pcapSerial->printf("  %s %u%%, level %u, max %u, changes %u\n", "overload start:",
+            ol->start_pct, ol->level, ol->max_level, ol->changes);
+        session->pcapSerial->printf("  %s %u/%llu/%u/%u\n", "overload truncated/bytes/sampled out/ctrl dropped:",
+            ol->truncated, ol->truncated_bytes, ol->sampled_out, ol->ctrl_dropped);
+    }
+    session->pcapSerial->printf("  %s %s\n", "filter stage:", (cust_fltr.deferred) ? "filter task" : "callback");
+    if (session->raw.size) {
+        session->pcapSerial->printf("  %s %u of %u, wraps %u, full %u\n", "raw ring high-water:",
+            session->raw.high_water, session->raw.size, session->raw.wraps, session->raw.full);
+    }
+    if (session->filter_stage.count) {
+        session->pcapSerial->printf("  %s avg %u us, max %u us\n", "raw ring latency:",
+            (uint32_t)(session->filter_stage.latency_sum_us / session->filter_stage.count),
+            session->filter_stage.latency_max_us);
+    }
+    if (session->cb_calls) {
+        session->pcapSerial->printf("  %s %u, avg %u cycles\n", "callback calls:",
+            session->cb_calls, (uint32_t)(session->cb_cycles / session->cb_calls));
+    }
+    const TxBatch *batch = &session->batch;
+    session->pcapSerial->printf("  %s %u bytes, %u ms\n", "batch limit:", batch->limit, batch->latency_ms);
+    if (session->telemetry.interval_ms) {
+        session->pcapSerial->printf("  %s %u ms\n", "telemetry:", session->telemetry.interval_ms);
+    }
+    if (session->compact.enabled || session->compact.records) {
+        const CompactState *cz = &session->compact;
+        session->pcapSerial->printf("  %s %s, %u records, %u.%02u bytes/record, PCAP %u.%02u\n", "compact format:",
+            (cz->enabled) ? "on" : "off", cz->records,
+            (uint32_t)((cz->records) ? cz->bytes * 100u / cz->records : 0) / 100u,
+            (uint32_t)((cz->records) ? cz->bytes * 100u / cz->records : 0) % 100u,
+            (uint32_t)((cz->records) ? cz->pcap_bytes * 100u / cz->records : 0) / 100u,
+            (uint32_t)((cz->records) ? cz->pcap_bytes * 100u / cz->records : 0) % 100u);
+    }
+    if (session->lz.enabled || session->lz.blocks) {
+        const LzState *lz = &session->lz;
+        const uint64_t elapsed_us = esp_timer_get_time() - lz->start_us;
+        session->pcapSerial->printf("  %s %s, %u blocks, %u as is, %u%% of %llu bytes\n", "block compression:",
+            (lz->enabled) ? "on" : "off", lz->blocks, lz->stored,
+            (uint32_t)((lz->in) ? lz->bytes * 100u / lz->in : 0), lz->in);
+        session->pcapSerial->printf("  %s %u cycles/KB, %u.%02u%% of a core\n", "block compression cost:",
+            (uint32_t)((lz->in) ? lz->cycles * 1024u / lz->in : 0),
+            (uint32_t)((elapsed_us) ? lz->cycles * 100u / (elapsed_us * getCpuFrequencyMhz()) : 0),
+            (uint32_t)((elapsed_us) ? lz->cycles * 10000u / (elapsed_us * getCpuFrequencyMhz()) % 100u : 0));
+    }
+    printHistogram(session, "latency residency:", &session->residency);
+    printHistogram(session, "latency usb write:", &session->write);
+    printHistogram(session, "latency end to end:", &session->end_to_end);
+    if (batch->writes) {
+        session->pcapSerial->printf("  %s %u, avg %u records, %u bytes/write\n", "batch writes:",
+            batch->writes, batch->sent / batch->writes, (uint32_t)(batch->bytes / batch->writes));
+    }
 }
 
 size_t parseInt2Array(uint8_t* array, int32_t* mac, SerialTask *session) {
@@ -182,6 +678,378 @@ size_t parseInt2Array(uint8_t* array, int32_t* mac, SerialTask *session) {
     return 3u;
 }
 
+// 'S', k_filter_custom_* bits
+static void custom_filter_set(uint32_t custom_filter) {
+    cust_fltr.badpkt = (0 != (k_filter_custom_badpkt & custom_filter));
+    cust_fltr.fcslen = (0 != (k_filter_custom_fcslen & custom_filter));
+    cust_fltr.dedup  = (0 != (k_filter_custom_dedup  & custom_filter));
+    cust_fltr.noretry = (0 != (k_filter_custom_noretry & custom_filter));
+    // The script is responsible for appending these flags to "filter"
+    // for supporting the "session" option. "filter |=
+    //   WIFI_PROMIS_FILTER_MASK_MGMT | WIFI_PROMIS_FILTER_MASK_DATA;"
+    cust_fltr.session = (0 != (k_filter_custom_session & custom_filter));
+}
+
+// 'T' key, (type << 4) | subtype or 0x100 | type for all subtypes
+static bool snaplen_key_valid(uint32_t key) {
+    return 0x3Fu >= key || 0x100u == (key & ~3u);
+}
+
+// 'T' and 't', "key" already checked
+static void snaplen_set(uint32_t key, uint16_t len) {
+    if (0x100 & key) {
+        for (size_t subtype = 0; subtype < 16; subtype++)
+            cust_fltr.snaplen[key & 3][subtype] = len;
+    } else {
+        cust_fltr.snaplen[(key >> 4) & 3][key & 15] = len;
+    }
+}
+
+// 'X', end of either dialog
+static esp_err_t hostDialogFinish(SerialTask *session, int channel, uint32_t filter) {
+    if (watch_list_empty(&cust_fltr.watch)) {
+        cust_fltr.mcastlen = 0;
+    }
+    // New Wireshark session, it needs to see every BSS again.
+    beacon_cache_flush(&beacon_cache);
+    retry_cache_flush(&retry_cache);
+    prescreen_select();
+    printSettings(session, channel, filter, "Final Config Settings");
+    session->pcapSerial->printf("<<PASSTHROUGH>>\n");
+    session->pcapSerial->flush();
+    session->pcapSerial->setTimeout(0);
+    ESP_LOGI(TAG, "Host Sync Complete");
+    return ESP_OK;
+}
+
+/*
+  Binary configuration, see ConfigMsgHeader
+*/
+constexpr size_t k_config_tries = 3;      // SETs with a bad CRC before giving up
+static_assert(CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH <= 0xFFFFu, "ConfigMsgHeader length is 16 bits");
+
+static void config_send(SerialTask *session, uint8_t type, const void *payload, size_t len) {
+    struct {
+        ConfigMsgHeader hdr;
+        uint8_t payload[sizeof(ConfigHello) + sizeof(uint32_t)];
+    } msg;
+    static_assert(sizeof(ConfigHello) >= sizeof(ConfigNak), "config_send() payload room");
+    msg.hdr.magic = CONFIG_MAGIC;
+    msg.hdr.type = type;
+    msg.hdr.version = CONFIG_VERSION;
+    msg.hdr.length = (uint16_t)len;
+    if (len) memcpy(msg.payload, payload, len);
+    const uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&msg, sizeof(ConfigMsgHeader) + len);
+    memcpy(&msg.payload[len], &crc, sizeof(crc));
+    session->pcapSerial->write((const uint8_t *)&msg, sizeof(ConfigMsgHeader) + len + sizeof(crc));
+    session->pcapSerial->flush();
+}
+
+static void config_nak(SerialTask *session, uint8_t tag, size_t offset, esp_err_t err) {
+    ConfigNak nak = { .tag = tag, .reserved = 0, .offset = (uint16_t)offset, .err = err };
+    config_send(session, CONFIG_MSG_NAK, &nak, sizeof(nak));
+    ESP_LOGE(TAG, "Config NAK tag %u at %u, 0x%X", tag, offset, err);
+}
+
+/*
+  Read one message into "buf". ESP_ERR_INVALID_CRC and ESP_ERR_INVALID_SIZE
+  are worth a NAK and another try, all else ends the dialog.
+*/
+static esp_err_t config_receive(SerialTask *session, uint8_t *buf, ConfigMsgHeader *hdr) {
+    if (sizeof(ConfigMsgHeader) != session->pcapSerial->readBytes((uint8_t *)hdr, sizeof(ConfigMsgHeader))) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (CONFIG_MAGIC != hdr->magic) return ESP_ERR_INVALID_RESPONSE;
+    if (CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH < hdr->length) {
+        // Skip it, CRC included
+        for (size_t left = hdr->length + sizeof(uint32_t); left; ) {
+            const size_t got = session->pcapSerial->readBytes(buf, std::min<size_t>(left, CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH));
+            if (0 == got) return ESP_ERR_TIMEOUT;
+            left -= got;
+        }
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t crc;
+    if (hdr->length != session->pcapSerial->readBytes(buf, hdr->length)
+        || sizeof(crc) != session->pcapSerial->readBytes((uint8_t *)&crc, sizeof(crc))) {
+        return ESP_ERR_TIMEOUT;
+    }
+    const uint32_t calc = esp_rom_crc32_le(esp_rom_crc32_le(0, (const uint8_t *)hdr, sizeof(ConfigMsgHeader)), buf, hdr->length);
+    return (calc == crc) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+static inline uint32_t config_u32(const uint8_t *v) {
+    uint32_t u;
+    memcpy(&u, v, sizeof(u));
+    return u;
+}
+
+// Add a TriggerDef, as 'E' or CONFIG_TAG_TRIGGER
+static esp_err_t trigger_add(TriggerState *ts, const TriggerDef *def) {
+    if (def->flags & ~TRIGGER_F_WATCHED) return ESP_ERR_INVALID_ARG;
+    switch (def->kind) {
+    case TRIGGER_MGMT:
+        if (15u < def->value) return ESP_ERR_INVALID_ARG;
+        break;
+    case TRIGGER_REASON:
+        break;
+    case TRIGGER_EAPOL:
+        if (4u < def->value) return ESP_ERR_INVALID_ARG;
+        break;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (k_trigger_max <= ts->len) return ESP_ERR_NO_MEM;
+    ts->list[ts->len++] = *def;
+    return ESP_OK;
+}
+
+// One setting of a SET, as its letter of the text dialog would
+static esp_err_t config_tag(SerialTask *session, uint8_t tag, const uint8_t *v, size_t n,
+    int& channel, uint32_t& filter, bool& watch_replaced, bool& print) {
+
+    const bool is_u32 = (sizeof(uint32_t) == n);
+    const uint32_t u32 = (is_u32) ? config_u32(v) : 0;
+    switch (tag) {
+    case CONFIG_TAG_CHANNEL:
+        if (1u != n) return ESP_ERR_INVALID_SIZE;
+        if (0 == v[0] || maxChannel < v[0]) return ESP_ERR_INVALID_ARG;
+        channel = v[0];
+        return ESP_OK;
+    case CONFIG_TAG_FILTER:
+        if (!is_u32) return ESP_ERR_INVALID_SIZE;
+        filter = u32;
+        return ESP_OK;
+    case CONFIG_TAG_CUSTOM:
+        if (!is_u32) return ESP_ERR_INVALID_SIZE;
+        custom_filter_set(u32);
+        return ESP_OK;
+    case CONFIG_TAG_WATCH_MAC:
+    case CONFIG_TAG_WATCH_OUI: {
+        const size_t size = (CONFIG_TAG_WATCH_MAC == tag) ? sizeof(MacAddr) : 3u;
+        if (0 != n % size) return ESP_ERR_INVALID_SIZE;
+        if (!watch_replaced) {
+            watch_list_clear(&cust_fltr.watch);
+            watch_replaced = true;
+        }
+        for (size_t at = 0; at < n; at += size) {
+            MacAddr addr = {};
+            memcpy(addr.mac, &v[at], size);
+            esp_err_t err = (CONFIG_TAG_WATCH_MAC == tag) ? watch_list_add_mac(&cust_fltr.watch, &addr)
+                                                          : watch_list_add_oui(&cust_fltr.watch, &addr);
+            if (ESP_OK != err) return err;
+        }
+        return ESP_OK;
+    }
+    case CONFIG_TAG_MULTICAST:
+        if (0 != n && 1u != n && 3u != n && sizeof(MacAddr) != n) return ESP_ERR_INVALID_SIZE;
+        memset(cust_fltr.mcast.mac, 0, sizeof(cust_fltr.mcast.mac));
+        memcpy(cust_fltr.mcast.mac, v, n);
+        cust_fltr.mcastlen = n;
+        return ESP_OK;
+    case CONFIG_TAG_SNAPLEN:
+        if (0 == n || 0 != n % sizeof(ConfigSnaplen)) return ESP_ERR_INVALID_SIZE;
+        for (size_t at = 0; at < n; at += sizeof(ConfigSnaplen)) {
+            ConfigSnaplen sl;
+            memcpy(&sl, &v[at], sizeof(sl));
+            if (!snaplen_key_valid(sl.key) || PCAP_MAX_CAPTURE_PACKET_SIZE < sl.length) return ESP_ERR_INVALID_ARG;
+            snaplen_set(sl.key, sl.length);
+        }
+        return ESP_OK;
+    case CONFIG_TAG_BPF: {
+        if (0 != n % sizeof(BpfInsn)) return ESP_ERR_INVALID_SIZE;
+        const size_t len = n / sizeof(BpfInsn);
+        if (CONFIG_WIFIPCAP_BPF_MAX_INSNS < len) return ESP_ERR_INVALID_SIZE;
+        bpf_remove(&cust_fltr.bpf);
+        cust_fltr.bpf.loading = 0;
+        cust_fltr.bpf.pass = cust_fltr.bpf.reject = 0;
+        cust_fltr.bpf.executed = 0;
+        memcpy(bpf_scratch(&cust_fltr.bpf), v, n);
+        return bpf_publish(&cust_fltr.bpf, len);
+    }
+    case CONFIG_TAG_TIME: {
+        if (sizeof(ConfigTime) != n) return ESP_ERR_INVALID_SIZE;
+        ConfigTime t;
+        memcpy(&t, v, sizeof(t));
+        if (0 == t.seconds || 1000000u <= t.microseconds) return ESP_ERR_INVALID_ARG;
+        session->timeseconds = t.seconds;
+        session->timemicroseconds = t.microseconds;
+        return ESP_OK;
+    }
+    case CONFIG_TAG_HOP:
+        if (0 == n || 0 != n % sizeof(ConfigHop)) return ESP_ERR_INVALID_SIZE;
+        for (size_t at = 0; at < n; at += sizeof(ConfigHop)) {
+            ConfigHop hop;
+            memcpy(&hop, &v[at], sizeof(hop));
+            if (0 == hop.channel || maxChannel < hop.channel || 0 == hop.dwell_ms) return ESP_ERR_INVALID_ARG;
+            if (k_hop_max <= session->hop_len) return ESP_ERR_NO_MEM;
+            session->hop_list[session->hop_len++] = { .channel = hop.channel, .dwell_ms = hop.dwell_ms };
+        }
+        return ESP_OK;
+    case CONFIG_TAG_TRIGGER:
+        if (0 != n % sizeof(TriggerDef)) return ESP_ERR_INVALID_SIZE;
+        // Without a history ring there is nowhere to hold frames
+        if (n && 0 == session->history.ring.size) return ESP_ERR_NOT_SUPPORTED;
+        if (0 == n) session->trigger.len = 0;
+        for (size_t at = 0; at < n; at += sizeof(TriggerDef)) {
+            TriggerDef def;
+            memcpy(&def, &v[at], sizeof(def));
+            esp_err_t err = trigger_add(&session->trigger, &def);
+            if (ESP_OK != err) return err;
+        }
+        return ESP_OK;
+    case CONFIG_TAG_PRINT:
+        if (0 != n) return ESP_ERR_INVALID_SIZE;
+        // Text in the middle of a message would break the dialog, print
+        // after the ACK.
+        print = true;
+        return ESP_OK;
+    default:
+        break;
+    }
+
+    // The rest are one uint32_t
+    if (CONFIG_TAG_LAST < tag || 0 == tag) return ESP_ERR_NOT_SUPPORTED;
+    if (!is_u32) return ESP_ERR_INVALID_SIZE;
+    switch (tag) {
+    case CONFIG_TAG_FILTER_STAGE:
+        cust_fltr.deferred = (0 != u32);
+        break;
+    case CONFIG_TAG_BEACON_REFRESH:
+        cust_fltr.beacon_refresh_ms = u32;
+        break;
+    case CONFIG_TAG_BATCH_BYTES:
+        session->batch.limit = std::min<uint32_t>(u32, session->batch.size);
+        break;
+    case CONFIG_TAG_BATCH_LATENCY:
+        session->batch.latency_ms = u32;
+        break;
+    case CONFIG_TAG_TELEMETRY:
+        session->telemetry.interval_ms = u32;
+        session->telemetry.last_ms = 0;
+        session->telemetry.channel = 0;
+        break;
+    case CONFIG_TAG_OVERLOAD:
+        if (100u < u32) return ESP_ERR_INVALID_ARG;
+        session->overload.start_pct = u32;
+        session->overload.level = 0;
+        break;
+    case CONFIG_TAG_HOP_FLOOR:
+        session->hop_floor_ms = u32;
+        break;
+    case CONFIG_TAG_SURVEY:
+        session->survey.interval_ms = u32;
+        session->survey.last_ms = 0;
+        break;
+    case CONFIG_TAG_PCAPNG:
+        session->pcapng.isb_ms = u32;
+        break;
+    case CONFIG_TAG_FRAMED:
+        session->frame.sync_ms = u32;
+        break;
+    case CONFIG_TAG_HISTORY:
+        session->history.seconds = u32;
+        break;
+    case CONFIG_TAG_HISTORY_KBYTES:
+        session->history.kbytes = u32;
+        break;
+    case CONFIG_TAG_TRIGGER_PRE:
+        session->trigger.pre_ms = u32;
+        break;
+    case CONFIG_TAG_TRIGGER_POST:
+        session->trigger.post_ms = u32;
+        break;
+    case CONFIG_TAG_COMPACT:
+        session->compact.enabled = (0 != u32);
+        break;
+    case CONFIG_TAG_COMPRESS:
+        session->lz.enabled = (0 != u32) && lz_alloc(&session->lz);
+        if (u32 && !session->lz.enabled) return ESP_ERR_NO_MEM;
+        break;
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t config_apply(SerialTask *session, const uint8_t *p, size_t len, int& channel, uint32_t& filter, bool& print, ConfigNak *nak) {
+    bool watch_replaced = false;
+    size_t at = 0;
+    while (at < len) {
+        ConfigTlv tlv;
+        esp_err_t err = ESP_ERR_INVALID_SIZE;
+        if (sizeof(ConfigTlv) <= len - at) {
+            memcpy(&tlv, &p[at], sizeof(tlv));
+            if (tlv.length <= len - at - sizeof(ConfigTlv)) {
+                err = config_tag(session, tlv.tag, &p[at + sizeof(ConfigTlv)], tlv.length, channel, filter, watch_replaced, print);
+            }
+        } else {
+            tlv.tag = 0;
+        }
+        if (ESP_OK != err) {
+            *nak = { .tag = tlv.tag, .reserved = 0, .offset = (uint16_t)at, .err = err };
+            return err;
+        }
+        at += sizeof(ConfigTlv) + tlv.length;
+    }
+    return ESP_OK;
+}
+
+/*
+  The binary dialog, from the first byte of CONFIG_MAGIC on. Ends the same as
+  the text dialog once a SET is ACKed.
+*/
+static esp_err_t hostDialogBinary(SerialTask *session, int& channel, uint32_t& filter) {
+    uint8_t *buf = (uint8_t *)malloc(CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH);
+    if (NULL == buf) {
+        ESP_LOGE(TAG, "Config malloc(%u) failed!", CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_ERR_TIMEOUT;
+    size_t tries = 0;
+    while (k_config_tries > tries) {
+        ConfigMsgHeader hdr;
+        err = config_receive(session, buf, &hdr);
+        if (ESP_ERR_INVALID_CRC == err || ESP_ERR_INVALID_SIZE == err) {
+            config_nak(session, 0, 0, err);
+            tries++;
+            continue;
+        }
+        if (ESP_OK != err) break;
+
+        if (CONFIG_MSG_HELLO == hdr.type) {
+            ConfigHello hello = {
+                .version = CONFIG_VERSION,
+                .max_length = CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH,
+                .tags = ((2u << CONFIG_TAG_LAST) - 1u) & ~1u
+            };
+            config_send(session, CONFIG_MSG_HELLO, &hello, sizeof(hello));
+            continue;
+        }
+        if (CONFIG_MSG_SET != hdr.type) {
+            err = ESP_ERR_NOT_SUPPORTED;
+            config_nak(session, 0, 0, err);
+            break;
+        }
+        ConfigNak nak;
+        bool print = false;
+        err = config_apply(session, buf, hdr.length, channel, filter, print, &nak);
+        if (ESP_OK == err) {
+            config_send(session, CONFIG_MSG_ACK, NULL, 0);
+            if (print) printSettings(session, channel, filter, "Current Config Settings");
+        } else {
+            config_nak(session, nak.tag, nak.offset, nak.err);
+        }
+        break;
+    }
+    free(buf);
+    if (ESP_OK != err) {
+        ESP_LOGE(TAG, "Binary config failed, 0x%X", err);
+        return err;
+    }
+    return hostDialogFinish(session, channel, filter);
+}
+
 esp_err_t hostDialog(SerialTask *session, int& channel, uint32_t& filter) {
 #if ARDUINO_USB_MODE
     // Doesn't work with USBCDC.cpp
@@ -192,8 +1060,9 @@ esp_err_t hostDialog(SerialTask *session, int& channel, uint32_t& filter) {
     ESP_LOGI(TAG, "Say Hello to Host");
     // Be helpful, tell them where to download the script from
     session->pcapSerial->printf("\nUse with script:\n  https://raw.githubusercontent.com/mhightower83/WiFiPcap/extras/esp32shark.py\n");
-    // First, say Hello to the python script
-    session->pcapSerial->printf("\n<<SerialPcap>>\n");
+    // First, say Hello to the python script. The line before tells a newer
+    // script it may use the binary dialog.
+    session->pcapSerial->printf("\n<<SerialPcap config %u>>\n<<SerialPcap>>\n", CONFIG_VERSION);
     session->pcapSerial->flush();
 
     session->timeseconds = 0;
@@ -227,6 +1096,17 @@ esp_err_t hostDialog(SerialTask *session, int& channel, uint32_t& filter) {
     */
     channel = getChannel();
     filter = getFilter();
+    if ((CONFIG_MAGIC & 0xFFu) == session->pcapSerial->peek()) {
+        return hostDialogBinary(session, channel, filter);
+    }
+    int32_t snap_key = -1;
+    uint32_t hop_key = 0;
+    // The first 'U' of a dialog replaces the watch list, more 'U'/'u' pairs add
+    // to it. U0u0 leaves it empty.
+    bool watch_replaced = false;
+    MacAddr watch_addr;
+    size_t watch_len = 0;
+    size_t bpf_at = 0;
     int c = session->pcapSerial->read();
     for (; '\n' != c && 0 < c; c = session->pcapSerial->read()) {
         if ('C' ==  c) {
@@ -258,21 +1138,25 @@ esp_err_t hostDialog(SerialTask *session, int& channel, uint32_t& filter) {
             } else {
                 session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
             }
-            cust_fltr.badpkt = (0 != (k_filter_custom_badpkt & custom_filter));
-            cust_fltr.fcslen = (0 != (k_filter_custom_fcslen & custom_filter));
-            // The script is responsible for appending these flags to "filter"
-            // for supporting the "session" option. "filter |=
-            //   WIFI_PROMIS_FILTER_MASK_MGMT | WIFI_PROMIS_FILTER_MASK_DATA;"
-            cust_fltr.session = (0 != (k_filter_custom_session & custom_filter));
+            custom_filter_set(custom_filter);
         } else
-        if ('U' ==  c) {  // Unicast
+        if ('U' ==  c) {  // Unicast or OUI, upper 3 bytes
             int32_t mac;
-            cust_fltr.moilen = parseInt2Array(&cust_fltr.moi.mac[0], &mac, session);
+            if (!watch_replaced) {
+                watch_list_clear(&cust_fltr.watch);
+                watch_replaced = true;
+            }
+            watch_len = parseInt2Array(&watch_addr.mac[0], &mac, session);
         } else
-        if ('u' ==  c) {
+        if ('u' ==  c) {  // Unicast lower 3 bytes, 0 for an OUI
             int32_t mac;
-            size_t len = parseInt2Array(&cust_fltr.moi.mac[3], &mac, session);
-            if (cust_fltr.moilen) cust_fltr.moilen += len;
+            size_t len = parseInt2Array(&watch_addr.mac[3], &mac, session);
+            if (watch_len) {
+                esp_err_t err = (len) ? watch_list_add_mac(&cust_fltr.watch, &watch_addr)
+                                      : watch_list_add_oui(&cust_fltr.watch, &watch_addr);
+                if (ESP_OK != err) session->pcapSerial->printf("Watch list full, %s ignored", (len) ? "unicast" : "oui");
+            }
+            watch_len = 0;
         } else
         if ('M' == c) {  // Multicast
             int32_t mac;
@@ -285,95 +1169,302 @@ esp_err_t hostDialog(SerialTask *session, int& channel, uint32_t& filter) {
             if (1 == cust_fltr.mcastlen && len) cust_fltr.mcastlen += 2;  // correct bad assumption
             if (3 == cust_fltr.mcastlen) cust_fltr.mcastlen += len;
         } else
-        if ('G' == c) {
-            int32_t i = session->pcapSerial->parseInt();
-            if (i > 0) {
-                session->timeseconds = i;
+        if ('T' == c) {   // Snap length select, (type << 4) | subtype or 0x100 | type for all subtypes
+            int32_t val = session->pcapSerial->parseInt();
+            snap_key = (0 <= val && snaplen_key_valid(val)) ? val : -1;
+            if (0 > snap_key) session->pcapSerial->printf("Bad snap length select %d", val);
+        } else
+        if ('t' == c) {   // Snap length for the selection
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= snap_key && 0 <= val && PCAP_MAX_CAPTURE_PACKET_SIZE >= val) {
+                snaplen_set(snap_key, val);
             } else {
-                ESP_LOGE(TAG, "Missing Host time.");
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
             }
         } else
-        if ('g' == c) {
-            int32_t i = session->pcapSerial->parseInt();
-            if (i > 0 && 1000000u > i) {
-                session->timemicroseconds = i;
+        if ('Q' == c) {   // BPF program upload, instruction count. 0 removes the program
+            int32_t val = session->pcapSerial->parseInt();
+            bpf_remove(&cust_fltr.bpf);
+            cust_fltr.bpf.loading = 0;
+            cust_fltr.bpf.pass = cust_fltr.bpf.reject = 0;
+            cust_fltr.bpf.executed = 0;
+            bpf_at = 0;
+            if (0 <= val && CONFIG_WIFIPCAP_BPF_MAX_INSNS >= val) {
+                cust_fltr.bpf.loading = val;
             } else {
-                ESP_LOGE(TAG, "Malformed Host time.");
+                session->pcapSerial->printf("BPF program too long %d, max %u", val, CONFIG_WIFIPCAP_BPF_MAX_INSNS);
             }
         } else
-        if ('P' == c) {
-            printSettings(session, channel, filter, "Current Config Settings");
+        if ('I' == c) {   // BPF instruction, (code << 16) | (jt << 8) | jf
+            int32_t val = session->pcapSerial->parseInt();
+            if (bpf_at < cust_fltr.bpf.loading) {
+                BpfInsn *insn = &bpf_scratch(&cust_fltr.bpf)[bpf_at];
+                insn->code = (uint16_t)(val >> 16);
+                insn->jt = (uint8_t)(val >> 8);
+                insn->jf = (uint8_t)val;
+            }
         } else
-        if ('X' == c) {
-            if (0 == cust_fltr.moilen) {
-                cust_fltr.mcastlen = 0;
+        if ('i' == c) {   // BPF instruction k, may be negative
+            int32_t val = session->pcapSerial->parseInt();
+            if (bpf_at < cust_fltr.bpf.loading) {
+                bpf_scratch(&cust_fltr.bpf)[bpf_at++].k = (uint32_t)val;
+                if (bpf_at == cust_fltr.bpf.loading) {
+                    esp_err_t err = bpf_publish(&cust_fltr.bpf, bpf_at);
+                    if (ESP_OK != err) {
+                        session->pcapSerial->printf("BPF program rejected, 0x%X", err);
+                    }
+                }
             }
-            printSettings(session, channel, filter, "Final Config Settings");
-            session->pcapSerial->printf("<<PASSTHROUGH>>\n");
-            session->pcapSerial->flush();
-            session->pcapSerial->setTimeout(0);
-            ESP_LOGI(TAG, "Host Sync Complete");
-            return ESP_OK;
-        } else {
-            ESP_LOGE(TAG, "Unknown config ID: 0x%02X", c);
-            session->pcapSerial->printf("Unknown config ID: 0x%02X ignored", c);
-        }
-    }
-    ESP_LOGE(TAG, "Missing 'X' at the end of config");
-    return ESP_ERR_TIMEOUT;
-}
-
-#if ARDUINO_USB_MODE
-/*
-  Workaround for HWCDC not having a useable DTR indication for the connected state.
-*/
-constexpr uint32_t k_usb_tx_hang_timeout = 100u;
-static bool isTxHang(SerialTask *session) {
-   // TX Hang protocol check
-   bool timeout = false;
-   uint32_t start = millis();
-   do {
-       delay(5u);
-       if (session->pcapSerial->availableForWrite()) break;
-       timeout = (millis() - start > k_usb_tx_hang_timeout);
-   } while (! timeout);
-   if (timeout) {
-       ESP_LOGE(TAG, "Write PCAP HWCDC TX Hang detected");
-       serial_pcap_notifyDtrRts(false, false);
-       return true;
-   }
-   return false;
-}
-#else
-static inline bool isTxHang(SerialTask *session) { return false; }
-#endif
-
-bool writeWait(SerialTask *session, const void *data, const size_t total_length) {
-    static bool nodelay = true;
-    const uint8_t *pb = (const uint8_t *)data;
-    ssize_t remaining = total_length;
-    ssize_t wrote = 0;
-    while (remaining) {
-        wrote = session->pcapSerial->write(pb, remaining);
-        if (0 <= wrote) {
-            remaining -= wrote;
-            pb = &pb[wrote];
-            if (0 == wrote) {
-                // reduce message spew
-                if (nodelay) {
-                    ESP_LOGE(TAG, "Write PCAP wrote %d of %u", wrote, total_length);
-                } else {
+        } else
+        if ('D' == c) {   // Filter stage, 1 filter task, 0 callback
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                cust_fltr.deferred = (0 != val);
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('B' == c) {   // Beacon dedup refresh interval, ms
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                cust_fltr.beacon_refresh_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('W' == c) {   // Write batch byte budget
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->batch.limit = std::min((uint32_t)val, session->batch.size);
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('L' == c) {   // Write batch latency budget, ms
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->batch.latency_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('Z' == c) {   // Compact format, 1 on, 0 off. Off unless asked for each session
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->compact.enabled = (0 != val);
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('z' == c) {   // Block compression, 1 on, 0 off. Off unless asked for each session
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->lz.enabled = (0 != val) && lz_alloc(&session->lz);
+                if (val && !session->lz.enabled) session->pcapSerial->printf("Block compression, out of memory");
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('H' == c) {   // Hop list channel, 0 empties the list
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 == val) {
+                session->hop_len = 0;
+            } else
+            if (0 < val && maxChannel >= val) {
+                hop_key = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('h' == c) {   // Dwell, ms. Adds the 'H' channel to the hop list
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 < val && hop_key && k_hop_max > session->hop_len) {
+                session->hop_list[session->hop_len++] = { .channel = hop_key, .dwell_ms = (uint32_t)val };
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('N' == c) {   // pcapng, Interface Statistics Block interval ms. 0 for PCAP 2.4, the default each session
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->pcapng.isb_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('J' == c) {   // Capture history to replay, seconds. 0 for none, the default each session
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->history.seconds = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('j' == c) {   // and at most this many KB of it, the newest. 0 for no limit
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->history.kbytes = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('E' == c) {   // Trigger, kind | flags << 8 | value << 16. 0 empties the list, the default each session
+            int32_t val = session->pcapSerial->parseInt();
+            const TriggerDef def = { .kind = (uint8_t)val, .flags = (uint8_t)(val >> 8), .value = (uint16_t)(val >> 16) };
+            if (0 == val) {
+                session->trigger.len = 0;
+            } else
+            if (0 == session->history.ring.size) {
+                session->pcapSerial->printf("Trigger needs the history ring, none allocated");
+            } else
+            if (ESP_OK != trigger_add(&session->trigger, &def)) {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('K' == c) {   // Pre-trigger window, ms
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->trigger.pre_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('k' == c) {   // Post-trigger window, ms
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->trigger.post_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('R' == c) {   // Framed transport, FrameSync interval ms. 0 for the plain stream, the default each session
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->frame.sync_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('A' == c) {   // Adaptive dwell floor, ms. 0 keeps the 'h' dwells
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->hop_floor_ms = val;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('V' == c) {   // Survey report interval, ms, statistics only. Off unless asked for each session
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->survey.interval_ms = val;
+                session->survey.last_ms = 0;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('O' == c) {   // Overload ladder start, percent. 0 for off
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val && 100 >= val) {
+                session->overload.start_pct = val;
+                session->overload.level = 0;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('Y' == c) {   // Telemetry interval, ms. 0 for off
+            int32_t val = session->pcapSerial->parseInt();
+            if (0 <= val) {
+                session->telemetry.interval_ms = val;
+                session->telemetry.last_ms = 0;
+                session->telemetry.channel = 0;
+            } else {
+                session->pcapSerial->printf("parseInt() failed on ID '%c'", c);
+            }
+        } else
+        if ('G' == c) {
+            int32_t i = session->pcapSerial->parseInt();
+            if (i > 0) {
+                session->timeseconds = i;
+            } else {
+                ESP_LOGE(TAG, "Missing Host time.");
+            }
+        } else
+        if ('g' == c) {
+            int32_t i = session->pcapSerial->parseInt();
+            if (i > 0 && 1000000u > i) {
+                session->timemicroseconds = i;
+            } else {
+                ESP_LOGE(TAG, "Malformed Host time.");
+            }
+        } else
+        if ('P' == c) {
+            printSettings(session, channel, filter, "Current Config Settings");
+        } else
+        if ('X' == c) {
+            return hostDialogFinish(session, channel, filter);
+        } else {
+            ESP_LOGE(TAG, "Unknown config ID: 0x%02X", c);
+            session->pcapSerial->printf("Unknown config ID: 0x%02X ignored", c);
+        }
+    }
+    ESP_LOGE(TAG, "Missing 'X' at the end of config");
+    return ESP_ERR_TIMEOUT;
+}
+
+#if ARDUINO_USB_MODE
+/*
+  Workaround for HWCDC not having a useable DTR indication for the connected state.
+*/
+constexpr uint32_t k_usb_tx_hang_timeout = 100u;
+static bool isTxHang(SerialTask *session) {
+   // TX Hang protocol check
+   bool timeout = false;
+   uint32_t start = millis();
+   do {
+       delay(5u);
+       if (session->pcapSerial->availableForWrite()) break;
+       timeout = (millis() - start > k_usb_tx_hang_timeout);
+   } while (! timeout);
+   if (timeout) {
+       ESP_LOGE(TAG, "Write PCAP HWCDC TX Hang detected");
+       serial_pcap_notifyDtrRts(false, false);
+       return true;
+   }
+   return false;
+}
+#else
+static inline bool isTxHang(SerialTask *session) { return false; }
+#endif
+
+bool writeWait(SerialTask *session, const void *data, const size_t total_length) {
+    static bool nodelay = true;
+    const uint8_t *pb = (const uint8_t *)data;
+    ssize_t remaining = total_length;
+    ssize_t wrote = 0;
+    int64_t stalled = 0;
+    const uint32_t start = (uint32_t)esp_timer_get_time();
+    while (remaining) {
+        wrote = session->pcapSerial->write(pb, remaining);
+        if (0 <= wrote) {
+            remaining -= wrote;
+            pb = &pb[wrote];
+            if (0 == wrote) {
+                if (0 == stalled) stalled = esp_timer_get_time();
+                // reduce message spew
+                if (nodelay) {
+                    ESP_LOGE(TAG, "Write PCAP wrote %d of %u", wrote, total_length);
+                } else {
                     delay(1);
                 }
                 nodelay = false;
 #if 1 //ARDUINO_USB_MODE
-                if (isTxHang(session)) return false;
+                if (isTxHang(session)) break;
                 // HWCDC does not support DTR so we rely on the script send an
                 // EOT when closing serial. On EOT, simulate a DTR LOW event.
                 if ('\x04' == session->pcapSerial->read()) {
                     ESP_LOGE(TAG, "Write PCAP RX EOT - Abort!");
                     serial_pcap_notifyDtrRts(false, false);
-                    return false;
+                    break;
                 }
 #endif
             } else {
@@ -381,15 +1472,516 @@ bool writeWait(SerialTask *session, const void *data, const size_t total_length)
             }
         } else {
             ESP_LOGE(TAG, "Write PCAP error %d", wrote);
-            return false;
+            break;
+        }
+    }
+    if (stalled) session->batch.stall_us += esp_timer_get_time() - stalled;
+    histogram_add(&session->write, (uint32_t)esp_timer_get_time() - start);
+    return 0 == remaining;
+}
+
+/*
+  Framed transport, see FrameHeader
+
+  Write "len" bytes at "payload" as one frame on "channel". The
+  sizeof(FrameHeader) bytes before "payload" and the CRC's 4 bytes after it
+  are overwritten.
+*/
+static bool frame_write(SerialTask *session, uint8_t channel, uint8_t *payload, size_t len) {
+    FrameHeader *hdr = (FrameHeader *)payload - 1;
+    hdr->sync = FRAME_SYNC;
+    hdr->length = (uint16_t)len;
+    hdr->channel = channel;
+    hdr->reserved = 0;
+    hdr->seq = session->frame.seq++;
+    const uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)hdr, sizeof(FrameHeader) + len);
+    memcpy(&payload[len], &crc, sizeof(crc));
+    session->frame.frames++;
+    return writeWait(session, hdr, sizeof(FrameHeader) + len + sizeof(crc));
+}
+
+// Packet data, "data" has room to be framed in place. See frame_write().
+static inline bool stream_write(SerialTask *session, uint8_t *data, const size_t len) {
+    if (session->frame.sync_ms) return frame_write(session, FRAME_CHANNEL_PCAP, data, len);
+    return writeWait(session, data, len);
+}
+
+/*
+  esp_log_set_vprintf() hook while framed, any task. The line waits in the
+  log ring for serial_task, the console does not see it.
+*/
+static int frame_log_vprintf(const char *fmt, va_list args) {
+    FrameState *fs = &st.frame;
+    char line[k_frame_log_line];
+    const int len = vsnprintf(line, sizeof(line), fmt, args);
+    if (0 >= len) return len;
+    const size_t n = std::min<size_t>(len, sizeof(line) - 1);
+    if (NULL == fs->log || pdTRUE != xRingbufferSend(fs->log, line, n, 0)) {
+        __atomic_add_fetch(&fs->log_lost, 1u, __ATOMIC_RELAXED);
+    }
+    return len;
+}
+
+static void frame_log_begin(FrameState *fs) {
+    if (NULL == fs->log) fs->log = xRingbufferCreate(CONFIG_WIFIPCAP_FRAME_LOG_SIZE, RINGBUF_TYPE_NOSPLIT);
+    if (NULL == fs->log) {
+        ESP_LOGE(TAG, "Frame log ring create failed, logs stay on the console");
+        return;
+    }
+    if (NULL == fs->console) fs->console = esp_log_set_vprintf(frame_log_vprintf);
+}
+
+// Give the log back to the console. Lines still waiting are lost.
+static void frame_log_end(FrameState *fs) {
+    if (NULL == fs->console) return;
+    esp_log_set_vprintf(fs->console);
+    fs->console = NULL;
+}
+
+/*
+  Block compression, see LzBlockHeader
+*/
+static bool lz_alloc(LzState *lz) {
+    if (lz->buf && lz->table && lz->out) return true;
+    if (NULL == lz->buf) lz->buf = (uint8_t *)heap_caps_malloc(CONFIG_WIFIPCAP_LZ_WINDOW + CONFIG_WIFIPCAP_BATCH_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (NULL == lz->table) lz->table = (uint32_t *)heap_caps_malloc(sizeof(uint32_t) << CONFIG_WIFIPCAP_LZ_HASH_BITS, MALLOC_CAP_INTERNAL | MALLOC_CAP_32BIT);
+    if (NULL == lz->out) {
+        // Kept for good, with room to frame it in place
+        uint8_t *frame = (uint8_t *)heap_caps_malloc(k_frame_overhead + sizeof(LzBlockHeader) + CONFIG_WIFIPCAP_BATCH_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (frame) lz->out = &frame[sizeof(FrameHeader)];
+    }
+    if (lz->buf && lz->table && lz->out) return true;
+    ESP_LOGE(TAG, "Block compression malloc failed!");
+    return false;
+}
+
+// New stream, nothing to refer back to
+static void lz_reset(LzState *lz) {
+    memset(lz->table, 0, sizeof(uint32_t) << CONFIG_WIFIPCAP_LZ_HASH_BITS);
+    lz->hist = 0;
+    lz->base = 0;
+    lz->poor = 0;
+    lz->rest = 0;
+    lz->start_us = esp_timer_get_time();
+}
+
+static inline uint8_t *lz_put_length(uint8_t *op, size_t len) {
+    while (255u <= len) {
+        *op++ = 255u;
+        len -= 255u;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// One LZ4 sequence, or the last literals when "offset" is 0. NULL when it does not fit.
+static inline uint8_t *lz_sequence(uint8_t *op, const uint8_t *op_end, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    if (op + 1u + lit_len + lit_len / 255u + 2u + match_len / 255u + 1u > op_end) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)(std::min<size_t>(lit_len, 15u) << 4);
+    if (15u <= lit_len) op = lz_put_length(op, lit_len - 15u);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (0 == offset) return op;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= k_lz_min_match;
+    *token |= (uint8_t)std::min<size_t>(match_len, 15u);
+    if (15u <= match_len) op = lz_put_length(op, match_len - 15u);
+    return op;
+}
+
+/*
+  Pack the "len" bytes after the history in lz->buf into "dst". Returns the
+  packed length, 0 when it would not fit in "cap".
+*/
+static size_t lz_compress(LzState *lz, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t * const b = lz->buf;
+    const size_t end = lz->hist + len;
+    const uint8_t * const op_end = dst + cap;
+    uint8_t *op = dst;
+    size_t ip = lz->hist;
+    size_t anchor = ip;
+    uint32_t misses = 0;
+    while (ip + k_lz_match_limit < end) {
+        uint32_t seq;
+        memcpy(&seq, &b[ip], sizeof(seq));
+        const uint32_t h = (seq * 2654435761u) >> (32u - CONFIG_WIFIPCAP_LZ_HASH_BITS);
+        const uint32_t cand = lz->table[h];
+        lz->table[h] = lz->base + ip + 1u;
+        const uint32_t at = cand - 1u - lz->base;  // Out of range wraps high
+        if (cand && at < ip && ip - at <= 0xFFFFu && 0 == memcmp(&b[at], &seq, sizeof(seq))) {
+            size_t match_len = k_lz_min_match;
+            while (ip + match_len < end - k_lz_last_literals && b[at + match_len] == b[ip + match_len]) match_len++;
+            op = lz_sequence(op, op_end, &b[anchor], ip - anchor, ip - at, match_len);
+            if (NULL == op) return 0;
+            ip += match_len;
+            anchor = ip;
+            misses = 0;
+        } else {
+            ip += 1u + (misses++ >> 5);  // Skip ahead faster through data that does not pack
+        }
+    }
+    op = lz_sequence(op, op_end, &b[anchor], end - anchor, 0, 0);
+    return (op) ? op - dst : 0;
+}
+
+/*
+  Write "data" as one block, packed when that saves at least
+  CONFIG_WIFIPCAP_LZ_MIN_SAVE_PCT.
+*/
+static bool lz_write(SerialTask *session, const void *data, const size_t len) {
+    LzState *lz = &session->lz;
+    if (CONFIG_WIFIPCAP_BATCH_SIZE < len) {
+        ESP_LOGE(TAG, "Block compression, %u bytes is too big", len);
+        return false;
+    }
+    const uint32_t start = esp_cpu_get_cycle_count();
+    memcpy(&lz->buf[lz->hist], data, len);
+    LzBlockHeader *hdr = (LzBlockHeader *)lz->out;
+    uint8_t *block = &lz->out[sizeof(LzBlockHeader)];
+    size_t packed_len = 0;
+    if (lz->rest) {
+        lz->rest--;
+    } else {
+        packed_len = lz_compress(lz, len, block, len - len * CONFIG_WIFIPCAP_LZ_MIN_SAVE_PCT / 100u);
+        if (packed_len) {
+            lz->poor = 0;
+        } else
+        if (k_lz_poor_limit <= ++lz->poor) {
+            lz->poor = 0;
+            lz->rest = k_lz_rest;
+        }
+    }
+    if (0 == packed_len) {
+        memcpy(block, data, len);
+        lz->stored++;
+    }
+    hdr->raw_len = len;
+    hdr->packed_len = packed_len;
+
+    // Keep the last CONFIG_WIFIPCAP_LZ_WINDOW bytes for the next block
+    const size_t total = lz->hist + len;
+    if (CONFIG_WIFIPCAP_LZ_WINDOW < total) {
+        const size_t drop = total - CONFIG_WIFIPCAP_LZ_WINDOW;
+        memmove(lz->buf, &lz->buf[drop], CONFIG_WIFIPCAP_LZ_WINDOW);
+        lz->base += drop;
+        lz->hist = CONFIG_WIFIPCAP_LZ_WINDOW;
+    } else {
+        lz->hist = total;
+    }
+    lz->cycles += esp_cpu_get_cycle_count() - start;
+
+    const size_t out_len = sizeof(LzBlockHeader) + ((packed_len) ? packed_len : len);
+    lz->blocks++;
+    lz->in += len;
+    lz->bytes += out_len;
+    return stream_write(session, lz->out, out_len);
+}
+
+// "data" is the batch or, not framed, a record written on its own
+static inline bool batch_write(SerialTask *session, const void *data, const size_t len) {
+    if (session->lz.enabled) return lz_write(session, data, len);
+    return stream_write(session, (uint8_t *)data, len);
+}
+
+/*
+  Write batching, see TxBatch.h. The batch goes out through batch_write().
+*/
+static bool batch_io_write(void *ctx, const void *data, size_t len) {
+    return batch_write((SerialTask *)ctx, data, len);
+}
+
+static uint32_t batch_now_ms(void) {
+    return millis();
+}
+
+static uint32_t batch_now_us(void) {
+    return esp_timer_get_time();
+}
+
+static inline void batch_reset(SerialTask *session) {
+    tx_batch_reset(&session->batch);
+}
+
+// Microseconds from capture time "rx_us" till now
+static inline uint32_t since_capture(uint32_t rx_us) {
+    const int32_t us = (uint32_t)esp_timer_get_time() - rx_us;
+    return (0 < us) ? us : 0;
+}
+
+bool batch_flush(SerialTask *session) {
+    return tx_batch_flush(&session->batch);
+}
+
+bool batch_append(SerialTask *session, const void *data, const size_t len) {
+    session->batch.whole = (0 != session->frame.sync_ms);
+    return tx_batch_append(&session->batch, data, len);
+}
+
+static uint32_t batch_deadline(SerialTask *session, bool& success) {
+    return tx_batch_deadline(&session->batch, WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS, success);
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t val) {
+    while (0x80u <= val) {
+        *p++ = (uint8_t)val | 0x80u;
+        val >>= 7;
+    }
+    *p++ = (uint8_t)val;
+    return p;
+}
+
+// Addresses in the header that go through the compact address table
+static inline size_t compact_addr_count(const WiFiPktHdr* const pkt, size_t caplen) {
+    if (offsetof(struct WiFiPktHdr, ra) > caplen) return 0;
+    size_t count = 3;
+    if (WLAN_FC_TYPE_CTRL == pkt->fctl.type) {
+        count = (WLAN_FC_STYPE_ACK == pkt->fctl.subtype || WLAN_FC_STYPE_CTS == pkt->fctl.subtype) ? 1 : 2;
+    } else
+    if (WLAN_FC_TYPE_DATA != pkt->fctl.type && WLAN_FC_TYPE_MGMT != pkt->fctl.type) {
+        return 0;
+    }
+    return std::min(count, (caplen - offsetof(struct WiFiPktHdr, ra)) / sizeof(MacAddr));
+}
+
+/*
+  Encode a record in the compact format straight into the batch.
+*/
+static bool compact_append(SerialTask *session, const WiFiPcap *wpcap) {
+    TxBatch *batch = &session->batch;
+    CompactState *cz = &session->compact;
+    const PcapPacketHeader *hdr = &wpcap->pcap_header;
+    const size_t caplen = hdr->capture_length;
+    if (batch->len + caplen + k_compact_overhead > batch->limit) {
+        if (! batch_flush(session)) return false;
+    }
+    if (0 == batch->len) batch->first_ms = millis();
+
+    uint8_t * const start = &batch->buf[batch->len];
+    uint8_t *p = start + 1;
+    uint8_t tag = 0;
+    const uint64_t us = (uint64_t)hdr->seconds * 1000000u + hdr->microseconds;
+    const int64_t delta = (int64_t)(us - cz->last_us);
+    cz->last_us = us;
+    p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    p = put_varint(p, caplen);
+    if (hdr->packet_length > caplen) {
+        tag |= COMPACT_TAG_ORIG_LEN;
+        p = put_varint(p, hdr->packet_length - caplen);
+    }
+
+    size_t at = 0;
+    if (session->radiotap && sizeof(RadiotapHeader) <= caplen) {
+        const RadiotapHeader *rt = (const RadiotapHeader *)wpcap->payload;
+        const uint32_t ch = radiotap_channel(rt);
+        RadiotapHeader canon;
+        radiotap_init(&canon, ch, rt->signal, rt->flags);
+        if (0xFFu >= ch && 0 == memcmp(&canon, rt, sizeof(RadiotapHeader))) {
+            tag |= COMPACT_TAG_RADIOTAP;
+            *p++ = (uint8_t)ch;
+            *p++ = (uint8_t)rt->signal;
+            *p++ = rt->flags;
+        } else {
+            memcpy(p, rt, sizeof(RadiotapHeader));
+            p += sizeof(RadiotapHeader);
+        }
+        at = sizeof(RadiotapHeader);
+    }
+    const WiFiPktHdr* const pkt = (const WiFiPktHdr*)&wpcap->payload[at];
+    const size_t count = compact_addr_count(pkt, caplen - at);
+    if (count) {
+        memcpy(p, pkt, offsetof(struct WiFiPktHdr, ra));
+        p += offsetof(struct WiFiPktHdr, ra);
+        at += offsetof(struct WiFiPktHdr, ra);
+    }
+    for (size_t n = 0; n < count; n++, at += sizeof(MacAddr)) {
+        const uint8_t *mac = &wpcap->payload[at];
+        const uint8_t slot = compact_mac_slot(mac);
+        if (0 == memcmp(cz->mac[slot].mac, mac, sizeof(MacAddr))) {
+            *p++ = slot;
+            tag |= COMPACT_TAG_ADDR(n);
+        } else {
+            memcpy(cz->mac[slot].mac, mac, sizeof(MacAddr));
+            memcpy(p, mac, sizeof(MacAddr));
+            p += sizeof(MacAddr);
         }
     }
+    memcpy(p, &wpcap->payload[at], caplen - at);
+    p += caplen - at;
+    *start = tag;
+
+    const size_t len = p - start;
+    batch->len += len;
+    batch->records++;
+    cz->records++;
+    cz->pcap_bytes += sizeof(PcapPacketHeader) + caplen;
+    cz->bytes += len;
+    // Over the byte budget on its own, write it now
+    if (batch->len > batch->limit) return batch_flush(session);
+    return true;
+}
+
+// pcapng option at "p", padded. Returns the end.
+static uint8_t *pcapng_option(uint8_t *p, uint16_t code, const void *value, uint16_t len) {
+    const PcapngOption opt = { .code = code, .length = len };
+    const size_t padded = (len + 3u) & ~3u;
+    memcpy(p, &opt, sizeof(opt));
+    p += sizeof(opt);
+    if (len) memcpy(p, value, len);
+    memset(p + len, 0, padded - len);
+    return p + padded;
+}
+
+// End the options of the block at "start" and fill in its length, both places
+static size_t pcapng_close(uint8_t *start, uint8_t *p) {
+    p = pcapng_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    const uint32_t length = (p - start) + sizeof(uint32_t);
+    memcpy(start + sizeof(uint32_t), &length, sizeof(length));
+    memcpy(p, &length, sizeof(length));
+    return length;
+}
+
+// Section Header Block, the start of a pcapng stream. No interfaces yet.
+static bool pcapng_section(SerialTask *session) {
+    PcapngState *ng = &session->pcapng;
+    ng->if_count = 0;
+    memset(ng->if_id, k_pcapng_no_if, sizeof(ng->if_id));
+    ng->last_ms = millis();
+
+    uint8_t block[64];
+    const uint32_t head[] = { PCAPNG_SHB_TYPE, 0, PCAPNG_BYTE_ORDER_MAGIC,
+        1u,                               // major 1, minor 0
+        UINT32_MAX, UINT32_MAX };         // section length unknown, -1
+    memcpy(block, head, sizeof(head));
+    uint8_t *p = pcapng_option(&block[sizeof(head)], PCAPNG_OPT_SHB_USERAPPL, "WiFiPcap", 8);
+    return batch_append(session, block, pcapng_close(block, p));
+}
+
+// Interface Description Block for "channel"
+static bool pcapng_interface(SerialTask *session, uint32_t channel) {
+    PcapngState *ng = &session->pcapng;
+    char name[8];
+    char desc[12];
+    const size_t name_len = snprintf(name, sizeof(name), "ch%u", (unsigned)channel);
+    const size_t desc_len = snprintf(desc, sizeof(desc), "%u MHz", (unsigned)((14u == channel) ? 2484u : 2407u + 5u * channel));
+    const uint8_t fcslen = (cust_fltr.fcslen) ? 4u : 0u;
+
+    uint8_t block[64];
+    const uint32_t head[] = { PCAPNG_IDB_TYPE, 0,
+        PCAP_LINK_TYPE_802_11_RADIOTAP,   // and 16 bits reserved
+        PCAP_MAX_CAPTURE_PACKET_SIZE + sizeof(RadiotapHeader) };
+    memcpy(block, head, sizeof(head));
+    uint8_t *p = &block[sizeof(head)];
+    p = pcapng_option(p, PCAPNG_OPT_IF_NAME, name, name_len);
+    p = pcapng_option(p, PCAPNG_OPT_IF_DESCRIPTION, desc, desc_len);
+    p = pcapng_option(p, PCAPNG_OPT_IF_FCSLEN, &fcslen, sizeof(fcslen));
+    if (! batch_append(session, block, pcapng_close(block, p))) return false;
+
+    ChannelStats stats;
+    get_channel_stats(channel, &stats);
+    ng->base_recv[channel - 1] = stats.total;
+    ng->base_drop[channel - 1] = stats.dropped;
+    ng->base_shed[channel - 1] = session->overload.shed[channel - 1];
+    ng->if_channel[ng->if_count] = channel;
+    ng->if_id[channel - 1] = ng->if_count++;
+    return true;
+}
+
+/*
+  Encode a record as an Enhanced Packet Block straight into the batch. The
+  RadiotapHeader in front of the frame picks the interface.
+*/
+static bool pcapng_append(SerialTask *session, const WiFiPcap *wpcap) {
+    PcapngState *ng = &session->pcapng;
+    const PcapPacketHeader *hdr = &wpcap->pcap_header;
+    const size_t caplen = hdr->capture_length;
+    const RadiotapHeader *rt = (const RadiotapHeader *)wpcap->payload;
+    uint32_t channel = (sizeof(RadiotapHeader) <= caplen) ? radiotap_channel(rt) : 0;
+    if (0 == channel || maxChannel < channel) channel = getChannel();
+    if (k_pcapng_no_if == ng->if_id[channel - 1]) {
+        if (! pcapng_interface(session, channel)) return false;
+    }
+
+    TxBatch *batch = &session->batch;
+    const size_t padded = (caplen + 3u) & ~3u;
+    if (batch->len + padded + k_pcapng_epb_overhead > batch->limit) {
+        if (! batch_flush(session)) return false;
+    }
+    if (0 == batch->len) batch->first_ms = millis();
+
+    uint8_t * const start = &batch->buf[batch->len];
+    const uint64_t us = (uint64_t)hdr->seconds * 1000000u + hdr->microseconds;
+    const PcapngEpb epb = {
+        .type = PCAPNG_EPB_TYPE,
+        .length = 0,
+        .interface_id = ng->if_id[channel - 1],
+        .ts_high = (uint32_t)(us >> 32),
+        .ts_low = (uint32_t)us,
+        .capture_length = (uint32_t)caplen,
+        .packet_length = hdr->packet_length
+    };
+    memcpy(start, &epb, sizeof(epb));
+    uint8_t *p = start + sizeof(epb);
+    memcpy(p, wpcap->payload, caplen);
+    memset(p + caplen, 0, padded - caplen);
+    p += padded;
+    const bool fcs = (sizeof(RadiotapHeader) <= caplen) && (rt->flags & RADIOTAP_F_FCS);
+    const uint32_t flags = PCAPNG_EPB_INBOUND | ((fcs) ? PCAPNG_EPB_FCSLEN(4) : 0);
+    p = pcapng_option(p, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+
+    batch->len += pcapng_close(start, p);
+    batch->records++;
+    // Over the byte budget on its own, write it now
+    if (batch->len > batch->limit) return batch_flush(session);
     return true;
 }
 
-bool writePcapWait(SerialTask *session, const WiFiPcap *wpcap) {
+/*
+  Append a PCAP record to the batch, in the format the host asked for.
+*/
+static inline bool pcap_append(SerialTask *session, const WiFiPcap *wpcap) {
+    if (session->pcapng.isb_ms) return pcapng_append(session, wpcap);
+    if (session->compact.enabled) return compact_append(session, wpcap);
     size_t total_length = offsetof(struct WiFiPcap, payload) + wpcap->pcap_header.capture_length;
-    return writeWait(session, wpcap, total_length);
+    return batch_append(session, wpcap, total_length);
+}
+
+/*
+  Append a record built with a RadiotapHeader right after the PCAP header,
+  device records and the auth cache. Without radiotap this session, the PCAP
+  header is moved up over the RadiotapHeader, which is lost.
+*/
+static_assert(sizeof(RadiotapHeader) == sizeof(PcapPacketHeader), "pcap_append_rt() moves one over the other");
+static bool pcap_append_rt(SerialTask *session, PcapPacketHeader *hdr) {
+    if (session->radiotap) return pcap_append(session, (const WiFiPcap *)hdr);
+    PcapPacketHeader *moved = hdr + 1;
+    *moved = *hdr;
+    moved->capture_length -= sizeof(RadiotapHeader);
+    moved->packet_length -= sizeof(RadiotapHeader);
+    return pcap_append(session, (const WiFiPcap *)moved);
+}
+
+/*
+  Append a device record, built as for pcap_append_rt(). Framed, it is
+  written on its own on FRAME_CHANNEL_TELEMETRY instead, after the batch so
+  far, RadiotapHeader kept.
+*/
+static bool device_record_append(SerialTask *session, PcapPacketHeader *hdr) {
+    if (0 == session->frame.sync_ms) return pcap_append_rt(session, hdr);
+    if (! batch_flush(session)) return false;
+    const size_t len = sizeof(PcapPacketHeader) + hdr->capture_length;
+    memcpy(session->batch.buf, hdr, len);
+    return frame_write(session, FRAME_CHANNEL_TELEMETRY, session->batch.buf, len);
+}
+
+/*
+  "rx_us" is the capture time, rx_ctrl.timestamp, for the end to end latency.
+*/
+bool writePcapWait(SerialTask *session, const WiFiPcap *wpcap, uint32_t rx_us) {
+    if (! pcap_append(session, wpcap)) return false;
+    tx_batch_mark(&session->batch, rx_us);
+    return true;
 }
 
 #pragma GCC push_options
@@ -412,32 +2004,33 @@ bool writePcapWait(SerialTask *session, const WiFiPcap *wpcap) {
   On new connections to Wireshark, pass the authentication cache to Wireshark to
   aid in decoding encrypted packets.
 */
-const uint8_t k_llc_snap_hdr[] = { 0xAAu, 0xAAu, 0x03u, 0x00, 0x00, 0x00 };
-
-static void cache_authenticate(WiFiPcap *wpcap) {
-    const WiFiPktHdr* const pkt = (WiFiPktHdr*)wpcap->payload;
+static void cache_authenticate(const SerialTask *session, WiFiPcap *wpcap) {
+    const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+    const WiFiPktHdr* const pkt = (WiFiPktHdr*)&wpcap->payload[rt_len];
     if (0 == cust_fltr.cache_auth) return;
-    // Rapid disqualifier
-    size_t len = offsetof(struct WiFiPktHdr, addr4);
-    size_t qos_len = 0;
-    if (WLAN_FC_TYPE_DATA      == pkt->fctl.type &&
-        WLAN_FC_STYPE_QOS_DATA == pkt->fctl.subtype) qos_len = sizeof(QOS_CNTRL);
-
-    len += sizeof(LLC) + qos_len;
-    if (wpcap->pcap_header.capture_length <= len) return;
-
-    const LLC * const llc = (LLC*)((uintptr_t)pkt->addr4.mac + qos_len);
-    if (k_802_1x_authentication != llc->type) return;
-    if (0 != memcmp(llc, k_llc_snap_hdr, sizeof(k_llc_snap_hdr))) return;
+    if (NULL == wifi_eapol(pkt, wpcap->pcap_header.capture_length - rt_len)) return;
 
     cust_fltr.cache_auth_count++;
     // Save authentication packets as a Prologue in PSRAM to send to Wireshark
     // at the start of a new trace. This will simplify restart work during testing.
     // Set packet timestamps to 1 hour before trace started.
-    size_t total_length = offsetof(struct WiFiPcap, payload) + wpcap->pcap_header.capture_length;
+    // Always kept with a RadiotapHeader, for pcap_append_rt().
+    const size_t frame_len = wpcap->pcap_header.capture_length - rt_len;
+    size_t total_length = offsetof(struct WiFiPcap, payload) + sizeof(RadiotapHeader) + frame_len;
     uintptr_t next = cust_fltr.cache_next + total_length;
     if (cust_fltr.cache_end >= next) {
-        memcpy((void*)cust_fltr.cache_next, wpcap, total_length);
+        WiFiPcap *cached = (WiFiPcap *)cust_fltr.cache_next;
+        RadiotapHeader *rt = (RadiotapHeader *)cached->payload;
+        cached->pcap_header = wpcap->pcap_header;
+        cached->pcap_header.capture_length = sizeof(RadiotapHeader) + frame_len;
+        cached->pcap_header.packet_length += sizeof(RadiotapHeader) - rt_len;
+        if (rt_len) {
+            memcpy(rt, wpcap->payload, sizeof(RadiotapHeader));
+        } else {
+            radiotap_init(rt, getChannel(), 0, (cust_fltr.fcslen) ? RADIOTAP_F_FCS : 0);
+            rt->present &= ~RADIOTAP_ANT_SIGNAL;
+        }
+        memcpy(&cached->payload[sizeof(RadiotapHeader)], pkt, frame_len);
         cust_fltr.cache_next = next;
     }
 }
@@ -466,7 +2059,12 @@ static esp_err_t prologue(SerialTask *session, const WiFiPcap *ts_ref) {
             wpcap->pcap_header.seconds      = ts_ref->pcap_header.seconds - 60;
             wpcap->pcap_header.microseconds = ts_ref->pcap_header.microseconds;
 
-            if (false == writePcapWait(session, wpcap)) {
+            // Replayed, not counted in the latency histograms
+            RadiotapHeader rt;
+            memcpy(&rt, wpcap->payload, sizeof(rt));
+            const bool ok = pcap_append_rt(session, &wpcap->pcap_header);
+            memcpy(wpcap->payload, &rt, sizeof(rt));
+            if (false == ok) {
                 ESP_LOGE(TAG, "prologue write failed!");
                 return ESP_FAIL;
             }
@@ -478,7 +2076,7 @@ static esp_err_t prologue(SerialTask *session, const WiFiPcap *ts_ref) {
     return ESP_OK;
 }
 #else
-static inline void cache_authenticate([[maybe_unused]] WiFiPcap *wpcap) {}
+static inline void cache_authenticate([[maybe_unused]] const SerialTask *session, [[maybe_unused]] WiFiPcap *wpcap) {}
 static inline esp_err_t prologue(SerialTask *session, const WiFiPcap *ts_ref) { return ESP_OK; }
 #endif
 #pragma GCC pop_options
@@ -507,6 +2105,8 @@ esp_err_t pcap_serial_start(SerialTask *session, pcap_link_type_t link_type) {
     if (state.b.is_running && !state.b.need_resync) return ESP_OK;
 
     //+ ESP_LOGI(TAG, "pcap_serial_start");
+    // Logs go back to the console till the host asks for frames again
+    frame_log_end(&session->frame);
     if (state.b.need_init) {
         reinit_serial(session);
         union UTaskState old_state;
@@ -533,149 +2133,1165 @@ esp_err_t pcap_serial_start(SerialTask *session, pcap_link_type_t link_type) {
         //+ ESP_LOGI(TAG, "Host not yet ready DTR: %s, %sUSBSerial", (state.b.dtr) ? "HIGH" : "LOW", (*session->pcapSerial) ? "" : "!");
         return ESP_FAIL;
     }
-#if ARDUINO_USB_MODE
-    if (false == *session->pcapSerial) {
-        // Works with HWCDC but not USBCDC
-        // This has to do with not handling the connect state properly after a
-        // Serial.end()/Serial.begin() with DTR staying high.
-        //
-        // For USBCDC, we now rely on state.b.dtr as ready indicator
-        ESP_LOGI(TAG, "Host status DTR: %s, %sUSBSerial", (state.b.dtr) ? "HIGH" : "LOW", (true == *session->pcapSerial) ? "" : "!");
+#if ARDUINO_USB_MODE
+    if (false == *session->pcapSerial) {
+        // Works with HWCDC but not USBCDC
+        // This has to do with not handling the connect state properly after a
+        // Serial.end()/Serial.begin() with DTR staying high.
+        //
+        // For USBCDC, we now rely on state.b.dtr as ready indicator
+        ESP_LOGI(TAG, "Host status DTR: %s, %sUSBSerial", (state.b.dtr) ? "HIGH" : "LOW", (true == *session->pcapSerial) ? "" : "!");
+    }
+#endif
+    ESP_LOGI(TAG, "Drain RX FIFO");
+    // Clear Serial RX FIFO
+    while (0 < session->pcapSerial->available()) session->pcapSerial->read();
+
+    int channel;
+    uint32_t filter;
+    // A host that does not know these formats never asks for them
+    session->compact.enabled = false;
+    session->lz.enabled = false;
+    session->hop_len = 0;
+    session->hop_floor_ms = 0;
+    session->survey.interval_ms = 0;
+    session->telemetry.interval_ms = 0;
+    session->telemetry.due = false;
+    session->pcapng.isb_ms = 0;
+    session->frame.sync_ms = 0;
+    session->history.seconds = 0;
+    session->history.kbytes = 0;
+    session->trigger.len = 0;
+    session->trigger.pre_ms = k_trigger_pre_ms;
+    session->trigger.post_ms = k_trigger_post_ms;
+    session->trigger.until_us = 0;
+    session->trigger.pending = -1;
+    live_cancel(&session->live);
+    // The script sends snap lengths only when asked, none carry over
+    memset(cust_fltr.snaplen, 0, sizeof(cust_fltr.snaplen));
+    // Poll host for the Promiscuous Configuration
+    if (ESP_OK != hostDialog(session, channel, filter)) {
+        // Host not ready
+        return ESP_FAIL;
+    }
+
+    begin_promiscuous(channel, filter, filter);
+    session->trigger.start_us = esp_timer_get_time();
+    // Hopping and pcapng, each record says which channel it came from
+    session->radiotap = (2 <= session->hop_len) || session->pcapng.isb_ms;
+    if (2 <= session->hop_len) hop_start(session->hop_list, session->hop_len, session->hop_floor_ms);
+    if (session->radiotap) link_type = PCAP_LINK_TYPE_802_11_RADIOTAP;
+
+    // Write Pcap File header - About PCAP_MAGIC, The decoder will use it to
+    // detect if byte swapping is needed when interpreting the results. No need
+    // for extra care in constructing byteswapped headers.
+    PcapFileHeader header = {
+        .magic = PCAP_MAGIC,                      // 0xA1B2C3D4 PCAP Magic value
+        .major = PCAP_DEFAULT_VERSION_MAJOR,      // 2.4
+        .minor = PCAP_DEFAULT_VERSION_MINOR,      //
+        .zone  = PCAP_DEFAULT_TIME_ZONE_GMT,      // Most implementations set tp 0
+        .sigfigs = 0,                             // accuracy of timestamps, ditto above
+        .snaplen = PCAP_MAX_CAPTURE_PACKET_SIZE,  // MAX length of captured packets, in octets
+        .link_type = link_type
+    };
+    if (session->compact.enabled) {
+        header.magic = PCAP_COMPACT_MAGIC;
+        compact_reset(&session->compact);
+    }
+    if (session->lz.enabled) lz_reset(&session->lz);
+    if (session->frame.sync_ms) {
+        FrameState *fs = &session->frame;
+        fs->seq = 0;
+        fs->last_ms = millis();
+        fs->log_lost = 0;
+        frame_log_begin(fs);
+    }
+
+    batch_reset(session);
+    bool success;
+    if (session->pcapng.isb_ms) {
+        // Compact records are PCAP 2.4 records
+        session->compact.enabled = false;
+        success = pcapng_section(session);
+    } else {
+        success = batch_append(session, &header, sizeof(header));
+    }
+    if (success && batch_flush(session)) {
+        // All is good. We can now forward packets to the Serial interface with
+        // a pcap packet header and the script will pass it on to Wireshark.
+        reset_dropped_count();
+        return ESP_OK;
+    }
+
+    ESP_LOGE(TAG, "Write PCAP File Header failed!");
+    union UTaskState old_state;
+    do {
+        old_state.u32 = interlocked_read((volatile uint32_t*)&session->state);
+        state = old_state;
+        state.b.need_resync = true;
+        state.b.need_init = true;
+    } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
+    return ESP_FAIL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+/*
+  to handshake through "reboot_enable" behavior in USBCDC.cpp
+  For a resync, host should
+   1) drop DTR, event post disconnected advance to state  CDC_LINE_1
+   2) drop RTS, back to state CDC_LINE_IDLE
+
+  For connecting back with both DTR and RTS false.
+   1) Raise DTR
+   2) Raise RTS
+
+  There is also an issue of connect status staying disconnected after a
+  Serial.end()/Serial.begin() while DTR is held high.
+*/
+void serial_pcap_notifyDtrRts(bool dtr, bool rts) {
+    SerialTask *session = &st;
+    /*
+      For USBCDC, false DTR, connected, and CDC_LINE_IDLE will change
+      connected to false;
+    */
+    union UTaskState old_state, state;
+    do {
+        old_state.u32 = interlocked_read((volatile uint32_t*)&session->state);
+        state = old_state;
+        state.b.dtr = dtr;
+        state.b.rts = rts;
+        if (false == old_state.b.dtr && true == dtr && state.b.is_running) {
+            state.b.need_resync = state.b.need_init = true;
+        }
+    } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
+    if (state.b.dtr != old_state.b.dtr) ESP_LOGE(TAG, "Host update DTR: %s", (state.b.dtr) ? "HIGH" : "LOW");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Handles Host time sync up, 32 bit counter rollovers, and finalzing pcap
+// packet header timestamp.
+static inline void pcap_time_sync(SerialTask *session, WiFiPcap *wpcap) {
+    if (session->finish_host_time_sync) {
+        // session->finish_host_time_sync = false;
+        // assume this to be ESP32 system time
+        const uint32_t systime = wpcap->pcap_header.microseconds;
+        const uint32_t seconds = systime / 1000000u;
+        const uint32_t microseconds = systime % 1000000u;
+
+        session->timeseconds -= seconds;
+        if (microseconds > session->timemicroseconds) {
+            session->timeseconds--;
+            session->timemicroseconds += 1000000u;
+        }
+        session->timemicroseconds -= microseconds;
+        session->last_microseconds = systime;
+    }
+    // Records from the high priority lane can be written ahead of older ones
+    // from the best effort lane. Only a forward step, by the signed delta,
+    // moves last_microseconds and can carry a rollover.
+    const uint32_t systime = wpcap->pcap_header.microseconds;
+    uint32_t timeseconds = session->timeseconds;
+    uint32_t timemicroseconds = session->timemicroseconds;
+    if (0 <= (int32_t)(systime - session->last_microseconds)) {
+        if (session->last_microseconds > systime) {
+            // catch 32-bit register rollover and perform carry
+            // For this logic to work we must receive at least one packet every
+            // 1.19 hours. Unless some really tight prefilters are used, this is
+            // no expected to be an issue.
+            session->timeseconds      += USCLOCK32_ROLLOVER_SECONDS;
+            session->timemicroseconds += USCLOCK32_ROLLOVER_MICROSECONDS;
+            if (1000000u <= session->timemicroseconds) {
+                session->timeseconds++;
+                session->timemicroseconds -= 1000000u;
+            }
+            timeseconds = session->timeseconds;
+            timemicroseconds = session->timemicroseconds;
+        }
+        session->last_microseconds = systime;
+    } else
+    if (systime > session->last_microseconds) {
+        // An older record from before the last rollover, borrow it back
+        timeseconds -= USCLOCK32_ROLLOVER_SECONDS;
+        if (USCLOCK32_ROLLOVER_MICROSECONDS > timemicroseconds) {
+            timeseconds--;
+            timemicroseconds += 1000000u;
+        }
+        timemicroseconds -= USCLOCK32_ROLLOVER_MICROSECONDS;
+    }
+
+    // Finish defered processing of timestamp in this non-critical path.
+    wpcap->pcap_header.seconds      = systime / 1000000u;
+    wpcap->pcap_header.microseconds = systime % 1000000u;
+
+    // Add in system time correction - assumes GMT
+    wpcap->pcap_header.seconds      += timeseconds;
+    wpcap->pcap_header.microseconds += timemicroseconds;
+    if (1000000u <= wpcap->pcap_header.microseconds) {
+        wpcap->pcap_header.seconds  += 1;
+        wpcap->pcap_header.microseconds -= 1000000u;
+    }
+}
+
+/*
+  PCAP header time for ESP32 system time "systime", taken now rather than at
+  capture. Unlike pcap_time_sync(), the rollover state is left alone for the
+  packets still in the ring.
+*/
+static inline void pcap_timestamp(const SerialTask *session, uint32_t systime, PcapPacketHeader *hdr) {
+    uint32_t seconds = systime / 1000000u + session->timeseconds;
+    uint32_t microseconds = systime % 1000000u + session->timemicroseconds;
+    if (0 <= (int32_t)(systime - session->last_microseconds) && systime < session->last_microseconds) {
+        // The counter rolled over since the last packet
+        seconds      += USCLOCK32_ROLLOVER_SECONDS;
+        microseconds += USCLOCK32_ROLLOVER_MICROSECONDS;
+    }
+    while (1000000u <= microseconds) {
+        seconds++;
+        microseconds -= 1000000u;
+    }
+    hdr->seconds = seconds;
+    hdr->microseconds = microseconds;
+}
+
+// Counters of "channel", or of all channels for 0
+static void get_session_stats(uint32_t channel, ChannelStats *out) {
+    if (channel) return get_channel_stats(channel, out);
+    memset(out, 0, sizeof(ChannelStats));
+    for (size_t ch = 1; ch <= maxChannel; ch++) {
+        ChannelStats one;
+        get_channel_stats(ch, &one);
+        const uint64_t *from = (const uint64_t *)&one;
+        uint64_t *to = (uint64_t *)out;
+        for (size_t n = 0; n < sizeof(ChannelStats) / sizeof(uint64_t); n++) to[n] += from[n];
+    }
+}
+
+static inline uint32_t delta32(uint64_t now, uint64_t then) {
+    const uint64_t delta = now - then;
+    return (delta < UINT32_MAX) ? delta : UINT32_MAX;
+}
+
+/*
+  PCAP header, RadiotapHeader and VendorFrame for a device record with
+  "body_len" bytes of body, time stamped now. Send with pcap_append_rt().
+*/
+static void vendor_frame_init(const SerialTask *session, PcapPacketHeader *hdr, RadiotapHeader *rt, VendorFrame *frame, uint8_t subtype, size_t body_len, uint32_t seq) {
+    pcap_timestamp(session, (uint32_t)esp_timer_get_time(), hdr);
+    hdr->capture_length = sizeof(RadiotapHeader) + sizeof(VendorFrame) + body_len;
+    hdr->packet_length = hdr->capture_length;
+    radiotap_init(rt, getChannel(), 0, 0);
+    rt->present &= ~RADIOTAP_ANT_SIGNAL;
+
+    frame->fctl = (WLAN_FC_STYPE_ACTION << 4);
+    memcpy(frame->addr1, ones_addr.mac, sizeof(frame->addr1));
+    memcpy(frame->addr2, k_telemetry_addr, sizeof(frame->addr2));
+    memcpy(frame->addr3, k_telemetry_addr, sizeof(frame->addr3));
+    frame->seqctl = (uint16_t)(seq << 4);
+    frame->category = TELEMETRY_CATEGORY;
+    memcpy(frame->oui, k_telemetry_oui, sizeof(frame->oui));
+    frame->subtype = subtype;
+}
+
+/*
+  Append a Telemetry record to the batch when one is due. Records start after
+  the first packet has set the host time.
+*/
+static bool telemetry_poll(SerialTask *session) {
+    TelemetryState *tm = &session->telemetry;
+    if (session->finish_host_time_sync) return true;
+    if (0 == tm->interval_ms) {
+        // A host that did not ask may not know to strip them
+        tm->due = false;
+        return true;
+    }
+    const uint32_t now = millis();
+    if (!tm->due && now - tm->last_ms < tm->interval_ms) return true;
+    tm->due = false;
+
+    struct {
+        PcapPacketHeader pcap_header;
+        RadiotapHeader radiotap;
+        VendorFrame frame;
+        Telemetry body;
+    } STRUCT_PACKED rec;
+    memset(&rec, 0, sizeof(rec));
+    vendor_frame_init(session, &rec.pcap_header, &rec.radiotap, &rec.frame, TELEMETRY_SUBTYPE, sizeof(Telemetry), tm->seq);
+
+    Telemetry *t = &rec.body;
+    t->version = TELEMETRY_VERSION;
+    t->length = sizeof(Telemetry);
+    t->seq = tm->seq++;
+    t->interval_ms = (tm->last_ms) ? now - tm->last_ms : 0;
+    tm->last_ms = now;
+
+    ChannelStats stats;
+    // While hopping, all channels together
+    const uint32_t channel = (session->radiotap) ? 0 : getChannel();
+    get_session_stats(channel, &stats);
+    if (channel != tm->channel) {
+        // New channel, the first interval starts here
+        tm->channel = channel;
+        tm->stats = stats;
+    }
+    t->channel   = channel;
+    t->total     = delta32(stats.total, tm->stats.total);
+    t->mgmt      = delta32(stats.mgmt, tm->stats.mgmt);
+    t->ctrl      = delta32(stats.ctrl, tm->stats.ctrl);
+    t->data      = delta32(stats.data, tm->stats.data);
+    t->error     = delta32(stats.error, tm->stats.error);
+    t->dropped   = delta32(stats.dropped, tm->stats.dropped);
+    t->full      = delta32(stats.full, tm->stats.full);
+    t->bytes     = delta32(stats.totalBytes, tm->stats.totalBytes);
+    tm->stats = stats;
+
+    t->ring_used       = ring_used(&session->ring);
+    t->ring_high_water = session->ring.high_water;
+    t->ring_full       = session->ring.full;
+    t->raw_used        = ring_used(&session->raw);
+    t->raw_high_water  = session->raw.high_water;
+    t->raw_full        = session->raw.full;
+    t->prio_used       = ring_used(&session->prio);
+    t->prio_high_water = session->prio.high_water;
+    t->prio_spilled    = session->prio_spilled;
+    t->high_dropped    = session->lane[k_lane_high].dropped;
+    t->best_dropped    = session->lane[k_lane_best].dropped;
+
+    const OverloadLadder *ol = &session->overload;
+    t->overload_level  = ol->level;
+    t->sample_shift    = k_overload_sample_shift[ol->level];
+    t->pressure        = ol->pressure;
+    t->drain_Bps       = ol->drain_Bps;
+    t->truncated       = ol->truncated;
+    t->sampled_out     = ol->sampled_out;
+    t->ctrl_dropped    = ol->ctrl_dropped;
+
+    t->heap_free       = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    t->heap_largest    = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    t->heap_min        = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    t->psram_free      = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    if (cust_fltr.cache_auth) {
+        t->auth_cache_used = cust_fltr.cache_next - cust_fltr.cache_auth;
+        t->auth_cache_size = cust_fltr.cache_end - cust_fltr.cache_auth;
+    }
+    t->stack_serial    = uxTaskGetStackHighWaterMark(NULL);
+    if (session->filter_task) t->stack_filter = uxTaskGetStackHighWaterMark(session->filter_task);
+
+    const TxBatch *batch = &session->batch;
+    t->writes      = batch->writes - tm->writes;
+    t->write_bytes = delta32(batch->bytes, tm->bytes);
+    t->stall_us    = delta32(batch->stall_us, tm->stall_us);
+    tm->writes   = batch->writes;
+    tm->bytes    = batch->bytes;
+    tm->stall_us = batch->stall_us;
+
+    const LzState *lz = &session->lz;
+    t->lz_in     = delta32(lz->in, tm->lz_in);
+    t->lz_out    = delta32(lz->bytes, tm->lz_bytes);
+    t->lz_cycles = delta32(lz->cycles, tm->lz_cycles);
+    tm->lz_in     = lz->in;
+    tm->lz_bytes  = lz->bytes;
+    tm->lz_cycles = lz->cycles;
+
+    HopStats hs;
+    get_hop_stats(&hs);
+    t->hops          = hs.hops;
+    t->retune_fail   = hs.fail;
+    t->retune_us     = hs.retune_us;
+    t->retune_max_us = hs.retune_max_us;
+    t->retune_lost   = hs.lost;
+    t->stale         = hs.stale;
+
+    return device_record_append(session, &rec.pcap_header);
+}
+
+/*
+  Append a SurveyReport to the batch when one is due. The first poll of a
+  session only takes the baseline.
+*/
+static bool survey_poll(SerialTask *session) {
+    SurveyState *sv = &session->survey;
+    if (0 == sv->interval_ms) return true;
+    const uint32_t now = millis();
+    if (sv->last_ms && now - sv->last_ms < sv->interval_ms) return true;
+    // No frames come through to set the host time and carry the time
+    // rollover, a stand in for one does.
+    WiFiPcap ref;
+    ref.pcap_header.microseconds = (uint32_t)esp_timer_get_time();
+    pcap_time_sync(session, &ref);
+    session->finish_host_time_sync = false;
+
+    struct {
+        PcapPacketHeader pcap_header;
+        RadiotapHeader radiotap;
+        VendorFrame frame;
+        SurveyReport body;
+        SurveyChannel channel[maxChannel];
+    } STRUCT_PACKED rec;
+    memset(&rec, 0, sizeof(rec));
+    SurveyReport *r = &rec.body;
+
+    HopEntry list[k_hop_max];
+    const size_t len = get_hop_list(list, k_hop_max);
+    uint32_t dwell_ms[maxChannel] = {};
+    bool listed[maxChannel] = {};
+    for (size_t i = 0; i < len; i++) {
+        dwell_ms[list[i].channel - 1] += list[i].dwell_ms;
+        listed[list[i].channel - 1] = true;
+    }
+    if (0 == len) listed[getChannel() - 1] = true;
+
+    const uint32_t interval_ms = (sv->last_ms) ? now - sv->last_ms : 0;
+    for (size_t ch = 1; ch <= maxChannel; ch++) {
+        if (!listed[ch - 1]) continue;
+        SurveyBase *b = &sv->base[ch - 1];
+        ChannelStats stats;
+        get_channel_stats(ch, &stats);
+        const uint64_t listen_us = (len) ? get_hop_listen_us(ch) : b->listen_us + interval_ms * 1000ull;
+        if (sv->last_ms) {
+            SurveyChannel *c = &rec.channel[r->count++];
+            c->channel   = ch;
+            c->dwell_ms  = std::min<uint32_t>(dwell_ms[ch - 1], 0xFFFFu);
+            c->listen_ms = delta32(listen_us, b->listen_us) / 1000u;
+            c->frames    = delta32(stats.total, b->frames);
+            c->bytes     = delta32(stats.totalBytes, b->bytes);
+            c->mgmt      = delta32(stats.mgmt, b->mgmt);
+            c->ctrl      = delta32(stats.ctrl, b->ctrl);
+            c->data      = delta32(stats.data, b->data);
+            c->error     = delta32(stats.error, b->error);
+        }
+        b->frames    = stats.total;
+        b->bytes     = stats.totalBytes;
+        b->mgmt      = stats.mgmt;
+        b->ctrl      = stats.ctrl;
+        b->data      = stats.data;
+        b->error     = stats.error;
+        b->listen_us = listen_us;
+    }
+    const bool baseline = (0 == sv->last_ms);
+    sv->last_ms = (now) ? now : 1;
+    if (baseline) return true;
+
+    const size_t body_len = sizeof(SurveyReport) + r->count * sizeof(SurveyChannel);
+    vendor_frame_init(session, &rec.pcap_header, &rec.radiotap, &rec.frame, SURVEY_SUBTYPE, body_len, sv->seq);
+    HopStats hs;
+    get_hop_stats(&hs);
+    r->version = SURVEY_VERSION;
+    r->length = sizeof(SurveyReport);
+    r->seq = sv->seq++;
+    r->interval_ms = interval_ms;
+    r->rounds = hs.rounds;
+    return device_record_append(session, &rec.pcap_header);
+}
+
+/*
+  Append an Interface Statistics Block for each pcapng interface when they
+  are due. Like device records, they start after the host time is set.
+*/
+static bool pcapng_poll(SerialTask *session) {
+    PcapngState *ng = &session->pcapng;
+    if (0 == ng->isb_ms || session->finish_host_time_sync) return true;
+    const uint32_t now = millis();
+    if (now - ng->last_ms < ng->isb_ms) return true;
+    ng->last_ms = now;
+
+    PcapPacketHeader ts;
+    pcap_timestamp(session, (uint32_t)esp_timer_get_time(), &ts);
+    const uint64_t us = (uint64_t)ts.seconds * 1000000u + ts.microseconds;
+    for (size_t id = 0; id < ng->if_count; id++) {
+        const uint32_t channel = ng->if_channel[id];
+        ChannelStats stats;
+        get_channel_stats(channel, &stats);
+        const PcapngIsb isb = {
+            .type = PCAPNG_ISB_TYPE,
+            .length = sizeof(PcapngIsb),
+            .interface_id = (uint32_t)id,
+            .ts_high = (uint32_t)(us >> 32),
+            .ts_low = (uint32_t)us,
+            .ifrecv_opt = { .code = PCAPNG_OPT_ISB_IFRECV, .length = sizeof(uint64_t) },
+            .ifrecv = stats.total - ng->base_recv[channel - 1],
+            .ifdrop_opt = { .code = PCAPNG_OPT_ISB_IFDROP, .length = sizeof(uint64_t) },
+            .ifdrop = stats.dropped - ng->base_drop[channel - 1],
+            .osdrop_opt = { .code = PCAPNG_OPT_ISB_OSDROP, .length = sizeof(uint64_t) },
+            .osdrop = (uint32_t)(session->overload.shed[channel - 1] - ng->base_shed[channel - 1]),
+            .end_opt = { .code = PCAPNG_OPT_ENDOFOPT, .length = 0 },
+            .length_end = sizeof(PcapngIsb)
+        };
+        if (! batch_append(session, &isb, sizeof(isb))) return false;
+    }
+    return true;
+}
+
+/*
+  Append a LatencyReport to the batch, the histograms start over.
+*/
+static bool latency_report(SerialTask *session) {
+    struct {
+        PcapPacketHeader pcap_header;
+        RadiotapHeader radiotap;
+        VendorFrame frame;
+        LatencyReport body;
+    } STRUCT_PACKED rec;
+    memset(&rec, 0, sizeof(rec));
+    vendor_frame_init(session, &rec.pcap_header, &rec.radiotap, &rec.frame, LATENCY_SUBTYPE, sizeof(LatencyReport), session->latency_seq);
+
+    LatencyReport *r = &rec.body;
+    r->version = LATENCY_VERSION;
+    r->buckets = k_histogram_buckets;
+    r->length = sizeof(LatencyReport);
+    r->seq = session->latency_seq++;
+    histogram_take(&session->residency, &r->residency);
+    histogram_take(&session->write, &r->write);
+    histogram_take(&session->end_to_end, &r->end_to_end);
+    return device_record_append(session, &rec.pcap_header);
+}
+
+/*
+  Framed, every 'R' ms write the batch, start the compact encoder and block
+  compressor over and send a FrameSync. Then the log lines waiting.
+*/
+static bool frame_poll(SerialTask *session) {
+    FrameState *fs = &session->frame;
+    if (0 == fs->sync_ms) return true;
+    bool success = true;
+    const uint32_t now = millis();
+    if (now - fs->last_ms >= fs->sync_ms) {
+        fs->last_ms = now;
+        success = batch_flush(session);
+        if (session->compact.enabled) compact_reset(&session->compact);
+        if (session->lz.enabled) lz_reset(&session->lz);
+        struct {
+            FrameHeader frame;
+            FrameSync body;
+            uint32_t crc;
+        } sync;
+        sync.body.interval_ms = fs->sync_ms;
+        sync.body.log_lost = fs->log_lost;
+        success = success && frame_write(session, FRAME_CHANNEL_CONTROL, (uint8_t *)&sync.body, sizeof(sync.body));
+    }
+    while (success && fs->log) {
+        size_t len = 0;
+        void *line = xRingbufferReceive(fs->log, &len, 0);
+        if (NULL == line) break;
+        struct {
+            FrameHeader frame;
+            uint8_t text[k_frame_log_line];
+            uint32_t crc;
+        } rec;
+        len = std::min<size_t>(len, sizeof(rec.text));
+        memcpy(rec.text, line, len);
+        vRingbufferReturnItem(fs->log, line);
+        fs->log_lines++;
+        success = frame_write(session, FRAME_CHANNEL_LOG, rec.text, len);
+    }
+    return success;
+}
+
+/*
+  Live reconfiguration, the tags a SET may hold while streaming. Those that
+  change the stream format or print are for the dialog only.
+*/
+constexpr uint32_t k_config_live_tags = (1u << CONFIG_TAG_CHANNEL)
+    | (1u << CONFIG_TAG_FILTER) | (1u << CONFIG_TAG_CUSTOM)
+    | (1u << CONFIG_TAG_WATCH_MAC) | (1u << CONFIG_TAG_WATCH_OUI)
+    | (1u << CONFIG_TAG_MULTICAST) | (1u << CONFIG_TAG_SNAPLEN)
+    | (1u << CONFIG_TAG_BPF) | (1u << CONFIG_TAG_FILTER_STAGE)
+    | (1u << CONFIG_TAG_BEACON_REFRESH);
+
+static void live_cancel(LiveConfig *live) {
+    // A waiting SET left capture paused, see live_receive()
+    if (live->buf) {
+        pause_promiscuous(false);
+        free(live->buf);
+        live->buf = NULL;
+    }
+    live->seq = 0;
+}
+
+// k_filter_custom_* bits of cust_fltr, as 'S' took them
+static uint32_t custom_filter_get(void) {
+    return ((cust_fltr.badpkt) ? k_filter_custom_badpkt : 0)
+         | ((cust_fltr.fcslen) ? k_filter_custom_fcslen : 0)
+         | ((cust_fltr.dedup) ? k_filter_custom_dedup : 0)
+         | ((cust_fltr.noretry) ? k_filter_custom_noretry : 0)
+         | ((cust_fltr.session) ? k_filter_custom_session : 0);
+}
+
+// Answer a live SET, the settings in use after it
+static bool live_report(SerialTask *session, esp_err_t err, uint8_t tag, size_t offset, uint32_t paused_us) {
+    LiveConfig *live = &session->live;
+    struct {
+        PcapPacketHeader pcap_header;
+        RadiotapHeader radiotap;
+        VendorFrame frame;
+        ConfigReport body;
+    } STRUCT_PACKED rec;
+    memset(&rec, 0, sizeof(rec));
+    vendor_frame_init(session, &rec.pcap_header, &rec.radiotap, &rec.frame, CONFIG_SUBTYPE, sizeof(ConfigReport), live->seq);
+
+    ConfigReport *r = &rec.body;
+    r->version = CONFIG_REPORT_VERSION;
+    r->channel = (hop_active()) ? 0 : getChannel();
+    r->length = sizeof(ConfigReport);
+    r->seq = live->seq++;
+    r->err = err;
+    r->tag = tag;
+    r->offset = (uint16_t)offset;
+    r->filter = getFilter();
+    r->custom = custom_filter_get();
+    r->watch_macs = cust_fltr.watch.mac_count;
+    r->watch_ouis = cust_fltr.watch.oui_count;
+    r->bpf_insns = bpf_length(&cust_fltr.bpf);
+    r->mcastlen = cust_fltr.mcastlen;
+    r->filter_stage = (session->deferred) ? 1 : 0;
+    r->paused_us = paused_us;
+    if (ESP_OK != err) ESP_LOGE(TAG, "Live config tag %u at %u, 0x%X", tag, offset, err);
+    return device_record_append(session, &rec.pcap_header);
+}
+
+/*
+  Read a SET sent while streaming, the first byte of CONFIG_MAGIC is waiting.
+  The whole message is expected within k_serial_timeout. Checked for tags
+  that may change live, then capture stops and live_poll() takes over.
+*/
+static bool live_receive(SerialTask *session) {
+    LiveConfig *live = &session->live;
+    uint8_t *buf = (uint8_t *)malloc(CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH);
+    ConfigMsgHeader hdr;
+    esp_err_t err = ESP_ERR_NO_MEM;
+    session->pcapSerial->setTimeout(k_serial_timeout);
+    if (buf) {
+        err = config_receive(session, buf, &hdr);
+    } else
+    if (sizeof(hdr) == session->pcapSerial->readBytes((uint8_t *)&hdr, sizeof(hdr))) {
+        // Skip it, the bytes must not be taken for an EOT or ENQ
+        ESP_LOGE(TAG, "Config malloc(%u) failed!", CONFIG_WIFIPCAP_CONFIG_MAX_LENGTH);
+        uint8_t skip[32];
+        for (size_t left = hdr.length + sizeof(uint32_t); left; ) {
+            const size_t got = session->pcapSerial->readBytes(skip, std::min<size_t>(left, sizeof(skip)));
+            if (0 == got) break;
+            left -= got;
+        }
+    }
+    session->pcapSerial->setTimeout(0);
+    if (ESP_OK == err && CONFIG_MSG_SET != hdr.type) err = ESP_ERR_NOT_SUPPORTED;
+
+    uint8_t tag = 0;
+    size_t at = 0;
+    while (ESP_OK == err && at < hdr.length) {
+        ConfigTlv tlv;
+        if (sizeof(ConfigTlv) > hdr.length - at) {
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        memcpy(&tlv, &buf[at], sizeof(tlv));
+        if (CONFIG_TAG_LAST < tlv.tag || 0 == (k_config_live_tags & (1u << tlv.tag))) {
+            tag = tlv.tag;
+            err = ESP_ERR_NOT_SUPPORTED;
+            break;
+        }
+        at += sizeof(ConfigTlv) + tlv.length;
+    }
+    if (ESP_OK != err) {
+        free(buf);
+        return live_report(session, err, tag, (ESP_ERR_NOT_SUPPORTED == err) ? at : 0, 0);
+    }
+    live->buf = buf;
+    live->len = hdr.length;
+    live->stop_us = (uint32_t)esp_timer_get_time();
+    pause_promiscuous(true);
+    return true;
+}
+
+/*
+  Apply the waiting SET once the rings are empty, every record in them was
+  captured with the old settings. Capture stays stopped till then, a packet
+  already in the WiFi callback lands in a ring and is written first. On a
+  failure, cust_fltr goes back as it was.
+*/
+static bool live_poll(SerialTask *session) {
+    LiveConfig *live = &session->live;
+    if (NULL == live->buf) return true;
+    if (ring_peek(&session->raw) || ring_peek(&session->prio) || ring_peek(&session->ring)) return true;
+
+    CustomFilters *saved = (CustomFilters *)malloc(sizeof(CustomFilters));
+    esp_err_t err = ESP_ERR_NO_MEM;
+    ConfigNak nak = {};
+    bool print = false;  // Not in k_config_live_tags
+    int channel = getChannel();
+    uint32_t filter = getFilter();
+    if (saved) {
+        memcpy(saved, &cust_fltr, sizeof(CustomFilters));
+        err = config_apply(session, live->buf, live->len, channel, filter, print, &nak);
+        if (ESP_OK != err) memcpy(&cust_fltr, saved, sizeof(CustomFilters));
+        free(saved);
+    }
+    free(live->buf);
+    live->buf = NULL;
+
+    if (ESP_OK == err) {
+        if (watch_list_empty(&cust_fltr.watch)) cust_fltr.mcastlen = 0;
+        prescreen_select();
+    }
+    if (ESP_OK == err && ((size_t)channel != getChannel() || filter != getFilter())) {
+        begin_promiscuous(channel, filter, filter);
+    } else {
+        pause_promiscuous(false);
+    }
+    const uint32_t paused_us = (uint32_t)esp_timer_get_time() - live->stop_us;
+    return live_report(session, err, nak.tag, nak.offset, paused_us);
+}
+
+/*
+  While streaming, the host may send an EOT to stop, an ENQ to ask for a
+  LatencyReport or a CONFIG_MSG_SET, see live_receive(). Looked at every
+  20 ms, not while a SET waits.
+*/
+static bool host_poll(SerialTask *session) {
+    if (! live_poll(session)) return false;
+    if (session->live.buf) return true;
+    const uint32_t now = millis();
+    if (now - session->host_poll_ms < 20u) return true;
+    session->host_poll_ms = now;
+
+    bool success = true;
+    while (success && 0 < session->pcapSerial->available()) {
+        if ((CONFIG_MAGIC & 0xFFu) == session->pcapSerial->peek()) {
+            // Records and the report need the host time, see latency_report()
+            if (session->finish_host_time_sync) break;
+            success = live_receive(session);
+            break;
+        }
+        const int c = session->pcapSerial->read();
+        if ('\x04' == c) {
+            ESP_LOGE(TAG, "RX EOT - Abort!");
+            serial_pcap_notifyDtrRts(false, false);
+            success = false;
+        } else
+        if ('\x05' == c && ! session->finish_host_time_sync) {
+            success = latency_report(session);
+        }
+    }
+    return success;
+}
+
+/*
+  Every 20 ms, set the overload level from the packet ring pressure: the
+  larger of its fill and the time to drain it at the measured USB rate. Steps
+  up as soon as a threshold is passed, down one level at a time after
+  falling CONFIG_WIFIPCAP_OVERLOAD_HYSTERESIS below it.
+
+  The bytes written only show what USB can carry while the writer is kept
+  busy, on a quiet channel they are the offered load. The rate is measured
+  over intervals the ring stayed backed up or a write waited on a full TX
+  buffer. A measured rate of 0, a stalled link, with bytes queued is 100%.
+*/
+static void overload_update(SerialTask *session) {
+    OverloadLadder *ol = &session->overload;
+    const uint32_t now = millis();
+    const uint32_t ms = now - ol->last_ms;
+    if (ms < 20u) return;
+
+    const uint32_t used = ring_used(&session->ring);
+    const uint64_t bytes = session->batch.bytes;
+    const uint64_t stall_us = session->batch.stall_us;
+    if (stall_us != ol->last_stall_us || (ol->last_used && used)) {
+        const uint32_t Bps = (uint32_t)((bytes - ol->last_bytes) * 1000u / ms);
+        ol->drain_Bps = (ol->drain_measured) ? (3u * ol->drain_Bps + Bps) / 4u : Bps;
+        ol->drain_measured = true;
+    }
+    ol->last_bytes = bytes;
+    ol->last_stall_us = stall_us;
+    ol->last_used = used;
+    ol->last_ms = now;
+    if (0 == ol->start_pct || 0 == session->ring.size) {
+        ol->level = 0;
+        return;
+    }
+
+    uint32_t pressure = (uint32_t)((uint64_t)used * 100u / session->ring.size);
+    if (ol->drain_measured && used) {
+        const uint64_t drain_ms = (ol->drain_Bps) ? (uint64_t)used * 1000u / ol->drain_Bps : UINT64_MAX / 100u;
+        pressure = std::max(pressure, (uint32_t)std::min<uint64_t>(drain_ms * 100u / CONFIG_WIFIPCAP_OVERLOAD_DRAIN_MS, 100u));
+    }
+    ol->pressure = pressure;
+
+    uint32_t level = ol->level;
+    const uint32_t threshold = ol->start_pct + (level - 1u) * CONFIG_WIFIPCAP_OVERLOAD_STEP;
+    while (k_overload_max > level && pressure >= ol->start_pct + level * CONFIG_WIFIPCAP_OVERLOAD_STEP) {
+        level++;
+    }
+    if (level == ol->level && level && pressure + CONFIG_WIFIPCAP_OVERLOAD_HYSTERESIS < threshold) {
+        level--;
+    }
+    if (level != ol->level) {
+        ol->level = level;
+        ol->changes++;
+        if (level > ol->max_level) ol->max_level = level;
+        session->telemetry.due = true;    // Report the new sampling rate in-band
     }
-#endif
-    ESP_LOGI(TAG, "Drain RX FIFO");
-    // Clear Serial RX FIFO
-    while (0 < session->pcapSerial->available()) session->pcapSerial->read();
+}
 
-    int channel;
-    uint32_t filter;
-    // Poll host for the Promiscuous Configuration
-    if (ESP_OK != hostDialog(session, channel, filter)) {
-        // Host not ready
-        return ESP_FAIL;
+/*
+  The host went away, often because it stopped reading and the level is
+  high. overload_update() does not run without one, the history ring and the
+  TF card get whole frames till the next session measures again.
+*/
+static void overload_reset(SerialTask *session) {
+    OverloadLadder *ol = &session->overload;
+    ol->level = 0;
+    ol->pressure = 0;
+    ol->last_used = 0;
+}
+
+/*
+  Next record for serial_task, high priority first. With a
+  CONFIG_WIFIPCAP_PRIO_WEIGHT, a waiting best effort record goes after that
+  many high priority ones in a row. "*from" gets the ring for ring_release().
+*/
+static RingRecord *lane_peek(SerialTask *session, PcapRing **from) {
+    RingRecord *rec = NULL;
+#if CONFIG_WIFIPCAP_PRIO_WEIGHT
+    const bool best_turn = CONFIG_WIFIPCAP_PRIO_WEIGHT <= session->prio_run;
+#else
+    const bool best_turn = false;
+#endif
+    if (!best_turn && (rec = ring_peek(&session->prio))) {
+        *from = &session->prio;
+        session->prio_run++;
+    } else
+    if ((rec = ring_peek(&session->ring))) {
+        *from = &session->ring;
+        session->prio_run = 0;
+    } else
+    if ((rec = ring_peek(&session->prio))) {
+        *from = &session->prio;
+        session->prio_run++;
     }
+    return rec;
+}
 
-    begin_promiscuous(channel, filter, filter);
+/*
+  The record header of a frame kept on the device, history or TF card. Time
+  stamped with the uptime, always with a RadiotapHeader. The queued time,
+  rx_ctrl.timestamp, is the low 32 bits of the uptime; frames are drained
+  well within the 71 minutes it takes to wrap.
+*/
+static void uptime_header(SerialTask *session, const WiFiPcap *wpcap, PcapPacketHeader *header, RadiotapHeader *rt) {
+    const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+    const uint64_t now = esp_timer_get_time();
+    const uint64_t uptime = now - (uint32_t)((uint32_t)now - wpcap->pcap_header.microseconds);
+    header->seconds = uptime / 1000000u;
+    header->microseconds = uptime % 1000000u;
+    header->capture_length = wpcap->pcap_header.capture_length + sizeof(RadiotapHeader) - rt_len;
+    header->packet_length = wpcap->pcap_header.packet_length + sizeof(RadiotapHeader) - rt_len;
+    if (rt_len) {
+        memcpy(rt, wpcap->payload, sizeof(RadiotapHeader));
+    } else {
+        radiotap_init(rt, getChannel(), 0, (cust_fltr.fcslen) ? RADIOTAP_F_FCS : 0);
+        rt->present &= ~RADIOTAP_ANT_SIGNAL;
+    }
+}
 
-    // Write Pcap File header - About PCAP_MAGIC, The decoder will use it to
-    // detect if byte swapping is needed when interpreting the results. No need
-    // for extra care in constructing byteswapped headers.
-    PcapFileHeader header = {
-        .magic = PCAP_MAGIC,                      // 0xA1B2C3D4 PCAP Magic value
-        .major = PCAP_DEFAULT_VERSION_MAJOR,      // 2.4
-        .minor = PCAP_DEFAULT_VERSION_MINOR,      //
-        .zone  = PCAP_DEFAULT_TIME_ZONE_GMT,      // Most implementations set tp 0
-        .sigfigs = 0,                             // accuracy of timestamps, ditto above
-        .snaplen = PCAP_MAX_CAPTURE_PACKET_SIZE,  // MAX length of captured packets, in octets
-        .link_type = link_type
-    };
+// Keep a frame lane_drain() takes, the oldest history goes to make room.
+// Returns false when it was not kept.
+static bool history_save(SerialTask *session, const WiFiPcap *wpcap) {
+    HistoryState *hs = &session->history;
+    if (0 == hs->ring.size) return false;
+    const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+    const size_t frame_len = wpcap->pcap_header.capture_length - rt_len;
+    WiFiPcap *saved;
+    while (NULL == (saved = (WiFiPcap *)ring_reserve(&hs->ring, sizeof(WiFiPcap) + sizeof(RadiotapHeader) + frame_len))) {
+        RingRecord *old = ring_peek(&hs->ring);
+        if (NULL == old) return false;  // Bigger than the ring
+        ring_release(&hs->ring, old);
+        hs->overwritten++;
+    }
+    uptime_header(session, wpcap, &saved->pcap_header, (RadiotapHeader *)saved->payload);
+    memcpy(&saved->payload[sizeof(RadiotapHeader)], &wpcap->payload[rt_len], frame_len);
+    ring_commit(&hs->ring);
+    hs->saved++;
+    return true;
+}
 
-    if (writeWait(session, &header, sizeof(header))) {
-        // All is good. We can now forward packets to the Serial interface with
-        // a pcap packet header and the script will pass it on to Wireshark.
-        reset_dropped_count();
-        return ESP_OK;
+#if USE_SD_CAPTURE
+/*
+  TF card capture, while no host is connected. lane_drain() appends the
+  frames it takes, as history_save() keeps them, and sd_task writes them out,
+  see SdWriter.h. A frame the card has no room for yet stays in the packet
+  ring. When the card falls behind for long, the rings fill and
+  serial_pcap_cb() drops and counts as it does for a slow host.
+*/
+static int sd_open(void *ctx, const char *path, uint32_t prealloc) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // In write mode FATFS allocates the clusters up to a seek past the end
+    if (0 <= fd && prealloc && ((off_t)prealloc != lseek(fd, prealloc, SEEK_SET) || 0 != lseek(fd, 0, SEEK_SET))) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    ESP_LOGE(TAG, "Write PCAP File Header failed!");
-    union UTaskState old_state;
-    do {
-        old_state.u32 = interlocked_read((volatile uint32_t*)&session->state);
-        state = old_state;
-        state.b.need_resync = true;
-        state.b.need_init = true;
-    } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
-    return ESP_FAIL;
+static int sd_write(void *ctx, int fd, const void *buf, size_t len) {
+    return write(fd, buf, len);
+}
+
+static int sd_sync(void *ctx, int fd) {
+    return fsync(fd);
+}
+
+// Cut by path, not all FATFS VFS versions have ftruncate()
+static int sd_close(void *ctx, int fd, uint32_t length) {
+    const SdWriter *w = (const SdWriter *)ctx;
+    char path[k_sd_path_max + 24];
+    sd_writer_path(w, w->fd_file, path, sizeof(path));
+    const int ret = close(fd);
+    return (0 == ret) ? truncate(path, length) : ret;
+}
+
+static uint64_t sd_now_us(void) {
+    return esp_timer_get_time();
+}
+
+static void sd_task(void *parameters) {
+    SdWriter *w = (SdWriter *)parameters;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        while (sd_writer_service(w)) {}
+    }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
 /*
-  to handshake through "reboot_enable" behavior in USBCDC.cpp
-  For a resync, host should
-   1) drop DTR, event post disconnected advance to state  CDC_LINE_1
-   2) drop RTS, back to state CDC_LINE_IDLE
+  Append a frame lane_drain() takes. Returns false when it must wait in the
+  ring, "hold", else a frame with no room is dropped and counted.
+*/
+static bool sd_save(SerialTask *session, const WiFiPcap *wpcap, bool hold) {
+    if (NULL == session->sd_task) return true;
+    const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+    const size_t frame_len = wpcap->pcap_header.capture_length - rt_len;
+    struct {
+        PcapPacketHeader pcap_header;
+        RadiotapHeader radiotap;
+    } STRUCT_PACKED head;
+    if (hold && !sd_writer_ready(&session->sd, sizeof(head) + frame_len)) return false;
+    uptime_header(session, wpcap, &head.pcap_header, &head.radiotap);
+    sd_writer_append(&session->sd, &head, sizeof(head), &wpcap->payload[rt_len], frame_len);
+    return true;
+}
 
-  For connecting back with both DTR and RTS false.
-   1) Raise DTR
-   2) Raise RTS
+// End a file grown too old, and wake sd_task for what was handed over since "handoffs"
+static void sd_poll(SerialTask *session, uint32_t handoffs) {
+    if (NULL == session->sd_task) return;
+    sd_writer_poll(&session->sd);
+    if (handoffs != session->sd.handoffs) xTaskNotifyGive(session->sd_task);
+}
 
-  There is also an issue of connect status staying disconnected after a
-  Serial.end()/Serial.begin() while DTR is held high.
+// The host is back, the file captured without it goes to the card
+static void sd_finish(SerialTask *session) {
+    if (NULL == session->sd_task) return;
+    while (!sd_writer_finish(&session->sd)) delay(1);
+    xTaskNotifyGive(session->sd_task);
+}
+#endif
+
+/*
+  Send the history of the last "span_ms", since uptime "since_us" and no
+  more than the newest "max_bytes" of it. The uptime of each frame becomes
+  host time through the time sync. Sent or too old, the history is emptied.
+  Adds the frames and 802.11 bytes sent to "count" and "bytes".
 */
-void serial_pcap_notifyDtrRts(bool dtr, bool rts) {
-    SerialTask *session = &st;
-    /*
-      For USBCDC, false DTR, connected, and CDC_LINE_IDLE will change
-      connected to false;
-    */
-    union UTaskState old_state, state;
-    do {
-        old_state.u32 = interlocked_read((volatile uint32_t*)&session->state);
-        state = old_state;
-        state.b.dtr = dtr;
-        state.b.rts = rts;
-        if (false == old_state.b.dtr && true == dtr && state.b.is_running) {
-            state.b.need_resync = state.b.need_init = true;
+static bool history_send(SerialTask *session, uint64_t span_ms, uint64_t since_us, uint32_t max_bytes, uint32_t *count, uint32_t *bytes) {
+    HistoryState *hs = &session->history;
+    const uint64_t now = esp_timer_get_time();
+    PcapPacketHeader host;
+    pcap_timestamp(session, (uint32_t)now, &host);
+    const uint64_t host_now = (uint64_t)host.seconds * 1000000u + host.microseconds;
+    const uint64_t span = span_ms * 1000u;
+    const uint64_t oldest = std::max<uint64_t>((now > span) ? now - span : 0, since_us);
+
+    bool success = true;
+    RingRecord *rec;
+    while (success && (rec = ring_peek(&hs->ring))) {
+        WiFiPcap *wpcap = (WiFiPcap *)rec->data;
+        const uint64_t uptime = (uint64_t)wpcap->pcap_header.seconds * 1000000u + wpcap->pcap_header.microseconds;
+        if (uptime >= oldest && ring_used(&hs->ring) <= max_bytes) {
+            const uint64_t when = host_now - (now - uptime);
+            wpcap->pcap_header.seconds = when / 1000000u;
+            wpcap->pcap_header.microseconds = when % 1000000u;
+            *bytes += wpcap->pcap_header.capture_length - sizeof(RadiotapHeader);
+            success = pcap_append_rt(session, &wpcap->pcap_header);
+            (*count)++;
         }
-    } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
-    if (state.b.dtr != old_state.b.dtr) ESP_LOGE(TAG, "Host update DTR: %s", (state.b.dtr) ? "HIGH" : "LOW");
+        ring_release(&hs->ring, rec);
+    }
+    return success;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Handles Host time sync up, 32 bit counter rollovers, and finalzing pcap
-// packet header timestamp.
-static inline void pcap_time_sync(SerialTask *session, WiFiPcap *wpcap) {
-    if (session->finish_host_time_sync) {
-        // session->finish_host_time_sync = false;
-        // assume this to be ESP32 system time
-        const uint32_t systime = wpcap->pcap_header.microseconds;
-        const uint32_t seconds = systime / 1000000u;
-        const uint32_t microseconds = systime % 1000000u;
+/*
+  After the prologue, the history the host asked for: the last 'J' seconds,
+  no more than the newest 'j' KB.
+*/
+static bool history_replay(SerialTask *session) {
+    HistoryState *hs = &session->history;
+    if (0 == hs->seconds || 0 == hs->ring.size) return true;
+    const uint32_t max_bytes = (hs->kbytes) ? std::min<uint32_t>(hs->kbytes, UINT32_MAX / 1024u) * 1024u : UINT32_MAX;
+    uint32_t count = 0, bytes = 0;
+    const bool success = history_send(session, (uint64_t)hs->seconds * 1000u, 0, max_bytes, &count, &bytes);
+    hs->replayed += count;
+    ESP_LOGI(TAG, "History, %u frames replayed", count);
+    return success;
+}
 
-        session->timeseconds -= seconds;
-        if (microseconds > session->timemicroseconds) {
-            session->timeseconds--;
-            session->timemicroseconds += 1000000u;
+// Index of the first TriggerDef the frame matches, else -1
+static int trigger_match(const SerialTask *session, const WiFiPcap *wpcap) {
+    const TriggerState *ts = &session->trigger;
+    const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+    const WiFiPktHdr* const pkt = (const WiFiPktHdr*)&wpcap->payload[rt_len];
+    const size_t caplen = wpcap->pcap_header.capture_length - rt_len;
+    if (offsetof(struct WiFiPktHdr, seqctl) > caplen) return -1;
+    if (WLAN_FC_TYPE_MGMT != pkt->fctl.type && WLAN_FC_TYPE_DATA != pkt->fctl.type) return -1;
+
+    const bool mgmt = (WLAN_FC_TYPE_MGMT == pkt->fctl.type);
+    // As the prescreen matches, addr4 only when it was captured
+    const bool wds = pkt->fctl.toDS && pkt->fctl.fromDS;
+    const bool watched = (!wds || offsetof(struct WiFiPktHdr, addr4) + sizeof(MacAddr) <= caplen)
+                      && watch_list_match_frame(&cust_fltr.watch, pkt);
+    for (size_t i = 0; i < ts->len; i++) {
+        const TriggerDef *def = &ts->list[i];
+        if ((def->flags & TRIGGER_F_WATCHED) && !watched) continue;
+        switch (def->kind) {
+        case TRIGGER_MGMT:
+            if (mgmt && def->value == pkt->fctl.subtype) return i;
+            break;
+        case TRIGGER_REASON: {
+            if (!mgmt || pkt->fctl.protFrame) break;
+            if (WLAN_FC_STYPE_DEAUTH != pkt->fctl.subtype && WLAN_FC_STYPE_DISASSOC != pkt->fctl.subtype) break;
+            const size_t at = wifi_header_length(pkt);
+            if (at + sizeof(uint16_t) > caplen) break;
+            const uint8_t *body = (const uint8_t *)pkt + at;
+            if (def->value == (body[0] | body[1] << 8)) return i;
+            break;
         }
-        session->timemicroseconds -= microseconds;
-        session->last_microseconds = systime;
-    } else
-    if (session->last_microseconds > wpcap->pcap_header.microseconds) {
-        // catch 32-bit register rollover and perform carry
-        // For this logic to work we must receive at least one packet every
-        // 1.19 hours. Unless some really tight prefilters are used, this is
-        // no expected to be an issue.
-        session->timeseconds      += USCLOCK32_ROLLOVER_SECONDS;
-        session->timemicroseconds += USCLOCK32_ROLLOVER_MICROSECONDS;
-        if (1000000u <= session->timemicroseconds) {
-            session->timeseconds++;
-            session->timemicroseconds -= 1000000u;
+        case TRIGGER_EAPOL: {
+            const uint32_t msg = (mgmt) ? 0 : wifi_eapol_key_message(pkt, caplen);
+            if (msg && (0 == def->value || def->value == msg)) return i;
+            break;
+        }
+        default:
+            break;
         }
-        // if (1000000u <= session->timemicroseconds) {
-        //     session->timeseconds += session->timemicroseconds / 1000000u;
-        //     session->timemicroseconds = session->timemicroseconds % 1000000u;
-        // }
     }
-    session->last_microseconds      = wpcap->pcap_header.microseconds;
+    return -1;
+}
 
-    // Finish defered processing of timestamp in this non-critical path.
-    wpcap->pcap_header.seconds      = wpcap->pcap_header.microseconds / 1000000u;
-    wpcap->pcap_header.microseconds = wpcap->pcap_header.microseconds % 1000000u;
+/*
+  While quiet, hold the frame in the history ring rather than send it. Call
+  before pcap_time_sync(), the time is still the device's. A frame that
+  matches is left for trigger_fire().
+*/
+static bool trigger_hold(SerialTask *session, const WiFiPcap *wpcap) {
+    TriggerState *ts = &session->trigger;
+    if (0 == ts->len) return false;
+    ts->pending = trigger_match(session, wpcap);
+    if (0 <= ts->pending) return false;
+    if (ts->until_us && (uint64_t)esp_timer_get_time() < ts->until_us) return false;
+    ts->until_us = 0;
+    const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+    if (history_save(session, wpcap)) {
+        ts->held++;
+        ts->held_bytes += wpcap->pcap_header.capture_length - rt_len;
+    }
+    return true;
+}
 
-    // Add in system time correction - assumes GMT
-    wpcap->pcap_header.seconds      += session->timeseconds;
-    wpcap->pcap_header.microseconds += session->timemicroseconds;
-    if (1000000u <= wpcap->pcap_header.microseconds) {
-        wpcap->pcap_header.seconds  += 1;
-        wpcap->pcap_header.microseconds -= 1000000u;
+/*
+  Send the pre-trigger window and a TriggerReport ahead of the frame that
+  matched, "wpcap" in host time, and start the post-trigger window.
+*/
+static bool trigger_fire(SerialTask *session, const WiFiPcap *wpcap) {
+    TriggerState *ts = &session->trigger;
+    if (0 > ts->pending) return true;
+    const size_t index = ts->pending;
+    ts->pending = -1;
+
+    // Frames held before this session are not its pre-trigger window
+    uint32_t count = 0, bytes = 0;
+    bool success = history_send(session, ts->pre_ms, ts->start_us, UINT32_MAX, &count, &bytes);
+    ts->sent_bytes += bytes;
+    ts->until_us = esp_timer_get_time() + (uint64_t)ts->post_ms * 1000u;
+
+    struct {
+        PcapPacketHeader pcap_header;
+        RadiotapHeader radiotap;
+        VendorFrame frame;
+        TriggerReport body;
+    } STRUCT_PACKED rec;
+    memset(&rec, 0, sizeof(rec));
+    vendor_frame_init(session, &rec.pcap_header, &rec.radiotap, &rec.frame, TRIGGER_SUBTYPE, sizeof(TriggerReport), ts->fired);
+    rec.pcap_header.seconds = wpcap->pcap_header.seconds;  // with the frame, before it
+    rec.pcap_header.microseconds = wpcap->pcap_header.microseconds;
+
+    TriggerReport *r = &rec.body;
+    r->version = TRIGGER_REPORT_VERSION;
+    r->index = index;
+    r->length = sizeof(TriggerReport);
+    r->seq = ts->fired++;
+    r->trigger = ts->list[index];
+    r->pre_frames = count;
+    r->pre_bytes = bytes;
+    r->held = ts->held;
+    r->saved_bytes = ts->held_bytes - ts->sent_bytes;
+    ESP_LOGI(TAG, "Trigger %u fired, %u frames before", index, count);
+    return success && device_record_append(session, &rec.pcap_header);
+}
+
+/*
+  Clear both lanes. With TF card capture, "hold" stops at a frame the card
+  has no room for yet, leaving it and the rest in the rings.
+*/
+static void lane_drain(SerialTask *session, bool hold) {
+    RingRecord *rec;
+    PcapRing *from;
+#if USE_SD_CAPTURE
+    const uint32_t handoffs = session->sd.handoffs;
+#endif
+    while ((rec = lane_peek(session, &from))) {
+#if USE_SD_CAPTURE
+        if (!sd_save(session, (WiFiPcap *)rec->data, hold)) break;
+#endif
+        cache_authenticate(session, (WiFiPcap *)rec->data);
+        history_save(session, (WiFiPcap *)rec->data);
+        ring_release(from, rec);
     }
+#if USE_SD_CAPTURE
+    sd_poll(session, handoffs);
+#endif
+}
+
+/*
+  Wait "ms" for the host. With TF card capture the lanes keep draining to the
+  card meanwhile, it only takes a couple of chunks at a time.
+*/
+static void host_wait(SerialTask *session, uint32_t ms) {
+#if USE_SD_CAPTURE
+    if (session->sd_task) {
+        const uint32_t start = millis();
+        do {
+            lane_drain(session, true);
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2));
+        } while (millis() - start < ms);
+        return;
+    }
+#endif
+    delay(ms);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 static void serial_task(void *parameters) {
     SerialTask *session = (SerialTask *)parameters;
+    RingRecord *rec = NULL;
+    PcapRing *from = NULL;
     WiFiPcap *wpcap = NULL;
 
     ESP_LOGI(TAG, "Task Started");
@@ -697,28 +3313,40 @@ static void serial_task(void *parameters) {
     } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
 
     while (state.b.is_running) {
-        // Get a captured packet from the queue
-        if (pdTRUE != xQueueReceive(session->work_queue, &wpcap, pdMS_TO_TICKS(WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS))) {
-            wpcap = NULL;
+        // Get a captured packet from the rings. When they are empty, write the
+        // batch or sleep till serial_pcap_cb() notifies us, no longer than
+        // the batch latency budget.
+        bool success = true;
+        rec = lane_peek(session, &from);
+        if (NULL == rec) {
+            uint32_t wait_ms = batch_deadline(session, success);
+            if (success) {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+                rec = lane_peek(session, &from);
+            }
         }
+        wpcap = (rec) ? (WiFiPcap *)rec->data : NULL;
         state.u32 = interlocked_read((volatile uint32_t*)&session->state);
         bool need_resync = state.b.need_resync;
         while (need_resync) {
+            success = true;
+            overload_reset(session);
+            // serial_pcap_cb() keeps no frames while surveying, the history
+            // ring and TF card need them without a host
+            session->survey.interval_ms = 0;
             if (wpcap) {
-                cache_authenticate(wpcap);
-                free(wpcap);
+                cache_authenticate(session, wpcap);
+                ring_release(from, rec);
                 wpcap = NULL;
             }
             need_resync = (ESP_OK != pcap_serial_start(session, PCAP_LINK_TYPE_802_11));
-            // Clear queue so we can get time synced properly with host
-            while (pdTRUE == xQueueReceive(session->work_queue, &wpcap, 0)) {
-                cache_authenticate(wpcap);
-                free(wpcap);
-            }
+            // Clear rings so we can get time synced properly with host
+            lane_drain(session, need_resync);
+            rec = NULL;
             wpcap = NULL;
 
             if (need_resync) {
-                delay(WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS);
+                host_wait(session, WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS);
                 // state = (TaskState)interlocked_read((volatile void**)&session->state);
             } else {
                 do {
@@ -726,19 +3354,33 @@ static void serial_task(void *parameters) {
                     state = old_state;
                     state.b.need_resync = !state.b.dtr;
                 } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
+#if USE_SD_CAPTURE
+                sd_finish(session);
+#endif
             }
         }
-        if (NULL == wpcap) continue;
-
-        bool success = true;
-        pcap_time_sync(session, wpcap);
-        if (session->finish_host_time_sync) {
-            session->finish_host_time_sync = false;
-            success = (ESP_OK == prologue(session, wpcap));
+        if (success) {
+            overload_update(session);
+            success = survey_poll(session) && telemetry_poll(session) && pcapng_poll(session) && frame_poll(session) && host_poll(session);
         }
-        cache_authenticate(wpcap);
+        if (wpcap) {
+            const uint32_t rx_us = wpcap->pcap_header.microseconds;
+            histogram_add(&session->residency, since_capture(rx_us));
+            stage_stats_add(&session->writer_stage, wpcap->pcap_header.seconds);
+            const bool held = trigger_hold(session, wpcap);
+            pcap_time_sync(session, wpcap);
+            if (session->finish_host_time_sync) {
+                session->finish_host_time_sync = false;
+                success = (ESP_OK == prologue(session, wpcap)) && history_replay(session);
+            }
+            cache_authenticate(session, wpcap);
+            if (success && !held) {
+                success = trigger_fire(session, wpcap) && writePcapWait(session, wpcap, rx_us);
+            }
+            ring_release(from, rec);
+        } else
         if (success) {
-            success = writePcapWait(session, wpcap);
+            continue;
         }
         if (! success) {
             // This is the path taken when Wireshark exits and python script closes.
@@ -758,10 +3400,10 @@ static void serial_task(void *parameters) {
             } else {
                 ESP_LOGE(TAG, "Host has disconnected!");  // maybe => ESP_LOGI
             }
-            delay(1000);
+            batch_reset(session);
+            host_wait(session, 1000);
             // TODO: Review TX timeout possible issues
         }
-        free(wpcap);
     }
     // session->need_resync = false;
     session->task = NULL;
@@ -772,19 +3414,19 @@ static void serial_task(void *parameters) {
         state.b.need_init = false;        // assume an idle stance
     } while (false == interlocked_compare_exchange((volatile uint32_t*)&session->state, old_state.u32, state.u32));
 
-    // Drain queue and free allocations
+    // Drain ring and free the arena
     // Use WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS to allow any inprogress
-    // serial_pcap_cb()/xQueueSend to finish
-    while (pdTRUE == xQueueReceive(session->work_queue, &wpcap, WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS)) {
-        free(wpcap);
+    // serial_pcap_cb()/ring_commit to finish
+    delay(WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS);
+    while ((rec = lane_peek(session, &from))) {
+        ring_release(from, rec);
     }
     // At this time, we never stop the task. So, this path is never taken.
     // Re-evaluate atomics when/if this changes
-    // QueueHandle_t work_queue = interlocked_read((volatile void**)&session->work_queue);
-    // interlocked_write(&session->work_queue, NULL);
-
-    vQueueDelete(session->work_queue);
-    session->work_queue = NULL;
+    free(session->ring.arena);
+    ring_init(&session->ring, NULL, 0);
+    free(session->prio.arena);
+    ring_init(&session->prio, NULL, 0);
 
     ESP_LOGE(TAG, "Task stopped!");
     vTaskDelete(NULL);
@@ -795,6 +3437,131 @@ static void serial_task(void *parameters) {
 //
 #pragma GCC push_options
 #pragma GCC optimize("Ofast")
+/*
+  High priority lane, frames that make or break a trace: EAPOL, needed to
+  decrypt, and Authentication, (Re)Association, Disassociation and
+  Deauthentication.
+*/
+static inline bool pcap_priority(const wifi_promiscuous_pkt_t *snoop, wifi_promiscuous_pkt_type_t type, size_t caplen) {
+    const WiFiPktHdr* const pkt = (WiFiPktHdr*)snoop->payload;
+    if (WIFI_PKT_MGMT == type) {
+        switch (pkt->fctl.subtype) {
+            case WLAN_FC_STYPE_ASSOC_REQ:
+            case WLAN_FC_STYPE_ASSOC_RESP:
+            case WLAN_FC_STYPE_REASSOC_REQ:
+            case WLAN_FC_STYPE_REASSOC_RESP:
+            case WLAN_FC_STYPE_DISASSOC:
+            case WLAN_FC_STYPE_AUTH:
+            case WLAN_FC_STYPE_DEAUTH:
+                return true;
+            default:
+                return false;
+        }
+    }
+    return WIFI_PKT_DATA == type && NULL != wifi_eapol(pkt, caplen);
+}
+
+/*
+  Apply the prescreen filters and move a kept packet into the packet rings for
+  serial_task. The only producer of the packet rings, called from
+  serial_pcap_cb() or filter_task but never both at once, see serial_pcap_cb().
+
+  High priority frames go in the prio ring, or the packet ring when it is
+  full. Best effort frames only use the packet ring, so they cannot crowd out
+  the high priority ones.
+*/
+static esp_err_t pcap_enqueue(SerialTask *session, const wifi_promiscuous_pkt_t *snoop, wifi_promiscuous_pkt_type_t type, TickType_t wait) {
+    const prescreen_fn prescreen_active = (prescreen_fn)interlocked_read((volatile void**)&active_prescreen);
+    ssize_t length = 0;
+    ssize_t keepLength = prescreen_active(&prescreen_ctx, snoop, type, &length);
+    if (keepLength > 0) {
+        // Reserve room in the ring for a Wireshark/pcap ready packet
+        // Allow brief blocking
+        //   * so serial_task can release records and we can avoid
+        //     dropping the packet
+        //   * short enough to avoid overflow in the SDK's WiFi RX
+        //     calling path to serial_pcap_cb().
+        const size_t lane = (pcap_priority(snoop, type, keepLength)) ? k_lane_high : k_lane_best;
+        const uint32_t level = session->overload.level;
+        if (level && k_lane_best == lane) {
+            OverloadLadder *ol = &session->overload;
+            const WiFiPktHdr* const pkt = (WiFiPktHdr*)snoop->payload;
+            if (WIFI_PKT_DATA == type) {
+                if (k_overload_sample <= level) {
+                    // Same for both directions, a conversation is kept or dropped whole
+                    const uint8_t *ta = pkt->ta.mac;
+                    const uint8_t *ra = pkt->ra.mac;
+                    const uint32_t key = ((uint32_t)ta[2] << 24 | (uint32_t)ta[3] << 16 | (uint32_t)ta[4] << 8 | ta[5])
+                                       ^ ((uint32_t)ra[2] << 24 | (uint32_t)ra[3] << 16 | (uint32_t)ra[4] << 8 | ra[5]);
+                    const uint32_t shift = k_overload_sample_shift[level];
+                    if ((key * 2654435761u) >> (32u - shift)) {  // Knuth multiplicative hash
+                        ol->sampled_out++;
+                        ol->shed[snoop->rx_ctrl.channel - 1]++;
+                        return ESP_OK;
+                    }
+                }
+                const ssize_t hdrlen = wifi_header_length(pkt);
+                if (keepLength > hdrlen) {
+                    ol->truncated++;
+                    ol->truncated_bytes += keepLength - hdrlen;
+                    keepLength = hdrlen;
+                }
+            } else
+            if (WIFI_PKT_CTRL == type && k_overload_drop_ctrl <= level) {
+                ol->ctrl_dropped++;
+                ol->shed[snoop->rx_ctrl.channel - 1]++;
+                return ESP_OK;
+            }
+        }
+        const size_t rt_len = (session->radiotap) ? sizeof(RadiotapHeader) : 0;
+        const size_t need = rt_len + keepLength + sizeof(WiFiPcap);
+        PcapRing *ring = &session->ring;
+        WiFiPcap *wpcap;
+        while (true) {
+            if (k_lane_high == lane && (wpcap = (WiFiPcap*)ring_reserve(&session->prio, need))) {
+                ring = &session->prio;
+                break;
+            }
+            if ((wpcap = (WiFiPcap*)ring_reserve(&session->ring, need))) {
+                if (k_lane_high == lane) session->prio_spilled++;
+                break;
+            }
+            // "wait" reservations in all, a tick apart
+            if (0 == wait || 0 == --wait) {
+                // ESP_LOGE(TAG, "snoop ring full");
+                session->ring.full++;
+                if (k_lane_high == lane) session->prio.full++;
+                session->lane[lane].dropped++;
+                return ESP_ERR_TIMEOUT;
+            }
+            vTaskDelay(1);
+        }
+        session->lane[lane].queued++;
+        // Make a copy of received packet
+        if (rt_len) {
+            radiotap_init((RadiotapHeader *)wpcap->payload, snoop->rx_ctrl.channel,
+                snoop->rx_ctrl.rssi, (cust_fltr.fcslen) ? RADIOTAP_F_FCS : 0);
+        }
+        memcpy(&wpcap->payload[rt_len], snoop->payload, keepLength);
+        /*
+          Prepare pcap packet header
+        */
+        // Critical path, defer divides and timestamp corrections till later
+        //   seconds = snoop->rx_ctrl.timestamp / 1000000u;
+        //   microseconds = snoop->rx_ctrl.timestamp % 1000000u;
+        wpcap->pcap_header.microseconds = snoop->rx_ctrl.timestamp;
+        // Until pcap_time_sync(), seconds holds the time queued for writer_stage
+        wpcap->pcap_header.seconds = (uint32_t)esp_timer_get_time();
+        wpcap->pcap_header.capture_length = rt_len + keepLength;
+        wpcap->pcap_header.packet_length = rt_len + length;
+
+        if (ring_commit(ring)) {
+            xTaskNotifyGive(session->task);
+        }
+    }
+    return ESP_OK;
+}
+
 esp_err_t serial_pcap_cb(void *recv_buf, wifi_promiscuous_pkt_type_t type) {
     wifi_promiscuous_pkt_t *snoop = (wifi_promiscuous_pkt_t *)recv_buf;
     SerialTask *session = &st;
@@ -802,143 +3569,161 @@ esp_err_t serial_pcap_cb(void *recv_buf, wifi_promiscuous_pkt_type_t type) {
     union UTaskState state;
     state.u32 = interlocked_read((volatile uint32_t*)&session->state);
     if (!state.b.is_running) return ESP_ERR_INVALID_STATE;
+    // Statistics only, wifi_promis_cb() has counted it
+    if (session->survey.interval_ms) return ESP_OK;
 
-    // Skip error state packets - does this include with FCS Errors ??
-    // rx_ctrl.rx_state is underdocumented. I assume it would be set for errors
-    // other than fcsfail. Like runt packets, jumbo packets, DMA error, etc.
-    if (cust_fltr.badpkt || 0 == snoop->rx_ctrl.rx_state) {
-#if 1
-        const WiFiPktHdr* const pkt = (WiFiPktHdr*)snoop->payload;
-        // Apply prescreen filters
-        if (cust_fltr.session) {
-            // These seem to work for limiting excess captured packets when
-            // focusing on IP/TCP data. While Wireshark is logging, each side
-            // needs to authenticate with the AP for decryption to work.
-            //?? Do I need any WIFI_PKT_MGMT packets ??
-            if (WIFI_PKT_MGMT == type) {
-                if (WLAN_FC_STYPE_BEACON     == pkt->fctl.subtype) return ESP_OK;
-                if (WLAN_FC_STYPE_PROBE_REQ  == pkt->fctl.subtype) return ESP_OK;
-                if (WLAN_FC_STYPE_PROBE_RESP == pkt->fctl.subtype) return ESP_OK;
-            }
-            // Disregard (no data) subtypes.
-            if (WIFI_PKT_DATA == type && (0x04u & pkt->fctl.subtype)) return ESP_OK;
-        }
-        // Match Source or Destination Address to an OUI (or unicast address)
-        if (cust_fltr.moilen) {
-            do {
-                if (cust_fltr.mcastlen) {
-                    if (1 == cust_fltr.mcastlen) {
-                        // Keep any broadcast response
-                        if ((!pkt->fctl.toDS && (1u & pkt->ra.mac[0])) ||
-                            ( pkt->fctl.toDS && (1u & pkt->addr3.mac[0])) ) {
-                            continue;
-                        }
-                    } else {
-                      // Keep selective broadcast
-                      size_t len = cust_fltr.mcastlen;
-                      uint8_t *moi = cust_fltr.mcast.mac;
-                      if ((!pkt->fctl.toDS && 0 == memcmp(pkt->ra.mac,    moi, len)) ||
-                          ( pkt->fctl.toDS && 0 == memcmp(pkt->addr3.mac, moi, len))) {
-                          continue;
-                      }
-                    }
-                }
-                size_t len = cust_fltr.moilen;
-                uint8_t *moi = cust_fltr.moi.mac;
-                if (6 == len) { // unicast
-                    do {// Log packet on interesting Source Address or Destination Address
-                        // Check the last byte of the MAC address early, it will have more entropy.
-                        if (!pkt->fctl.toDS   && pkt->ra.mac[5] == moi[5] && 0 == memcmp(pkt->ra.mac, moi, 5)) continue;
-                        if (!pkt->fctl.fromDS && pkt->ta.mac[5] == moi[5] && 0 == memcmp(pkt->ta.mac, moi, 5)) continue;
-                        if ((pkt->fctl.toDS || pkt->fctl.fromDS)
-                                              && pkt->addr3.mac[5] == moi[5] && 0 == memcmp(pkt->addr3.mac, moi, 5)) continue;
-                        if ( pkt->fctl.toDS && pkt->fctl.fromDS
-                                              && pkt->addr4.mac[5] == moi[5] && 0 == memcmp(pkt->addr4.mac, moi, 5)) continue;
-                        return ESP_OK;
-                    } while (false);
-                } else
-                if (3 == len) { // OUI
-                    do {
-                        if (!pkt->fctl.toDS   && pkt->ra.mac[0] == moi[0] && pkt->ra.mac[1] == moi[1] && pkt->ra.mac[2] == moi[2] ) continue;
-                        if (!pkt->fctl.fromDS && pkt->ta.mac[0] == moi[0] && pkt->ta.mac[1] == moi[1] && pkt->ta.mac[2] == moi[2]) continue;
-                        if ((pkt->fctl.toDS || pkt->fctl.fromDS)
-                                              && pkt->addr3.mac[0] == moi[0] && pkt->addr3.mac[1] == moi[1] && pkt->addr3.mac[2] == moi[2]) continue;
-                        if ( pkt->fctl.toDS && pkt->fctl.fromDS
-                                              && pkt->addr4.mac[0] == moi[0] && pkt->addr4.mac[1] == moi[1] && pkt->addr4.mac[2] == moi[2]) continue;
-                        return ESP_OK;
-                    } while (false);
-                }
-                // #if 0
-                // else if (len) {
-                //     do {  // Log packet on interesting Source Address or Destination Address
-                //         if (!pkt->fctl.toDS   && 0 == memcmp(pkt->ra.mac,    moi, len)) continue;
-                //         if (!pkt->fctl.fromDS && 0 == memcmp(pkt->ta.mac,    moi, len)) continue;
-                //         if ((pkt->fctl.toDS || pkt->fctl.fromDS)
-                //                               && 0 == memcmp(pkt->addr3.mac, moi, len)) continue;
-                //         if ( pkt->fctl.toDS && pkt->fctl.fromDS
-                //                               && 0 == memcmp(pkt->addr4.mac, moi, len)) continue;
-                //         return ESP_OK;
-                //     } while (false);
-                // }
-                // #endif
-            } while (false);
-        }
-#endif
-        ssize_t length = snoop->rx_ctrl.sig_len;
-        if (! cust_fltr.fcslen) {
-            length -= WIFIPCAP_PAYLOAD_FCS_LEN;
+    const uint32_t start = esp_cpu_get_cycle_count();
+    esp_err_t err = ESP_OK;
+    /*
+      With the filter stage deferred, only copy the packet for filter_task.
+      After switching back, keep using the raw ring until filter_task has
+      emptied it. filter_task releases a raw record only after it is done with
+      the packet ring. So, an empty raw ring means we are the only producer
+      for the packet ring.
+    */
+    if (interlocked_read(&session->deferred) || ring_used(&session->raw)) {
+        ssize_t len = snoop->rx_ctrl.sig_len;
+        if (len > PCAP_MAX_CAPTURE_PACKET_SIZE + WIFIPCAP_PAYLOAD_FCS_LEN) {
+            len = PCAP_MAX_CAPTURE_PACKET_SIZE + WIFIPCAP_PAYLOAD_FCS_LEN;
         }
-        ssize_t keepLength = length;
-        if (keepLength > PCAP_MAX_CAPTURE_PACKET_SIZE) keepLength = PCAP_MAX_CAPTURE_PACKET_SIZE;
-        if (keepLength > 0) {
-            // This may need to use PSRAM
-            // Use work_queue size as a limiter on total memory allocated.wpcap->payload / 1000000u;
-            WiFiPcap *wpcap = (WiFiPcap*)malloc(keepLength + sizeof(WiFiPcap));
-            if (wpcap) {
-                // Make a copy of received packet
-                memcpy(wpcap->payload, snoop->payload, keepLength);
-                /*
-                  Prepare pcap packet header
-                */
-                // Critical path, defer divides and timestamp corrections till later
-                //   seconds = snoop->rx_ctrl.timestamp / 1000000u;
-                //   microseconds = snoop->rx_ctrl.timestamp % 1000000u;
-                wpcap->pcap_header.microseconds = snoop->rx_ctrl.timestamp;
-                wpcap->pcap_header.capture_length = keepLength;
-                wpcap->pcap_header.packet_length = length;
-
-                // Queue Wireshark/pcap ready packet
-                // Allow brief blocking - WIFIPCAP_HP_PROCESS_PACKET_TIMEOUT_MS
-                //   * so xQueueReceive can finish and we can avoid dropping
-                //     the packet
-                //   * short enough to avoid overflow in the SDK's WiFi RX
-                //     calling path to serial_pcap_cb().
-
-                // QueueHandle_t work_queue = (QueueHandle_t)interlocked_read((void*)&session->work_queue);
-                // if (NULL != work_queue && pdTRUE != xQueueSend(work_queue, &wpcap, pdMS_TO_TICKS(WIFIPCAP_HP_PROCESS_PACKET_TIMEOUT_MS))) {
-                if (pdTRUE != xQueueSend(session->work_queue, &wpcap, pdMS_TO_TICKS(WIFIPCAP_HP_PROCESS_PACKET_TIMEOUT_MS))) {
-                    // ESP_LOGE(TAG, "snoop work queue full");
-                    free(wpcap);
-                    return ESP_ERR_TIMEOUT;
-                }
-            } else {
-                return ESP_ERR_NO_MEM;
+        RawPacket *raw = (RawPacket *)ring_reserve(&session->raw, sizeof(RawPacket) + len);
+        if (raw) {
+            raw->type = type;
+            raw->enqueued_us = (uint32_t)esp_timer_get_time();
+            raw->pkt.rx_ctrl = snoop->rx_ctrl;
+            memcpy(raw->pkt.payload, snoop->payload, len);
+            if (ring_commit(&session->raw)) {
+                xTaskNotifyGive(session->filter_task);
             }
+        } else {
+            session->raw.full++;
+            err = ESP_ERR_TIMEOUT;
         }
+    } else {
+        err = pcap_enqueue(session, snoop, type, pdMS_TO_TICKS(WIFIPCAP_HP_PROCESS_PACKET_TIMEOUT_MS));
     }
-    return ESP_OK;
+    session->cb_calls++;
+    session->cb_cycles += esp_cpu_get_cycle_count() - start;
+    return err;
 }
 #pragma GCC pop_options
 
+/*
+  Filter stage, the middle of serial_pcap_cb() -> filter_task -> serial_task.
+  Pinned to the same core as serial_task, away from the SDK's WiFi task.
+*/
+static void filter_task(void *parameters) {
+    SerialTask *session = (SerialTask *)parameters;
+    ESP_LOGI(TAG, "Filter Task Started");
+    while (true) {
+        RingRecord *rec = ring_peek(&session->raw);
+        if (NULL == rec) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        RawPacket *raw = (RawPacket *)rec->data;
+        stage_stats_add(&session->filter_stage, raw->enqueued_us);
+        pcap_enqueue(session, &raw->pkt, (wifi_promiscuous_pkt_type_t)raw->type,
+            pdMS_TO_TICKS(WIFIPCAP_PROCESS_PACKET_TIMEOUT_MS));
+        ring_release(&session->raw, rec);
+    }
+}
+
+/*
+  Choose the prescreen function for the current cust_fltr settings and publish
+  it to serial_pcap_cb(). Called when the host dialog completes. The settings
+  read at run time by the selected function, the watch list and BPF program,
+  may be changed by the next host dialog while it runs; as before, packets
+  during the dialog see a mix.
+*/
+static void prescreen_select(void) {
+    const uint32_t policy = prescreen_policy(&cust_fltr);
+    void *old = interlocked_read((volatile void**)&active_prescreen);
+    interlocked_compare_exchange((volatile void**)&active_prescreen, old, (void*)prescreen_table[policy]);
+
+    SerialTask *session = &st;
+    const uint32_t deferred = (cust_fltr.deferred && session->raw.size && session->filter_task) ? true : false;
+    interlocked_compare_exchange(&session->deferred, session->deferred, deferred);
+    ESP_LOGI(TAG, "Prescreen policy 0x%02X, %s", policy, (deferred) ? "filter task" : "callback");
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /*
   setup captured packet queue and worker thread
   called once from setup()
 */
+/*
+  Capture to PCAP files in "dir" on the mounted TF card while no host is
+  connected, after serial_pcap_start(). Files continue the numbering found.
+  Without a host there is no time sync, records carry the uptime.
+*/
+esp_err_t serial_pcap_sd_start(const char *dir) {
+#if USE_SD_CAPTURE
+    SerialTask *session = &st;
+    if (session->sd_task) return ESP_ERR_INVALID_STATE;
+
+    mkdir(dir, 0775);    // fails when it is there
+    uint8_t *bufs[k_sd_buffers];
+    size_t n = 0;
+    for (; n < k_sd_buffers; n++) {
+        bufs[n] = (uint8_t *)heap_caps_malloc(CONFIG_WIFIPCAP_SD_CHUNK_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (NULL == bufs[n]) break;
+    }
+    if (k_sd_buffers != n) {
+        ESP_LOGE(TAG, "TF card buffers malloc(%u) failed!", CONFIG_WIFIPCAP_SD_CHUNK_SIZE);
+        while (n) free(bufs[--n]);
+        return ESP_ERR_NO_MEM;
+    }
+
+    const PcapFileHeader header = {
+        .magic = PCAP_MAGIC,
+        .major = PCAP_DEFAULT_VERSION_MAJOR,
+        .minor = PCAP_DEFAULT_VERSION_MINOR,
+        .zone  = PCAP_DEFAULT_TIME_ZONE_GMT,
+        .sigfigs = 0,
+        .snaplen = PCAP_MAX_CAPTURE_PACKET_SIZE,
+        .link_type = PCAP_LINK_TYPE_802_11_RADIOTAP,
+    };
+    const SdWriterIo io = { &session->sd, sd_open, sd_write, sd_sync, sd_close, sd_now_us };
+    SdWriter *w = &session->sd;
+    sd_writer_init(w, &io, dir, bufs, CONFIG_WIFIPCAP_SD_CHUNK_SIZE, CONFIG_WIFIPCAP_SD_FILE_SIZE,
+        CONFIG_WIFIPCAP_SD_FILE_MS, &header, sizeof(header), 1);
+    w->sync_ms = CONFIG_WIFIPCAP_SD_SYNC_MS;
+    w->stall_us = CONFIG_WIFIPCAP_SD_STALL_US;
+    char path[k_sd_path_max + 24];
+    struct stat info;
+    for (;; w->next_file++) {
+        sd_writer_path(w, w->next_file, path, sizeof(path));
+        if (0 != stat(path, &info)) break;
+    }
+
+    TaskHandle_t task = NULL;
+    if (pdPASS != xTaskCreatePinnedToCore(
+            sd_task,                              // TaskFunction_t, Function to implement the task
+            "SdTask",                             // char *, Task Name
+            CONFIG_WIFIPCAP_TASK_STACK_SIZE,      // uint32_t, Stack size in bytes (4 byte increments)
+            w,                                    // void *, Task input parameter
+            tskIDLE_PRIORITY + 1,                 // UBaseType_t , Priority of the task, below serial_task
+            &task,                                // TaskHandle_t *, Task handle
+            APP_CPU_NUM)) {                       // BaseType_t, Core where the task should run
+        ESP_LOGE(TAG, "Create SD Task Failed!");
+        for (n = 0; n < k_sd_buffers; n++) free(bufs[n]);
+        memset(w, 0, sizeof(SdWriter));
+        return ESP_FAIL;
+    }
+    // serial_task starts appending
+    interlocked_compare_exchange((volatile void**)&session->sd_task, NULL, (void *)task);
+    ESP_LOGI(TAG, "TF card capture to %s, from file %u", dir, w->next_file);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 esp_err_t serial_pcap_start(SERIAL_INF* pcapSerial, bool init_custom_filter) {
     SerialTask *session = &st;
 
-    if (interlocked_read((volatile void**)&session->work_queue)) return ESP_FAIL;
+    if (interlocked_read((volatile void**)&session->ring.arena)) return ESP_FAIL;
 
     // init state
     session->state.is_running = false;
@@ -950,9 +3735,16 @@ esp_err_t serial_pcap_start(SERIAL_INF* pcapSerial, bool init_custom_filter) {
     if (init_custom_filter) {
         cust_fltr.badpkt = false;
         cust_fltr.fcslen = false;
+        cust_fltr.dedup = false;
+        cust_fltr.noretry = false;
+        cust_fltr.deferred = false;
+        cust_fltr.beacon_refresh_ms = CONFIG_WIFIPCAP_BEACON_REFRESH_MS;
         cust_fltr.session = (USE_WIFIPCAP_FILTER_AP_SESSION) ? true : false;
         cust_fltr.mcastlen = 0;
-        cust_fltr.moilen = 0;
+        watch_list_clear(&cust_fltr.watch);
+        bpf_remove(&cust_fltr.bpf);
+        cust_fltr.bpf.loading = 0;
+        memset(cust_fltr.snaplen, 0, sizeof(cust_fltr.snaplen));
     }
 #if defined(BOARD_HAS_PSRAM) || defined(USE_DRAM_CACHE)
     cust_fltr.cache_auth_count = 0;
@@ -988,12 +3780,91 @@ esp_err_t serial_pcap_start(SERIAL_INF* pcapSerial, bool init_custom_filter) {
         return ESP_FAIL;
     }
     session->pcapSerial = pcapSerial;
-    session->work_queue = xQueueCreate(CONFIG_WIFIPCAP_WORK_QUEUE_LEN, sizeof(WiFiPcap*));
 
-    if (NULL == session->work_queue) {
-        ESP_LOGE(TAG, "create work queue failed");
+    // The packet ring replaces a malloc per packet. Prefer PSRAM, what is left
+    // after the Cache AUTH, and fallback to DRAM.
+    void *arena = NULL;
+    size_t ring_sz = 0;
+    if (heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) >= CONFIG_WIFIPCAP_RING_SIZE_PSRAM) {
+        ring_sz = CONFIG_WIFIPCAP_RING_SIZE_PSRAM;
+        arena = heap_caps_malloc(ring_sz, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (NULL == arena) {
+        ring_sz = CONFIG_WIFIPCAP_RING_SIZE_DRAM;
+        arena = heap_caps_malloc(ring_sz, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (NULL == arena) {
+        ESP_LOGE(TAG, "Packet ring malloc(%u) failed!", ring_sz);
+        return ESP_FAIL;
+    }
+    ring_init(&session->ring, arena, ring_sz);
+    ESP_LOGI(TAG, "Packet ring 0x%08X = malloc(%u) success", (uintptr_t)arena, ring_sz);
+
+    // High priority lane. Without it, all frames share the packet ring.
+    void *prio_arena = heap_caps_malloc(CONFIG_WIFIPCAP_PRIO_RING_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ring_init(&session->prio, prio_arena, CONFIG_WIFIPCAP_PRIO_RING_SIZE);
+    if (NULL == prio_arena) {
+        ESP_LOGE(TAG, "Prio ring malloc(%u) failed!", CONFIG_WIFIPCAP_PRIO_RING_SIZE);
+    }
+
+    // Filter stage ring, DRAM for a fast copy in serial_pcap_cb(). Without it
+    // filtering stays in the callback.
+    void *raw_arena = heap_caps_malloc(CONFIG_WIFIPCAP_RAW_RING_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ring_init(&session->raw, raw_arena, CONFIG_WIFIPCAP_RAW_RING_SIZE);
+    if (NULL == raw_arena) {
+        ESP_LOGE(TAG, "Raw ring malloc(%u) failed!", CONFIG_WIFIPCAP_RAW_RING_SIZE);
+    }
+
+    memset(&session->batch, 0, sizeof(session->batch));
+    session->batch.frame = (uint8_t *)heap_caps_malloc(k_frame_overhead + CONFIG_WIFIPCAP_BATCH_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    session->batch.buf = (session->batch.frame) ? &session->batch.frame[sizeof(FrameHeader)] : NULL;
+    if (NULL == session->batch.buf) {
+        ESP_LOGE(TAG, "Write batch malloc(%u) failed!", CONFIG_WIFIPCAP_BATCH_SIZE);
+        free(session->ring.arena);
+        ring_init(&session->ring, NULL, 0);
+        free(session->prio.arena);
+        ring_init(&session->prio, NULL, 0);
+        free(session->raw.arena);
+        ring_init(&session->raw, NULL, 0);
         return ESP_FAIL;
     }
+    session->batch.io = { session, batch_io_write, batch_now_ms, batch_now_us };
+    session->batch.end_to_end = &session->end_to_end;
+    session->batch.size = CONFIG_WIFIPCAP_BATCH_SIZE;
+    session->batch.limit = std::min(CONFIG_WIFIPCAP_SERIAL_TX_BUFFER_SIZE, CONFIG_WIFIPCAP_BATCH_SIZE);
+    session->batch.latency_ms = CONFIG_WIFIPCAP_BATCH_LATENCY_MS;
+    memset(&session->overload, 0, sizeof(session->overload));
+    session->overload.start_pct = CONFIG_WIFIPCAP_OVERLOAD_START;
+
+    // Capture history, PSRAM only, the whole size asked for with
+    // CONFIG_WIFIPCAP_HISTORY_HEADROOM to spare or none.
+    memset(&session->history, 0, sizeof(session->history));
+    memset(&session->trigger, 0, sizeof(session->trigger));
+    session->trigger.pending = -1;
+    const size_t history_sz = CONFIG_WIFIPCAP_HISTORY_SIZE;
+    const size_t psram_largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    void *history_arena = NULL;
+    if (history_sz && psram_largest >= history_sz + CONFIG_WIFIPCAP_HISTORY_HEADROOM) {
+        history_arena = heap_caps_malloc(history_sz, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    ring_init(&session->history.ring, history_arena, history_sz);
+    if (history_arena) {
+        ESP_LOGI(TAG, "History ring 0x%08X = malloc(%u) success", (uintptr_t)history_arena, history_sz);
+    } else if (history_sz) {
+        ESP_LOGI(TAG, "No history ring, PSRAM largest free block %u < %u + %u headroom", psram_largest, history_sz, CONFIG_WIFIPCAP_HISTORY_HEADROOM);
+    }
+    if (session->raw.size && pdPASS != xTaskCreatePinnedToCore(
+            filter_task,                          // TaskFunction_t, Function to implement the task
+            "FilterTask",                         // char *, Task Name
+            CONFIG_WIFIPCAP_TASK_STACK_SIZE,      // uint32_t, Stack size in bytes (4 byte increments)
+            session,                              // void *, Task input parameter
+            CONFIG_WIFIPCAP_FILTER_TASK_PRIORITY, // UBaseType_t , Priority of the task
+            (void**)&session->filter_task,        // TaskHandle_t *, Task handle
+            APP_CPU_NUM)) {                       // BaseType_t, Core where the task should run
+        ESP_LOGE(TAG, "Create Filter Task Failed!");
+        session->filter_task = NULL;
+    }
+    prescreen_select();
 #if 0
     // Let the OS choose processor - lets see if this handles contension with
     // MSC better.
@@ -1034,8 +3905,14 @@ esp_err_t serial_pcap_start(SERIAL_INF* pcapSerial, bool init_custom_filter) {
     // session->pcapSerial->end();  // These calls appear to cause a crash
     session->pcapSerial = NULL;
 
-    vQueueDelete(session->work_queue);
-    session->work_queue = NULL;
+    free(session->batch.frame);
+    session->batch.frame = NULL;
+    session->batch.buf = NULL;
+    free(session->ring.arena);
+    ring_init(&session->ring, NULL, 0);
+    free(session->prio.arena);
+    ring_init(&session->prio, NULL, 0);
+    // filter_task, if started, stays waiting on an empty raw ring.
 
     return ESP_FAIL;
 }
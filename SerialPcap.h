@@ -19,6 +19,7 @@
 
 #include <Arduino.h>
 #include <USB.h>
+#include "Histogram.h"
 /*
   HWSerial:
 
@@ -116,7 +117,8 @@ typedef enum {
     PCAP_LINK_TYPE_CISCO_HDLC = 104,   // Cisco HDLC
     PCAP_LINK_TYPE_802_11 = 105,       // 802.11
     PCAP_LINK_TYPE_BSD_LOOPBACK = 108, // OpenBSD loopback devices(with AF_value in network byte order)
-    PCAP_LINK_TYPE_LOCAL_TALK = 114    // LocalTalk
+    PCAP_LINK_TYPE_LOCAL_TALK = 114,   // LocalTalk
+    PCAP_LINK_TYPE_802_11_RADIOTAP = 127 // 802.11 with a radiotap header
 } pcap_link_type_t;
 
 
@@ -150,9 +152,562 @@ struct WiFiPcap {  // Object to place on queue
     uint8_t payload[];
 } STRUCT_PACKED;
 
+/*
+   Radiotap header, https://www.radiotap.org
+
+   While the device hops channels the link type is
+   PCAP_LINK_TYPE_802_11_RADIOTAP and each record starts with this header,
+   so the channel a frame was heard on goes along with it. Always the same
+   three fields, the same size as a PcapPacketHeader.
+ */
+#define RADIOTAP_FLAGS          (1u << 1)
+#define RADIOTAP_CHANNEL        (1u << 3)
+#define RADIOTAP_ANT_SIGNAL     (1u << 5)   // dBm
+#define RADIOTAP_F_FCS          (0x10u)     // frame ends with the FCS
+#define RADIOTAP_CHAN_2GHZ      (0x0080u)
+
+struct RadiotapHeader {
+    uint8_t  version;         // 0
+    uint8_t  pad;
+    uint16_t length;          // sizeof(RadiotapHeader)
+    uint32_t present;         // RADIOTAP_FLAGS | RADIOTAP_CHANNEL | RADIOTAP_ANT_SIGNAL
+    uint8_t  flags;           // RADIOTAP_F_*
+    uint8_t  pad1;
+    uint16_t freq;            // MHz
+    uint16_t chan_flags;      // RADIOTAP_CHAN_2GHZ
+    int8_t   signal;          // dBm
+    uint8_t  pad2;
+} STRUCT_PACKED;
+
+static inline void radiotap_init(RadiotapHeader *rt, uint32_t channel, int8_t signal, uint8_t flags) {
+    memset(rt, 0, sizeof(RadiotapHeader));
+    rt->length = sizeof(RadiotapHeader);
+    rt->present = RADIOTAP_FLAGS | RADIOTAP_CHANNEL | RADIOTAP_ANT_SIGNAL;
+    rt->flags = flags;
+    rt->freq = (14u == channel) ? 2484u : 2407u + 5u * channel;
+    rt->chan_flags = RADIOTAP_CHAN_2GHZ;
+    rt->signal = signal;
+}
+
+static inline uint32_t radiotap_channel(const RadiotapHeader *rt) {
+    return (2484u == rt->freq) ? 14u : (rt->freq - 2407u) / 5u;
+}
+
+/*
+   Device records
+
+   serial_task sends its own records in the PCAP stream, framed as an 802.11
+   Vendor Specific Action frame from k_telemetry_addr. Wireshark shows them as
+   such. esp32shark.py with --telemetry_log takes them out of the stream and
+   logs them. The subtype after the OUI selects the body.
+   All values little endian.
+ */
+#define TELEMETRY_CATEGORY      (127)     // Vendor Specific Action
+#define TELEMETRY_SUBTYPE       (1)       // Telemetry
+#define LATENCY_SUBTYPE         (2)       // LatencyReport
+#define SURVEY_SUBTYPE          (3)       // SurveyReport
+#define CONFIG_SUBTYPE          (4)       // ConfigReport
+#define TRIGGER_SUBTYPE         (5)       // TriggerReport
+const uint8_t k_telemetry_oui[3]  = { 0x02u, 0x57u, 0x50u };
+const uint8_t k_telemetry_addr[6] = { 0x02u, 0x57u, 0x50u, 0x00u, 0x00u, 0x01u };
+
+struct VendorFrame {
+    uint16_t fctl;            // Management, Action
+    uint16_t duration;
+    uint8_t  addr1[6];
+    uint8_t  addr2[6];
+    uint8_t  addr3[6];
+    uint16_t seqctl;
+    uint8_t  category;        // TELEMETRY_CATEGORY
+    uint8_t  oui[3];          // k_telemetry_oui
+    uint8_t  subtype;         // selects the body that follows
+} STRUCT_PACKED;
+
+/*
+   Telemetry, sent every 'Y' milliseconds. Counters marked "interval" cover
+   the time since the previous record, the others are totals or current
+   values.
+ */
+#define TELEMETRY_VERSION       (1)
+
+struct Telemetry {
+    uint8_t  version;         // TELEMETRY_VERSION
+    uint8_t  channel;
+    uint16_t length;          // sizeof(Telemetry)
+    uint32_t seq;
+    uint32_t interval_ms;
+
+    // ChannelStats of the current channel, interval
+    uint32_t total;
+    uint32_t mgmt;
+    uint32_t ctrl;
+    uint32_t data;
+    uint32_t error;
+    uint32_t dropped;
+    uint32_t full;
+    uint32_t bytes;
+
+    // Packet ring, then raw ring
+    uint32_t ring_used;
+    uint32_t ring_high_water;
+    uint32_t ring_full;
+    uint32_t raw_used;
+    uint32_t raw_high_water;
+    uint32_t raw_full;
+
+    // Memory
+    uint32_t heap_free;       // internal
+    uint32_t heap_largest;
+    uint32_t heap_min;
+    uint32_t psram_free;
+    uint32_t auth_cache_used;
+    uint32_t auth_cache_size;
+    uint32_t stack_serial;    // bytes never used, SerialTask
+    uint32_t stack_filter;    //   and FilterTask
+
+    // USB writes, interval
+    uint32_t writes;
+    uint32_t write_bytes;
+    uint32_t stall_us;        // time writeWait() waited on a full TX buffer
+
+    // High priority lane, totals
+    uint32_t prio_used;
+    uint32_t prio_high_water;
+    uint32_t prio_spilled;    // high priority records put in the packet ring
+    uint32_t high_dropped;
+    uint32_t best_dropped;
+
+    // Overload ladder. Also sent when the level changes. Data frame counts
+    // since then scale back up by 2^sample_shift.
+    uint8_t  overload_level;
+    uint8_t  sample_shift;
+    uint16_t pressure;        // percent
+    uint32_t drain_Bps;       // measured USB drain rate
+    uint32_t truncated;       // totals
+    uint32_t sampled_out;
+    uint32_t ctrl_dropped;
+
+    // Block compression, interval
+    uint32_t lz_in;           // bytes before
+    uint32_t lz_out;          //   and after, block headers included
+    uint32_t lz_cycles;       // CPU cycles spent packing
+
+    // Channel hopping, totals, see HopStats. While hopping, the counts at
+    // the top are for all channels and "channel" is 0.
+    uint32_t hops;
+    uint32_t retune_fail;
+    uint32_t retune_us;       // time in esp_wifi_set_channel()
+    uint32_t retune_max_us;
+    uint32_t retune_lost;     // estimated, frames not heard while retuning
+    uint32_t stale;           // heard on the old channel after a retune
+} STRUCT_PACKED;
+
+/*
+   LatencyReport, sent when the host asks with an ENQ while streaming. The
+   histograms start over after each report and after each 'P'.
+ */
+#define LATENCY_VERSION         (1)
+
+struct LatencyReport {
+    uint8_t  version;         // LATENCY_VERSION
+    uint8_t  buckets;         // k_histogram_buckets
+    uint16_t length;          // sizeof(LatencyReport)
+    uint32_t seq;
+    Histogram residency;      // capture to dequeue by serial_task
+    Histogram write;          // each write to the USB CDC driver
+    Histogram end_to_end;     // capture to USB write, oldest frame of each write
+} STRUCT_PACKED;
+
+/*
+   SurveyReport, statistics only operation, selected by the host with 'V<ms>'
+   for one session. No frames are forwarded. Every 'V' milliseconds a report
+   with one SurveyChannel for each channel of the hop list, or the one
+   channel, follows. Counts cover the time since the previous report.
+ */
+#define SURVEY_VERSION          (1)
+
+struct SurveyChannel {
+    uint8_t  channel;
+    uint8_t  pad;
+    uint16_t dwell_ms;        // per round now, all hop list entries of the channel
+    uint32_t listen_ms;       // time spent on the channel
+    uint32_t frames;
+    uint32_t bytes;
+    uint32_t mgmt;
+    uint32_t ctrl;
+    uint32_t data;
+    uint32_t error;           // receive errors, not in mgmt/ctrl/data
+} STRUCT_PACKED;
+
+struct SurveyReport {
+    uint8_t  version;         // SURVEY_VERSION
+    uint8_t  count;           // SurveyChannel entries that follow
+    uint16_t length;          // sizeof(SurveyReport), without the entries
+    uint32_t seq;
+    uint32_t interval_ms;
+    uint32_t rounds;          // hop rounds, total
+} STRUCT_PACKED;
+
+/*
+   ConfigReport, one for each CONFIG_MSG_SET the host sends while streaming,
+   see Binary configuration. With "err" ESP_OK the settings were applied:
+   records before this one were captured with the old settings, records after
+   it with the new ones. Otherwise nothing changed, "tag" and "offset" are
+   as in a ConfigNak. The settings after are reported either way.
+ */
+#define CONFIG_REPORT_VERSION   (1)
+
+struct ConfigReport {
+    uint8_t  version;         // CONFIG_REPORT_VERSION
+    uint8_t  channel;         // 0 while hopping
+    uint16_t length;          // sizeof(ConfigReport)
+    uint32_t seq;             // SETs while streaming, this session
+    int32_t  err;             // esp_err_t
+    uint8_t  tag;
+    uint8_t  reserved;
+    uint16_t offset;
+    uint32_t filter;          // wifi_promiscuous_filter_t mask
+    uint32_t custom;          // k_filter_custom_* bits
+    uint16_t watch_macs;
+    uint16_t watch_ouis;
+    uint16_t bpf_insns;
+    uint8_t  mcastlen;
+    uint8_t  filter_stage;    // 1, custom filters run in filter_task
+    uint32_t paused_us;       // capture stopped while the change waited and applied
+} STRUCT_PACKED;
+
+/*
+   Trigger capture, selected by the host with one or more 'E' for one
+   session. Frames are held back in the history ring instead of sent. A frame
+   that matches a TriggerDef fires it: the held frames of the last 'K'
+   milliseconds go out, then a TriggerReport and the frame, then 'k'
+   milliseconds of live capture. A match in that time starts it again.
+   Held frames not sent are "saved_bytes", 802.11 bytes.
+ */
+#define TRIGGER_MGMT            (1)       // value, Management frame subtype
+#define TRIGGER_REASON          (2)       //   reason code of a Deauthentication or Disassociation
+#define TRIGGER_EAPOL           (3)       //   EAPOL-Key message 1 to 4 of the 4-way handshake, 0 any
+#define TRIGGER_F_WATCHED       (0x01)    // only frames to or from the watch list, 'U' and 'u'
+constexpr size_t k_trigger_max = 8;       // TriggerDef entries
+constexpr uint32_t k_trigger_pre_ms = 2000u;
+constexpr uint32_t k_trigger_post_ms = 2000u;
+
+struct TriggerDef {           // 'E', kind | flags << 8 | value << 16
+    uint8_t  kind;            // TRIGGER_*
+    uint8_t  flags;           // TRIGGER_F_*
+    uint16_t value;
+} STRUCT_PACKED;
+
+#define TRIGGER_REPORT_VERSION  (1)
+
+struct TriggerReport {
+    uint8_t  version;         // TRIGGER_REPORT_VERSION
+    uint8_t  index;           // of the TriggerDef that matched
+    uint16_t length;          // sizeof(TriggerReport)
+    uint32_t seq;             // triggers fired, total
+    TriggerDef trigger;
+    uint32_t pre_frames;      // held frames just sent
+    uint32_t pre_bytes;
+    uint32_t held;            // frames held back, total
+    uint64_t saved_bytes;     // total
+} STRUCT_PACKED;
+
+/*
+   Compact format, selected by the host with 'Z1' for one session
+
+   The file header is the PCAP File Header with PCAP_COMPACT_MAGIC. Each
+   record is then:
+
+     tag              uint8_t, COMPACT_TAG_*
+     time delta       zigzag varint, microseconds since the previous record
+     capture_length   varint, 1 or 2 bytes
+     extra length     varint, packet_length - capture_length, with
+                      COMPACT_TAG_ORIG_LEN
+     frame            capture_length bytes before address substitution
+
+   Varints are 7 bits per byte, low bits first, 0x80 set on all but the
+   last. The first 1 to 3 addresses of the 802.11 header, as many as the
+   frame type has and the capture holds (ACK and CTS 1, other Control 2,
+   Management and Data 3), go through a table of k_compact_mac_slots
+   addresses. The slot is compact_mac_slot() of the address. When the slot
+   holds the address, only the slot number is sent and COMPACT_TAG_ADDR(n)
+   is set. Otherwise the 6 bytes are sent and both ends store them in the
+   slot. The table and the time start at zero with the file header.
+   With PCAP_LINK_TYPE_802_11_RADIOTAP, a RadiotapHeader as radiotap_init()
+   makes it is sent as 3 bytes, channel, signal and flags, with
+   COMPACT_TAG_RADIOTAP. Other radiotap headers are part of the frame.
+   Addresses are those of the 802.11 header after it.
+   esp32shark.py turns the stream back into PCAP 2.4.
+ */
+#define PCAP_COMPACT_MAGIC            0x57504331  // "WPC1"
+#define COMPACT_TAG_ADDR(n)           (1u << (n))
+#define COMPACT_TAG_ORIG_LEN          (0x08u)
+#define COMPACT_TAG_RADIOTAP          (0x10u)
+constexpr size_t k_compact_mac_slots = 256u;
+constexpr size_t k_compact_overhead = 1u + 10u + 2u + 3u;  // Most bytes added to a record
+
+/*
+   Block compression, selected by the host with 'z1' for one session
+
+   Everything sent after the host dialog, the PCAP File Header included, is
+   a series of blocks, each an LzBlockHeader and then:
+
+     packed_len == 0  raw_len bytes, as is
+     otherwise        packed_len bytes of an LZ4 block, raw_len bytes when
+                      unpacked
+
+   An LZ4 block may copy from up to CONFIG_WIFIPCAP_LZ_WINDOW bytes before
+   it, across blocks, the ones sent as is included.
+ */
+struct LzBlockHeader {
+    uint16_t raw_len;
+    uint16_t packed_len;
+} STRUCT_PACKED;
+
+/*
+   pcapng, selected by the host with 'N<ms>' for one session
+   https://datatracker.ietf.org/doc/draft-ietf-opsawg-pcapng/
+
+   A Section Header Block starts the stream. An Interface Description Block
+   follows the first time a channel shows up; interface ids count up in
+   that order. Records are Enhanced Packet Blocks with epb_flags, the frame
+   behind a RadiotapHeader, link type PCAP_LINK_TYPE_802_11_RADIOTAP. Every
+   'N' milliseconds each interface gets an Interface Statistics Block with
+   the counts of its channel since its IDB:
+
+     isb_ifrecv   frames heard
+     isb_ifdrop   frames lost on the device, rings full
+     isb_osdrop   frames the overload ladder dropped on purpose
+ */
+#define PCAPNG_SHB_TYPE               0x0A0D0D0Au
+#define PCAPNG_IDB_TYPE               0x00000001u
+#define PCAPNG_ISB_TYPE               0x00000005u
+#define PCAPNG_EPB_TYPE               0x00000006u
+#define PCAPNG_BYTE_ORDER_MAGIC       0x1A2B3C4Du
+#define PCAPNG_OPT_ENDOFOPT           (0)
+#define PCAPNG_OPT_SHB_USERAPPL       (4)
+#define PCAPNG_OPT_IF_NAME            (2)
+#define PCAPNG_OPT_IF_DESCRIPTION     (3)
+#define PCAPNG_OPT_IF_FCSLEN          (13)
+#define PCAPNG_OPT_EPB_FLAGS          (2)
+#define PCAPNG_OPT_ISB_IFRECV         (4)
+#define PCAPNG_OPT_ISB_IFDROP         (5)
+#define PCAPNG_OPT_ISB_OSDROP         (7)
+#define PCAPNG_EPB_INBOUND            (0x00000001u)
+#define PCAPNG_EPB_FCSLEN(n)          ((uint32_t)(n) << 5)
+
+struct PcapngOption {
+    uint16_t code;
+    uint16_t length;          // value bytes, padded to 4 after
+} STRUCT_PACKED;
+
+struct PcapngEpb {
+    uint32_t type;            // PCAPNG_EPB_TYPE
+    uint32_t length;          // whole block, repeated at its end
+    uint32_t interface_id;
+    uint32_t ts_high;         // microseconds
+    uint32_t ts_low;
+    uint32_t capture_length;
+    uint32_t packet_length;
+} STRUCT_PACKED;
+
+struct PcapngIsb {
+    uint32_t type;            // PCAPNG_ISB_TYPE
+    uint32_t length;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    PcapngOption ifrecv_opt;
+    uint64_t ifrecv;
+    PcapngOption ifdrop_opt;
+    uint64_t ifdrop;
+    PcapngOption osdrop_opt;
+    uint64_t osdrop;
+    PcapngOption end_opt;
+    uint32_t length_end;
+} STRUCT_PACKED;
+
+// EPB bytes around the frame, epb_flags and the end of options included
+constexpr size_t k_pcapng_epb_overhead = sizeof(PcapngEpb) + 3u + 2u * sizeof(PcapngOption) + 2u * sizeof(uint32_t);
+
+/*
+   Framed transport, selected by the host with 'R<ms>' for one session
+
+   Everything sent after the host dialog goes out as frames:
+
+     FrameHeader, "length" bytes of payload, CRC-32 of both
+
+   Every frame starts with FRAME_SYNC. A reader that lost its place looks for
+   the next one and takes the first frame whose CRC checks out. "seq" counts
+   the frames of all channels, a gap is frames lost. Channels:
+
+     FRAME_CHANNEL_PCAP       the stream any other session would get, PCAP,
+                              pcapng, compact or block compressed, in pieces
+                              of whole records or blocks
+     FRAME_CHANNEL_TELEMETRY  one device record, PCAP header, RadiotapHeader
+                              and VendorFrame, whatever the stream format
+     FRAME_CHANNEL_LOG        one line of ESP_LOG output
+     FRAME_CHANNEL_CONTROL    a FrameSync, every 'R' milliseconds
+
+   Right before each FrameSync the compact encoder and block compressor
+   start over. A reader that lost a frame of those picks up after it.
+ */
+#define FRAME_SYNC                    0xC35AA53Cu
+#define FRAME_CHANNEL_PCAP            (1u)
+#define FRAME_CHANNEL_TELEMETRY       (2u)
+#define FRAME_CHANNEL_LOG             (3u)
+#define FRAME_CHANNEL_CONTROL         (4u)
+
+struct FrameHeader {
+    uint32_t sync;
+    uint16_t length;          // of the payload
+    uint8_t channel;
+    uint8_t reserved;
+    uint32_t seq;
+} STRUCT_PACKED;
+
+struct FrameSync {
+    uint32_t interval_ms;
+    uint32_t log_lost;        // log lines that found no room, this session
+} STRUCT_PACKED;
+
+constexpr size_t k_frame_overhead = sizeof(FrameHeader) + sizeof(uint32_t);
+
+/*
+   Binary configuration, in place of the text dialog
+
+   A device that takes it says "<<SerialPcap config N>>", N the
+   CONFIG_VERSION, on the line before "<<SerialPcap>>". A host that answers
+   with CONFIG_MAGIC instead of text gets the binary dialog. Messages both
+   ways are:
+
+     ConfigMsgHeader, "length" bytes of payload, CRC-32 of both
+
+     host                            device
+     CONFIG_MSG_HELLO  ConfigHello   CONFIG_MSG_HELLO  ConfigHello, the
+                                                       version, largest
+                                                       payload and tags known
+     CONFIG_MSG_SET    ConfigTlv...  CONFIG_MSG_ACK, settings applied, or
+                                     CONFIG_MSG_NAK    ConfigNak
+
+   A SET with a bad CRC is NAKed with ESP_ERR_INVALID_CRC and may be sent
+   again. Any other NAK ends the dialog. After the ACK, the settings are
+   printed and "<<PASSTHROUGH>>" follows as in the text dialog.
+
+   While streaming, the host may send another SET, nothing else. It may hold
+   the tags in k_config_live_tags, the channel and the filters. The device
+   stops capture, waits for the rings to drain, applies the whole SET or
+   none of it and captures again. The answer is a ConfigReport in the
+   stream, not an ACK or NAK. A new channel or SDK filter stops hopping.
+
+   Tag values, little endian. A tag may repeat, the first watch list tag of
+   a SET replaces the list.
+
+     CONFIG_TAG_CHANNEL         uint8_t
+     CONFIG_TAG_FILTER          uint32_t, wifi_promiscuous_filter_t mask << 16
+                                | ctrl filter mask, 'F' and 'f'
+     CONFIG_TAG_CUSTOM          uint32_t, k_filter_custom_* bits, 'S'
+     CONFIG_TAG_WATCH_MAC       MacAddr, none or more
+     CONFIG_TAG_WATCH_OUI       3 bytes, none or more
+     CONFIG_TAG_MULTICAST       0, 1, 3 or 6 bytes of address, 1 for any
+     CONFIG_TAG_SNAPLEN         ConfigSnaplen, one or more, 'T' and 't'
+     CONFIG_TAG_BPF             BpfInsn, none to remove the program
+     CONFIG_TAG_TIME            ConfigTime, host GMT, 'G' and 'g'
+     CONFIG_TAG_HOP             ConfigHop, one or more, 'H' and 'h'
+     CONFIG_TAG_TRIGGER         TriggerDef, none to remove them, 'E'.
+                                ESP_ERR_NOT_SUPPORTED without a history ring
+     CONFIG_TAG_PRINT           nothing, print the settings after the ACK, 'P'
+     others                     uint32_t, as the letter given
+ */
+#define CONFIG_MAGIC                  0x57C5u  // 0xC5 first, never text
+#define CONFIG_VERSION                (1u)
+#define CONFIG_MSG_HELLO              (1u)
+#define CONFIG_MSG_SET                (2u)
+#define CONFIG_MSG_ACK                (3u)
+#define CONFIG_MSG_NAK                (4u)
+
+#define CONFIG_TAG_CHANNEL            (1u)
+#define CONFIG_TAG_FILTER             (2u)
+#define CONFIG_TAG_CUSTOM             (3u)
+#define CONFIG_TAG_WATCH_MAC          (4u)
+#define CONFIG_TAG_WATCH_OUI          (5u)
+#define CONFIG_TAG_MULTICAST          (6u)
+#define CONFIG_TAG_SNAPLEN            (7u)
+#define CONFIG_TAG_BPF                (8u)
+#define CONFIG_TAG_FILTER_STAGE       (9u)   // 'D'
+#define CONFIG_TAG_BEACON_REFRESH     (10u)  // 'B'
+#define CONFIG_TAG_BATCH_BYTES        (11u)  // 'W'
+#define CONFIG_TAG_BATCH_LATENCY      (12u)  // 'L'
+#define CONFIG_TAG_TELEMETRY          (13u)  // 'Y'
+#define CONFIG_TAG_OVERLOAD           (14u)  // 'O'
+#define CONFIG_TAG_HOP                (15u)
+#define CONFIG_TAG_HOP_FLOOR          (16u)  // 'A'
+#define CONFIG_TAG_SURVEY             (17u)  // 'V'
+#define CONFIG_TAG_PCAPNG             (18u)  // 'N'
+#define CONFIG_TAG_FRAMED             (19u)  // 'R'
+#define CONFIG_TAG_COMPACT            (20u)  // 'Z'
+#define CONFIG_TAG_COMPRESS           (21u)  // 'z'
+#define CONFIG_TAG_TIME               (22u)
+#define CONFIG_TAG_PRINT              (23u)
+#define CONFIG_TAG_HISTORY            (24u)  // 'J'
+#define CONFIG_TAG_HISTORY_KBYTES     (25u)  // 'j'
+#define CONFIG_TAG_TRIGGER            (26u)
+#define CONFIG_TAG_TRIGGER_PRE        (27u)  // 'K'
+#define CONFIG_TAG_TRIGGER_POST       (28u)  // 'k'
+#define CONFIG_TAG_LAST               CONFIG_TAG_TRIGGER_POST
+
+struct ConfigMsgHeader {
+    uint16_t magic;           // CONFIG_MAGIC
+    uint8_t type;
+    uint8_t version;          // CONFIG_VERSION
+    uint16_t length;          // of the payload
+} STRUCT_PACKED;
+
+struct ConfigHello {
+    uint16_t version;
+    uint16_t max_length;      // largest SET payload, 0 from the host
+    uint32_t tags;            // bit n set, CONFIG_TAG n is known. 0 from the host
+} STRUCT_PACKED;
+
+struct ConfigNak {
+    uint8_t tag;              // 0, the message as a whole
+    uint8_t reserved;
+    uint16_t offset;          // of the tag in the payload
+    int32_t err;              // esp_err_t
+} STRUCT_PACKED;
+
+struct ConfigTlv {
+    uint8_t tag;
+    uint16_t length;          // of the value that follows
+} STRUCT_PACKED;
+
+struct ConfigSnaplen {
+    uint16_t key;             // as 'T', (type << 4) | subtype, or 0x100 | type
+    uint16_t length;
+} STRUCT_PACKED;
+
+struct ConfigTime {
+    uint32_t seconds;
+    uint32_t microseconds;
+} STRUCT_PACKED;
+
+struct ConfigHop {
+    uint8_t channel;
+    uint8_t reserved[3];
+    uint32_t dwell_ms;
+} STRUCT_PACKED;
+
+static inline uint8_t compact_mac_slot(const uint8_t *mac) {
+    const uint32_t key = ((uint32_t)mac[0] << 8 | mac[1])
+                       ^ ((uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | (uint32_t)mac[4] << 8 | mac[5]);
+    return (uint8_t)((key * 2654435761u) >> 24);  // Knuth multiplicative hash
+}
+
 
 esp_err_t serial_pcap_start(SERIAL_INF* pcapSerial, bool init_custom_filter);
 
+esp_err_t serial_pcap_sd_start(const char *dir);
+
 esp_err_t serial_pcap_cb(void *recv_buf, wifi_promiscuous_pkt_type_t type);
 
 void serial_pcap_notifyDtrRts(bool dtr, bool rts);
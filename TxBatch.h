@@ -0,0 +1,141 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef TXBATCH_H
+#define TXBATCH_H
+/*
+  TxBatch - Write batching. Packets are copied into one buffer and handed to
+  the USB CDC driver with a single write. A 14 byte ACK no longer costs a
+  full write call. The batch is written when the byte budget, "limit", is
+  reached, or from serial_task when the queue runs dry and the oldest record
+  has waited "latency_ms", see tx_batch_deadline().
+
+  Writes and the clock go through TxBatchIo. On the device that is
+  batch_write() and millis(). For extras/batch_bench.cpp, a counting sink and
+  a simulated clock.
+*/
+#include <stdint.h>
+#include <string.h>
+#include "Histogram.h"
+
+struct TxBatchIo {
+    void *ctx;
+    bool (*write)(void *ctx, const void *data, size_t len);  // the batch, or a record on its own
+    uint32_t (*now_ms)(void);
+    uint32_t (*now_us)(void);     // low 32 bits, as rx_ctrl.timestamp
+};
+
+struct TxBatch {
+    TxBatchIo io;
+    uint8_t *frame;          // FrameHeader, then "buf", then room for the CRC
+    uint8_t *buf;
+    uint32_t size;           // CONFIG_WIFIPCAP_BATCH_SIZE
+    uint32_t len;            // bytes waiting to be written
+    uint32_t records;        // records waiting to be written
+    uint32_t first_ms;       // now_ms() when the first waiting record was added
+    uint32_t limit;          // byte budget, write when reached
+    uint32_t latency_ms;     // time budget, write when reached
+    bool whole;              // framed, a record over the budget still goes in the batch
+    Histogram *end_to_end;   // capture to write, NULL for none
+
+    // Statistics
+    uint32_t writes;         // write calls for packet data
+    uint32_t sent;           // records written
+    uint64_t bytes;          // bytes written
+    uint64_t stall_us;       // write time spent on a full TX buffer
+    uint32_t first_rx_us;    // capture time of the oldest frame waiting
+    bool first_rx;           //   valid
+};
+
+static inline void tx_batch_reset(TxBatch *batch) {
+    batch->len = 0;
+    batch->records = 0;
+    batch->first_rx = false;
+}
+
+// Microseconds from capture time "rx_us" till now
+static inline uint32_t tx_batch_since(const TxBatch *batch, uint32_t rx_us) {
+    const int32_t us = batch->io.now_us() - rx_us;
+    return (0 < us) ? us : 0;
+}
+
+static inline bool tx_batch_flush(TxBatch *batch) {
+    if (0 == batch->len) return true;
+    bool success = batch->io.write(batch->io.ctx, batch->buf, batch->len);
+    if (success) {
+        batch->writes++;
+        batch->sent += batch->records;
+        batch->bytes += batch->len;
+        if (batch->first_rx && batch->end_to_end) histogram_add(batch->end_to_end, tx_batch_since(batch, batch->first_rx_us));
+    }
+    tx_batch_reset(batch);
+    return success;
+}
+
+static inline bool tx_batch_append(TxBatch *batch, const void *data, const size_t len) {
+    if (batch->len + len > batch->limit) {
+        if (! tx_batch_flush(batch)) return false;
+        if (len >= batch->limit && ! batch->whole) {
+            // Does not fit in the budget, write it on its own
+            bool success = batch->io.write(batch->io.ctx, data, len);
+            if (success) {
+                batch->writes++;
+                batch->sent++;
+                batch->bytes += len;
+            }
+            return success;
+        }
+    }
+    if (0 == batch->len) batch->first_ms = batch->io.now_ms();
+    memcpy(&batch->buf[batch->len], data, len);
+    batch->len += len;
+    batch->records++;
+    // Full. Framed, a record over the budget also ends up here, on its own
+    if (batch->len >= batch->limit) return tx_batch_flush(batch);
+    return true;
+}
+
+/*
+  After appending a frame captured at "rx_us", rx_ctrl.timestamp, for the end
+  to end latency.
+*/
+static inline void tx_batch_mark(TxBatch *batch, uint32_t rx_us) {
+    if (0 == batch->len) {
+        // Too big for the batch, it was written on its own
+        if (batch->end_to_end) histogram_add(batch->end_to_end, tx_batch_since(batch, rx_us));
+    } else
+    if (! batch->first_rx) {
+        batch->first_rx = true;
+        batch->first_rx_us = rx_us;
+    }
+}
+
+/*
+  Flush if the oldest record in the batch has used up the latency budget.
+  Returns milliseconds left before a flush is due, "idle_ms" when nothing
+  waits.
+*/
+static inline uint32_t tx_batch_deadline(TxBatch *batch, uint32_t idle_ms, bool& success) {
+    success = true;
+    if (0 == batch->len) return idle_ms;
+    uint32_t age = batch->io.now_ms() - batch->first_ms;
+    if (age >= batch->latency_ms) {
+        success = tx_batch_flush(batch);
+        return idle_ms;
+    }
+    return batch->latency_ms - age;
+}
+
+#endif // TXBATCH_H
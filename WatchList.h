@@ -0,0 +1,136 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef WATCHLIST_H
+#define WATCHLIST_H
+/*
+  WatchList - the set of MAC addresses and OUIs the address filter keeps
+
+  Two fixed size open addressed hash sets. MAC addresses are held as 48 bit
+  keys in a uint64_t, OUIs as 24 bit keys in a uint32_t. A key of 0 marks an
+  empty slot, so the stored key has a marker bit set above the address bits.
+  A lookup is a hash and usually one whole word compare.
+
+  There is no remove, only clear. Loading is limited to 3/4 of the slots to
+  keep probe sequences short.
+*/
+#include "KConfig.h"
+#include "WiFiPcap.h"
+
+static_assert(0 == (CONFIG_WIFIPCAP_WATCH_MAC_SIZE & (CONFIG_WIFIPCAP_WATCH_MAC_SIZE - 1)),
+    "CONFIG_WIFIPCAP_WATCH_MAC_SIZE must be a power of 2");
+static_assert(0 == (CONFIG_WIFIPCAP_WATCH_OUI_SIZE & (CONFIG_WIFIPCAP_WATCH_OUI_SIZE - 1)),
+    "CONFIG_WIFIPCAP_WATCH_OUI_SIZE must be a power of 2");
+
+constexpr uint64_t k_watch_mac_used = (1ull << 48);
+constexpr uint32_t k_watch_oui_used = (1u << 24);
+
+struct WatchList {
+    uint64_t mac[CONFIG_WIFIPCAP_WATCH_MAC_SIZE];
+    uint32_t oui[CONFIG_WIFIPCAP_WATCH_OUI_SIZE];
+    uint32_t mac_count;
+    uint32_t oui_count;
+};
+
+static inline uint64_t watch_mac_key(const MacAddr *addr) {
+    uint64_t key = 0;
+    memcpy(&key, addr->mac, sizeof(MacAddr));   // Little endian, mac[0] in the low byte
+    return key | k_watch_mac_used;
+}
+
+static inline uint32_t watch_oui_key(const MacAddr *addr) {
+    return ((uint32_t)addr->mac[0] | (uint32_t)addr->mac[1] << 8 | (uint32_t)addr->mac[2] << 16) | k_watch_oui_used;
+}
+
+static inline uint32_t watch_hash(uint32_t x) {
+    return (x * 2654435761u) >> 16;   // Knuth multiplicative hash
+}
+
+static inline void watch_list_clear(WatchList *wl) {
+    memset(wl, 0, sizeof(WatchList));
+}
+
+static inline bool watch_list_empty(const WatchList *wl) {
+    return 0 == (wl->mac_count | wl->oui_count);
+}
+
+static inline esp_err_t watch_list_add_mac(WatchList *wl, const MacAddr *addr) {
+    const uint64_t key = watch_mac_key(addr);
+    const uint32_t mask = CONFIG_WIFIPCAP_WATCH_MAC_SIZE - 1;
+    for (uint32_t i = watch_hash((uint32_t)(key >> 24) ^ (uint32_t)key);; i++) {
+        uint64_t *slot = &wl->mac[i & mask];
+        if (key == *slot) return ESP_OK;
+        if (0 == *slot) {
+            if (wl->mac_count >= CONFIG_WIFIPCAP_WATCH_MAC_SIZE * 3 / 4) return ESP_ERR_NO_MEM;
+            *slot = key;
+            wl->mac_count++;
+            return ESP_OK;
+        }
+    }
+}
+
+static inline esp_err_t watch_list_add_oui(WatchList *wl, const MacAddr *addr) {
+    const uint32_t key = watch_oui_key(addr);
+    const uint32_t mask = CONFIG_WIFIPCAP_WATCH_OUI_SIZE - 1;
+    for (uint32_t i = watch_hash(key);; i++) {
+        uint32_t *slot = &wl->oui[i & mask];
+        if (key == *slot) return ESP_OK;
+        if (0 == *slot) {
+            if (wl->oui_count >= CONFIG_WIFIPCAP_WATCH_OUI_SIZE * 3 / 4) return ESP_ERR_NO_MEM;
+            *slot = key;
+            wl->oui_count++;
+            return ESP_OK;
+        }
+    }
+}
+
+static inline bool watch_list_match(const WatchList *wl, const MacAddr *addr) {
+    if (wl->oui_count) {
+        const uint32_t key = watch_oui_key(addr);
+        const uint32_t mask = CONFIG_WIFIPCAP_WATCH_OUI_SIZE - 1;
+        for (uint32_t i = watch_hash(key);; i++) {
+            const uint32_t slot = wl->oui[i & mask];
+            if (key == slot) return true;
+            if (0 == slot) break;
+        }
+    }
+    if (wl->mac_count) {
+        const uint64_t key = watch_mac_key(addr);
+        const uint32_t mask = CONFIG_WIFIPCAP_WATCH_MAC_SIZE - 1;
+        for (uint32_t i = watch_hash((uint32_t)(key >> 24) ^ (uint32_t)key);; i++) {
+            const uint64_t slot = wl->mac[i & mask];
+            if (key == slot) return true;
+            if (0 == slot) break;
+        }
+    }
+    return false;
+}
+
+/*
+  The addresses of a frame the address filter checks: the receiver and
+  transmitter when they are stations, addr3 when either DS bit is set and
+  addr4 when both are.
+*/
+static inline bool watch_list_match_frame(const WatchList *wl, const WiFiPktHdr *pkt) {
+    if (!pkt->fctl.toDS   && watch_list_match(wl, &pkt->ra)) return true;
+    if (!pkt->fctl.fromDS && watch_list_match(wl, &pkt->ta)) return true;
+    if ((pkt->fctl.toDS || pkt->fctl.fromDS)
+                          && watch_list_match(wl, &pkt->addr3)) return true;
+    if ( pkt->fctl.toDS && pkt->fctl.fromDS
+                          && watch_list_match(wl, &pkt->addr4)) return true;
+    return false;
+}
+
+#endif // WATCHLIST_H
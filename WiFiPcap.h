@@ -50,6 +50,10 @@ constexpr uint8_t maxChannel = CONFIG_WIFIPCAP_CHANNEL_MAX; // Regional value
 constexpr uint32_t k_filter_custom_session = (1<<16);
 constexpr uint32_t k_filter_custom_fcslen = (1<<17);
 constexpr uint32_t k_filter_custom_badpkt = (1<<18);
+// Drop Beacons and Probe Responses that repeat the last one from a BSSID
+constexpr uint32_t k_filter_custom_dedup = (1<<19);
+// Drop exact retransmits, same TA, sequence and fragment number
+constexpr uint32_t k_filter_custom_noretry = (1<<20);
 constexpr uint32_t k_filter_all_known_sdk_bits = (0xFF80007Fu);
 
 //D constexpr size_t k_pass_multicast_count = 16;
@@ -162,10 +166,98 @@ struct WiFiPktHdr {
     };
 } STRUCT_PACKED;
 
+const uint8_t k_llc_snap_hdr[] = { 0xAAu, 0xAAu, 0x03u, 0x00, 0x00, 0x00 };
+
+/*
+  Length of the 802.11 MAC header. For data frames this includes addr4, QoS
+  Control, HT Control and for protected frames the 8 byte CCMP/TKIP header.
+  Everything after this is payload.
+*/
+static inline size_t wifi_header_length(const WiFiPktHdr* const pkt) {
+    if (WLAN_FC_TYPE_CTRL == pkt->fctl.type) {
+        if (WLAN_FC_STYPE_ACK == pkt->fctl.subtype ||
+            WLAN_FC_STYPE_CTS == pkt->fctl.subtype) return offsetof(struct WiFiPktHdr, ta);
+        return offsetof(struct WiFiPktHdr, addr3);
+    }
+    size_t len = offsetof(struct WiFiPktHdr, addr4);
+    if (WLAN_FC_TYPE_DATA == pkt->fctl.type) {
+        if (pkt->fctl.toDS && pkt->fctl.fromDS) len += sizeof(MacAddr);
+        if (0x08u & pkt->fctl.subtype) {
+            len += sizeof(QOS_CNTRL);
+            if (pkt->fctl.order) len += 4;  // HT Control
+        }
+    } else
+    if (pkt->fctl.order) {
+        len += 4;
+    }
+    if (pkt->fctl.protFrame) len += 8;
+    return len;
+}
+
+// Returns the LLC header of an unencrypted EAPOL (802.1X) data frame, else NULL
+static inline const LLC* wifi_eapol(const WiFiPktHdr* const pkt, const size_t caplen) {
+    if (WLAN_FC_TYPE_DATA != pkt->fctl.type || pkt->fctl.protFrame) return NULL;
+    const size_t len = wifi_header_length(pkt);
+    if (caplen <= len + sizeof(LLC)) return NULL;
+    const LLC * const llc = (const LLC*)((uintptr_t)pkt + len);
+    if (k_802_1x_authentication != llc->type) return NULL;
+    if (0 != memcmp(llc, k_llc_snap_hdr, sizeof(k_llc_snap_hdr))) return NULL;
+    return llc;
+}
+
+/*
+  Message 1 to 4 of the 4-way handshake of an EAPOL-Key frame, else 0. M2 and
+  M4 differ by the Secure bit, or for WPA by an empty Key Data field.
+*/
+static inline uint32_t wifi_eapol_key_message(const WiFiPktHdr* const pkt, const size_t caplen) {
+    const LLC* const llc = wifi_eapol(pkt, caplen);
+    if (NULL == llc) return 0;
+    const uint8_t* const eapol = (const uint8_t*)(llc + 1);
+    const size_t len = caplen - ((uintptr_t)eapol - (uintptr_t)pkt);
+    if (7u > len || 3u != eapol[1]) return 0;                 // EAPOL-Key
+    const uint32_t info = (uint32_t)eapol[5] << 8 | eapol[6];  // Key Information, big endian
+    if (0 == (info & 0x0008u)) return 0;                      // Group Key
+    const bool ack = (info & 0x0080u), mic = (info & 0x0100u), secure = (info & 0x0200u);
+    if (ack) return (mic) ? 3 : 1;
+    if (!mic) return 0;
+    if (secure) return 4;
+    return (99u <= len && 0 == (eapol[97] | eapol[98])) ? 4 : 2;
+}
+
 size_t getChannel();
 uint32_t getFilter();
 uint32_t begin_promiscuous(uint32_t c);
 uint32_t begin_promiscuous(uint32_t c, uint32_t filter, uint32_t ctrl_filter);
+void pause_promiscuous(bool pause);
+
+/*
+  Channel hopping, WiFiPcap.ino. The radio steps through a list of channels,
+  staying dwell_ms on each. With a floor, the dwells are shared out again by
+  traffic after each round, see hop_rebalance().
+*/
+constexpr size_t k_hop_max = 32;              // Entries in a hop list
+
+struct HopEntry {
+    uint32_t channel;
+    uint32_t dwell_ms;
+};
+
+struct HopStats {                             // Totals
+    uint32_t hops;                            // Retunes
+    uint32_t fail;                            // esp_wifi_set_channel() errors
+    uint32_t retune_us;                       // Time in esp_wifi_set_channel()
+    uint32_t retune_max_us;
+    uint32_t lost;                            // Frames expected while retuning, estimate
+    uint32_t stale;                           // Frames from the last channel after a retune
+    uint32_t rounds;                          // Passes through the whole list
+};
+
+void hop_start(const HopEntry *list, size_t count, uint32_t floor_ms);
+void hop_stop(void);
+bool hop_active(void);
+void get_hop_stats(HopStats *out);
+size_t get_hop_list(HopEntry *out, size_t max);
+uint64_t get_hop_listen_us(size_t channel);
 void usbCdcEventCallback(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 
 ////////////////////////////////////////////////////////////////////////////////
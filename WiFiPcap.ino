@@ -201,14 +201,17 @@
 #include <nvs_flash.h>
 #include <esp_system.h>
 #include <esp_wifi.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "SerialPcap.h"
 #include "WiFiPcap.h"
 #include "Interlocks.h"
+#include "ChanStats.h"
 using namespace std;
 
 
-#if USE_USB_MSC
+#if USE_USB_MSC || USE_SD_CAPTURE
 #include "usb-msc.h"
 #endif
 
@@ -330,18 +333,69 @@ struct WiFiPSession {
 };
 WiFiPSession __NOINIT_ATTR ws;
 
-struct ChannelStats {
-    uint64_t mgmt  = 0;
-    uint64_t ctrl  = 0;
-    volatile uint64_t dropped = 0;
-    uint64_t full = 0;                  // queue full
-    uint64_t data  = 0;
-    uint64_t error = 0;
-    uint64_t total = 0;
-    volatile uint64_t totalBytes = 0;
-    uint64_t mgmtSubtype[16] = { 0 };
-    uint64_t dataSubtype[16] = { 0 };
-} cs[maxChannel];
+ChanStats cs;
+
+// loop() owned, see get_bps() and get_dropped_count()
+struct ChannelRate {
+    uint64_t totalBytes;
+    uint32_t ms;
+    uint32_t bps;
+} rate[maxChannel];
+
+/*
+  Channel hopping - An esp_timer steps through the hop list. A step only
+  retunes the radio with esp_wifi_set_channel(), promiscuous mode and the
+  filters stay as they are. Any other channel change, begin_promiscuous(),
+  stops it.
+
+  Frames sent while the radio retunes are lost. Their number is estimated from
+  the frame rate seen on the channel during its last dwell.
+
+  With a floor, the dwells adapt to the traffic, see hop_rebalance().
+
+  The timer callback writes "hop", except hop.stats.stale which
+  wifi_promis_cb() writes. All counters are 32 bits, other tasks read whole
+  values.
+
+  hop.lock serializes the callback with hop_start() and hop_stop().
+  esp_timer_stop() does not wait for a callback already running. Holding the
+  lock, hop_stop() knows no callback is past its "running" test, so none
+  retunes after begin_promiscuous() sets ws.channel, and hop_start() rewrites
+  the list with no callback reading it.
+*/
+struct HopDwell {
+    uint64_t total;          // ChannelStats total at the start of the dwell
+    uint64_t bytes;          //   and totalBytes
+    uint32_t start_us;
+    uint32_t fps;            // frames per second during the last dwell
+    uint64_t round_frames;   // this round, for hop_rebalance()
+    uint64_t round_bytes;
+    uint32_t round_us;
+};
+
+struct HopState {
+    esp_timer_handle_t timer;
+    SemaphoreHandle_t lock;
+    volatile bool running;
+    HopEntry list[k_hop_max];
+    size_t count;
+    size_t at;
+    uint32_t floor_ms;       // 0, the dwells stay as given
+    uint32_t round_ms;       // sum of the dwells as given
+    HopDwell dwell[k_hop_max];
+    uint64_t listen_us[maxChannel];
+    uint64_t lost_acc;       // frames x us / s
+    HopStats stats;
+} hop;
+
+// Air time of a frame beyond its bytes, preamble and gaps, in bytes at 1 byte/us
+constexpr uint32_t k_hop_frame_cost = 64;
+
+volatile uint32_t drop_reset_req[maxChannel];
+struct DropBase {
+    uint32_t ack;
+    uint64_t dropped;
+} drop_base[maxChannel];
 
 inline static size_t getChannelIndex() {
     return ws.channel - 1;
@@ -407,53 +461,85 @@ void wifi_promis_cb(void* buf, wifi_promiscuous_pkt_type_t type) {
     CHECK_CORE();   // Core 0
     if (0 == rx_ctrl.channel || maxChannel < rx_ctrl.channel) return;
     const size_t i = (rx_ctrl.channel - 1); //getChannelIndex();
+    if (hop.running && rx_ctrl.channel != ws.channel) hop.stats.stale++;
 
     // Collect some statistics
+    ChannelStats *stats = chan_stats_begin(&cs, i);
     if (rx_ctrl.rx_state) { // 0: no error; others: unpublished error numbers :(
-        cs[i].error++;
+        stats->error++;
     } else
     if (WIFI_PKT_MGMT == type){
-        cs[i].mgmt++;
-        cs[i].mgmtSubtype[wh->fctl.subtype]++;
+        stats->mgmt++;
+        stats->mgmtSubtype[wh->fctl.subtype]++;
     } else
     if (WIFI_PKT_DATA == type){
-        cs[i].data++;
-        cs[i].dataSubtype[wh->fctl.subtype]++;
+        stats->data++;
+        stats->dataSubtype[wh->fctl.subtype]++;
     } else
     if (WIFI_PKT_CTRL == type){
-          cs[i].ctrl++;
+          stats->ctrl++;
     }
-    cs[i].total++;
-    cs[i].totalBytes += rx_ctrl.sig_len;
+    stats->total++;
+    stats->totalBytes += rx_ctrl.sig_len;
+    chan_stats_end(&cs, i);
 
     // Queue a copy of packet for Wireshark
     int ret = serial_pcap_cb(buf, type);
     if (ESP_OK == ret) return;
 
+    stats = chan_stats_begin(&cs, i);
     if (ESP_ERR_NO_MEM == ret) {
-        cs[i].dropped++;
+        stats->dropped++;
     } else
     if (ESP_ERR_TIMEOUT == ret) {
-        cs[i].full++;
-        cs[i].dropped++;
+        stats->full++;
+        stats->dropped++;
     } else
     if (ESP_ERR_INVALID_STATE == ret) {
-        cs[i].dropped++;
+        stats->dropped++;
     }
+    chan_stats_end(&cs, i);
 }
 #pragma GCC pop_options
 
+// Any task - The displayed drop count starts over from the next snapshot.
 void reset_dropped_count(void) {
-    cs[getChannelIndex()].dropped = 0;
+    const size_t i = getChannelIndex();
+    drop_reset_req[i] = drop_reset_req[i] + 1;
+}
+
+// Any task - Consistent snapshot of the counters, for the host.
+void get_channel_stats(size_t channel, ChannelStats *out) {
+    chan_stats_snapshot(&cs, channel - 1, out);
+}
+
+// loop() - Drops since the last reset_dropped_count()
+[[maybe_unused]]
+static uint64_t get_dropped_count(size_t i, const ChannelStats *stats) {
+    const uint32_t req = drop_reset_req[i];
+    if (req != drop_base[i].ack) {
+        drop_base[i].ack = req;
+        drop_base[i].dropped = stats->dropped;
+    }
+    return stats->dropped - drop_base[i].dropped;
 }
 
+/*
+  loop() - Bits per second received on channel index "i" since the previous
+  call for the same channel. Taken from the difference of two snapshots, the
+  counters are not reset.
+*/
 [[maybe_unused]]
-uint32_t get_bps() {
-    uint64_t bps = cs[getChannelIndex()].totalBytes;
-    cs[getChannelIndex()].totalBytes = 0;
-    bps *= 8u;
-    bps /= 60u;
-    return (bps < UINT32_MAX) ? bps : UINT32_MAX;
+static uint32_t get_bps(size_t i, const ChannelStats *stats) {
+    const uint32_t now = millis();
+    const uint32_t ms = now - rate[i].ms;
+    if (rate[i].ms && ms) {
+        const uint64_t bps = (stats->totalBytes - rate[i].totalBytes) * 8000u / ms;
+        rate[i].bps = (bps < UINT32_MAX) ? bps : UINT32_MAX;
+    }
+    rate[i].totalBytes = stats->totalBytes;
+    rate[i].ms = (now) ? now : 1;
+    return rate[i].bps;
 }
 
 // Wraps around channel number
@@ -472,10 +558,175 @@ static void end_promiscuous() {
     ESP_ERROR_CHECK(esp_wifi_set_promiscuous(false));
 }
 
+// Any task - Stop or restart wifi_promis_cb() calls. The channel, the filters
+// and hopping stay as they are.
+void pause_promiscuous(bool pause) {
+    ESP_ERROR_CHECK(esp_wifi_set_promiscuous(!pause));
+}
+
+// hop timer - Start the dwell on list entry "at"
+static void hop_enter(size_t at) {
+    const HopEntry *e = &hop.list[at];
+    const uint32_t start = (uint32_t)esp_timer_get_time();
+    const esp_err_t err = esp_wifi_set_channel(e->channel, WIFI_SECOND_CHAN_NONE);
+    const uint32_t now = (uint32_t)esp_timer_get_time();
+    if (ESP_OK == err) {
+        const uint32_t us = now - start;
+        ws.channel = e->channel;
+        hop.stats.hops++;
+        hop.stats.retune_us += us;
+        if (us > hop.stats.retune_max_us) hop.stats.retune_max_us = us;
+        hop.lost_acc += (uint64_t)hop.dwell[at].fps * us;
+        hop.stats.lost = hop.lost_acc / 1000000u;
+    } else {
+        hop.stats.fail++;
+    }
+
+    ChannelStats stats;
+    get_channel_stats(e->channel, &stats);
+    hop.dwell[at].total = stats.total;
+    hop.dwell[at].bytes = stats.totalBytes;
+    hop.dwell[at].start_us = now;
+    esp_timer_start_once(hop.timer, (uint64_t)e->dwell_ms * 1000u);
+}
+
+/*
+  hop timer - At the end of a round, share the round time out again. Each
+  entry gets floor_ms, the rest goes by the air time seen on the channel per
+  second listened, bytes plus k_hop_frame_cost per frame. Half the change is
+  applied per round, so one busy moment does not take over.
+*/
+static void hop_rebalance(void) {
+    uint64_t score[k_hop_max];
+    uint64_t sum = 0;
+    for (size_t i = 0; i < hop.count; i++) {
+        HopDwell *d = &hop.dwell[i];
+        const uint64_t air = d->round_bytes + (uint64_t)k_hop_frame_cost * d->round_frames;
+        score[i] = (d->round_us) ? air * 1000u / d->round_us : 0;   // per ms
+        sum += score[i];
+        d->round_frames = d->round_bytes = d->round_us = 0;
+    }
+    const uint32_t floor_total = hop.floor_ms * hop.count;
+    const uint32_t spare = (hop.round_ms > floor_total) ? hop.round_ms - floor_total : 0;
+    for (size_t i = 0; i < hop.count; i++) {
+        const uint32_t target = hop.floor_ms + (uint32_t)((sum) ? spare * score[i] / sum : spare / hop.count);
+        hop.list[i].dwell_ms = std::max(hop.floor_ms, (hop.list[i].dwell_ms + target + 1u) / 2u);
+    }
+}
+
+static void hop_timer_cb([[maybe_unused]] void *arg) {
+    xSemaphoreTake(hop.lock, portMAX_DELAY);
+    if (!hop.running) {
+        xSemaphoreGive(hop.lock);
+        return;
+    }
+    HopDwell *d = &hop.dwell[hop.at];
+    const uint32_t channel = hop.list[hop.at].channel;
+    ChannelStats stats;
+    get_channel_stats(channel, &stats);
+    const uint32_t us = (uint32_t)esp_timer_get_time() - d->start_us;
+    const uint64_t frames = stats.total - d->total;
+    if (us) d->fps = frames * 1000000u / us;
+    d->round_frames += frames;
+    d->round_bytes += stats.totalBytes - d->bytes;
+    d->round_us += us;
+    hop.listen_us[channel - 1] += us;
+
+    hop.at = (hop.at + 1u < hop.count) ? hop.at + 1u : 0;
+    if (0 == hop.at) {
+        hop.stats.rounds++;
+        if (hop.floor_ms) hop_rebalance();
+    }
+    hop_enter(hop.at);
+    xSemaphoreGive(hop.lock);
+}
+
+// With hop.lock held
+static void hop_halt(void) {
+    hop.running = false;
+    esp_timer_stop(hop.timer);
+}
+
+// Any task - Hop through "list", needs two entries or more. A "floor_ms"
+// other than 0 lets the dwells follow the traffic.
+void hop_start(const HopEntry *list, size_t count, uint32_t floor_ms) {
+    if (2 > count) {
+        hop_stop();
+        return;
+    }
+    if (NULL == hop.lock) {
+        hop.lock = xSemaphoreCreateMutex();
+        if (NULL == hop.lock) return;
+    }
+    if (NULL == hop.timer) {
+        const esp_timer_create_args_t args = {
+            .callback = &hop_timer_cb,
+            .arg = NULL,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "hop",
+            .skip_unhandled_events = true,
+        };
+        if (ESP_OK != esp_timer_create(&args, &hop.timer)) return;
+    }
+    xSemaphoreTake(hop.lock, portMAX_DELAY);
+    hop_halt();
+    hop.count = std::min(count, k_hop_max);
+    memcpy(hop.list, list, hop.count * sizeof(HopEntry));
+    memset(hop.dwell, 0, sizeof(hop.dwell));
+    hop.floor_ms = floor_ms;
+    hop.round_ms = 0;
+    for (size_t i = 0; i < hop.count; i++) hop.round_ms += hop.list[i].dwell_ms;
+    hop.at = 0;
+    hop.running = true;
+    hop_enter(0);
+    xSemaphoreGive(hop.lock);
+}
+
+// Any task - Stay on the current channel. No hop happens after it returns.
+void hop_stop(void) {
+    // No lock yet, hop_start() never got as far as the timer
+    if (NULL == hop.lock || NULL == hop.timer) return;
+    xSemaphoreTake(hop.lock, portMAX_DELAY);
+    hop_halt();
+    xSemaphoreGive(hop.lock);
+}
+
+bool hop_active(void) {
+    return hop.running;
+}
+
+void get_hop_stats(HopStats *out) {
+    memcpy(out, &hop.stats, sizeof(HopStats));
+}
+
+// Any task - The hop list with the dwells in use now, 0 when not hopping
+size_t get_hop_list(HopEntry *out, size_t max) {
+    if (!hop.running) return 0;
+    xSemaphoreTake(hop.lock, portMAX_DELAY);
+    const size_t count = (hop.running) ? std::min(hop.count, max) : 0;
+    for (size_t i = 0; i < count; i++) {
+        out[i].channel = hop.list[i].channel;
+        out[i].dwell_ms = hop.list[i].dwell_ms;
+    }
+    xSemaphoreGive(hop.lock);
+    return count;
+}
+
+// Any task - Total time spent on "channel" while hopping, ends of dwells
+uint64_t get_hop_listen_us(size_t channel) {
+    const volatile uint64_t *p = &hop.listen_us[channel - 1];
+    uint64_t us;
+    do {
+        us = *p;
+    } while (us != *p);       // torn 64 bit read, the timer task moved it
+    return us;
+}
+
 uint32_t begin_promiscuous(void) {
     // Interface must be started and idled when changing channel
     // ESP_ERROR_CHECK(esp_wifi_set_promiscuous(false));
     //? What does ESP_ERROR_CHECK go on non-debug builds?
+    hop_stop();
     end_promiscuous();
     ESP_ERROR_CHECK(esp_wifi_set_channel(ws.channel, WIFI_SECOND_CHAN_NONE));
     ESP_ERROR_CHECK(esp_wifi_set_promiscuous_filter(&ws.filter));
@@ -894,6 +1145,16 @@ void setup() {
     if (ESP_OK != serial_pcap_start(&USBSerial, init_custom_filter)) {
         ESP_LOGE(TAG, "Serial pcap failed to start.");
     }
+#if USE_SD_CAPTURE
+    // Headless capture, while no host is connected
+    if (ESP_OK == sd_init()) {
+        esp_err_t err_sd = serial_pcap_sd_start(MOUNT_POINT "/pcap");
+        if (ESP_OK != err_sd) {
+            ESP_LOGE(TAG, "TF card capture failed to start: %s", esp_err_to_name(err_sd));
+            sd_end();
+        }
+    }
+#endif
 
     delay(100);
     printMemory(HWSerial);
@@ -1002,7 +1263,9 @@ void updateScreen(size_t chView) {
     if (0 != screen.select) return;
 
     size_t i = chView - 1;
-    uint32_t bps = get_bps();
+    ChannelStats stats;
+    chan_stats_snapshot(&cs, i, &stats);
+    uint32_t bps = get_bps(i, &stats) / 10u;     // kbps with two decimals
     static size_t last_i = SIZE_MAX;
     // const int32_t tweak = -2;
     const uint8_t font = GFXFF;
@@ -1047,16 +1310,16 @@ void updateScreen(size_t chView) {
     }
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    tft.drawString(String(cs[i].mgmt), xPos, yPos, font);
+    tft.drawString(String(stats.mgmt), xPos, yPos, font);
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    tft.drawString(String(cs[i].ctrl), xPos, yPos, font);
+    tft.drawString(String(stats.ctrl), xPos, yPos, font);
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    tft.drawString(String(cs[i].data), xPos, yPos, font);
+    tft.drawString(String(stats.data), xPos, yPos, font);
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    // tft.drawString(String(cs[i].error), xPos, yPos, font);
+    // tft.drawString(String(stats.error), xPos, yPos, font);
     {
         char buf[32];
         snprintf(buf, sizeof(buf), "%04u", bps);
@@ -1070,10 +1333,10 @@ void updateScreen(size_t chView) {
     }
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    tft.drawString(String(cs[i].dropped), xPos, yPos, font);
+    tft.drawString(String(get_dropped_count(i, &stats)), xPos, yPos, font);
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    tft.drawString(String(cs[i].total), xPos, yPos, font);
+    tft.drawString(String(stats.total), xPos, yPos, font);
     last_i = i;
 }
 
@@ -1082,7 +1345,9 @@ void updateScreen(const size_t chView) {
     if (0 != screen.select) return;
 
     size_t i = chView - 1;
-    uint32_t bps = get_bps();
+    ChannelStats stats;
+    chan_stats_snapshot(&cs, i, &stats);
+    uint32_t bps = get_bps(i, &stats) / 10u;     // kbps with two decimals
     const uint8_t font = GFXFF;
     const int32_t lines = 3;
     tft.setFreeFont(FSS9);
@@ -1128,11 +1393,11 @@ void updateScreen(const size_t chView) {
     }
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    tft.drawString(String(cs[i].dropped), xPos, yPos, font);
+    tft.drawString(String(get_dropped_count(i, &stats)), xPos, yPos, font);
     // tft.drawString(String(not_the_one), xPos, yPos, font);
     yPos += h + gap;
     tft.fillRect(xStart, yPos, (kMaxX - xStart) - sz, h, TFT_BLACK);
-    // tft.drawString(String(cs[i].total), xPos, yPos, font);
+    // tft.drawString(String(stats.total), xPos, yPos, font);
     {
         char buf[32];
         snprintf(buf, sizeof(buf), "%04u", bps);
@@ -87,6 +87,16 @@ Build with Tools selection:              (defines set)
 #define USE_USB_MSC 0
 #endif
 
+// Headless capture, PCAP files on the TFCard while no host is connected.
+// The card belongs to the capture, not to MSC.
+#ifndef USE_SD_CAPTURE
+#define USE_SD_CAPTURE 0
+#endif
+
+#if USE_SD_CAPTURE && USE_USB_MSC
+#error "USE_SD_CAPTURE and USE_USB_MSC both want the TFCard"
+#endif
+
 // Default pre-filter if never set by python script. Intended to capture a WiFi
 // session without all the noise of AP beacons, etc. Othewise, the code defaults
 // to receive all packets.
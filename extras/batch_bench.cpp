@@ -0,0 +1,162 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+/*
+  batch_bench - TxBatch.h on a PC, write calls per packet
+
+  A synthetic stream of PCAP records, on a simulated clock, goes through
+  tx_batch_append() and tx_batch_deadline() as serial_task drives them.
+  Each write the batch makes is a real write() to "--out", /dev/null by
+  default, and is counted. Every traffic mix runs twice: once with a budget
+  of 0 bytes, every record written on its own as before batching, and once
+  with the batch budgets.
+
+  Build and run from this folder:
+
+    g++ -std=gnu++17 -O2 -I.. batch_bench.cpp -o batch_bench
+    ./batch_bench --records 200000
+
+  Options, defaults in brackets:
+    --records N         records per run [200000]
+    --limit BYTES       batch byte budget [2048], CONFIG_WIFIPCAP_SERIAL_TX_BUFFER_SIZE
+    --latency MS        batch time budget [20], CONFIG_WIFIPCAP_BATCH_LATENCY_MS
+    --out PATH          where writes go [/dev/null]
+*/
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "TxBatch.h"
+
+static uint64_t sim_us;     // the simulated clock
+
+static uint32_t sim_now_ms(void) {
+    return sim_us / 1000u;
+}
+
+static uint32_t sim_now_us(void) {
+    return sim_us;
+}
+
+struct Sink {
+    int fd;
+    uint64_t calls;
+};
+
+static bool sink_write(void *ctx, const void *data, size_t len) {
+    Sink *sink = (Sink *)ctx;
+    sink->calls++;
+    return (ssize_t)len == write(sink->fd, data, len);
+}
+
+/*
+  A traffic mix: "small_pct" of frames are 14 to 40 bytes, ACK, CTS and the
+  like, the rest 100 to 1500. Frames come every "gap_us" on average,
+  exponentially distributed.
+*/
+struct Mix {
+    const char *name;
+    uint32_t small_pct;
+    uint32_t gap_us;
+};
+
+struct Result {
+    uint64_t writes;
+    uint64_t bytes;
+    double wall_ms;
+    Histogram latency;
+};
+
+static Result run(const Mix &mix, uint32_t records, uint32_t limit, uint32_t latency_ms, int fd) {
+    Result r = {};
+    Sink sink = { fd, 0 };
+    std::vector<uint8_t> buf(4 * 1024 + 2048);
+    static TxBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.io = { &sink, sink_write, sim_now_ms, sim_now_us };
+    batch.buf = buf.data();
+    batch.size = buf.size();
+    batch.limit = limit;
+    batch.latency_ms = latency_ms;
+    batch.end_to_end = &r.latency;
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<uint32_t> pct(0, 99), small_len(14, 40), big_len(100, 1500);
+    std::exponential_distribution<double> gap(1.0 / mix.gap_us);
+    uint8_t rec[16 + 1500] = {};
+    sim_us = 1000000u;
+    const auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t n = 0; n < records; n++) {
+        const uint64_t at = sim_us + (uint64_t)gap(rng);
+        // The queue is dry till "at", serial_task sleeps to the deadline
+        if (batch.len && (uint64_t)(batch.first_ms + batch.latency_ms) * 1000u <= at) {
+            sim_us = std::max<uint64_t>(sim_us, (uint64_t)(batch.first_ms + batch.latency_ms) * 1000u);
+            bool success;
+            tx_batch_deadline(&batch, 100, success);
+        }
+        sim_us = at;
+        const uint32_t len = (pct(rng) < mix.small_pct) ? small_len(rng) : big_len(rng);
+        const uint32_t hdr[4] = { (uint32_t)(at / 1000000u), (uint32_t)(at % 1000000u), len, len };
+        memcpy(rec, hdr, sizeof(hdr));
+        if (! tx_batch_append(&batch, rec, sizeof(hdr) + len)) break;
+        tx_batch_mark(&batch, (uint32_t)at);
+        r.bytes += sizeof(hdr) + len;
+    }
+    tx_batch_flush(&batch);
+    r.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    r.writes = sink.calls;
+    return r;
+}
+
+static const char *arg(int argc, char **argv, const char *name, const char *dflt) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], name)) return argv[i + 1];
+    }
+    return dflt;
+}
+
+int main(int argc, char **argv) {
+    const uint32_t records = strtoul(arg(argc, argv, "--records", "200000"), NULL, 0);
+    const uint32_t limit = strtoul(arg(argc, argv, "--limit", "2048"), NULL, 0);
+    const uint32_t latency_ms = strtoul(arg(argc, argv, "--latency", "20"), NULL, 0);
+    const char *out = arg(argc, argv, "--out", "/dev/null");
+    const int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (0 > fd) {
+        perror(out);
+        return 1;
+    }
+
+    const Mix mixes[] = {
+        { "acks, busy",   90,   50 },
+        { "mixed, busy",  50,  100 },
+        { "bulk, busy",   10,  200 },
+        { "mixed, quiet", 50, 5000 },
+    };
+    printf("%-14s %-8s %9s %10s %10s %9s %10s %10s\n",
+        "mix", "budget", "records", "writes", "writes/pkt", "B/write", "wall ms", "lat avg us");
+    for (const Mix &mix : mixes) {
+        for (const uint32_t budget : { 0u, limit }) {
+            const Result r = run(mix, records, budget, latency_ms, fd);
+            printf("%-14s %-8u %9u %10llu %10.3f %9.0f %10.1f %10.0f\n", mix.name, budget, records,
+                (unsigned long long)r.writes, (double)r.writes / records, (double)r.bytes / r.writes, r.wall_ms,
+                (r.latency.count) ? (double)r.latency.sum_us / r.latency.count : 0.0);
+        }
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,544 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+/*
+  bpf_conformance - Bpf.cpp on a PC, checked against libpcap
+
+  Without libpcap:
+    Every 16 bit opcode is put in a small program. bpf_validate() must
+    accept it exactly when bpf_filter() has a case for it. Then a list of
+    programs that must be rejected, "ret x", "neg" with the X bit, "ld #k"
+    with a size, a store with mode bits, scratch memory out of range and the
+    like, and some that must pass.
+
+  With libpcap, loaded at run time:
+    Capture filters are compiled for linktype 105 the way esp32shark.py
+    --bpf does. bpf_validate() must accept each program and bpf_filter()
+    must return what pcap_offline_filter() returns, for every frame. The
+    frames are built here, beacons, probes, ACK, RTS, data with and without
+    QoS, EAPOL, IPv4, IPv6, ARP, 4 address and protected frames, each also
+    cut short to every length, and any sample captures given with --pcap.
+    Linktype 105 files are used as they are, 127 after removing the
+    radiotap header.
+
+    Then random programs. Any program bpf_validate() accepts, libpcap's
+    bpf_validate() must accept too, and both bpf_filter()s must agree on
+    it for every frame.
+
+  Build and run from this folder:
+
+    g++ -std=gnu++17 -O2 -I.. -include host_shim.h bpf_conformance.cpp ../Bpf.cpp -ldl -o bpf_conformance
+    ./bpf_conformance --pcap sample.pcap
+
+  Options, defaults in brackets:
+    --pcap FILE         sample capture, may be given more than once
+    --fuzz N            random programs [20000]
+    --seed N            [1]
+    --libpcap PATH      libpcap to load [libpcap.so.1, libpcap.so.0.8, libpcap.so]
+
+  Exits with 1 on any disagreement. Without libpcap, the comparison is
+  reported as skipped.
+*/
+#include "host_shim.h"
+#include <cstdarg>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include "Bpf.h"
+
+// The libpcap names used, as in pcap/pcap.h and pcap/bpf.h
+struct pcap_bpf_program {
+    unsigned int bf_len;
+    BpfInsn *bf_insns;        // struct bpf_insn, the same layout
+};
+
+struct pcap_pkthdr {
+    struct timeval ts;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct LibPcap {
+    void *dl;
+    void *(*open_dead)(int linktype, int snaplen);
+    void *(*open_offline)(const char *fname, char *errbuf);
+    int (*compile)(void *p, pcap_bpf_program *fp, const char *str, int optimize, uint32_t netmask);
+    int (*offline_filter)(const pcap_bpf_program *fp, const pcap_pkthdr *h, const uint8_t *pkt);
+    void (*freecode)(pcap_bpf_program *fp);
+    char *(*geterr)(void *p);
+    int (*datalink)(void *p);
+    int (*next_ex)(void *p, pcap_pkthdr **h, const uint8_t **pkt);
+    void (*close)(void *p);
+    int (*validate)(const BpfInsn *f, int len);
+    unsigned int (*filter)(const BpfInsn *pc, const uint8_t *pkt, unsigned int wirelen, unsigned int buflen);
+};
+
+static const uint32_t k_linktype_802_11 = 105;
+static const uint32_t k_linktype_radiotap = 127;
+static const uint32_t k_netmask_unknown = 0xFFFFFFFFu;     // PCAP_NETMASK_UNKNOWN
+
+static bool libpcap_load(LibPcap *lib, const char *path) {
+    const char *names[] = { path, "libpcap.so.1", "libpcap.so.0.8", "libpcap.so", "libpcap.dylib" };
+    memset(lib, 0, sizeof(*lib));
+    for (const char *name : names) {
+        if (name && NULL != (lib->dl = dlopen(name, RTLD_NOW))) break;
+        if (path) return false;
+    }
+    if (NULL == lib->dl) return false;
+
+    bool found = true;
+    auto sym = [&](auto &fn, const char *name) {
+        fn = (std::remove_reference_t<decltype(fn)>)dlsym(lib->dl, name);
+        if (NULL == fn) {
+            fprintf(stderr, "libpcap: no %s\n", name);
+            found = false;
+        }
+    };
+    sym(lib->open_dead, "pcap_open_dead");
+    sym(lib->open_offline, "pcap_open_offline");
+    sym(lib->compile, "pcap_compile");
+    sym(lib->offline_filter, "pcap_offline_filter");
+    sym(lib->freecode, "pcap_freecode");
+    sym(lib->geterr, "pcap_geterr");
+    sym(lib->datalink, "pcap_datalink");
+    sym(lib->next_ex, "pcap_next_ex");
+    sym(lib->close, "pcap_close");
+    sym(lib->validate, "bpf_validate");
+    sym(lib->filter, "bpf_filter");
+    return found;
+}
+
+// A frame, "buf" bytes of it captured from "wire"
+struct Frame {
+    std::string name;
+    std::vector<uint8_t> data;
+    uint32_t wire;
+};
+
+static std::vector<Frame> frames;
+
+static void add(const char *name, std::initializer_list<std::vector<uint8_t>> parts) {
+    Frame f;
+    f.name = name;
+    for (const auto &part : parts) f.data.insert(f.data.end(), part.begin(), part.end());
+    f.wire = f.data.size();
+    frames.push_back(f);
+}
+
+static const std::vector<uint8_t> k_watched = { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55 };
+static const std::vector<uint8_t> k_bssid   = { 0x02, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE };
+static const std::vector<uint8_t> k_station = { 0x3C, 0x71, 0xBF, 0x01, 0x02, 0x03 };
+static const std::vector<uint8_t> k_bcast   = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static const std::vector<uint8_t> k_seq     = { 0x10, 0x00 };
+static const std::vector<uint8_t> k_dur     = { 0x3A, 0x01 };
+
+static void build_frames(void) {
+    const std::vector<uint8_t> beacon_body = {
+        0, 1, 2, 3, 4, 5, 6, 7,  0x64, 0x00,  0x11, 0x04,        // timestamp, interval, capability
+        0x00, 0x04, 'l', 'a', 'b', '1',                          // SSID
+        0x01, 0x04, 0x82, 0x84, 0x8B, 0x96,                      // rates
+        0x03, 0x01, 0x06 };                                      // channel
+    const std::vector<uint8_t> llc_ipv4 = { 0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, 0x08, 0x00 };
+    const std::vector<uint8_t> ipv4_tcp = {
+        0x45, 0x00, 0x00, 0x28, 0x12, 0x34, 0x40, 0x00, 0x40, 0x06, 0x00, 0x00,
+        192, 168, 4, 2,  93, 184, 216, 34,
+        0xC0, 0x01, 0x00, 0x50, 0, 0, 0, 1, 0, 0, 0, 0, 0x50, 0x02, 0x72, 0x10, 0, 0, 0, 0 };
+    const std::vector<uint8_t> llc_eapol = { 0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, 0x88, 0x8E,
+        0x02, 0x03, 0x00, 0x5F, 0x02, 0x00, 0x8A };
+    const std::vector<uint8_t> llc_arp = { 0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, 0x08, 0x06,
+        0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01, 0x3C, 0x71, 0xBF, 0x01, 0x02, 0x03,
+        192, 168, 4, 2, 0, 0, 0, 0, 0, 0, 192, 168, 4, 1 };
+    const std::vector<uint8_t> llc_ipv6_udp = { 0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, 0x86, 0xDD,
+        0x60, 0x00, 0x00, 0x00, 0x00, 0x10, 0x11, 0x40,
+        0xFE, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+        0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFB,
+        0x14, 0xE9, 0x14, 0xE9, 0x00, 0x10, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    add("beacon",       { { 0x80, 0x00, 0x00, 0x00 }, k_bcast, k_bssid, k_bssid, k_seq, beacon_body });
+    add("beacon, watched bssid", { { 0x80, 0x00, 0x00, 0x00 }, k_bcast, k_watched, k_watched, k_seq, beacon_body });
+    add("probe request", { { 0x40, 0x00, 0x00, 0x00 }, k_bcast, k_watched, k_bcast, k_seq, { 0x00, 0x00, 0x01, 0x02, 0x82, 0x84 } });
+    add("probe response", { { 0x50, 0x00 }, k_dur, k_watched, k_bssid, k_bssid, k_seq, beacon_body });
+    add("auth",         { { 0xB0, 0x00 }, k_dur, k_bssid, k_station, k_bssid, k_seq, { 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 } });
+    add("deauth",       { { 0xC0, 0x00 }, k_dur, k_station, k_bssid, k_bssid, k_seq, { 0x07, 0x00 } });
+    add("ack",          { { 0xD4, 0x00, 0x00, 0x00 }, k_watched });
+    add("cts",          { { 0xC4, 0x00 }, k_dur, k_station });
+    add("rts",          { { 0xB4, 0x00 }, k_dur, k_bssid, k_watched });
+    add("block ack",    { { 0x94, 0x00 }, k_dur, k_bssid, k_station, { 0x04, 0x00, 0x10, 0x00, 0xFF, 0xFF, 0, 0, 0, 0, 0, 0 } });
+    add("data to ds, ipv4 tcp", { { 0x08, 0x01 }, k_dur, k_bssid, k_watched, k_bcast, k_seq, llc_ipv4, ipv4_tcp });
+    add("data from ds, arp", { { 0x08, 0x02 }, k_dur, k_station, k_bssid, k_watched, k_seq, llc_arp });
+    add("qos data, eapol", { { 0x88, 0x02 }, k_dur, k_station, k_bssid, k_bssid, k_seq, { 0x06, 0x00 }, llc_eapol });
+    add("qos data to ds, ipv6 udp", { { 0x88, 0x01 }, k_dur, k_bssid, k_station, k_bcast, k_seq, { 0x00, 0x00 }, llc_ipv6_udp });
+    add("data 4 address, arp", { { 0x08, 0x03 }, k_dur, k_bssid, k_station, k_bcast, k_seq, k_watched, llc_arp });
+    add("qos data 4 address, eapol", { { 0x88, 0x03 }, k_dur, k_bssid, k_station, k_bcast, k_seq, k_watched, { 0x00, 0x00 }, llc_eapol });
+    add("protected data", { { 0x08, 0x41 }, k_dur, k_bssid, k_station, k_bcast, k_seq,
+        { 0x01, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0xDE, 0xAD, 0xBE, 0xEF, 0x01, 0x02, 0x03, 0x04 } });
+    add("null",         { { 0x48, 0x01 }, k_dur, k_bssid, k_station, k_bssid, k_seq });
+    add("qos null",     { { 0xC8, 0x01 }, k_dur, k_bssid, k_watched, k_bssid, k_seq, { 0x00, 0x00 } });
+    add("empty",        { });
+
+    // Each cut short at every length, the whole length still on the wire
+    const size_t whole = frames.size();
+    for (size_t i = 0; i < whole; i++) {
+        for (uint32_t len = 0; len < frames[i].data.size(); len++) {
+            Frame f = frames[i];
+            f.name += ", " + std::to_string(len) + " captured";
+            f.data.resize(len);
+            frames.push_back(f);
+        }
+    }
+
+    // And random bytes, with a valid frame control byte half the time
+    std::mt19937 rng(7);
+    for (uint32_t n = 0; n < 200; n++) {
+        Frame f;
+        f.name = "random " + std::to_string(n);
+        f.data.resize(rng() % 120);
+        for (uint8_t &b : f.data) b = rng();
+        if (f.data.size() && (n & 1)) f.data[0] &= 0xFC;
+        f.wire = f.data.size() + rng() % 4;
+        frames.push_back(f);
+    }
+}
+
+static bool load_pcap(const LibPcap &lib, const char *path) {
+    char errbuf[256] = "";
+    void *p = lib.open_offline(path, errbuf);
+    if (NULL == p) {
+        fprintf(stderr, "%s: %s\n", path, errbuf);
+        return false;
+    }
+    const int linktype = lib.datalink(p);
+    if (k_linktype_802_11 != (uint32_t)linktype && k_linktype_radiotap != (uint32_t)linktype) {
+        fprintf(stderr, "%s: linktype %d, only 105 and 127 are used\n", path, linktype);
+        lib.close(p);
+        return false;
+    }
+    pcap_pkthdr *h;
+    const uint8_t *pkt;
+    uint32_t count = 0;
+    while (1 == lib.next_ex(p, &h, &pkt)) {
+        uint32_t skip = 0;
+        if (k_linktype_radiotap == (uint32_t)linktype) {
+            if (4 > h->caplen) continue;
+            skip = pkt[2] | pkt[3] << 8;
+            if (skip > h->caplen || skip > h->len) continue;
+        }
+        Frame f;
+        f.name = std::string(path) + " #" + std::to_string(++count);
+        f.data.assign(pkt + skip, pkt + h->caplen);
+        f.wire = h->len - skip;
+        frames.push_back(f);
+    }
+    lib.close(p);
+    printf("%s: %u frames\n", path, count);
+    return true;
+}
+
+static uint32_t failures;
+
+// Counts a failure, the first 20 are printed with the program
+static void mismatch(const BpfInsn *insn, size_t len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void mismatch(const BpfInsn *insn, size_t len, const char *fmt, ...) {
+    if (20 <= failures++) return;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("  MISMATCH ");
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n   ");
+    for (size_t i = 0; i < len; i++) printf(" {0x%02x,%u,%u,0x%x}", insn[i].code, insn[i].jt, insn[i].jf, insn[i].k);
+    printf("\n");
+}
+
+static uint32_t run(const std::vector<BpfInsn> &prog, const Frame &f) {
+    uint64_t executed = 0;
+    return bpf_filter(prog.data(), prog.size(), f.data.data(), f.wire, f.data.size(), &executed);
+}
+
+/*
+  "code" after "ld #5; ldx #5", then "ret #1". k is 5, 0 for a jump so it
+  goes on to the next instruction.
+*/
+static std::vector<BpfInsn> opcode_program(uint16_t code) {
+    const uint32_t k = (0x05 == (code & 0x07)) ? 0 : 5;
+    return { { 0x00, 0, 0, 5 }, { 0x01, 0, 0, 5 }, { code, 0, 0, k }, { 0x06, 0, 0, 1 } };
+}
+
+/*
+  Whether bpf_filter() has a case for "code". In opcode_program() a handled
+  instruction goes on to "ret #1" or returns 5. An unknown one ends the
+  program with 0 after 3 instructions.
+*/
+static bool interpreter_runs(uint16_t code) {
+    const std::vector<BpfInsn> prog = opcode_program(code);
+    uint8_t pkt[64] = {};
+    uint64_t executed = 0;
+    const uint32_t result = bpf_filter(prog.data(), prog.size(), pkt, sizeof(pkt), sizeof(pkt), &executed);
+    return 0 != result || 4 == executed;
+}
+
+static void check_opcodes(void) {
+    uint32_t accepted = 0, wrong = 0;
+    for (uint32_t code = 0; code <= 0xFFFF; code++) {
+        const std::vector<BpfInsn> prog = opcode_program(code);
+        const bool valid = ESP_OK == bpf_validate(prog.data(), prog.size());
+        accepted += valid;
+        if (valid != interpreter_runs(code)) {
+            if (10 > wrong++) printf("  opcode 0x%04x: validate %s, bpf_filter %s\n", code,
+                (valid) ? "accepts" : "rejects", (valid) ? "has no case" : "runs it");
+        }
+    }
+    failures += wrong;
+    printf("opcodes     %u of 65536 accepted, %u disagree with bpf_filter()\n", accepted, wrong);
+}
+
+struct Case {
+    const char *name;
+    std::vector<BpfInsn> prog;
+    bool valid;
+};
+
+static void check_cases(void) {
+    const BpfInsn ret1 = { 0x06, 0, 0, 1 };
+    const std::vector<Case> cases = {
+        { "ret #1",                     { ret1 }, true },
+        { "ret a",                      { { 0x16, 0, 0, 0 } }, true },
+        { "ret x, 0x0e",                { { 0x0e, 0, 0, 0 } }, false },
+        { "neg with X bit, 0x8c",       { { 0x8c, 0, 0, 0 }, ret1 }, false },
+        { "neg, 0x84",                  { { 0x84, 0, 0, 0 }, ret1 }, true },
+        { "ld #k with size h, 0x08",    { { 0x08, 0, 0, 1 }, ret1 }, false },
+        { "ld #k with size b, 0x10",    { { 0x10, 0, 0, 1 }, ret1 }, false },
+        { "ldx with size h, 0x09",      { { 0x09, 0, 0, 1 }, ret1 }, false },
+        { "ldx abs, 0x21",              { { 0x21, 0, 0, 1 }, ret1 }, false },
+        { "ldx msh size w, 0xa1",       { { 0xa1, 0, 0, 1 }, ret1 }, false },
+        { "st with mode bits, 0x62",    { { 0x62, 0, 0, 1 }, ret1 }, false },
+        { "stx with size bits, 0x0b",   { { 0x0b, 0, 0, 1 }, ret1 }, false },
+        { "st M[15]",                   { { 0x02, 0, 0, 15 }, ret1 }, true },
+        { "st M[16]",                   { { 0x02, 0, 0, 16 }, ret1 }, false },
+        { "ld M[16]",                   { { 0x60, 0, 0, 16 }, ret1 }, false },
+        { "ldx M[16]",                  { { 0x61, 0, 0, 16 }, ret1 }, false },
+        { "div #0",                     { { 0x34, 0, 0, 0 }, ret1 }, false },
+        { "mod #0",                     { { 0x94, 0, 0, 0 }, ret1 }, false },
+        { "div x",                      { { 0x3c, 0, 0, 0 }, ret1 }, true },
+        { "alu op 0xb0",                { { 0xb4, 0, 0, 1 }, ret1 }, false },
+        { "lsh #40",                    { { 0x64, 0, 0, 40 }, ret1 }, true },
+        { "ja to the end",              { { 0x05, 0, 0, 0 }, ret1 }, true },
+        { "ja past the end",            { { 0x05, 0, 0, 1 }, ret1 }, false },
+        { "ja with X bit, 0x0d",        { { 0x0d, 0, 0, 0 }, ret1 }, false },
+        { "jeq jt past the end",        { { 0x15, 1, 0, 0 }, ret1 }, false },
+        { "jeq jf past the end",        { { 0x15, 0, 1, 0 }, ret1 }, false },
+        { "jmp op 0x50",                { { 0x55, 0, 0, 0 }, ret1 }, false },
+        { "tax",                        { { 0x07, 0, 0, 0 }, ret1 }, true },
+        { "misc op 0x08",               { { 0x0f, 0, 0, 0 }, ret1 }, false },
+        { "no ret at the end",          { { 0x00, 0, 0, 1 } }, false },
+        { "empty",                      { }, false },
+        { "too long",                   std::vector<BpfInsn>(CONFIG_WIFIPCAP_BPF_MAX_INSNS + 1, ret1), false },
+        { "longest",                    std::vector<BpfInsn>(CONFIG_WIFIPCAP_BPF_MAX_INSNS, ret1), true },
+    };
+    uint32_t wrong = 0;
+    for (const Case &c : cases) {
+        const bool valid = ESP_OK == bpf_validate(c.prog.data(), c.prog.size());
+        if (valid != c.valid) {
+            printf("  %s: %s, expected %s\n", c.name, (valid) ? "accepted" : "rejected", (c.valid) ? "accepted" : "rejected");
+            wrong++;
+        }
+        // bpf_filter() stops where a torn program would leave, and rejects.
+        // With A == 0 these take the jump out.
+        if (strstr(c.name, "ja past") || strstr(c.name, "jt past") || strstr(c.name, "no ret")) {
+            uint8_t pkt[64] = {};
+            uint64_t executed = 0;
+            const uint32_t result = bpf_filter(c.prog.data(), c.prog.size(), pkt, sizeof(pkt), sizeof(pkt), &executed);
+            if (0 != result) {
+                printf("  %s: ran off the end, returned %u\n", c.name, result);
+                wrong++;
+            }
+        }
+    }
+    failures += wrong;
+    printf("cases       %zu, %u wrong\n", cases.size(), wrong);
+}
+
+static const char *k_filters[] = {
+    "",
+    "type mgmt",
+    "type mgmt subtype beacon",
+    "not type mgmt subtype beacon",
+    "subtype probe-req or subtype probe-resp",
+    "type mgmt and not subtype beacon and wlan addr3 02:aa:bb:cc:dd:ee",
+    "type ctl",
+    "type ctl subtype ack",
+    "subtype rts or subtype cts",
+    "type data",
+    "subtype qos-data",
+    "type data and not subtype null and not subtype qos-null",
+    "wlan addr1 02:11:22:33:44:55",
+    "wlan addr2 02:11:22:33:44:55",
+    "wlan addr3 02:11:22:33:44:55",
+    "wlan addr4 02:11:22:33:44:55",
+    "wlan host 02:11:22:33:44:55",
+    "wlan src 02:11:22:33:44:55",
+    "wlan dst 02:11:22:33:44:55",
+    "wlan ta 02:11:22:33:44:55",
+    "wlan ra 02:11:22:33:44:55",
+    "wlan bssid 02:aa:bb:cc:dd:ee",
+    "dir tods",
+    "dir fromds",
+    "dir dstods",
+    "dir nods",
+    "ether proto 0x888e",
+    "(type mgmt and not subtype beacon and wlan addr3 02:00:00:00:00:01) or ether proto 0x888e",
+    "arp",
+    "ip",
+    "ip6",
+    "tcp port 80",
+    "udp port 5353",
+    "ip host 192.168.4.2",
+    "len > 100",
+    "len <= 24",
+    "greater 60",
+    "less 20",
+    "wlan[0] & 0xfc == 0x80",
+    "wlan[1] & 0x40 != 0",
+    "wlan[4:4] = 0xffffffff",
+    "wlan[len - 1] = 0x8a",
+    "wlan[0] % 3 = 0",
+    "wlan[0] ^ 0x88 = 0",
+    "wlan[0] << 2 > 100",
+    "wlan[1] >> 1 = 1",
+    "wlan[2:2] * 2 / 3 > 100",
+    "wlan[0] + wlan[1] - 1 > 0x80",
+    "wlan[wlan[1] & 3] = 0",
+};
+
+static void check_filters(const LibPcap &lib) {
+    void *p = lib.open_dead(k_linktype_802_11, 65535);
+    uint32_t compiled = 0, skipped = 0, before = failures;
+    for (const char *filter : k_filters) {
+        pcap_bpf_program prog = {};
+        if (0 > lib.compile(p, &prog, filter, 1, k_netmask_unknown)) {
+            printf("  \"%s\" does not compile with this libpcap, %s\n", filter, lib.geterr(p));
+            skipped++;
+            continue;
+        }
+        compiled++;
+        if (ESP_OK != bpf_validate(prog.bf_insns, prog.bf_len)) {
+            mismatch(prog.bf_insns, prog.bf_len, "\"%s\" rejected by bpf_validate()", filter);
+            lib.freecode(&prog);
+            continue;
+        }
+        const std::vector<BpfInsn> insns(prog.bf_insns, prog.bf_insns + prog.bf_len);
+        for (const Frame &f : frames) {
+            const pcap_pkthdr h = { {}, (uint32_t)f.data.size(), f.wire };
+            const uint32_t theirs = lib.offline_filter(&prog, &h, f.data.data());
+            const uint32_t ours = run(insns, f);
+            if (ours != theirs) mismatch(insns.data(), insns.size(), "\"%s\" on %s: %u, libpcap %u", filter, f.name.c_str(), ours, theirs);
+        }
+        lib.freecode(&prog);
+    }
+    lib.close(p);
+    printf("filters     %u compiled, %u skipped, %zu frames, %u mismatches\n", compiled, skipped, frames.size(), failures - before);
+}
+
+/*
+  Random programs from the opcodes bpf_filter() runs, with a few unknown
+  ones mixed in. libpcap's bpf_filter() leaves scratch memory uninitialized,
+  so a prologue stores M[0] to M[3] and memory opcodes use only those.
+*/
+static void check_fuzz(const LibPcap &lib, uint32_t count, uint32_t seed) {
+    static const uint16_t k_codes[] = {
+        0x06, 0x16, 0x20, 0x28, 0x30, 0x40, 0x48, 0x50, 0x80, 0x81, 0x00, 0x01, 0xb1, 0x60, 0x61, 0x02, 0x03,
+        0x05, 0x15, 0x25, 0x35, 0x45, 0x1d, 0x2d, 0x3d, 0x4d,
+        0x04, 0x14, 0x24, 0x34, 0x44, 0x54, 0x64, 0x74, 0x94, 0xa4,
+        0x0c, 0x1c, 0x2c, 0x3c, 0x4c, 0x5c, 0x6c, 0x7c, 0x9c, 0xac, 0x84, 0x07, 0x87 };
+    std::mt19937 rng(seed);
+    uint32_t ours_only = 0, theirs_only = 0, run_count = 0, before = failures;
+    for (uint32_t n = 0; n < count; n++) {
+        std::vector<BpfInsn> prog;
+        for (uint32_t m = 0; m < 4; m++) {
+            prog.push_back({ 0x00, 0, 0, (uint32_t)rng() });
+            prog.push_back({ 0x02, 0, 0, m });
+        }
+        const uint32_t body = 1 + rng() % 24;
+        for (uint32_t i = 0; i < body; i++) {
+            BpfInsn insn;
+            insn.code = (0 == rng() % 32) ? (uint16_t)(rng() & 0xFF) : k_codes[rng() % (sizeof(k_codes) / sizeof(k_codes[0]))];
+            insn.jt = rng() % 4;
+            insn.jf = rng() % 4;
+            switch (rng() % 4) {
+                case 0: insn.k = rng() % 4; break;
+                case 1: insn.k = rng() % 64; break;
+                case 2: insn.k = rng(); break;
+                default: insn.k = rng() % 40; break;
+            }
+            const uint16_t mode = insn.code & 0xe7;
+            if (0x60 == mode || 0x61 == mode || 0x02 == insn.code || 0x03 == insn.code) insn.k &= 3;
+            prog.push_back(insn);
+        }
+        prog.push_back({ (uint16_t)((rng() & 1) ? 0x16 : 0x06), 0, 0, (uint32_t)rng() % 4 });
+
+        const bool ours = ESP_OK == bpf_validate(prog.data(), prog.size());
+        const bool theirs = 0 != lib.validate(prog.data(), prog.size());
+        if (ours && !theirs) {
+            ours_only++;
+            mismatch(prog.data(), prog.size(), "program %u accepted by bpf_validate(), not by libpcap", n);
+        }
+        if (theirs && !ours) theirs_only++;
+        if (!ours || !theirs) continue;
+
+        run_count++;
+        for (const Frame &f : frames) {
+            const uint32_t a = run(prog, f);
+            const uint32_t b = lib.filter(prog.data(), f.data.data(), f.wire, f.data.size());
+            if (a != b) {
+                mismatch(prog.data(), prog.size(), "program %u on %s: %u, libpcap %u", n, f.name.c_str(), a, b);
+                break;
+            }
+        }
+    }
+    printf("fuzz        %u programs, %u run on both, %u only libpcap accepts, %u only we accept, %u mismatches\n",
+        count, run_count, theirs_only, ours_only, failures - before);
+}
+
+static const char *arg(int argc, char **argv, const char *name, const char *dflt) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], name)) return argv[i + 1];
+    }
+    return dflt;
+}
+
+int main(int argc, char **argv) {
+    const uint32_t fuzz = strtoul(arg(argc, argv, "--fuzz", "20000"), NULL, 0);
+    const uint32_t seed = strtoul(arg(argc, argv, "--seed", "1"), NULL, 0);
+
+    check_opcodes();
+    check_cases();
+
+    LibPcap lib;
+    if (! libpcap_load(&lib, arg(argc, argv, "--libpcap", NULL))) {
+        printf("libpcap     not found, comparison SKIPPED\n");
+        return (failures) ? 1 : 0;
+    }
+    build_frames();
+    for (int i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], "--pcap") && ! load_pcap(lib, argv[i + 1])) failures++;
+    }
+    check_filters(lib);
+    check_fuzz(lib, fuzz, seed);
+    printf("%s\n", (failures) ? "FAILED" : "passed");
+    return (failures) ? 1 : 0;
+}
@@ -42,6 +42,13 @@ import signal
 import platform
 import time
 import re
+import ctypes
+import ctypes.util
+import struct
+import csv
+import json
+import zlib
+import select
 # https://stackoverflow.com/a/52809180
 import serial.tools.list_ports
 
@@ -50,6 +57,117 @@ wireshark_path='wireshark'
 wireshark_path_win32=r'C:\Program Files\Wireshark\Wireshark.exe'
 
 serialport = ""
+bpf_max_insns = 256     # CONFIG_WIFIPCAP_BPF_MAX_INSNS in KConfig.h
+
+# Device records, see struct VendorFrame, Telemetry and LatencyReport in SerialPcap.h
+telemetry_oui = b'\x02\x57\x50'
+telemetry_addr = b'\x02\x57\x50\x00\x00\x01'
+telemetry_subtype = 1
+latency_subtype = 2
+telemetry_fields = [
+    'version', 'channel', 'length', 'seq', 'interval_ms',
+    'total', 'mgmt', 'ctrl', 'data', 'error', 'dropped', 'full', 'bytes',
+    'ring_used', 'ring_high_water', 'ring_full', 'raw_used', 'raw_high_water', 'raw_full',
+    'heap_free', 'heap_largest', 'heap_min', 'psram_free', 'auth_cache_used', 'auth_cache_size',
+    'stack_serial', 'stack_filter',
+    'writes', 'write_bytes', 'stall_us',
+    'prio_used', 'prio_high_water', 'prio_spilled', 'high_dropped', 'best_dropped',
+    'overload_level', 'sample_shift', 'pressure', 'drain_Bps', 'truncated', 'sampled_out', 'ctrl_dropped',
+    'lz_in', 'lz_out', 'lz_cycles',
+    'hops', 'retune_fail', 'retune_us', 'retune_max_us', 'retune_lost', 'stale' ]
+telemetry_format = '<BBH' + 'I' * (len(telemetry_fields) - 3 - 16) + 'BBHIIII' + 'III' + 'IIIIII'
+telemetry_offset = 29   # 802.11 header, category, OUI and subtype
+latency_buckets = 24    # k_histogram_buckets in Histogram.h
+latency_histograms = [ 'residency', 'write', 'end_to_end' ]
+latency_format = '<BBHI' + ('IIQ' + 'I' * latency_buckets) * len(latency_histograms)
+survey_subtype = 3
+survey_format = '<BBHIII'   # SurveyReport, then "count" of SurveyChannel
+survey_channel_fields = [ 'channel', 'pad', 'dwell_ms', 'listen_ms', 'frames', 'bytes', 'mgmt', 'ctrl', 'data', 'error' ]
+survey_channel_format = '<BBHIIIIIII'
+config_subtype = 4
+config_report_fields = [ 'version', 'channel', 'length', 'seq', 'err', 'tag', 'reserved', 'offset', 'filter', 'custom', 'watch_macs', 'watch_ouis', 'bpf_insns', 'mcastlen', 'filter_stage', 'paused_us' ]
+config_report_format = '<BBHIiBBHIIHHHBBI'
+trigger_subtype = 5
+trigger_report_fields = [ 'version', 'index', 'length', 'seq', 'kind', 'flags', 'value', 'pre_frames', 'pre_bytes', 'held', 'saved_bytes' ]
+trigger_report_format = '<BBHIBBHIIIQ'
+trigger_kinds = { 'mgmt': 1, 'reason': 2, 'eapol': 3 }     # TRIGGER_* in SerialPcap.h
+trigger_mgmt_names = { 'assoc': 0, 'reassoc': 2, 'probe': 4, 'beacon': 8, 'disassoc': 10, 'auth': 11, 'deauth': 12, 'action': 13 }
+trigger_f_watched = 0x01
+# Compact format, see PCAP_COMPACT_MAGIC in SerialPcap.h
+pcap_magic = 0xA1B2C3D4
+compact_magic = 0x57504331
+compact_tag_orig_len = 0x08
+compact_tag_radiotap = 0x10
+compact_mac_slots = 256
+# Link types, the device uses radiotap while hopping, see RadiotapHeader in SerialPcap.h
+link_type_802_11 = 105
+link_type_radiotap = 127
+radiotap_len = 16
+hop_dwell = 200             # ms, --dwell default
+# pcapng, see PCAPNG_* in SerialPcap.h
+pcapng_shb_type = 0x0A0D0D0A
+pcapng_idb_type = 1
+pcapng_epb_type = 6
+# Framed transport, see FrameHeader in SerialPcap.h
+frame_sync = struct.pack('<I', 0xC35AA53C)
+frame_header_format = '<IHBBI'     # sync, length, channel, reserved, seq
+frame_header_len = 12
+frame_channel_pcap = 1
+frame_channel_telemetry = 2
+frame_channel_log = 3
+frame_channel_control = 4
+frame_sync_format = '<II'          # FrameSync, interval_ms and log_lost
+# Binary configuration, see ConfigMsgHeader in SerialPcap.h
+config_magic = 0x57C5
+config_version = 1
+config_header_format = '<HBBH'     # magic, type, version, length
+config_header_len = 6
+config_msg_hello = 1
+config_msg_set = 2
+config_msg_ack = 3
+config_msg_nak = 4
+config_hello_format = '<HHI'       # version, max_length, tags
+config_nak_format = '<BBHi'        # tag, reserved, offset, err
+config_tag_channel = 1
+config_tag_filter = 2
+config_tag_custom = 3
+config_tag_watch_mac = 4
+config_tag_watch_oui = 5
+config_tag_multicast = 6
+config_tag_snaplen = 7
+config_tag_bpf = 8
+config_tag_filter_stage = 9
+config_tag_beacon_refresh = 10
+config_tag_batch_bytes = 11
+config_tag_batch_latency = 12
+config_tag_telemetry = 13
+config_tag_overload = 14
+config_tag_hop = 15
+config_tag_hop_floor = 16
+config_tag_survey = 17
+config_tag_pcapng = 18
+config_tag_framed = 19
+config_tag_compact = 20
+config_tag_compress = 21
+config_tag_time = 22
+config_tag_print = 23
+config_tag_history = 24
+config_tag_history_kbytes = 25
+config_tag_trigger = 26
+config_tag_trigger_pre = 27
+config_tag_trigger_post = 28
+config_tag_last = config_tag_trigger_post
+serial_timeout = 0.5        # k_serial_timeout in SerialPcap.h
+esp_err_not_supported = 0x106
+esp_err_invalid_crc = 0x109
+# Block compression, see LzBlockHeader in SerialPcap.h and CONFIG_WIFIPCAP_LZ_* in KConfig.h
+lz_window = 4 * 1024
+lz_hash_bits = 11
+lz_min_save_pct = 10
+lz_poor_limit = 8
+lz_rest = 32
+batch_size = 4 * 1024       # CONFIG_WIFIPCAP_BATCH_SIZE
+batch_limit = 2 * 1024      # CONFIG_WIFIPCAP_SERIAL_TX_BUFFER_SIZE, default byte budget
 bpsRate = 9216000
 # bpsRate = 115200
 esp32_name = "WiFiPcap"
@@ -94,6 +212,10 @@ def parseArgs():
 
          {name} -c6 --filter "mgmt|data" --oui "00:DD:00" --multicast
 
+         {name} -c6 --filter "mgmt|data" --mac "02:00:00:00:00:01" --mac "02:00:00:00:00:02" --oui "00:DD:00"
+
+         {name} -c6 --bpf "(type mgmt and not subtype beacon and wlan addr3 02:00:00:00:00:01) or ether proto 0x888e"
+
        These mnemonics represent filter options offered by the ESP32 SDK.
        Join these mnemonics with '|' to construct a FILTER_MASK:
 
@@ -125,6 +247,10 @@ def parseArgs():
          session    Uses logic in callback function to select packets related
                     to AP connections
          fcslen     Experimental, FCS Length include in packet length
+         dedup      Drop Beacons and Probe Responses that repeat the last one
+                    from the same BSSID, see --beacon_refresh
+         noretry    Drop exact retransmits (retry bit, same TA, sequence and
+                    fragment number). The first copy is kept.
 
          0x10000    Hex constant are also supported
 
@@ -139,11 +265,39 @@ def parseArgs():
     parser.add_argument('--port', '-p', required=False, default=None, help=f'Full device path for USB CDC device connected to {esp32_name}.')
     parser.add_argument('--zc', dest='channel', type=int, choices=range(1, 15), required=False, default=None, help=argparse.SUPPRESS)   # debug
     parser.add_argument('--testing', '--test', '-t', action='store_true', default=None, help="Test run - It does everything but start Wireshark.")
-
-
-    group2 = parser.add_mutually_exclusive_group(required=False)
-    group2.add_argument('--unicast', '-u', '--mac', required=False, default=None, help=f'unicast/MAC, 6 bytes of Source or Destination Address of interest expressed in hex and quoted, with "-" or ":" for byte separator')
-    group2.add_argument('--oui', '-o', required=False, default=None, help=f'OUI, first 3 bytes of Source or Destination Address of interest in quotes with "-" or ":" separator')
+    parser.add_argument('--batch_bytes', type=int, required=False, default=None, help=f'Byte budget for coalescing packets into one USB write. 0 writes each packet on its own.')
+    parser.add_argument('--batch_ms', type=int, required=False, default=None, help=f'Longest time, in ms, {esp32_name} holds a partly filled USB write waiting for more packets.')
+    parser.add_argument('--beacon_refresh', type=int, required=False, default=None, help=f'With the "dedup" filter, forward an unchanged Beacon/Probe Response after this many ms. 0 forwards only on change.')
+    parser.add_argument('--bpf', required=False, default=None, help=f'Capture filter in libpcap/Wireshark capture filter syntax, compiled for 802.11 and run on {esp32_name}. Needs libpcap (Npcap on Windows). An empty string "" removes the filter.')
+    parser.add_argument('--filter_stage', choices=['callback', 'task'], required=False, default=None, help=f'Where {esp32_name} runs the custom filters. "callback" filters in the WiFi RX callback, best with very selective filters. "task" only copies packets in the callback and filters on the other core.')
+    parser.add_argument('--telemetry', type=int, required=False, default=None, help=f'{esp32_name} sends a telemetry record every TELEMETRY ms, 0 for off. Wireshark shows them as Vendor Specific Action frames unless --telemetry_log takes them out.')
+    parser.add_argument('--telemetry_log', required=False, default=None, help=f'Take telemetry records out of the stream and log them to this file, JSON lines for a ".json" or ".jsonl" file, otherwise CSV. --telemetry defaults to 1000 ms.')
+    parser.add_argument('--latency_query', type=float, required=False, default=None, help=f'With --telemetry_log, ask {esp32_name} for its latency histograms every LATENCY_QUERY seconds and log them. The histograms start over after each query.')
+    parser.add_argument('--overload', type=int, required=False, default=None, help=f'Packet ring pressure, percent, where {esp32_name} starts to shed load: cut Data frames to headers, then sample Data frames by address pair, then drop Control frames. 0 for off, only drop when full.')
+    parser.add_argument('--hop', required=False, default=None, help=f'{esp32_name} hops through these channels, "CH[:MS],CH[:MS],...", staying MS ms on each, --dwell when omitted. A channel may be listed more than once to visit it more often. Needs 2 or more entries. Frames carry their channel in a radiotap header. eg. --hop 1:400,6,11')
+    parser.add_argument('--adapt', metavar='FLOOR', type=int, required=False, default=None, help=f'With --hop, {esp32_name} shares the round time out again after each round, more to channels with more traffic, never less than FLOOR ms each.')
+    parser.add_argument('--survey', metavar='MS', type=int, required=False, default=None, help=f'Statistics only, no Wireshark. {esp32_name} sends a summary of each channel every MS ms: frames, bytes, type mix and errors, printed here and logged to --telemetry_log when given. Hops all channels when --hop is not given.')
+    parser.add_argument('--dwell', type=int, required=False, default=None, help=f'With --hop, ms to stay on a channel without its own dwell, default {hop_dwell}.')
+    parser.add_argument('--pcapng', metavar='MS', nargs='?', type=int, const=1000, required=False, default=None, help=f'{esp32_name} sends pcapng instead of PCAP 2.4: an interface for each channel and, every MS ms (default 1000), interface statistics with the frames it heard, lost and dropped on purpose. Wireshark shows them in Capture File Properties. Not with --compact.')
+    parser.add_argument('--dialog', choices=[ 'text', 'binary' ], required=False, default=None, help=f'How the options are sent to {esp32_name}. Default binary, when {esp32_name} offers it.')
+    parser.add_argument('--dialog_bench', metavar='RUNS', nargs='?', type=int, const=5, required=False, default=None, help=f'Time from port open to the first packet, text and binary dialog, RUNS times each (default 5), with the other options given. Uses a stand-in for {esp32_name} on a pseudo terminal, no {esp32_name} needed. Not on Windows.')
+    parser.add_argument('--control', action='store_true', required=False, default=None, help=f'While capturing, read changes from the keyboard, one line at a time of --channel, --filter_mask, --filter_good, --filter_all, --filter_session, --unicast, --oui, --no_addr, --multicast, --broadcast, --snaplen, --bpf, --beacon_refresh and --filter_stage options. {esp32_name} applies each line between two records, the capture goes on, and reports back. A new channel or filter mask stops --hop. Not on Windows.')
+    parser.add_argument('--framed', metavar='MS', nargs='?', type=int, const=1000, required=False, default=None, help=f'{esp32_name} sends everything in frames with a sequence number and CRC, its log lines included, and a sync mark every MS ms (default 1000). Lost or damaged data is counted and skipped, capture carries on with the next good frame, with --compact or --compress after the next sync mark.')
+    parser.add_argument('--compact', action='store_true', required=False, default=None, help=f'{esp32_name} sends a compact format, short time and length fields and an address table, expanded back to PCAP here. Saves the most on Control frames.')
+    parser.add_argument('--compact_bench', metavar='PCAP', required=False, default=None, help=f'Report bytes per frame of a recorded 802.11 PCAP file as sent by {esp32_name}, PCAP and compact, by frame type. No {esp32_name} needed.')
+    parser.add_argument('--compress', action='store_true', required=False, default=None, help=f'{esp32_name} packs each USB write with an LZ4 block compressor, unpacked here. Helps most with repeated management frames. Blocks that do not pack are sent as is.')
+    parser.add_argument('--compress_bench', metavar='PCAP', required=False, default=None, help=f'Report how well a recorded 802.11 PCAP file packs with --compress, in --batch_bytes blocks and with --compact when given. No {esp32_name} needed.')
+    parser.add_argument('--history', metavar='SECONDS', nargs='?', type=int, const=30, required=False, default=None, help=f'Replay the frames {esp32_name} kept in PSRAM while no host was connected, the last SECONDS seconds (default 30), ahead of the live capture. Older history is dropped.')
+    parser.add_argument('--history_mb', metavar='MB', type=float, required=False, default=None, help='With --history, replay no more than the newest MB megabytes.')
+    parser.add_argument('--trigger', action='append', required=False, default=None, help=f'{esp32_name} holds frames back until one matches "KIND[=VALUE][@watch]", then sends --trigger_pre ms before it and --trigger_post ms after it. KIND is mgmt=SUBTYPE, a subtype name ({", ".join(trigger_mgmt_names)}), reason=CODE of a Deauthentication or Disassociation, or eapol[=1-4] for a 4-way handshake message. "@watch" limits it to frames to or from --watch addresses. Repeat for more, up to 8. eg. --trigger deauth --trigger eapol=2@watch')
+    parser.add_argument('--trigger_pre', metavar='MS', type=int, required=False, default=None, help='Milliseconds of held frames sent when a trigger fires, default 2000.')
+    parser.add_argument('--trigger_post', metavar='MS', type=int, required=False, default=None, help='Milliseconds of capture sent after a trigger fires, default 2000.')
+    parser.add_argument('--snaplen', action='append', required=False, default=None, help=f'Truncate captured frames by type, "TYPE[.SUBTYPE]=LENGTH". TYPE is mgmt, ctrl, data or 0-2. SUBTYPE is 0-15, all when omitted. LENGTH is bytes, "hdr" for the 802.11 header only, or "full". EAPOL frames are always kept whole. Repeat for more types. eg. --snaplen data=hdr --snaplen mgmt.8=full')
+
+
+    group2 = parser.add_argument_group('address watch list', 'Repeat --unicast and --oui to watch several addresses. The list replaces the one on the device.')
+    group2.add_argument('--unicast', '-u', '--mac', action='append', required=False, default=None, help=f'unicast/MAC, 6 bytes of Source or Destination Address of interest expressed in hex and quoted, with "-" or ":" for byte separator')
+    group2.add_argument('--oui', '-o', action='append', required=False, default=None, help=f'OUI, first 3 bytes of Source or Destination Address of interest in quotes with "-" or ":" separator')
     group2.add_argument('--no_addr', action='store_true', required=False, default=None, help=f'Clear Unicast/OUI filter option')
 
     group3 = parser.add_mutually_exclusive_group(required=False)
@@ -204,7 +358,15 @@ def processFilter(filter_str, filter_good, filter_all, filter_session):
 
     k_filter_custom_badpkt  = (1<<18)       # keep bad packets
 
-    k_filter_custom_mask    = (0x00070000)
+    k_filter_custom_dedup   = (1<<19)       # Internal to WiFiPcap, not an SDK value.
+                                            # Drop Beacons and Probe Responses that repeat
+                                            # the last one from the same BSSID
+
+    k_filter_custom_noretry = (1<<20)       # Internal to WiFiPcap, not an SDK value.
+                                            # Drop exact retransmits, same TA, sequence
+                                            # and fragment number. The first copy is kept.
+
+    k_filter_custom_mask    = (0x001F0000)
 
     k_filter_table = {
         "all":       k_filter_all,              # filter/keep all packets
@@ -234,9 +396,11 @@ def processFilter(filter_str, filter_good, filter_all, filter_session):
         "session":   (k_filter_custom_session | k_filter_mgmt | k_filter_data),   # Capture packets related to an AP connection
         "fcslen":    k_filter_custom_fcslen,    # Experimental - FCS length include in packet length
         "bad":       (k_filter_custom_badpkt | k_filter_fcsfail),    # Bad packets
+        "dedup":     k_filter_custom_dedup,     # Drop repeated Beacons and Probe Responses
+        "noretry":   k_filter_custom_noretry,   # Drop exact retransmits
         "custom_mask": k_filter_custom_mask }
 
-    supported_mnemonics = "all|all_mask|good|mgmt|ctrl|data|misc|mpdu|ampdu|fcsfail|ctrl_mas|wrapper|bar|ba|pspoll|rts|cts|ack|cfend|cfendack|session|fcslen"
+    supported_mnemonics = "all|all_mask|good|mgmt|ctrl|data|misc|mpdu|ampdu|fcsfail|ctrl_mas|wrapper|bar|ba|pspoll|rts|cts|ack|cfend|cfendack|session|fcslen|bad|dedup|noretry"
 
     use_filter = None
     use_custom_filter = None
@@ -311,7 +475,7 @@ def pickPort():
     return serialport
 
 
-def connectESP32(port, channel, filter, unicast, multicast, time_sync):
+def connectESP32(port, channel, filter, unicast, multicast, batch, snaplen, beacon_refresh, bpf, filter_stage, telemetry, overload, hop, adapt, survey, pcapng, framed, compact, compress, history, trigger, time_sync, dialog=None):
     global bpsRate
 
     retry = 3
@@ -342,6 +506,7 @@ def connectESP32(port, channel, filter, unicast, multicast, time_sync):
 
     print(f'[+] Connected to serial port: "{ser.name}"')
 
+    offered = 0         # binary configuration version, 0 for text only
     while True:
         try:
             line = ser.readline()
@@ -351,11 +516,22 @@ def connectESP32(port, channel, filter, unicast, multicast, time_sync):
             print("[!] Serial port connection closed/failed while reading port!")
             return None
 
-        print(f'[>] ESP32 -> "{line.decode()[:-1]}"')
+        print(f'[>] ESP32 -> "{line.decode(errors="replace")[:-1]}"')
+        match = re.search(rb'<<SerialPcap config (\d+)>>', line)
+        if match:
+            offered = int(match.group(1))
         if b"<<SerialPcap>>" in line:
             print("[+] Uploading options ...")
             break
 
+    if 'text' != dialog and offered >= config_version:
+        tlvs = configTlvs(channel, filter, unicast, multicast, batch, snaplen, beacon_refresh, bpf, filter_stage, telemetry, overload, hop, adapt, survey, pcapng, framed, compact, compress, history, trigger, time_sync)
+        if not configBinary(ser, tlvs):
+            return None
+        return passthrough(ser)
+    if 'binary' == dialog:
+        print(f'[!] {esp32_name} does not offer the binary dialog, using text')
+
     str = "P"
     if channel:
         str += f'C{channel}'
@@ -370,12 +546,75 @@ def connectESP32(port, channel, filter, unicast, multicast, time_sync):
         str += f'S{val}'
 
     if unicast:
-        str += f'U{unicast[0]}u{unicast[1]}'
+        for addr in unicast:
+            str += f'U{addr[0]}u{addr[1]}'
         if multicast:
             str += f'M{multicast[0]}m{multicast[1]}'
         else:
             str += f'M0m0'
 
+    if snaplen:
+        for key, length in snaplen:
+            str += f'T{key}t{length}'
+
+    if bpf != None:
+        str += f'Q{len(bpf)}'
+        for code, jt, jf, k in bpf:
+            if k >= 0x80000000:
+                k -= 0x100000000        # parseInt() is signed 32 bits
+            str += f'I{(code << 16) | (jt << 8) | jf}i{k}'
+
+    if filter_stage != None:
+        str += 'D1' if 'task' == filter_stage else 'D0'
+
+    if beacon_refresh != None:
+        str += f'B{beacon_refresh}'
+
+    if telemetry != None:
+        str += f'Y{telemetry}'
+
+    if overload != None:
+        str += f'O{overload}'
+
+    if hop:
+        for ch, dwell in hop:
+            str += f'H{ch}h{dwell}'
+        if adapt != None:
+            str += f'A{adapt}'
+
+    if survey != None:
+        str += f'V{survey}'
+
+    if pcapng:
+        str += f'N{pcapng}'
+
+    if framed:
+        str += f'R{framed}'
+
+    if compact:
+        str += 'Z1'
+
+    if compress:
+        str += 'z1'
+
+    if history[0] != None:
+        str += f'J{history[0]}'
+    if history[1] != None:
+        str += f'j{history[1]}'
+
+    if trigger[0]:
+        for kind, flags, value in trigger[0]:
+            str += f'E{kind | (flags << 8) | (value << 16)}'
+        if trigger[1] != None:
+            str += f'K{trigger[1]}'
+        if trigger[2] != None:
+            str += f'k{trigger[2]}'
+
+    if batch[0] != None:
+        str += f'W{batch[0]}'
+    if batch[1] != None:
+        str += f'L{batch[1]}'
+
     if time_sync:
         now = time.time_ns()    # returns time as an integer number of nanoseconds since the epoch
         microseconds = round(now / 1000)
@@ -389,7 +628,13 @@ def connectESP32(port, channel, filter, unicast, multicast, time_sync):
     ser.write(cmd)
     ser.flush()
     print("[<] ESP32 <- {}".format(cmd))
+    return passthrough(ser)
+
 
+def passthrough(ser):
+    """
+    Settings lines from the device till the stream starts.
+    """
     while True:
         try:
             line = ser.readline()
@@ -408,16 +653,1309 @@ def connectESP32(port, channel, filter, unicast, multicast, time_sync):
     return ser
 
 
-def runWireshark(ser):
+def configTlvs(channel, filter, unicast, multicast, batch, snaplen, beacon_refresh, bpf, filter_stage, telemetry, overload, hop, adapt, survey, pcapng, framed, compact, compress, history, trigger, time_sync):
+    """
+    The settings of connectESP32() as [ tag, value ] pairs for the binary
+    dialog, in the order of the text one.
+    """
+    u32 = lambda val: struct.pack('<I', val & 0xFFFFFFFF)
+    tlvs = [ [ config_tag_print, b'' ] ]
+    if channel:
+        tlvs.append([ config_tag_channel, struct.pack('<B', channel) ])
+    if filter[0] != None:
+        tlvs.append([ config_tag_filter, u32(filter[0]) ])
+    if filter[1] != None:
+        tlvs.append([ config_tag_custom, u32(filter[1] & 0xFFFF0000) ])
+
+    if unicast:
+        macs = b''.join(struct.pack('>I', msb)[1:] + struct.pack('>I', lsb)[1:] for msb, lsb in unicast if msb and lsb)
+        ouis = b''.join(struct.pack('>I', msb)[1:] for msb, lsb in unicast if msb and not lsb)
+        tlvs.append([ config_tag_watch_mac, macs ])
+        if ouis:
+            tlvs.append([ config_tag_watch_oui, ouis ])
+        address = b''
+        if multicast and multicast[1]:
+            address = struct.pack('>I', multicast[0])[1:] + struct.pack('>I', multicast[1])[1:]
+        elif multicast and 0x10000 == multicast[0]:
+            address = b'\x01'                 # any multicast
+        elif multicast and multicast[0]:
+            address = struct.pack('>I', multicast[0])[1:]
+        tlvs.append([ config_tag_multicast, address ])
+
+    if snaplen:
+        tlvs.append([ config_tag_snaplen, b''.join(struct.pack('<HH', key, length) for key, length in snaplen) ])
+    if bpf != None:
+        tlvs.append([ config_tag_bpf, b''.join(struct.pack('<HBBI', code, jt, jf, k & 0xFFFFFFFF) for code, jt, jf, k in bpf) ])
+    if filter_stage != None:
+        tlvs.append([ config_tag_filter_stage, u32(1 if 'task' == filter_stage else 0) ])
+    if beacon_refresh != None:
+        tlvs.append([ config_tag_beacon_refresh, u32(beacon_refresh) ])
+    if telemetry != None:
+        tlvs.append([ config_tag_telemetry, u32(telemetry) ])
+    if overload != None:
+        tlvs.append([ config_tag_overload, u32(overload) ])
+    if hop:
+        tlvs.append([ config_tag_hop, b''.join(struct.pack('<B3xI', ch, dwell) for ch, dwell in hop) ])
+        if adapt != None:
+            tlvs.append([ config_tag_hop_floor, u32(adapt) ])
+    if survey != None:
+        tlvs.append([ config_tag_survey, u32(survey) ])
+    if pcapng:
+        tlvs.append([ config_tag_pcapng, u32(pcapng) ])
+    if framed:
+        tlvs.append([ config_tag_framed, u32(framed) ])
+    if compact:
+        tlvs.append([ config_tag_compact, u32(1) ])
+    if compress:
+        tlvs.append([ config_tag_compress, u32(1) ])
+    if history[0] != None:
+        tlvs.append([ config_tag_history, u32(history[0]) ])
+    if history[1] != None:
+        tlvs.append([ config_tag_history_kbytes, u32(history[1]) ])
+    if trigger[0]:
+        tlvs.append([ config_tag_trigger, b''.join(struct.pack('<BBH', kind, flags, value) for kind, flags, value in trigger[0]) ])
+        if trigger[1] != None:
+            tlvs.append([ config_tag_trigger_pre, u32(trigger[1]) ])
+        if trigger[2] != None:
+            tlvs.append([ config_tag_trigger_post, u32(trigger[2]) ])
+    if batch[0] != None:
+        tlvs.append([ config_tag_batch_bytes, u32(batch[0]) ])
+    if batch[1] != None:
+        tlvs.append([ config_tag_batch_latency, u32(batch[1]) ])
+    if time_sync:
+        microseconds = round(time.time_ns() / 1000)
+        tlvs.append([ config_tag_time, struct.pack('<II', microseconds // 1000000, microseconds % 1000000) ])
+    return tlvs
+
+
+def configMessage(type, payload):
+    header = struct.pack(config_header_format, config_magic, type, config_version, len(payload))
+    return header + payload + struct.pack('<I', zlib.crc32(header + payload))
+
+
+def configRead(ser, timeout=2.0):
+    """
+    The next message from the device as [ type, payload ], None on a timeout
+    or bad CRC. Text ahead of it is printed.
+    """
+    magic = struct.pack('<H', config_magic)
+    saved = ser.timeout
+    ser.timeout = timeout
+    try:
+        # Nothing past the message is read, the settings text follows the ACK
+        buf = bytearray()
+        while not buf.endswith(magic):
+            byte = ser.read(1)
+            if not byte:
+                print('[!] Config: no reply')
+                return None
+            buf += byte
+        for line in buf[:-len(magic)].decode(errors='replace').splitlines():
+            print(f'[>] ESP32 -> "{line}"')
+        header = magic + ser.read(config_header_len - len(magic))
+        if len(header) < config_header_len:
+            print('[!] Config: no reply')
+            return None
+        _, type, _, length = struct.unpack(config_header_format, header)
+        rest = ser.read(length + 4)
+        if len(rest) < length + 4 or zlib.crc32(header + rest[:length]) != struct.unpack_from('<I', rest, length)[0]:
+            print('[!] Config: reply with a bad CRC')
+            return None
+        return [ type, bytes(rest[:length]) ]
+    finally:
+        ser.timeout = saved
+
+
+def configBinary(ser, tlvs):
+    """
+    The binary dialog, HELLO then SET till it is ACKed. Tags the device does
+    not know are left out.
+    """
+    ser.write(configMessage(config_msg_hello, struct.pack(config_hello_format, config_version, 0, 0)))
+    reply = configRead(ser)
+    if not reply or config_msg_hello != reply[0]:
+        print('[!] Config: no HELLO from the device')
+        return False
+    version, max_length, tags = struct.unpack_from(config_hello_format, reply[1])
+    print(f'[+] Binary config v{version}, up to {max_length} bytes')
+    payload = bytearray()
+    for tag, value in tlvs:
+        if tags & (1 << tag):
+            payload += struct.pack('<BH', tag, len(value)) + value
+        else:
+            print(f'[!] Config: tag {tag} not known to the device, left out')
+    if len(payload) > max_length:
+        print(f'[!] Config: {len(payload)} bytes of settings, the device takes {max_length}')
+        return False
+    message = configMessage(config_msg_set, payload)
+    print(f'[<] ESP32 <- {len(message)} bytes of settings')
+    for attempt in range(3):
+        ser.write(message)
+        ser.flush()
+        reply = configRead(ser)
+        if not reply:
+            return False
+        if config_msg_ack == reply[0]:
+            return True
+        if config_msg_nak != reply[0]:
+            print(f'[!] Config: unexpected reply {reply[0]}')
+            return False
+        tag, _, offset, err = struct.unpack_from(config_nak_format, reply[1])
+        if 0 == tag and esp_err_invalid_crc == err:
+            print('[!] Config: damaged on the way, sending again')
+            continue
+        if config_tag_trigger == tag and esp_err_not_supported == err:
+            print(f'[!] Config: --trigger needs the capture history, {esp32_name} has none, see CONFIG_WIFIPCAP_HISTORY_SIZE')
+            return False
+        print(f'[!] Config: rejected, tag {tag} at {offset}, error 0x{err & 0xFFFFFFFF:X}')
+        return False
+    return False
+
+
+class LiveControl:
+    """
+    --control, a line of options from the keyboard becomes a SET sent while
+    streaming. The device answers with a config report in the stream, see
+    TelemetryTap.
+    """
+    def __init__(self):
+        parser = argparse.ArgumentParser(prog='live', add_help=False)
+        parser.add_argument('--channel', '-c', '--ch', type=int, choices=range(1, max_channel+1), default=None)
+        parser.add_argument('--filter_mask', '-f', '--filter', default=None)
+        parser.add_argument('--filter_all', '-a', action='store_true', default=None)
+        parser.add_argument('--filter_good', '-g', action='store_true', default=None)
+        parser.add_argument('--filter_session', action='store_true', default=None)
+        parser.add_argument('--unicast', '-u', '--mac', action='append', default=None)
+        parser.add_argument('--oui', '-o', action='append', default=None)
+        parser.add_argument('--no_addr', action='store_true', default=None)
+        parser.add_argument('--multicast', '-m', nargs='?', default=None, const="01:00:00:00:00:00")
+        parser.add_argument('--broadcast', '-b', action='store_true', default=None)
+        parser.add_argument('--snaplen', action='append', default=None)
+        parser.add_argument('--bpf', default=None)
+        parser.add_argument('--beacon_refresh', type=int, default=None)
+        parser.add_argument('--filter_stage', choices=['callback', 'task'], default=None)
+        self.parser = parser
+        self.open = True
+        self.sent = 0
+
+    def poll(self, ser):
+        if not self.open or not select.select([ sys.stdin ], [], [], 0)[0]:
+            return
+        line = sys.stdin.readline()
+        if not line:
+            self.open = False
+            return
+        line = line.strip()
+        if not line:
+            return
+        try:
+            args = self.parser.parse_args(shlex.split(line))
+            unicast, multicast = processWatch(args)
+            filter = processFilter(args.filter_mask, args.filter_good, args.filter_all, args.filter_session)
+            tlvs = configTlvs(args.channel, filter, unicast, multicast, [ None, None ], processSnaplen(args.snaplen),
+                args.beacon_refresh, compileBpf(args.bpf), args.filter_stage,
+                None, None, None, None, None, None, None, None, None, [ None, None ], [ None, None, None ], False)[1:]
+        except (SystemExit, Exception):
+            print(f'[!] Live: "{line}" not sent')
+            return
+        if not tlvs:
+            print(f'[!] Live: "{line}" changes nothing')
+            return
+        payload = b''.join(struct.pack('<BH', tag, len(value)) + value for tag, value in tlvs)
+        ser.write(configMessage(config_msg_set, payload))
+        print(f'[<] ESP32 <- live config {self.sent}: "{line}"')
+        self.sent += 1
+
+
+class DeviceStandIn:
+    """
+    Plays the device for --dialog_bench on a pseudo terminal: both dialogs,
+    then a PCAP File Header and one record. Times the host and the exchange,
+    not the device's own parsing. "hello" is when the hello the host
+    answered went out.
+    """
+    def __init__(self, fd):
+        self.fd = fd
+        self.buf = bytearray()
+        self.hello = 0.0
+
+    def read(self, count):
+        while len(self.buf) < count:
+            self.buf += os.read(self.fd, 4096)
+        data = bytes(self.buf[:count])
+        del self.buf[:count]
+        return data
+
+    def session(self):
+        while 0x12 not in self.buf:           # DC2, the host is ready
+            self.buf += os.read(self.fd, 4096)
+        self.buf.clear()
+        # As hostDialog(), say hello again each time the host is not heard from
+        while True:
+            self.hello = time.perf_counter()
+            os.write(self.fd, f'\n<<SerialPcap config {config_version}>>\n<<SerialPcap>>\n'.encode())
+            if select.select([ self.fd ], [], [], serial_timeout)[0]:
+                break
+        if config_magic & 0xFF == self.read(1)[0]:
+            self.buf[0:0] = bytes([ config_magic & 0xFF ])
+            while True:
+                _, type, _, length = struct.unpack(config_header_format, self.read(config_header_len))
+                self.read(length + 4)
+                if config_msg_hello == type:
+                    hello = struct.pack(config_hello_format, config_version, 8 * 1024, ((2 << config_tag_last) - 1) & ~1)
+                    os.write(self.fd, configMessage(config_msg_hello, hello))
+                else:
+                    os.write(self.fd, configMessage(config_msg_ack, b''))
+                    break
+        else:
+            while 0x0A not in self.buf:
+                self.buf += os.read(self.fd, 4096)
+        self.buf.clear()
+        header = struct.pack('<IHHiIII', pcap_magic, 2, 4, 0, 0, 2312, link_type_802_11)
+        frame = bytes([ 0x80, 0 ]) + bytes(34)
+        record = struct.pack('<IIII', 0, 0, len(frame), len(frame)) + frame
+        os.write(self.fd, b'Final Config Settings\n<<PASSTHROUGH>>\n' + header + record)
+
+
+def dialogBench(connect, runs):
+    """
+    Time from port open and from the hello to the first packet, each dialog
+    "runs" times. connect(port, dialog) is connectESP32() with the options
+    given. Port open includes the hello the host drops while its port
+    settles, the device says it again after serial_timeout.
+    """
+    import pty
+    import threading
+    import contextlib
+    master, slave = pty.openpty()
+    port = os.ttyname(slave)
+    device = DeviceStandIn(master)
+    for dialog in [ 'text', 'binary' ]:
+        times = []
+        opened = []
+        for run in range(runs):
+            thread = threading.Thread(target=device.session, daemon=True)
+            thread.start()
+            started = time.perf_counter()
+            with contextlib.redirect_stdout(io.StringIO()):
+                ser = connect(port, dialog)
+                first = ser.read(24 + 16) if ser else b''
+            times.append(time.perf_counter() - device.hello)
+            opened.append(time.perf_counter() - started)
+            if ser:
+                ser.close()
+            thread.join(1.0)
+            if len(first) < 24 + 16:
+                print(f'[!] {dialog}: no packet')
+                return 1
+        times.sort()
+        opened.sort()
+        print(f'[+] {dialog:>6} dialog: first packet {opened[runs // 2] * 1000:.1f} ms after port open, '
+              f'{times[runs // 2] * 1000:.1f} ms after hello (median), best {times[0] * 1000:.1f} ms, {runs} runs')
+    os.close(master)
+    os.close(slave)
+    return 0
+
+
+class TelemetryTap:
+    """
+    Follows the PCAP stream, takes the telemetry records out and logs them.
+    feed() returns the data to pass on to Wireshark. With "survey", survey
+    reports are also printed; "path" may then be None for no log.
+    """
+    def __init__(self, path, latency_query, survey=False, control=None):
+        self.buf = bytearray()
+        self.control = control
+        self.started = False
+        self.passthrough = False
+        self.link_type = link_type_802_11
+        self.pcapng = False
+        self.if_link = []       # pcapng, link type of each interface
+        self.latency_query = latency_query
+        self.latency_next = time.monotonic() + (latency_query or 0)
+        self.survey = survey
+        self.file = open(path, 'w', newline='') if path else None
+        self.json = bool(path) and path.lower().endswith(('.json', '.jsonl'))
+        if self.file and not self.json:
+            self.csv = csv.writer(self.file)
+            self.csv.writerow([ 'time' ] + telemetry_fields)
+            self.file.flush()
+            if latency_query:
+                # Histograms go to a second CSV file, one row per histogram
+                root, ext = os.path.splitext(path)
+                self.latency_file = open(f'{root}_latency{ext}', 'w', newline='')
+                self.latency_csv = csv.writer(self.latency_file)
+                self.latency_csv.writerow([ 'time', 'seq', 'histogram', 'count', 'max_us', 'sum_us' ]
+                    + [ f'le_{(1 << n) - 1 if n else 0}us' for n in range(latency_buckets) ])
+                self.latency_file.flush()
+            if survey:
+                root, ext = os.path.splitext(path)
+                self.survey_file = open(f'{root}_survey{ext}', 'w', newline='')
+                self.survey_csv = csv.writer(self.survey_file)
+                self.survey_csv.writerow([ 'time', 'seq', 'interval_ms', 'rounds' ]
+                    + [ name for name in survey_channel_fields if 'pad' != name ])
+                self.survey_file.flush()
+
+    def close(self):
+        if not self.file:
+            return
+        self.file.close()
+        if not self.json and self.latency_query:
+            self.latency_file.close()
+        if not self.json and self.survey:
+            self.survey_file.close()
+
+    def poll(self, ser):
+        """
+        Ask for a latency report when one is due, send live changes.
+        """
+        if self.control:
+            self.control.poll(ser)
+        if self.latency_query and time.monotonic() >= self.latency_next:
+            self.latency_next += self.latency_query
+            ser.write( b'\x05' )        # send ^E (ENQ)
+
+    def subtype(self, frame, link_type=None):
+        frame = radiotapStrip(link_type or self.link_type, frame)
+        if (len(frame) >= telemetry_offset
+            and 0xD0 == frame[0]
+            and telemetry_addr == frame[10:16]
+            and 127 == frame[24]
+            and telemetry_oui == frame[25:28]):
+            return frame[28]
+        return None
+
+    def log(self, seconds, microseconds, frame, subtype, link_type=None):
+        when = seconds + microseconds / 1000000
+        frame = radiotapStrip(link_type or self.link_type, frame)
+        if survey_subtype == subtype and len(frame) >= telemetry_offset + struct.calcsize(survey_format):
+            self.logSurvey(when, frame)
+        elif config_subtype == subtype and len(frame) >= telemetry_offset + struct.calcsize(config_report_format):
+            self.logConfig(when, frame)
+        elif trigger_subtype == subtype and len(frame) >= telemetry_offset + struct.calcsize(trigger_report_format):
+            self.logTrigger(when, frame)
+        elif not self.file:
+            return
+        elif telemetry_subtype == subtype and len(frame) >= telemetry_offset + struct.calcsize(telemetry_format):
+            values = struct.unpack_from(telemetry_format, frame, telemetry_offset)
+            if self.json:
+                record = { 'time': when, 'record': 'telemetry' }
+                record.update(zip(telemetry_fields, values))
+                self.file.write(json.dumps(record) + '\n')
+            else:
+                self.csv.writerow([ f'{when:.6f}' ] + list(values))
+            self.file.flush()
+        elif latency_subtype == subtype and len(frame) >= telemetry_offset + struct.calcsize(latency_format):
+            values = struct.unpack_from(latency_format, frame, telemetry_offset)
+            seq = values[3]
+            hist = values[4:]
+            step = 3 + latency_buckets
+            if self.json:
+                record = { 'time': when, 'record': 'latency', 'seq': seq }
+                for n, name in enumerate(latency_histograms):
+                    h = hist[n * step:(n + 1) * step]
+                    record[name] = { 'count': h[0], 'max_us': h[1], 'sum_us': h[2], 'buckets': list(h[3:]) }
+                self.file.write(json.dumps(record) + '\n')
+                self.file.flush()
+            elif self.latency_query:
+                for n, name in enumerate(latency_histograms):
+                    h = hist[n * step:(n + 1) * step]
+                    self.latency_csv.writerow([ f'{when:.6f}', seq, name ] + list(h))
+                self.latency_file.flush()
+
+    def logConfig(self, when, frame):
+        report = dict(zip(config_report_fields, struct.unpack_from(config_report_format, frame, telemetry_offset)))
+        if report['err']:
+            print(f'[!] Live config {report["seq"]}: rejected, tag {report["tag"]} at {report["offset"]}, error 0x{report["err"] & 0xFFFFFFFF:X}')
+        else:
+            print(f'[+] Live config {report["seq"]}: applied, capture paused {report["paused_us"] / 1000:.1f} ms')
+        channel = report['channel'] or 'hopping'
+        print(f'[+]   channel {channel}, filter 0x{report["filter"]:08X}, custom 0x{report["custom"]:08X}, '
+              f'{report["watch_macs"]} MAC, {report["watch_ouis"]} OUI, bpf {report["bpf_insns"]} insns')
+        if self.json:
+            record = { 'time': when, 'record': 'config' }
+            record.update(report)
+            del record['reserved']
+            self.file.write(json.dumps(record) + '\n')
+            self.file.flush()
+
+    def logTrigger(self, when, frame):
+        report = dict(zip(trigger_report_fields, struct.unpack_from(trigger_report_format, frame, telemetry_offset)))
+        kind = { v: k for k, v in trigger_kinds.items() }.get(report['kind'], report['kind'])
+        print(f'[+] Trigger {report["seq"]}: {kind}={report["value"]}, {report["pre_frames"]} frames before, '
+              f'{report["held"]} held, {report["saved_bytes"] / 1024:.1f} KB saved so far')
+        if self.json:
+            record = { 'time': when, 'record': 'trigger' }
+            record.update(report)
+            self.file.write(json.dumps(record) + '\n')
+            self.file.flush()
+
+    def logSurvey(self, when, frame):
+        version, count, length, seq, interval_ms, rounds = struct.unpack_from(survey_format, frame, telemetry_offset)
+        at = telemetry_offset + length
+        size = struct.calcsize(survey_channel_format)
+        rows = []
+        for n in range(count):
+            if at + size > len(frame):
+                break
+            row = dict(zip(survey_channel_fields, struct.unpack_from(survey_channel_format, frame, at)))
+            del row['pad']
+            rows.append(row)
+            at += size
+        if self.survey:
+            printSurvey(seq, interval_ms, rounds, rows)
+        if self.json:
+            record = { 'time': when, 'record': 'survey', 'seq': seq, 'interval_ms': interval_ms, 'rounds': rounds, 'channels': rows }
+            self.file.write(json.dumps(record) + '\n')
+            self.file.flush()
+        elif self.file and self.survey:
+            for row in rows:
+                self.survey_csv.writerow([ f'{when:.6f}', seq, interval_ms, rounds ] + list(row.values()))
+            self.survey_file.flush()
+
+    def feed(self, data):
+        if self.passthrough:
+            return data
+        self.buf += data
+        out = bytearray()
+        if not self.started:
+            if len(self.buf) < 24:      # PCAP File Header
+                return bytes(out)
+            self.started = True
+            self.pcapng = pcapng_shb_type == struct.unpack_from('<I', self.buf)[0]
+            if not self.pcapng:
+                self.link_type = struct.unpack_from('<I', self.buf, 20)[0] & 0xFFFF
+                out += self.buf[:24]
+                del self.buf[:24]
+        if self.pcapng:
+            return self.feedBlocks(out)
+        pos = 0
+        while len(self.buf) - pos >= 16:
+            seconds, microseconds, caplen, _ = struct.unpack_from('<IIII', self.buf, pos)
+            if caplen > 0x40000:
+                # Lost track of the records, stop looking
+                print("[!] Telemetry: PCAP stream not understood, logging stopped")
+                self.passthrough = True
+                out += self.buf[pos:]
+                self.buf.clear()
+                return bytes(out)
+            end = pos + 16 + caplen
+            if end > len(self.buf):
+                break
+            frame = self.buf[pos + 16:end]
+            subtype = self.subtype(frame)
+            if subtype != None:
+                self.log(seconds, microseconds, frame, subtype)
+            else:
+                out += self.buf[pos:end]
+            pos = end
+        del self.buf[:pos]
+        return bytes(out)
+
+    def record(self, data):
+        """
+        A device record from the telemetry channel of --framed, always with a
+        radiotap header.
+        """
+        if len(data) < 16:
+            return
+        seconds, microseconds, caplen, _ = struct.unpack_from('<IIII', data)
+        frame = data[16:16 + caplen]
+        subtype = self.subtype(frame, link_type_radiotap)
+        if subtype != None:
+            self.log(seconds, microseconds, frame, subtype, link_type_radiotap)
+
+    def reset(self):
+        pass
+
+    def feedBlocks(self, out):
+        """
+        feed() for a pcapng stream. Only Enhanced Packet Blocks can be device
+        records.
+        """
+        pos = 0
+        while len(self.buf) - pos >= 12:
+            type, length = struct.unpack_from('<II', self.buf, pos)
+            if length > 0x40000 or length < 12 or length & 3:
+                print("[!] Telemetry: pcapng stream not understood, logging stopped")
+                self.passthrough = True
+                out += self.buf[pos:]
+                self.buf.clear()
+                return bytes(out)
+            end = pos + length
+            if end > len(self.buf):
+                break
+            subtype = None
+            if pcapng_idb_type == type:
+                self.if_link.append(struct.unpack_from('<H', self.buf, pos + 8)[0])
+            elif pcapng_epb_type == type and length >= 32:
+                if_id, ts_high, ts_low, caplen = struct.unpack_from('<IIII', self.buf, pos + 8)
+                frame = self.buf[pos + 28:min(pos + 28 + caplen, end)]
+                if if_id < len(self.if_link):
+                    self.link_type = self.if_link[if_id]
+                subtype = self.subtype(frame)
+                if subtype != None:
+                    seconds, microseconds = divmod((ts_high << 32) | ts_low, 1000000)
+                    self.log(seconds, microseconds, frame, subtype)
+            if None == subtype:
+                out += self.buf[pos:end]
+            pos = end
+        del self.buf[:pos]
+        return bytes(out)
+
+
+def radiotapHeader(channel, signal, flags):
+    """
+    The radiotap header radiotap_init() in SerialPcap.h makes.
+    """
+    freq = 2484 if 14 == channel else 2407 + 5 * channel
+    return struct.pack('<BBHIBBHHbB', 0, 0, radiotap_len, 0x2A, flags, 0, freq, 0x0080, signal, 0)
+
+
+def radiotapChannel(header):
+    freq = struct.unpack_from('<H', header, 10)[0]
+    return 14 if 2484 == freq else (freq - 2407) // 5
+
+
+def radiotapStrip(link_type, frame):
+    """
+    The 802.11 frame, after the radiotap header when there is one.
+    """
+    if link_type_radiotap == link_type and len(frame) >= 4:
+        return frame[struct.unpack_from('<H', frame, 2)[0]:]
+    return frame
+
+
+def readVarint(buf, pos):
+    """
+    Returns the value and the position after it, or None when buf ends first.
+    """
+    val = shift = 0
+    while pos < len(buf):
+        byte = buf[pos]
+        pos += 1
+        val |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return val, pos
+        shift += 7
+        if shift > 63:
+            raise ValueError('varint too long')
+    return None
+
+
+def putVarint(out, val):
+    while val >= 0x80:
+        out.append((val & 0x7F) | 0x80)
+        val >>= 7
+    out.append(val)
+
+
+def compactMacSlot(mac):
+    key = ((mac[0] << 8) | mac[1]) ^ int.from_bytes(mac[2:6], 'big')
+    return ((key * 2654435761) & 0xFFFFFFFF) >> 24
+
+
+def compactAddrCount(fctl, caplen):
+    """
+    Addresses that go through the address table, from the first Frame Control
+    byte, as compact_addr_count() in SerialPcap.cpp.
+    """
+    if caplen < 4:
+        return 0
+    type = (fctl >> 2) & 3
+    subtype = fctl >> 4
+    if 1 == type:
+        count = 1 if subtype in (12, 13) else 2     # CTS, ACK
+    elif type in (0, 2):
+        count = 3
+    else:
+        return 0
+    return min(count, (caplen - 4) // 6)
+
+
+class CompactCodec:
+    """
+    One end of a compact stream, the time of the previous record and the
+    address table. encode() follows compact_append() in SerialPcap.cpp.
+    """
+    def __init__(self, link_type=link_type_802_11):
+        self.last_us = 0
+        self.mac = [ bytes(6) ] * compact_mac_slots
+        self.radiotap = link_type_radiotap == link_type
+
+    def encode(self, seconds, microseconds, frame, packet_length):
+        caplen = len(frame)
+        us = seconds * 1000000 + microseconds
+        delta = us - self.last_us
+        self.last_us = us
+        tag = 0
+        out = bytearray(1)
+        putVarint(out, (delta << 1) if delta >= 0 else ((-delta) << 1) - 1)
+        putVarint(out, caplen)
+        if packet_length > caplen:
+            tag |= compact_tag_orig_len
+            putVarint(out, packet_length - caplen)
+        at = 0
+        if self.radiotap and caplen >= radiotap_len:
+            header = bytes(frame[:radiotap_len])
+            channel = radiotapChannel(header)
+            signal, flags = struct.unpack_from('<b', header, 14)[0], header[8]
+            if 0 <= channel < 256 and radiotapHeader(channel, signal, flags) == header:
+                tag |= compact_tag_radiotap
+                out += struct.pack('<BbB', channel, signal, flags)
+            else:
+                out += header
+            at = radiotap_len
+        count = compactAddrCount(frame[at], caplen - at) if caplen > at else 0
+        if count:
+            out += frame[at:at + 4]
+            at += 4
+        for n in range(count):
+            mac = bytes(frame[at:at + 6])
+            slot = compactMacSlot(mac)
+            if self.mac[slot] == mac:
+                out.append(slot)
+                tag |= 1 << n
+            else:
+                self.mac[slot] = mac
+                out += mac
+            at += 6
+        out += frame[at:]
+        out[0] = tag
+        return bytes(out)
+
+    def decode(self, buf, pos):
+        """
+        The record at buf[pos:] as a PCAP 2.4 record, and the position after it.
+        None when buf does not hold all of it yet.
+        """
+        if pos >= len(buf):
+            return None
+        tag = buf[pos]
+        if tag & ~(0x1F if self.radiotap else 0x0F):
+            raise ValueError(f'bad tag {tag:#x}')
+        fields = []
+        at = pos + 1
+        for n in range(3 if tag & compact_tag_orig_len else 2):
+            field = readVarint(buf, at)
+            if None == field:
+                return None
+            val, at = field
+            fields.append(val)
+        zigzag, caplen = fields[:2]
+        extra = fields[2] if len(fields) > 2 else 0
+        if caplen > 0x40000:
+            raise ValueError(f'bad length {caplen}')
+        frame = bytearray()
+        skip = 0                # Bytes of the frame not sent
+        if self.radiotap and caplen >= radiotap_len:
+            if tag & compact_tag_radiotap:
+                if at + 3 > len(buf):
+                    return None
+                channel, signal, flags = struct.unpack_from('<BbB', buf, at)
+                frame += radiotapHeader(channel, signal, flags)
+                at += 3
+                skip = radiotap_len - 3
+            else:
+                frame += buf[at:at + radiotap_len]
+                at += radiotap_len
+        elif tag & compact_tag_radiotap:
+            raise ValueError(f'bad tag {tag:#x}')
+        rest = caplen - radiotap_len if self.radiotap and caplen >= radiotap_len else caplen
+        if rest and at >= len(buf):
+            return None
+        count = compactAddrCount(buf[at], rest) if rest else 0
+        indexed = [ bool(tag & (1 << n)) for n in range(count) ]
+        if tag & 0x07 & ~((1 << count) - 1):
+            raise ValueError(f'bad tag {tag:#x}')
+        end = at + rest - 5 * sum(indexed)
+        if end > len(buf):
+            return None
+
+        frame += buf[at:at + (4 if count else 0)]
+        at += 4 if count else 0
+        for n in range(count):
+            if indexed[n]:
+                frame += self.mac[buf[at]]
+                at += 1
+            else:
+                mac = bytes(buf[at:at + 6])
+                self.mac[compactMacSlot(mac)] = mac
+                frame += mac
+                at += 6
+        frame += buf[at:end]
+        self.last_us += (zigzag >> 1) ^ -(zigzag & 1)
+        seconds, microseconds = divmod(self.last_us, 1000000)
+        header = struct.pack('<IIII', seconds & 0xFFFFFFFF, microseconds, caplen, caplen + extra)
+        return header + frame, end
+
+
+class CompactDecoder:
+    """
+    Turns the compact format back into PCAP 2.4, ahead of "tap" when there is
+    one. A stream that starts with the PCAP magic passes through.
+    """
+    def __init__(self, tap):
+        self.tap = tap
+        self.buf = bytearray()
+        self.started = False
+        self.passthrough = False
+        self.link_type = link_type_802_11
+        self.codec = CompactCodec()
+
+    def close(self):
+        if self.tap:
+            self.tap.close()
+
+    def poll(self, ser):
+        if self.tap:
+            self.tap.poll(ser)
+
+    def record(self, data):
+        if self.tap:
+            self.tap.record(data)
+
+    def reset(self):
+        """
+        The device started its encoder over, see FrameSync.
+        """
+        self.buf.clear()
+        self.codec = CompactCodec(self.link_type)
+        if self.tap:
+            self.tap.reset()
+
+    def feed(self, data):
+        data = self.decode(data)
+        return self.tap.feed(data) if self.tap else data
+
+    def decode(self, data):
+        if self.passthrough:
+            return data
+        self.buf += data
+        out = bytearray()
+        if not self.started:
+            if len(self.buf) < 24:      # PCAP File Header
+                return bytes(out)
+            self.started = True
+            if compact_magic != struct.unpack_from('<I', self.buf)[0]:
+                print("[!] Compact: the device sent PCAP, passing it through")
+                self.passthrough = True
+                out += self.buf
+                self.buf.clear()
+                return bytes(out)
+            self.link_type = struct.unpack_from('<I', self.buf, 20)[0] & 0xFFFF
+            self.codec = CompactCodec(self.link_type)
+            out += struct.pack('<I', pcap_magic) + self.buf[4:24]
+            del self.buf[:24]
+        pos = 0
+        try:
+            while True:
+                record = self.codec.decode(self.buf, pos)
+                if None == record:
+                    break
+                data, pos = record
+                out += data
+        except (ValueError, IndexError) as e:
+            print(f'[!] Compact: stream not understood, {e}, decoding stopped')
+            self.passthrough = True
+        del self.buf[:pos]
+        return bytes(out)
+
+
+def readPcapFile(path):
+    """
+    Link type and frames, (seconds, microseconds, frame, packet_length), of a
+    PCAP file. None when it cannot be read.
+    """
+    try:
+        with open(path, 'rb') as f:
+            data = f.read()
+    except OSError as e:
+        print(f'[!] {e}')
+        return None
+    magics = { 0xA1B2C3D4: False, 0xA1B23C4D: True }    # nanoseconds
+    endian = None
+    for order in ('<', '>'):
+        if len(data) >= 24 and struct.unpack_from(order + 'I', data)[0] in magics:
+            endian = order
+    if None == endian:
+        print(f'[!] "{path}" is not a PCAP file, pcapng is not supported')
+        return None
+    nano = magics[struct.unpack_from(endian + 'I', data)[0]]
+    link_type = struct.unpack_from(endian + 'I', data, 20)[0] & 0xFFFF
+    frames = []
+    pos = 24
+    while pos + 16 <= len(data):
+        seconds, fraction, caplen, packet_length = struct.unpack_from(endian + 'IIII', data, pos)
+        frame = data[pos + 16:pos + 16 + caplen]
+        if len(frame) < caplen:
+            print(f'[!] Frame {len(frames) + 1} cut short, stopping')
+            break
+        pos += 16 + caplen
+        frames.append((seconds, fraction // 1000 if nano else fraction, frame, packet_length))
+    return link_type, frames
+
+
+def compactBench(path):
+    """
+    Bytes per frame of the frames in a PCAP file as the device sends them,
+    PCAP 2.4 and compact, by frame type. Each compact record is decoded again
+    and checked against the original.
+    """
+    pcap = readPcapFile(path)
+    if None == pcap:
+        return 1
+    link_type, frames = pcap
+    if link_type not in (link_type_802_11, link_type_radiotap):
+        print(f'[!] Link type {link_type} is not 802.11, no addresses are compacted')
+
+    classes = [ 'mgmt', 'ack/cts', 'ctrl other', 'data', 'other' ]
+    stats = { name: [ 0, 0, 0 ] for name in classes + [ 'total' ] }
+    encoder = CompactCodec(link_type)
+    decoder = CompactCodec(link_type)
+    count = 0
+    for seconds, microseconds, frame, packet_length in frames:
+        caplen = len(frame)
+        count += 1
+        wire = encoder.encode(seconds, microseconds, frame, packet_length)
+        record = decoder.decode(wire, 0)
+        if (None == record or record[1] != len(wire)
+            or record[0] != struct.pack('<IIII', seconds, microseconds, caplen, packet_length) + frame):
+            print(f'[!] Frame {count} does not decode back to the original')
+            return 1
+
+        name = 'other'
+        body = radiotapStrip(link_type, frame)
+        if body and link_type in (link_type_802_11, link_type_radiotap):
+            type, subtype = (body[0] >> 2) & 3, body[0] >> 4
+            if 0 == type:
+                name = 'mgmt'
+            elif 1 == type:
+                name = 'ack/cts' if subtype in (12, 13) else 'ctrl other'
+            elif 2 == type:
+                name = 'data'
+        for key in (name, 'total'):
+            stats[key][0] += 1
+            stats[key][1] += 16 + caplen
+            stats[key][2] += len(wire)
+
+    print(f'[+] "{path}", {count} frames, all decode back to the original')
+    print(f'    {"type":<12}{"frames":>10}{"PCAP B/frame":>15}{"compact B/frame":>18}{"saved":>8}')
+    for name in classes + [ 'total' ]:
+        frames, pcap_bytes, compact_bytes = stats[name]
+        if frames:
+            print(f'    {name:<12}{frames:>10}{pcap_bytes / frames:>15.2f}{compact_bytes / frames:>18.2f}'
+                  f'{100 * (pcap_bytes - compact_bytes) / pcap_bytes:>7.1f}%')
+    return 0
+
+
+class LzPacker:
+    """
+    The block compressor, as lz_write() in SerialPcap.cpp. For benchmarks.
+    """
+    def __init__(self):
+        self.buf = bytearray()          # history, then the block being packed
+        self.base = 0
+        self.table = [ 0 ] * (1 << lz_hash_bits)
+        self.poor = 0
+        self.rest = 0
+
+    def sequence(self, out, cap, literals, offset, match_len):
+        lit_len = len(literals)
+        if len(out) + 1 + lit_len + lit_len // 255 + 2 + match_len // 255 + 1 > cap:
+            return False
+        token = len(out)
+        out.append(min(lit_len, 15) << 4)
+        if lit_len >= 15:
+            putLz4Length(out, lit_len - 15)
+        out += literals
+        if 0 == offset:
+            return True
+        out += struct.pack('<H', offset)
+        match_len -= 4
+        out[token] |= min(match_len, 15)
+        if match_len >= 15:
+            putLz4Length(out, match_len - 15)
+        return True
+
+    def compress(self, hist, cap):
+        b = self.buf
+        end = len(b)
+        out = bytearray()
+        ip = anchor = hist
+        misses = 0
+        while ip + 12 < end:
+            seq = b[ip:ip + 4]
+            h = ((int.from_bytes(seq, 'little') * 2654435761) & 0xFFFFFFFF) >> (32 - lz_hash_bits)
+            cand = self.table[h]
+            self.table[h] = (self.base + ip + 1) & 0xFFFFFFFF
+            at = (cand - 1 - self.base) & 0xFFFFFFFF
+            if cand and at < ip and ip - at <= 0xFFFF and b[at:at + 4] == seq:
+                match_len = 4
+                while ip + match_len < end - 5 and b[at + match_len] == b[ip + match_len]:
+                    match_len += 1
+                if not self.sequence(out, cap, b[anchor:ip], ip - at, match_len):
+                    return None
+                ip += match_len
+                anchor = ip
+                misses = 0
+            else:
+                ip += 1 + (misses >> 5)
+                misses += 1
+        if not self.sequence(out, cap, b[anchor:end], 0, 0):
+            return None
+        return out
+
+    def block(self, data):
+        """
+        Block header and body for "data".
+        """
+        hist = len(self.buf)
+        self.buf += data
+        packed = None
+        if self.rest:
+            self.rest -= 1
+        else:
+            packed = self.compress(hist, len(data) - len(data) * lz_min_save_pct // 100)
+            if packed:
+                self.poor = 0
+            else:
+                self.poor += 1
+                if self.poor >= lz_poor_limit:
+                    self.poor = 0
+                    self.rest = lz_rest
+        if len(self.buf) > lz_window:
+            drop = len(self.buf) - lz_window
+            del self.buf[:drop]
+            self.base = (self.base + drop) & 0xFFFFFFFF
+        if packed:
+            return struct.pack('<HH', len(data), len(packed)) + packed
+        return struct.pack('<HH', len(data), 0) + bytes(data)
+
+
+def putLz4Length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def lz4Unpack(src, out):
+    """
+    Appends an LZ4 block to "out", which holds the history it refers to.
+    """
+    pos = 0
+    while pos < len(src):
+        token = src[pos]
+        pos += 1
+        lit_len = token >> 4
+        if 15 == lit_len:
+            while True:
+                byte = src[pos]
+                pos += 1
+                lit_len += byte
+                if 255 != byte:
+                    break
+        out += src[pos:pos + lit_len]
+        pos += lit_len
+        if pos >= len(src):
+            break
+        offset = src[pos] | (src[pos + 1] << 8)
+        pos += 2
+        match_len = token & 15
+        if 15 == match_len:
+            while True:
+                byte = src[pos]
+                pos += 1
+                match_len += byte
+                if 255 != byte:
+                    break
+        match_len += 4
+        start = len(out) - offset
+        if 0 == offset or start < 0:
+            raise ValueError(f'bad offset {offset}')
+        if offset >= match_len:
+            out += out[start:start + match_len]
+        else:
+            for n in range(match_len):
+                out.append(out[start + n])
+
+
+class LzDecoder:
+    """
+    Unpacks the block stream of --compress, ahead of "tap" when there is one.
+    """
+    def __init__(self, tap):
+        self.tap = tap
+        self.buf = bytearray()
+        self.history = bytearray()
+        self.failed = False
+
+    def close(self):
+        if self.tap:
+            self.tap.close()
+
+    def poll(self, ser):
+        if self.tap:
+            self.tap.poll(ser)
+
+    def record(self, data):
+        if self.tap:
+            self.tap.record(data)
+
+    def reset(self):
+        """
+        The device started its compressor over, see FrameSync. Decoding
+        starts again after an error too.
+        """
+        self.buf.clear()
+        self.history.clear()
+        self.failed = False
+        if self.tap:
+            self.tap.reset()
+
+    def feed(self, data):
+        data = self.decode(data)
+        return self.tap.feed(data) if self.tap else data
+
+    def decode(self, data):
+        if self.failed:
+            return b''
+        self.buf += data
+        out = bytearray()
+        pos = 0
+        try:
+            while len(self.buf) - pos >= 4:
+                raw_len, packed_len = struct.unpack_from('<HH', self.buf, pos)
+                end = pos + 4 + (packed_len or raw_len)
+                if end > len(self.buf):
+                    break
+                start = len(self.history)
+                if packed_len:
+                    lz4Unpack(self.buf[pos + 4:end], self.history)
+                else:
+                    self.history += self.buf[pos + 4:end]
+                if len(self.history) - start != raw_len:
+                    raise ValueError(f'block of {len(self.history) - start} bytes, expected {raw_len}')
+                out += self.history[start:]
+                if len(self.history) > 0x20000:
+                    del self.history[:-0x10000]
+                pos = end
+        except (ValueError, IndexError) as e:
+            print(f'[!] Compress: stream not understood, {e}, stopped till the next FrameSync')
+            self.failed = True
+        del self.buf[:pos]
+        return bytes(out)
+
+
+def compressBench(path, batch_bytes, compact):
+    """
+    How well the frames of a PCAP file pack as --compress blocks. Records are
+    batched up to "batch_bytes" like batch_append() does under load; lighter
+    load sends smaller writes, which pack less. The blocks are unpacked again
+    and checked against the original.
+    """
+    pcap = readPcapFile(path)
+    if None == pcap:
+        return 1
+    link_type, frames = pcap
+    limit = min(batch_bytes, batch_size) if batch_bytes != None else batch_limit
+    if compact:
+        header = struct.pack('<IHHiIII', compact_magic, 2, 4, 0, 0, 2312, link_type)
+        codec = CompactCodec(link_type)
+        records = [ codec.encode(*frame) for frame in frames ]
+    else:
+        header = struct.pack('<IHHiIII', pcap_magic, 2, 4, 0, 0, 2312, link_type)
+        records = [ struct.pack('<IIII', seconds, microseconds, len(frame), packet_length) + frame
+                    for seconds, microseconds, frame, packet_length in frames ]
+
+    # As batch_append()
+    writes = [ header ]
+    batch = bytearray()
+    for record in records:
+        if len(batch) + len(record) > limit:
+            if batch:
+                writes.append(bytes(batch))
+            batch = bytearray()
+            if len(record) >= limit:
+                writes.append(record)
+                continue
+        batch += record
+    if batch:
+        writes.append(bytes(batch))
+
+    packer = LzPacker()
+    started = time.perf_counter()
+    blocks = [ packer.block(data) for data in writes ]
+    pack_s = time.perf_counter() - started
+    decoder = LzDecoder(None)
+    started = time.perf_counter()
+    unpacked = decoder.decode(b''.join(blocks))
+    unpack_s = time.perf_counter() - started
+    raw = b''.join(writes)
+    if unpacked != raw:
+        print('[!] Blocks do not unpack back to the original')
+        return 1
+
+    sent = sum(len(block) for block in blocks)
+    stored = sum(1 for block in blocks if 0 == struct.unpack_from('<HH', block)[1])
+    kb = len(raw) / 1024
+    print(f'[+] "{path}", {len(frames)} frames, {"compact" if compact else "PCAP"}, {limit} byte writes, all unpack back to the original')
+    print(f'    {len(blocks)} blocks, {stored} sent as is')
+    print(f'    {len(raw)} bytes -> {sent} bytes, {100 * sent / max(len(raw), 1):.1f}%, ratio {len(raw) / max(sent, 1):.2f}')
+    print(f'    host, Python: pack {1e6 * pack_s / max(kb, 1e-9):.0f} us/KB, unpack {1e6 * unpack_s / max(kb, 1e-9):.0f} us/KB')
+    print(f'    {esp32_name}: cycles/KB and share of a core are in the settings report, "block compression cost",')
+    print(f'    and lz_cycles/lz_in in --telemetry_log')
+    return 0
+
+
+class FrameDecoder:
+    """
+    Takes the stream of --framed apart, ahead of "tap" when there is one.
+    Frames that fail the CRC are skipped up to the next sync word, gaps in
+    the sequence are frames lost. With "stateful", --compact or --compress,
+    the PCAP channel waits for the next FrameSync after a loss.
+    """
+    def __init__(self, tap, stateful):
+        self.tap = tap
+        self.stateful = stateful
+        self.buf = bytearray()
+        self.seq = 0
+        self.waiting = False    # for a FrameSync, after a loss
+        self.frames = 0
+        self.lost = 0
+        self.bad = 0            # CRC or length
+        self.skipped = 0        # bytes
+        self.log_lost = 0
+
+    def close(self):
+        print(f'[+] Framed: {self.frames} frames, {self.lost} lost, {self.bad} bad, {self.skipped} bytes skipped, {self.log_lost} log lines lost on {esp32_name}')
+        if self.tap:
+            self.tap.close()
+
+    def poll(self, ser):
+        if self.tap:
+            self.tap.poll(ser)
+
+    def feed(self, data):
+        self.buf += data
+        out = bytearray()
+        pos = 0
+        while True:
+            at = self.buf.find(frame_sync, pos)
+            if at < 0:
+                # Keep what could be the start of a sync word
+                keep = max(pos, len(self.buf) - len(frame_sync) + 1)
+                self.skipped += keep - pos
+                pos = keep
+                break
+            self.skipped += at - pos
+            pos = at
+            if len(self.buf) - pos < frame_header_len:
+                break
+            _, length, channel, _, seq = struct.unpack_from(frame_header_format, self.buf, pos)
+            end = pos + frame_header_len + length + 4
+            if length > batch_size + 4:
+                self.bad += 1
+                pos += 1
+                continue
+            if end > len(self.buf):
+                break
+            if zlib.crc32(self.buf[pos:end - 4]) != struct.unpack_from('<I', self.buf, end - 4)[0]:
+                self.bad += 1
+                pos += 1
+                continue
+            lost = (seq - self.seq) & 0xFFFFFFFF
+            if lost:
+                self.lost += lost
+                print(f'[!] Framed: {lost} frames lost')
+                self.waiting = self.stateful
+            self.seq = (seq + 1) & 0xFFFFFFFF
+            self.frames += 1
+            out += self.frame(channel, self.buf[pos + frame_header_len:end - 4])
+            pos = end
+        del self.buf[:pos]
+        return bytes(out)
+
+    def frame(self, channel, payload):
+        if frame_channel_pcap == channel:
+            if self.waiting:
+                return b''
+            return self.tap.feed(payload) if self.tap else payload
+        if frame_channel_telemetry == channel:
+            if self.tap:
+                self.tap.record(payload)
+        elif frame_channel_log == channel:
+            print(f'[{esp32_name}] {payload.decode(errors="replace").rstrip()}')
+        elif frame_channel_control == channel and len(payload) >= struct.calcsize(frame_sync_format):
+            _, self.log_lost = struct.unpack_from(frame_sync_format, payload)
+            self.waiting = False
+            if self.stateful and self.tap:
+                self.tap.reset()
+        return b''
+
+
+def printSurvey(seq, interval_ms, rounds, rows):
+    """
+    One SurveyReport as a table, rates per second of time on the channel.
+    """
+    print(f'[+] Survey {seq}, {interval_ms} ms, {rounds} rounds')
+    print(f'    {"ch":>3}{"dwell ms":>10}{"listen":>8}{"frames/s":>10}{"kB/s":>9}{"mgmt":>7}{"ctrl":>7}{"data":>7}{"error":>7}')
+    for row in rows:
+        listen_s = row['listen_ms'] / 1000
+        frames = row['frames']
+        share = lambda n: f'{100 * n / frames:.0f}%' if frames else '-'
+        print(f'    {row["channel"]:>3}{row["dwell_ms"]:>10}'
+              f'{100 * row["listen_ms"] / max(interval_ms, 1):>7.0f}%'
+              f'{frames / listen_s if listen_s else 0:>10.0f}'
+              f'{row["bytes"] / 1024 / listen_s if listen_s else 0:>9.1f}'
+              f'{share(row["mgmt"]):>7}{share(row["ctrl"]):>7}{share(row["data"]):>7}{share(row["error"]):>7}')
+
+
+def runSurvey(ser, tap):
+    """
+    Statistics only, the stream holds device records and nothing for Wireshark.
+    """
+    print("[+] Survey running, ^C to stop ...")
+    ser.timeout = 0.1
+    try:
+        while ser.is_open:
+            tap.poll(ser)
+            tap.feed(ser.read(ser.in_waiting or 1))
+    except KeyboardInterrupt:
+        pass
+
+
+def runWireshark(ser, tap):
     print("[+] Starting Wireshark ...")
-    proc=subprocess.Popen([ wireshark_path, '-k', '-i', '-' ], stdin=ser)
-    proc.communicate()
+    if not tap:
+        proc=subprocess.Popen([ wireshark_path, '-k', '-i', '-' ], stdin=ser)
+        proc.communicate()
+        return
+
+    # Pass the stream through the telemetry tap
+    proc=subprocess.Popen([ wireshark_path, '-k', '-i', '-' ], stdin=subprocess.PIPE)
+    ser.timeout = 0.1           # keep tap.poll() going when the stream is quiet
+    try:
+        while ser.is_open and None == proc.poll():
+            tap.poll(ser)
+            data = tap.feed(ser.read(ser.in_waiting or 1))
+            if data:
+                proc.stdin.write(data)
+                proc.stdin.flush()
+    except (BrokenPipeError, KeyboardInterrupt):
+        pass
+    try:
+        proc.stdin.close()
+    except:
+        pass
+    proc.wait()
     # cmd='wireshark -k -i -'
     # proc=subprocess.Popen(shlex.split(cmd), stdin=ser, start_new_session=True)
     # proc=subprocess.Popen(shlex.split(cmd), stdin=ser)
 
 
-def runWiresharkWin32(ser):
+def runWiresharkWin32(ser, tap):
     # Ref. https://wiki.wireshark.org/CaptureSetup/Pipes.md#way-3-python-on-windows
     # Ref. https://stackoverflow.com/a/13319731
     import win32pipe, win32file
@@ -440,9 +1978,14 @@ def runWiresharkWin32(ser):
         print("[+] Pipe Connected")
 
         while ser.is_open:
+            if tap:
+                tap.poll(ser)
             if 0 < ser.in_waiting:
                 data = ser.read(ser.in_waiting)
-                win32file.WriteFile(pipe, data)
+                if tap:
+                    data = tap.feed(data)
+                if data:
+                    win32file.WriteFile(pipe, data)
             else:
                 # Python processes typically use a single thread because of the GIL.
                 # We are all that is running? Do any of these libraries have
@@ -481,28 +2024,223 @@ def processAddress(unicast, oui):
     return [ msb, lsb ]
 
 
+def processSnaplen(snaplen):
+    """
+    Convert "TYPE[.SUBTYPE]=LENGTH" to [ key, length ] pairs for the T/t
+    commands. key is (type << 4) | subtype or 0x100 | type for all subtypes.
+    A length of 1 selects header only and 0 the full frame.
+    """
+    k_types = { 'mgmt': 0, 'ctrl': 1, 'data': 2 }
+    result = []
+    for item in snaplen or []:
+        try:
+            sel, length = item.split('=')
+            sel = sel.split('.')
+            ftype = k_types[sel[0]] if sel[0] in k_types else int(sel[0], 0)
+            if 2 < ftype or 0 > ftype:
+                raise ValueError
+            if 2 == len(sel):
+                subtype = int(sel[1], 0)
+                if 15 < subtype or 0 > subtype:
+                    raise ValueError
+                key = (ftype << 4) | subtype
+            else:
+                key = 0x100 | ftype
+            if 'hdr' == length:
+                length = 1
+            elif 'full' == length:
+                length = 0
+            else:
+                length = int(length, 0)
+                if 2 > length:
+                    raise ValueError
+        except:
+            print(f'[!] Bad formatting "{item}" should be "TYPE[.SUBTYPE]=LENGTH"')
+            raise Exception(f'Bad snaplen formatting')
+        result.append([ key, length ])
+    return result
+
+
+def processTrigger(specs):
+    """
+    Convert "KIND[=VALUE][@watch]" items to [ kind, flags, value ] for the E
+    command.
+    """
+    if not specs:
+        return None
+    result = []
+    for spec in specs:
+        try:
+            item, _, where = spec.strip().lower().partition('@')
+            name, _, value = item.partition('=')
+            flags = 0
+            if where:
+                if 'watch' != where:
+                    raise ValueError
+                flags |= trigger_f_watched
+            if name in trigger_mgmt_names and not value:
+                kind, value = trigger_kinds['mgmt'], trigger_mgmt_names[name]
+            elif 'mgmt' == name:
+                kind, value = trigger_kinds[name], trigger_mgmt_names[value] if value in trigger_mgmt_names else int(value, 0)
+                if 15 < value:
+                    raise ValueError
+            elif 'reason' == name:
+                kind, value = trigger_kinds[name], int(value, 0)
+                if 0xFFFF < value:
+                    raise ValueError
+            elif 'eapol' == name:
+                kind, value = trigger_kinds[name], int(value, 0) if value else 0
+                if 4 < value:
+                    raise ValueError
+            else:
+                raise ValueError
+            if 0 > value:
+                raise ValueError
+            result.append([ kind, flags, value ])
+        except:
+            print(f'[!] Bad formatting "{spec}" should be "KIND[=VALUE][@watch]", KIND mgmt, reason, eapol or a subtype name')
+            raise Exception(f'Bad trigger formatting')
+    if 8 < len(result):                     # k_trigger_max in SerialPcap.h
+        print(f'[!] Too many triggers, {len(result)} of 8')
+        raise Exception(f'Bad trigger formatting')
+    return result
+
+
+def processHop(hop, dwell):
+    """
+    Convert "CH[:MS],CH[:MS],..." to [ channel, dwell ] pairs for the H/h
+    commands.
+    """
+    if None == hop:
+        return None
+    dwell = hop_dwell if dwell == None else dwell
+    result = []
+    try:
+        if 0 >= dwell:
+            raise ValueError
+        for item in hop.split(','):
+            ch, _, ms = item.strip().partition(':')
+            ch = int(ch, 0)
+            ms = int(ms, 0) if ms else dwell
+            if 1 > ch or max_channel < ch or 0 >= ms:
+                raise ValueError
+            result.append([ ch, ms ])
+        if 2 > len(result) or 32 < len(result):  # k_hop_max in WiFiPcap.h
+            raise ValueError
+    except:
+        print(f'[!] Bad formatting "{hop}" should be 2 to 32 of "CH[:MS]", comma separated, channels 1-{max_channel}')
+        raise Exception(f'Bad hop formatting')
+    return result
+
+
+class bpf_insn(ctypes.Structure):
+    _fields_ = [ ('code', ctypes.c_ushort), ('jt', ctypes.c_ubyte), ('jf', ctypes.c_ubyte), ('k', ctypes.c_uint32) ]
+
+class bpf_program(ctypes.Structure):
+    _fields_ = [ ('bf_len', ctypes.c_uint), ('bf_insns', ctypes.POINTER(bpf_insn)) ]
+
+def compileBpf(filter_str):
+    """
+    Compile a capture filter with libpcap for linktype 105 (802.11).
+    Returns a list of (code, jt, jf, k), an empty list for "", or None when
+    no filter was given.
+    """
+    if filter_str == None:
+        return None
+    if not filter_str.strip():
+        return []
+    libname = ctypes.util.find_library('pcap') or ctypes.util.find_library('wpcap')
+    if not libname:
+        print('[!] --bpf needs libpcap (Npcap on Windows), not found')
+        raise Exception(f'libpcap not found')
+    libpcap = ctypes.CDLL(libname)
+    libpcap.pcap_open_dead.restype = ctypes.c_void_p
+    libpcap.pcap_open_dead.argtypes = [ ctypes.c_int, ctypes.c_int ]
+    libpcap.pcap_compile.argtypes = [ ctypes.c_void_p, ctypes.POINTER(bpf_program), ctypes.c_char_p, ctypes.c_int, ctypes.c_uint32 ]
+    libpcap.pcap_geterr.restype = ctypes.c_char_p
+    libpcap.pcap_geterr.argtypes = [ ctypes.c_void_p ]
+    libpcap.pcap_freecode.argtypes = [ ctypes.POINTER(bpf_program) ]
+    libpcap.pcap_close.argtypes = [ ctypes.c_void_p ]
+
+    k_linktype_802_11 = 105
+    k_netmask_unknown = 0xFFFFFFFF  # PCAP_NETMASK_UNKNOWN
+    pcap = libpcap.pcap_open_dead(k_linktype_802_11, 65535)
+    prog = bpf_program()
+    try:
+        if 0 > libpcap.pcap_compile(pcap, ctypes.byref(prog), filter_str.encode(), 1, k_netmask_unknown):
+            print(f'[!] Bad capture filter "{filter_str}": {libpcap.pcap_geterr(pcap).decode()}')
+            raise Exception(f'Bad capture filter')
+        insns = [ (prog.bf_insns[i].code, prog.bf_insns[i].jt, prog.bf_insns[i].jf, prog.bf_insns[i].k) for i in range(prog.bf_len) ]
+        libpcap.pcap_freecode(ctypes.byref(prog))
+    finally:
+        libpcap.pcap_close(pcap)
+
+    if len(insns) > bpf_max_insns:
+        print(f'[!] Capture filter compiles to {len(insns)} instructions, {esp32_name} accepts {bpf_max_insns}')
+        raise Exception(f'Capture filter too long')
+    return insns
+
+
+def processWatch(args):
+    """
+    The watch list and multicast address of --unicast, --oui, --no_addr,
+    --multicast and --broadcast, as [ unicast, multicast ].
+    """
+    if args.no_addr:
+        if args.unicast or args.oui:
+            print('[!] --no_addr cannot be used with --unicast or --oui')
+            raise Exception(f'Conflicting address options')
+        return [ [[0, 0]], None ]
+    unicast = processAddressList(args.unicast, args.oui)
+    if args.broadcast:
+        multicast = [ 0x0FFFFFF, 0x0FFFFFF ]
+    else:
+        multicast = processAddress(args.multicast, None)
+    return [ unicast, multicast ]
+
+
+def processAddressList(unicast, oui):
+    """
+    Returns a list of [ msb, lsb ] pairs for the watch list, OUIs have a lsb
+    of 0. None when no addresses were given.
+    """
+    result = []
+    for addr in unicast or []:
+        result.append(processAddress(addr, None))
+    for addr in oui or []:
+        result.append(processAddress(None, addr))
+    return result or None
+
+
 def main():
     default_encoding = get_encoding()
 
     try:
         args = parseArgs()
-        if args.no_addr:
-            unicast = [0, 0]
-            multicast = None
-        else:
-            unicast = processAddress(args.unicast, args.oui)
-            if args.broadcast:
-                multicast = [ 0x0FFFFFF, 0x0FFFFFF ]
-            else:
-                multicast = processAddress(args.multicast, None)
+        unicast, multicast = processWatch(args)
 
         filter = processFilter(args.filter_mask, args.filter_good, args.filter_all, args.filter_session)
+        snaplen = processSnaplen(args.snaplen)
+        hop = processHop(args.hop, args.dwell)
+        if args.survey != None and not hop:
+            hop = processHop(','.join(f'{ch}' for ch in range(1, max_channel + 1)), args.dwell)
+        if args.adapt != None and not hop:
+            print('[!] --adapt needs --hop')
+            raise Exception(f'Conflicting hop options')
+        bpf = compileBpf(args.bpf)
     except:
         print("[+] Exiting ...")
         return 1
 
+    if args.compact_bench:
+        return compactBench(args.compact_bench)
+    if args.compress_bench:
+        return compressBench(args.compress_bench, args.batch_bytes, args.compact)
+
     if args.port:
         port = args.port
+    elif args.dialog_bench != None:
+        port = 'stand-in'
     else:
         port = pickPort()
         if not port:
@@ -521,28 +2259,124 @@ def main():
     else:
         print('[+] custom_filter ="None"')
 
-    if unicast:
-        print(f'[+] unicast       ="{unicast}"')
-    # elif oui:
-    #     print(f'[+] --oui="{oui}"')
+    for addr in args.unicast or []:
+        print(f'[+] unicast       ="{addr}"')
+    for addr in args.oui or []:
+        print(f'[+] oui           ="{addr}"')
 
     if multicast:
         print(f'[+] multicast     ="{multicast}"')
 
+    batch = [ args.batch_bytes, args.batch_ms ]
+    if args.batch_bytes != None:
+        print(f'[+] batch_bytes   ="{args.batch_bytes}"')
+    if args.batch_ms != None:
+        print(f'[+] batch_ms      ="{args.batch_ms}"')
+
+    if args.beacon_refresh != None:
+        print(f'[+] beacon_refresh="{args.beacon_refresh}"')
+
+    if args.filter_stage != None:
+        print(f'[+] filter_stage  ="{args.filter_stage}"')
+
+    if bpf != None:
+        print(f'[+] bpf           ="{args.bpf}", {len(bpf)} instructions')
+
+    for item in args.snaplen or []:
+        print(f'[+] snaplen       ="{item}"')
+
+    telemetry = args.telemetry
+    if args.telemetry_log and telemetry == None:
+        telemetry = 1000
+    if telemetry != None:
+        print(f'[+] telemetry     ="{telemetry}" ms')
+    if args.telemetry_log:
+        print(f'[+] telemetry_log ="{args.telemetry_log}"')
+    if args.latency_query:
+        if not args.telemetry_log:
+            print('[!] --latency_query needs --telemetry_log')
+            print("[+] Exiting ...")
+            return 1
+        print(f'[+] latency_query ="{args.latency_query}" s')
+
+    if args.overload != None:
+        print(f'[+] overload      ="{args.overload}"')
+
+    if hop:
+        print(f'[+] hop           ="{", ".join(f"{ch}:{ms}" for ch, ms in hop)}" ms')
+        if args.channel:
+            print('[+] --channel is the channel before hopping starts')
+        if args.adapt != None:
+            print(f'[+] adapt         ="{args.adapt}" ms floor')
+    if args.survey != None:
+        print(f'[+] survey        ="{args.survey}" ms, statistics only')
+
+    if args.pcapng:
+        print(f'[+] pcapng        ="{args.pcapng}" ms')
+        if args.compact:
+            print('[!] --compact is a PCAP 2.4 format, not used with --pcapng')
+            args.compact = None
+
+    if args.framed:
+        print(f'[+] framed        ="{args.framed}" ms')
+
+    if args.control:
+        if "Windows" == platform.system():
+            print('[!] --control is not available on Windows')
+            args.control = None
+        else:
+            print('[+] control       ="keyboard"')
+
+    if args.compact:
+        print(f'[+] compact       ="{args.compact}"')
+
+    if args.compress:
+        print(f'[+] compress      ="{args.compress}"')
+
+    history = [ args.history, None ]
+    if args.history:
+        if args.history_mb:
+            history[1] = max(1, round(args.history_mb * 1024))
+            print(f'[+] history       ="{args.history}" s, {args.history_mb} MB')
+        else:
+            print(f'[+] history       ="{args.history}" s')
+
+    trigger = [ processTrigger(args.trigger), args.trigger_pre, args.trigger_post ]
+    if trigger[0]:
+        print(f'[+] trigger       ="{", ".join(args.trigger)}"')
+        print(f'[+] trigger window="{args.trigger_pre if args.trigger_pre != None else 2000}" ms before, '
+              f'"{args.trigger_post if args.trigger_post != None else 2000}" ms after')
+
     print(f'[+] set time      ="{args.time_sync}"')
     # sys.stdout.flush()
 
-    ser = connectESP32(port, args.channel, filter, unicast, multicast, args.time_sync)
+    connect = lambda port, dialog: connectESP32(port, args.channel, filter, unicast, multicast, batch, snaplen, args.beacon_refresh, bpf, args.filter_stage, telemetry, args.overload, hop, args.adapt, args.survey, args.pcapng, args.framed, args.compact, args.compress, history, trigger, args.time_sync, dialog)
+    if args.dialog_bench != None:
+        return dialogBench(connect, args.dialog_bench)
+    ser = connect(port, args.dialog)
     if None == ser:
         print("[+] Exiting ...")
         return 1
 
     if not args.testing:
+        survey = args.survey != None
+        control = LiveControl() if args.control else None
+        tap = TelemetryTap(args.telemetry_log, args.latency_query, survey, control) if args.telemetry_log or survey or control or trigger[0] else None
+        if args.compact:
+            tap = CompactDecoder(tap)
+        if args.compress:
+            tap = LzDecoder(tap)
+        if args.framed:
+            tap = FrameDecoder(tap, bool(args.compact or args.compress))
         system = platform.system()
-        if "Windows" == system:
-            runWiresharkWin32(ser)
+        if survey:
+            runSurvey(ser, tap)
+        elif "Windows" == system:
+            runWiresharkWin32(ser, tap)
         else:
-            runWireshark(ser)
+            runWireshark(ser, tap)
+        if tap:
+            tap.close()
 
     try:
         ser.write( b'\x04' )        # send ^D (EOT)
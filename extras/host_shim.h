@@ -0,0 +1,88 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+/*
+  host_shim - the few ESP-IDF and Arduino names the header only parts of the
+  sketch use, WiFiPcap.h, WatchList.h, Prescreen.h and the like, for the PC
+  builds in this folder.
+  Include it first.
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_NOT_SUPPORTED   0x106
+
+typedef const char *esp_event_base_t;
+
+#ifndef STRUCT_PACKED
+#define STRUCT_PACKED __attribute__((packed))
+#endif
+
+static inline uint32_t millis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000u + ts.tv_nsec / 1000000u);
+}
+
+// The ROM's CRC-32, as zlib's crc32(), table driven like the ROM's
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    static uint32_t table[256];
+    if (0 == table[1]) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int i = 0; i < 8; i++) c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1u)));
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *buf++) & 0xFFu] ^ (crc >> 8);
+    return ~crc;
+}
+
+// The promiscuous callback's packet, only the fields the sketch reads
+typedef enum {
+    WIFI_PKT_MGMT,
+    WIFI_PKT_CTRL,
+    WIFI_PKT_DATA,
+    WIFI_PKT_MISC,
+} wifi_promiscuous_pkt_type_t;
+
+typedef struct {
+    signed rssi:8;
+    unsigned sig_len:12;
+    unsigned rx_state:8;
+    unsigned timestamp:32;
+} wifi_pkt_rx_ctrl_t;
+
+typedef struct {
+    wifi_pkt_rx_ctrl_t rx_ctrl;
+    uint8_t payload[0];
+} wifi_promiscuous_pkt_t;
+
+#endif // HOST_SHIM_H
@@ -0,0 +1,290 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+/*
+  prescreen_bench - Prescreen.h on a PC, time per packet of the generic and
+  the specialized prescreen filters
+
+  Synthetic frames go through prescreen<k_policy_generic>(), every filter
+  tested at run time, and through the prescreen_table entry
+  prescreen_select() would pick, each called through a function pointer
+  loaded per packet as pcap_enqueue() does. Every filter setting runs on
+  three traffic mixes. Both must keep the same bytes of every frame.
+
+  Times are in ns and, on x86, TSC ticks per packet. The device is an
+  in-order Xtensa core; the ratio matters more than the numbers.
+
+  Build and run from this folder:
+
+    g++ -std=gnu++17 -O2 -I.. -include host_shim.h prescreen_bench.cpp ../Bpf.cpp -o prescreen_bench
+    ./prescreen_bench --packets 1000000
+
+  Options, defaults in brackets:
+    --packets N         packets per run [1000000]
+*/
+#include "host_shim.h"
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+#define PCAP_MAX_CAPTURE_PACKET_SIZE  2312u   // as SerialPcap.h
+#include "Prescreen.h"
+
+static CustomFilters fltr;
+static RetryCache retry_cache;
+static BeaconCache beacon_cache;
+static const PrescreenCtx ctx = { &fltr, &retry_cache, &beacon_cache };
+
+enum Kind { k_beacon, k_probe_req, k_probe_resp, k_qos_data, k_null, k_ack, k_eapol, k_kinds };
+
+/*
+  A traffic mix, the share of each Kind in percent, and how many frames in
+  a hundred have a non-zero rx_state.
+*/
+struct Mix {
+    const char *name;
+    uint32_t pct[k_kinds];
+    uint32_t bad_pct;
+};
+
+struct Packet {
+    std::vector<uint32_t> mem;  // wifi_promiscuous_pkt_t, aligned
+    wifi_promiscuous_pkt_type_t type;
+    const wifi_promiscuous_pkt_t *snoop() const { return (const wifi_promiscuous_pkt_t *)mem.data(); }
+};
+
+static MacAddr bssid[8], station[64];
+
+static MacAddr random_mac(std::mt19937 &rng) {
+    MacAddr m;
+    for (size_t i = 0; i < sizeof(m.mac); i++) m.mac[i] = rng();
+    m.mac[0] &= ~1u;    // unicast
+    return m;
+}
+
+static void put(std::vector<uint8_t> &f, const MacAddr &m) {
+    f.insert(f.end(), m.mac, m.mac + sizeof(m.mac));
+}
+
+static Packet make_packet(Kind kind, bool bad, std::mt19937 &rng) {
+    static const MacAddr bcast = { { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+    const MacAddr &ap = bssid[rng() % 8];
+    const MacAddr &sta = station[rng() % 64];
+    const uint8_t seq[2] = { (uint8_t)(rng() & 0xF0), (uint8_t)rng() };
+    std::vector<uint8_t> f;
+    wifi_promiscuous_pkt_type_t type = WIFI_PKT_MGMT;
+    auto hdr = [&](uint8_t type_bits, uint8_t subtype, uint8_t flags, const MacAddr &a1, const MacAddr &a2, const MacAddr &a3) {
+        f = { (uint8_t)(subtype << 4 | type_bits << 2), flags, 0x3A, 0x01 };
+        put(f, a1);
+        put(f, a2);
+        put(f, a3);
+        f.insert(f.end(), seq, seq + 2);
+    };
+    // The same body for every frame from one AP, so dedup finds repeats
+    auto beacon_body = [&]() {
+        const uint8_t fixed[] = { 0, 1, 2, 3, 4, 5, 6, 7, 0x64, 0x00, 0x11, 0x04, 0x00, 0x04, 'l', 'a', 'b', (uint8_t)('0' + ap.mac[5] % 10),
+            0x01, 0x04, 0x82, 0x84, 0x8B, 0x96, 0x03, 0x01, 0x06, 0x05, 0x04, 0x00, 0x01, 0x00, 0x00 };
+        f.insert(f.end(), fixed, fixed + sizeof(fixed));
+        f.resize(f.size() + 200, 0xDD);
+    };
+    switch (kind) {
+        case k_beacon:     hdr(0, WLAN_FC_STYPE_BEACON, 0, bcast, ap, ap); beacon_body(); break;
+        case k_probe_req:  hdr(0, WLAN_FC_STYPE_PROBE_REQ, 0, bcast, sta, bcast); f.resize(f.size() + 60, 0x01); break;
+        case k_probe_resp: hdr(0, WLAN_FC_STYPE_PROBE_RESP, 0, sta, ap, ap); beacon_body(); break;
+        case k_qos_data:
+            type = WIFI_PKT_DATA;
+            if (rng() & 1) hdr(2, 8, 0x01, ap, sta, bcast);
+            else           hdr(2, 8, 0x02, sta, ap, ap);
+            f.resize(f.size() + 2 + 100 + rng() % 1400, 0xAB);
+            break;
+        case k_null:
+            type = WIFI_PKT_DATA;
+            hdr(2, 4, 0x01, ap, sta, ap);
+            break;
+        case k_ack:
+            type = WIFI_PKT_CTRL;
+            f = { 0xD4, 0x00, 0x00, 0x00 };
+            put(f, (rng() & 1) ? sta : ap);
+            break;
+        case k_eapol: {
+            type = WIFI_PKT_DATA;
+            hdr(2, 8, 0x02, sta, ap, ap);
+            const uint8_t llc[] = { 0x00, 0x00, 0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, 0x88, 0x8E, 0x02, 0x03, 0x00, 0x5F };
+            f.insert(f.end(), llc, llc + sizeof(llc));
+            f.resize(f.size() + 95, 0);
+            break;
+        }
+        default:
+            break;
+    }
+    f.resize(f.size() + WIFIPCAP_PAYLOAD_FCS_LEN, 0xFC);
+
+    Packet p;
+    p.type = type;
+    p.mem.resize((sizeof(wifi_promiscuous_pkt_t) + f.size() + 3) / 4);
+    wifi_promiscuous_pkt_t *snoop = (wifi_promiscuous_pkt_t *)p.mem.data();
+    snoop->rx_ctrl.sig_len = f.size();
+    snoop->rx_ctrl.rx_state = (bad) ? 1 : 0;
+    memcpy(snoop->payload, f.data(), f.size());
+    return p;
+}
+
+static std::vector<Packet> make_packets(const Mix &mix, size_t count) {
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<uint32_t> pct(0, 99);
+    std::vector<Packet> pkts;
+    while (pkts.size() < count) {
+        uint32_t pick = pct(rng);
+        int kind = 0;
+        while (kind < k_kinds - 1 && pick >= mix.pct[kind]) pick -= mix.pct[kind++];
+        pkts.push_back(make_packet((Kind)kind, pct(rng) < mix.bad_pct, rng));
+    }
+    return pkts;
+}
+
+// A filter setting, applied to "fltr"
+struct Setting {
+    const char *name;
+    void (*apply)(CustomFilters *f);
+};
+
+static const Setting settings[] = {
+    { "none",           [](CustomFilters *) {} },
+    { "session",        [](CustomFilters *f) { f->session = true; } },
+    { "badpkt fcslen",  [](CustomFilters *f) { f->badpkt = true; f->fcslen = true; } },
+    { "watch 16",       [](CustomFilters *f) {
+            for (size_t i = 0; i < 16; i++) watch_list_add_mac(&f->watch, &station[i * 4]);
+            f->mcastlen = 1;
+        } },
+    { "session watch",  [](CustomFilters *f) {
+            f->session = true;
+            for (size_t i = 0; i < 16; i++) watch_list_add_mac(&f->watch, &station[i * 4]);
+        } },
+    { "bpf type mgmt",  [](CustomFilters *f) {
+            // ldb [0]; jset #0x0c jt 1 jf 0; ret #262144; ret #0
+            const BpfInsn prog[] = { { 0x30, 0, 0, 0 }, { 0x45, 1, 0, 0x0c }, { 0x06, 0, 0, 262144 }, { 0x06, 0, 0, 0 } };
+            memcpy(bpf_scratch(&f->bpf), prog, sizeof(prog));
+            bpf_publish(&f->bpf, sizeof(prog) / sizeof(prog[0]));
+        } },
+    { "dedup noretry",  [](CustomFilters *f) { f->dedup = true; f->noretry = true; } },
+    { "snaplen data",   [](CustomFilters *f) { for (uint16_t &s : f->snaplen[WLAN_FC_TYPE_DATA]) s = k_snaplen_header; } },
+};
+
+static void reset_filters(void) {
+    memset(&fltr, 0, sizeof(fltr));
+    watch_list_clear(&fltr.watch);
+    retry_cache_clear(&retry_cache);
+    beacon_cache_clear(&beacon_cache);
+}
+
+struct Timing {
+    double ns;
+    double tsc;
+    uint64_t kept;
+};
+
+static Timing run(prescreen_fn fn, const std::vector<Packet> &pkts, uint32_t packets) {
+    static volatile prescreen_fn active;
+    active = fn;
+    retry_cache_clear(&retry_cache);
+    beacon_cache_clear(&beacon_cache);
+    Timing t = {};
+    const size_t mask = pkts.size() - 1;
+    const auto t0 = std::chrono::steady_clock::now();
+#if HAVE_TSC
+    const uint64_t c0 = __rdtsc();
+#endif
+    for (uint32_t n = 0; n < packets; n++) {
+        const Packet &p = pkts[n & mask];
+        ssize_t length = 0;
+        const prescreen_fn f = active;
+        t.kept += 0 < f(&ctx, p.snoop(), p.type, &length);
+    }
+#if HAVE_TSC
+    t.tsc = (double)(__rdtsc() - c0) / packets;
+#endif
+    t.ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / packets;
+    return t;
+}
+
+// Both must keep the same bytes of every packet, from the same cache state
+static bool agree(prescreen_fn a, prescreen_fn b, const std::vector<Packet> &pkts) {
+    std::vector<ssize_t> keep[2];
+    const prescreen_fn fn[2] = { a, b };
+    for (size_t i = 0; i < 2; i++) {
+        retry_cache_clear(&retry_cache);
+        beacon_cache_clear(&beacon_cache);
+        for (const Packet &p : pkts) {
+            ssize_t length = 0;
+            const ssize_t kept = fn[i](&ctx, p.snoop(), p.type, &length);
+            keep[i].push_back(kept);
+            if (0 < kept) keep[i].push_back(length);
+        }
+    }
+    return keep[0] == keep[1];
+}
+
+static const char *arg(int argc, char **argv, const char *name, const char *dflt) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], name)) return argv[i + 1];
+    }
+    return dflt;
+}
+
+int main(int argc, char **argv) {
+    const uint32_t packets = strtoul(arg(argc, argv, "--packets", "1000000"), NULL, 0);
+    std::mt19937 rng(3);
+    for (MacAddr &m : bssid) m = random_mac(rng);
+    for (MacAddr &m : station) m = random_mac(rng);
+
+    //                       beacon  probe  resp  qos  null  ack  eapol  bad
+    const Mix mixes[] = {
+        { "beacons", {      60,     10,    5,   10,    0,  15,    0 },  2 },
+        { "data",    {      10,      2,    1,   50,   10,  25,    2 },  2 },
+        { "mixed",   {      30,      5,    5,   25,    5,  25,    5 }, 10 },
+    };
+    printf("%-8s %-14s %6s %9s %9s %9s %9s %7s %6s %6s\n", "mix", "filters", "policy",
+        "gen ns", "spec ns", "gen tsc", "spec tsc", "saved", "kept", "agree");
+    int rc = 0;
+    for (const Mix &mix : mixes) {
+        const std::vector<Packet> pkts = make_packets(mix, 4096);
+        for (const Setting &setting : settings) {
+            reset_filters();
+            setting.apply(&fltr);
+            const uint32_t policy = prescreen_policy(&fltr);
+            const prescreen_fn generic = prescreen<k_policy_generic>;
+            const prescreen_fn special = prescreen_table[policy];
+            const bool same = agree(generic, special, pkts);
+            if (! same) rc = 1;
+
+            // Best of three, alternating
+            Timing g = { 1e9, 1e9, 0 }, s = { 1e9, 1e9, 0 };
+            for (int rep = 0; rep < 3; rep++) {
+                const Timing tg = run(generic, pkts, packets);
+                const Timing ts = run(special, pkts, packets);
+                if (tg.ns < g.ns) g = tg;
+                if (ts.ns < s.ns) s = ts;
+            }
+            printf("%-8s %-14s   0x%02X %9.2f %9.2f %9.1f %9.1f %6.0f%% %5.0f%% %6s\n", mix.name, setting.name, policy,
+                g.ns, s.ns, g.tsc, s.tsc, 100.0 * (g.ns - s.ns) / g.ns, 100.0 * s.kept / packets,
+                (same) ? "yes" : "NO");
+        }
+    }
+    return rc;
+}
@@ -0,0 +1,146 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+/*
+  ring_stress - PcapRing.h on a PC, a producer and a consumer thread
+
+  The producer reserves records of random length, some too big to fit at the
+  end of the arena so they wrap, fills them with a pattern made from their
+  sequence number and commits. The consumer peeks, checks the sequence number,
+  length and every payload byte, then releases. A ring small next to the
+  records makes wraps and full rings frequent.
+
+  At the end the wraps the consumer stepped over must match "wraps", and
+  "high_water" must be within the arena and no less than the most the
+  consumer saw in use.
+
+  Build and run from this folder:
+
+    g++ -std=gnu++17 -O2 -pthread -I.. ring_stress.cpp -o ring_stress
+    ./ring_stress --records 5000000 --ring 4096
+
+  Options, defaults in brackets:
+    --records N         records to pass through [2000000]
+    --ring BYTES        arena size [4096]
+    --max BYTES         longest record [1600]
+    --seed N            [1]
+*/
+#include <atomic>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include "PcapRing.h"
+
+struct Record {
+    uint32_t seq;
+    uint32_t len;             // payload bytes that follow
+    uint8_t payload[];
+};
+
+static inline uint8_t pattern(uint32_t seq, uint32_t i) {
+    return (uint8_t)(seq * 31u + i * 7u + (i >> 8));
+}
+
+static const char *arg(int argc, char **argv, const char *name, const char *dflt) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], name)) return argv[i + 1];
+    }
+    return dflt;
+}
+
+int main(int argc, char **argv) {
+    const uint32_t records = strtoul(arg(argc, argv, "--records", "2000000"), NULL, 0);
+    const uint32_t size = strtoul(arg(argc, argv, "--ring", "4096"), NULL, 0);
+    const uint32_t max = strtoul(arg(argc, argv, "--max", "1600"), NULL, 0);
+    const uint32_t seed = strtoul(arg(argc, argv, "--seed", "1"), NULL, 0);
+    if (ring_record_size(sizeof(Record) + max) * 2 > size) {
+        fprintf(stderr, "--ring %u is too small for --max %u\n", size, max);
+        return 2;
+    }
+
+    // A guard word after the arena catches writes past the end
+    std::vector<uint32_t> mem(size / 4 + 1);
+    const uint32_t guard = 0xDEADBEEFu;
+    mem[size / 4] = guard;
+    static PcapRing ring;
+    ring_init(&ring, mem.data(), size);
+
+    std::atomic<bool> failed(false);
+    uint32_t full = 0;
+    std::thread producer([&]() {
+        std::mt19937 rng(seed);
+        // Mostly short, some long enough to rarely fit at the end
+        std::uniform_int_distribution<uint32_t> short_len(0, 64), long_len(0, max);
+        for (uint32_t seq = 0; seq < records && !failed; seq++) {
+            const uint32_t len = (rng() % 4) ? short_len(rng) : long_len(rng);
+            Record *r;
+            while (NULL == (r = (Record *)ring_reserve(&ring, sizeof(Record) + len))) {
+                full++;
+                if (failed) return;
+                std::this_thread::yield();
+            }
+            r->seq = seq;
+            r->len = len;
+            for (uint32_t i = 0; i < len; i++) r->payload[i] = pattern(seq, i);
+            ring_commit(&ring);
+        }
+    });
+
+    uint32_t expect = 0, seen_wraps = 0, used_max = 0, errors = 0;
+    uint64_t bytes = 0;
+    while (expect < records && !failed) {
+        const uint32_t tail = ring.tail;
+        RingRecord *rec = ring_peek(&ring);
+        if (NULL == rec) {
+            std::this_thread::yield();
+            continue;
+        }
+        if ((uint8_t *)rec != &ring.arena[tail]) seen_wraps++;
+        const uint32_t used = ring_used(&ring);
+        if (used > used_max) used_max = used;
+
+        const Record *r = (const Record *)rec->data;
+        const uint32_t offset = (uint8_t *)rec - ring.arena;
+        if (r->seq != expect || rec->length != ring_record_size(sizeof(Record) + r->len) || offset + rec->length > size) {
+            fprintf(stderr, "record %u: seq %u, len %u, length %u at offset %u\n", expect, r->seq, r->len, rec->length, offset);
+            failed = true;
+            break;
+        }
+        for (uint32_t i = 0; i < r->len; i++) {
+            if (r->payload[i] != pattern(r->seq, i)) {
+                if (10 > errors) fprintf(stderr, "record %u: byte %u is 0x%02X\n", r->seq, i, r->payload[i]);
+                errors++;
+                break;
+            }
+        }
+        bytes += r->len;
+        ring_release(&ring, rec);
+        expect++;
+    }
+    producer.join();
+
+    const bool wraps_ok = seen_wraps == ring.wraps && 0 < ring.wraps;
+    const bool high_water_ok = ring.high_water < size && ring.high_water >= used_max;
+    const bool guard_ok = guard == mem[size / 4];
+    printf("records     %u of %u, %llu payload bytes, %u payload errors\n", expect, records, (unsigned long long)bytes, errors);
+    printf("wraps       %u, consumer saw %u%s\n", ring.wraps, seen_wraps, (wraps_ok) ? "" : "  BAD");
+    printf("high water  %u of %u, consumer saw %u%s\n", ring.high_water, size, used_max, (high_water_ok) ? "" : "  BAD");
+    printf("full        %u reserve retries\n", full);
+    printf("guard       %s\n", (guard_ok) ? "ok" : "overwritten  BAD");
+    return (failed || errors || expect != records || !wraps_ok || !high_water_ok || !guard_ok) ? 1 : 0;
+}
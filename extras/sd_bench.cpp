@@ -0,0 +1,316 @@
+/*
+  Copyright (C) 2023 - M Hightower
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+/*
+  sd_bench - SdWriter.h on a PC, plain files standing in for the TF card
+
+  A producer thread makes bursty synthetic 802.11 traffic. It goes through a
+  model of the capture ring, which holds frames while sd_writer_ready() says
+  no and drops them when full, then is appended as serial_task would. A writer thread calls sd_writer_service() as the SD
+  task does. The card model limits the write rate, adds a cost per write
+  and stalls now and then, as cards do when they erase. At the end the
+  files are read back and the records counted.
+
+  Build and run from this folder:
+
+    g++ -std=gnu++17 -O2 -pthread -I.. sd_bench.cpp -o sd_bench
+    ./sd_bench --seconds 10 --mbps 1.5 --card_mbps 4 --stall_ms 250
+
+  Options, defaults in brackets:
+    --dir DIR           files go here, made if missing [/tmp/sd_bench]
+    --seconds N         traffic time [10]
+    --mbps MB           average offered rate, MB/s [1.0]
+    --burst X           rate during a burst, times the average [4]
+    --ring KB           capture ring size [256], CONFIG_WIFIPCAP_RING_SIZE
+    --chunk KB          chunk buffer size [16], CONFIG_WIFIPCAP_SD_CHUNK_SIZE
+    --file_mb MB        rotate at this file size [16]
+    --file_s S          and this file age, 0 none [0]
+    --card_mbps MB      card write rate, 0 unlimited [4]
+    --write_us US       card cost of each write [1500]
+    --stall_ms MS       card stall length, 0 none [200]
+    --stall_mb MB       one stall every this many MB written [8]
+*/
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SdWriter.h"
+
+struct CardModel {
+    double mbps = 4.0;
+    uint32_t write_us = 1500;
+    uint32_t stall_ms = 200;
+    double stall_mb = 8.0;
+    uint64_t written = 0;
+    uint64_t next_stall = 0;
+    uint32_t open_errors = 0;
+};
+
+static uint64_t now_us(void) {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static int file_open(void *ctx, const char *path, uint32_t prealloc) {
+    CardModel *card = (CardModel *)ctx;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (0 <= fd && prealloc && 0 != ftruncate(fd, prealloc)) {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+    if (0 > fd) {
+        fprintf(stderr, "sd_bench: %s: %s\n", path, strerror(errno));
+        card->open_errors++;
+    }
+    return fd;
+}
+
+// The write, then as long as the card would have taken
+static int file_write(void *ctx, int fd, const void *buf, size_t len) {
+    CardModel *card = (CardModel *)ctx;
+    const uint64_t t0 = now_us();
+    const int wrote = write(fd, buf, len);
+    uint64_t us = card->write_us;
+    if (card->mbps > 0) us += (uint64_t)(len / card->mbps);
+    card->written += len;
+    if (card->stall_ms && card->written >= card->next_stall) {
+        card->next_stall += (uint64_t)(card->stall_mb * 1e6);
+        us += card->stall_ms * 1000u;
+    }
+    const uint64_t spent = now_us() - t0;
+    if (us > spent) std::this_thread::sleep_for(std::chrono::microseconds(us - spent));
+    return wrote;
+}
+
+static int file_sync([[maybe_unused]] void *ctx, [[maybe_unused]] int fd) {
+    return 0;   // the card model has no cache
+}
+
+static int file_close([[maybe_unused]] void *ctx, int fd, uint32_t length) {
+    ftruncate(fd, length);
+    return close(fd);
+}
+
+// Records and bytes of a PCAP file, -1 when it does not parse to the end
+static long count_records(const std::string &path, uint64_t *bytes) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return -1;
+    uint8_t hdr[24];
+    long count = 0;
+    if (1 != fread(hdr, sizeof(hdr), 1, f)) count = -1;
+    uint8_t rec[16];
+    std::vector<uint8_t> body;
+    while (0 <= count && 1 == fread(rec, sizeof(rec), 1, f)) {
+        uint32_t caplen;
+        memcpy(&caplen, &rec[8], sizeof(caplen));
+        body.resize(caplen);
+        if (caplen && 1 != fread(body.data(), caplen, 1, f)) {
+            count = -1;
+            break;
+        }
+        *bytes += sizeof(rec) + caplen;
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+static const char *arg(int argc, char **argv, const char *name, const char *dflt) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (0 == strcmp(argv[i], name)) return argv[i + 1];
+    }
+    return dflt;
+}
+
+int main(int argc, char **argv) {
+    const std::string dir = arg(argc, argv, "--dir", "/tmp/sd_bench");
+    const double seconds = atof(arg(argc, argv, "--seconds", "10"));
+    const double mbps = atof(arg(argc, argv, "--mbps", "1.0"));
+    const double burst = atof(arg(argc, argv, "--burst", "4"));
+    const uint64_t ring_bytes = atoi(arg(argc, argv, "--ring", "256")) * 1024u;
+    const uint32_t chunk = atoi(arg(argc, argv, "--chunk", "16")) * 1024u;
+    const uint32_t file_bytes = atof(arg(argc, argv, "--file_mb", "16")) * 1024u * 1024u;
+    const uint32_t file_ms = atof(arg(argc, argv, "--file_s", "0")) * 1000u;
+    CardModel card;
+    card.mbps = atof(arg(argc, argv, "--card_mbps", "4"));
+    card.write_us = atoi(arg(argc, argv, "--write_us", "1500"));
+    card.stall_ms = atoi(arg(argc, argv, "--stall_ms", "200"));
+    card.stall_mb = atof(arg(argc, argv, "--stall_mb", "8"));
+    card.next_stall = (uint64_t)(card.stall_mb * 1e6);
+
+    // As mkdir -p
+    for (size_t at = dir.find('/', 1); ; at = dir.find('/', at + 1)) {
+        mkdir(dir.substr(0, at).c_str(), 0755);
+        if (std::string::npos == at) break;
+    }
+    DIR *d = opendir(dir.c_str());
+    if (NULL == d) {
+        fprintf(stderr, "sd_bench: --dir %s: %s\n", dir.c_str(), strerror(errno));
+        return 1;
+    }
+    while (struct dirent *e = readdir(d)) {
+        if (0 == strncmp(e->d_name, "cap", 3)) unlink((dir + "/" + e->d_name).c_str());
+    }
+    closedir(d);
+
+    std::vector<uint8_t> bufs_mem(k_sd_buffers * chunk);
+    uint8_t *bufs[k_sd_buffers];
+    for (size_t i = 0; i < k_sd_buffers; i++) bufs[i] = &bufs_mem[i * chunk];
+    const SdWriterIo io = { &card, file_open, file_write, file_sync, file_close, now_us };
+    const uint32_t pcap_header[6] = { 0xA1B2C3D4u, 0x00040002u, 0, 0, 65535u, 127u };
+    static SdWriter w;
+    sd_writer_init(&w, &io, dir.c_str(), bufs, chunk, file_bytes, file_ms, pcap_header, sizeof(pcap_header), 1);
+
+    std::mutex lock;
+    std::condition_variable wake;
+    bool done = false, pending = false;
+    std::thread writer([&]() {
+        std::unique_lock<std::mutex> hold(lock);
+        while (!done) {
+            // As ulTaskNotifyTake(), a notify before the wait is not lost
+            if (!pending) wake.wait_for(hold, std::chrono::milliseconds(100));
+            pending = false;
+            hold.unlock();
+            while (sd_writer_service(&w)) {}
+            hold.lock();
+        }
+        hold.unlock();
+        while (sd_writer_service(&w)) {}
+    });
+    auto notify = [&]() {
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            pending = true;
+        }
+        wake.notify_one();
+    };
+
+    // The capture ring, frame lengths only, and as lane_drain() empties it
+    std::deque<uint32_t> ring;
+    uint64_t ring_used = 0, ring_max = 0, ring_drops = 0, ring_dropped_bytes = 0;
+    uint8_t frame[2400] = {};
+    auto drain = [&]() {
+        const uint32_t handoffs = w.handoffs;
+        while (!ring.empty() && sd_writer_ready(&w, 16 + ring.front())) {
+            const uint32_t len = ring.front();
+            const uint64_t t = now_us();
+            const uint32_t rec[4] = { (uint32_t)(t / 1000000u), (uint32_t)(t % 1000000u), len, len };
+            sd_writer_append(&w, rec, sizeof(rec), frame, len);
+            ring.pop_front();
+            ring_used -= sizeof(rec) + len;
+        }
+        sd_writer_poll(&w);
+        if (handoffs != w.handoffs) notify();
+    };
+
+    // Bursts of 50 to 300 ms at "burst" times the average, quiet in between
+    // so the average comes out at "mbps". Two thirds of frames are short.
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> burst_ms(50, 300);
+    std::uniform_int_distribution<int> short_len(40, 300), long_len(300, 1600);
+    uint64_t offered = 0, offered_records = 0;
+    const uint64_t start = now_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1e6);
+    while (now_us() < end) {
+        const uint64_t on_us = burst_ms(rng) * 1000u;
+        const uint64_t off_us = (burst > 1) ? (uint64_t)(on_us * (burst - 1)) : 0;
+        const double rate = mbps * ((burst > 1) ? burst : 1);    // bytes per us
+        const uint64_t t0 = now_us();
+        uint64_t sent = 0;
+        while (now_us() - t0 < on_us) {
+            // Pace in 1 ms steps
+            const uint64_t due = (uint64_t)((now_us() - t0) * rate);
+            while (sent < due) {
+                const uint32_t len = (rng() % 3) ? short_len(rng) : long_len(rng);
+                const uint32_t size = 16 + len;
+                if (ring_used + size > ring_bytes) {
+                    ring_drops++;
+                    ring_dropped_bytes += size;
+                } else {
+                    ring.push_back(len);
+                    ring_used += size;
+                    if (ring_used > ring_max) ring_max = ring_used;
+                }
+                sent += size;
+                offered += size;
+                offered_records++;
+            }
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // Quiet, still draining
+        const uint64_t t1 = now_us();
+        while (now_us() - t1 < off_us) {
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    while (!ring.empty()) {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    while (!sd_writer_finish(&w)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    notify();
+    const double elapsed = (now_us() - start) / 1e6;
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        done = true;
+    }
+    wake.notify_one();
+    writer.join();
+
+    // Read back
+    long records = 0;
+    uint64_t record_bytes = 0;
+    uint32_t files = 0, bad = 0;
+    for (uint32_t n = 1; n < w.next_file; n++) {
+        char path[k_sd_path_max + 24];
+        sd_writer_path(&w, n, path, sizeof(path));
+        const long count = count_records(path, &record_bytes);
+        if (0 > count) bad++; else records += count;
+        files++;
+    }
+
+    const SdWriterStats &s = w.stats;
+    printf("offered     %.2f MB/s, %llu records, %.1f s\n", offered / elapsed / 1e6, (unsigned long long)offered_records, elapsed);
+    printf("written     %.2f MB/s, %u writes of %u KB, %u files\n", s.bytes / elapsed / 1e6, s.writes, chunk / 1024u, s.files);
+    printf("dropped     %llu records, %llu bytes (%.2f%%), ring full, ring max %llu KB\n", (unsigned long long)ring_drops,
+        (unsigned long long)ring_dropped_bytes, (offered) ? 100.0 * ring_dropped_bytes / offered : 0.0, (unsigned long long)(ring_max / 1024u));
+    printf("            %u records, %llu bytes, no free buffer\n", s.overruns, (unsigned long long)s.dropped_bytes);
+    printf("write       avg %u us, max %u us, %u stalls over %u us, busy %.0f%%\n",
+        (s.writes) ? (uint32_t)(s.write_us / s.writes) : 0, s.latency.max_us, s.stalls, w.stall_us, 100.0 * s.write_us / 1e6 / elapsed);
+    printf("open/close  max %u us / %u us, errors %u, open failed %u\n", s.open_max_us, s.close_max_us, s.errors, card.open_errors);
+    printf("           ");
+    for (size_t n = 0; n < k_histogram_buckets; n++) {
+        if (s.latency.bucket[n]) printf(" <=%u:%u", histogram_bucket_us(n), s.latency.bucket[n]);
+    }
+    printf("\n");
+    printf("read back   %ld of %u records, %u of %u files bad\n", records, s.records, bad, files);
+    return (bad || card.open_errors || records != (long)s.records || record_bytes + (uint64_t)files * sizeof(pcap_header) != s.bytes) ? 1 : 0;
+}
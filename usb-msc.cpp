@@ -29,15 +29,17 @@
 */
 #include "WiFiPcap.ino.globals.h"
 
-#if USE_USB_MSC
+#if USE_USB_MSC || USE_SD_CAPTURE
 
-#if ARDUINO_USB_MODE
+#if USE_USB_MSC && ARDUINO_USB_MODE
 #pragma message("This sketch should be used when USB is in OTG mode")
 #endif
 
 #include <Arduino.h>
 #include <USB.h>
+#if USE_USB_MSC
 #include <USBMSC.h>
+#endif
 
 #if ARDUINO_USB_MODE
 
@@ -78,8 +80,9 @@ extern USBCDC USBSerial;
 #include <sdmmc_cmd.h>
 #include "usb-msc.h"
 
+#if USE_USB_MSC
 USBMSC MSC;
-#define MOUNT_POINT "/sdcard"
+#endif
 struct TFCard {
   const char *mount_point;
   sdmmc_card_t *card;
@@ -104,7 +107,8 @@ TFCard tfc;
 
 /*
   Initialize SD Driver that allows the ESP32 to read and write from the
-  connected SD Card. Used to service request from the MSC Class.
+  connected SD Card. Used to service request from the MSC Class, or mounted
+  at MOUNT_POINT for USE_SD_CAPTURE.
 */
 esp_err_t sd_init(void) {
     // const char mount_point[] = MOUNT_POINT;
@@ -279,6 +283,7 @@ esp_err_t sd_init(void) {
     return tfc.err.sd;
 }
 
+#if USE_USB_MSC
 /*
   Allow void pointer math as if byte pointer
 */
@@ -352,6 +357,7 @@ bool setupMsc() {
     tfc.err.msc = MSC.begin(tfc.card->csd.capacity, tfc.card->csd.sector_size);
     return tfc.err.msc;
 }
+#endif // #if USE_USB_MSC
 
 void sd_end(void) {
     // const char mount_point[] = MOUNT_POINT;
@@ -364,4 +370,4 @@ void sd_end(void) {
     }
 }
 
-#endif // #if ARDUINO_USB_MODE
+#endif // #if USE_USB_MSC || USE_SD_CAPTURE
@@ -1,6 +1,8 @@
 #ifndef USB_MSC_H
 #define USB_MSC_H
 
+#define MOUNT_POINT "/sdcard"
+
 esp_err_t sd_init(void);
 void sd_end(void);
 bool setupMsc(void);